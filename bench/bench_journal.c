@@ -0,0 +1,116 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <unistd.h>
+
+#define JOURNAL_DIR "/tmp/quickio.bench_journal"
+
+#define CONFIG_FILE "/tmp/quickio.bench_journal.ini"
+#define CONFIG \
+	"[quick-event]\n" \
+	"threads = 1\n" \
+	"[quick.io]\n" \
+	"journal-dir = " JOURNAL_DIR "\n" \
+	"journal-segment-size = 268435456\n"
+
+/**
+ * Number of broadcasts journaled, then read back
+ */
+#define ENTRIES 10000000
+
+/**
+ * Number of distinct subscriptions broadcast to
+ */
+#define SUBS 100000
+
+#define JSON "{\"price\":1234.56,\"volume\":789}"
+
+static gchar *_paths[SUBS];
+static guint64 _i = 0;
+
+static gboolean _append(void *nothing G_GNUC_UNUSED)
+{
+	journal_append(_paths[_i++ % SUBS], JSON);
+	return TRUE;
+}
+
+static gboolean _replay(void *nothing G_GNUC_UNUSED)
+{
+	return journal_replay() >= ENTRIES;
+}
+
+static gboolean _restore(void *nothing G_GNUC_UNUSED)
+{
+	gchar *json = journal_restore(_paths[_i++ % SUBS]);
+	gboolean ok = json != NULL;
+
+	g_free(json);
+
+	return ok;
+}
+
+static void _clear_journal()
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open(JOURNAL_DIR, 0, NULL);
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		gchar *path = g_build_filename(JOURNAL_DIR, name, NULL);
+		unlink(path);
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+}
+
+int main()
+{
+	guint i;
+	qev_bench_t *bench;
+	gchar *argv[] = {
+		"bench_journal",
+		"--config-file=" CONFIG_FILE
+	};
+
+	ASSERT(g_file_set_contents(CONFIG_FILE, CONFIG, -1, NULL),
+		"Could not setup config file");
+
+	_clear_journal();
+
+	qev_pool_register_thread();
+	qio_main(G_N_ELEMENTS(argv), argv);
+
+	for (i = 0; i < SUBS; i++) {
+		_paths[i] = g_strdup_printf("/bench/journal/sub-%06u", i);
+	}
+
+	bench = qev_bench_new("journal", "bench_journal.xml");
+	qev_bench_fn(bench, "append", _append, NULL, ENTRIES);
+	qev_bench_fn(bench, "replay", _replay, NULL, 1);
+
+	_i = 0;
+	qev_bench_fn(bench, "restore", _restore, NULL, SUBS);
+	qev_bench_free(bench);
+
+	for (i = 0; i < SUBS; i++) {
+		g_free(_paths[i]);
+	}
+
+	qev_exit();
+
+	_clear_journal();
+	unlink(CONFIG_FILE);
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <unistd.h>
+
+#define CONFIG_FILE "/tmp/quickio.bench_publish.ini"
+#define CONFIG \
+	"[quick-event]\n" \
+	"threads = 1\n" \
+	"[quick.io]\n" \
+	"publish-udp = true\n"
+
+#define RECORD "/bench/publish/sub={\"price\":1234.56,\"volume\":789}\n"
+
+struct _datagram {
+	GString *buff;
+	guint64 records;
+};
+
+static struct _datagram _single;
+static struct _datagram _batched;
+
+static gboolean _publish(void *d_)
+{
+	struct _datagram *d = d_;
+
+	qev_on_udp(d->buff->str, d->buff->len, "127.0.0.1");
+
+	return TRUE;
+}
+
+static gboolean _handle(void *d_)
+{
+	gboolean ok;
+	struct _datagram *d = d_;
+	GString *buff = qev_buffer_get();
+
+	g_string_append_len(buff, d->buff->str, d->buff->len);
+	ok = publish_handle(buff->str, buff->len) == d->records;
+
+	qev_buffer_put(buff);
+
+	return ok;
+}
+
+static void _datagram_init(struct _datagram *d, const guint64 records)
+{
+	guint64 i;
+
+	d->buff = qev_buffer_get();
+	d->records = records;
+
+	for (i = 0; i < records; i++) {
+		g_string_append(d->buff, RECORD);
+	}
+}
+
+int main()
+{
+	qev_bench_t *bench;
+	gchar *argv[] = {
+		"bench_publish",
+		"--config-file=" CONFIG_FILE
+	};
+
+	ASSERT(g_file_set_contents(CONFIG_FILE, CONFIG, -1, NULL),
+		"Could not setup config file");
+
+	qev_pool_register_thread();
+	qio_main(G_N_ELEMENTS(argv), argv);
+
+	/*
+	 * Nothing is subscribed: this measures getting records to the point of
+	 * being queued, not sending them out
+	 */
+	evs_add_handler("/bench", "/publish", NULL, NULL, NULL, TRUE);
+
+	_datagram_init(&_single, 1);
+	_datagram_init(&_batched, 64);
+
+	bench = qev_bench_new("publish", "bench_publish.xml");
+	qev_bench_fn_for(bench, "handle.single", _handle, &_single, 1000);
+	qev_bench_fn_for(bench, "handle.batched", _handle, &_batched, 1000);
+	qev_bench_fn_for(bench, "datagram.single", _publish, &_single, 1000);
+	qev_bench_fn_for(bench, "datagram.batched", _publish, &_batched, 1000);
+	qev_bench_free(bench);
+
+	qev_buffer_put0(&_single.buff);
+	qev_buffer_put0(&_batched.buff);
+
+	unlink(CONFIG_FILE);
+
+	qev_exit();
+
+	return 0;
+}
@@ -56,6 +56,14 @@ static qev_fd_t _http_sock = -1;
 
 static struct client *_surrogate = NULL;
 
+/**
+ * Number of handlers registered for the many-handler lookups
+ */
+#define MANY_HANDLERS 4096
+
+static gchar *_many_paths[MANY_HANDLERS];
+static guint _many_i = 0;
+
 static gboolean _base_routing(void *nothing G_GNUC_UNUSED)
 {
 	qev_buffer_clear(_buff);
@@ -65,6 +73,87 @@ static gboolean _base_routing(void *nothing G_GNUC_UNUSED)
 	return TRUE;
 }
 
+static gboolean _many_handlers_lookup(void *nothing G_GNUC_UNUSED)
+{
+	gchar *ev_extra;
+	gboolean found;
+	const gchar *path = _many_paths[_many_i++ % MANY_HANDLERS];
+
+	evs_query_begin();
+	found = evs_query(path, &ev_extra) != NULL;
+	evs_query_end();
+
+	return found;
+}
+
+static gboolean _many_handlers_lookup_children(void *nothing G_GNUC_UNUSED)
+{
+	gchar *ev_extra;
+	gboolean found;
+	const gchar *path = "/bench/app-17/handler-0042/with/some/children";
+
+	evs_query_begin();
+	found = evs_query(path, &ev_extra) != NULL;
+	evs_query_end();
+
+	return found;
+}
+
+/**
+ * Subscribe and unsubscribe, without callbacks, so that everything's put
+ * back just as it was
+ */
+static void _churn(const gchar *path)
+{
+	g_string_printf(_buff, "/qio/on:0=\"%s\"", path);
+	protocol_raw_handle(_surrogate, _buff->str);
+
+	g_string_printf(_buff, "/qio/off:0=\"%s\"", path);
+	protocol_raw_handle(_surrogate, _buff->str);
+}
+
+static gboolean _subs_churn_single(void *nothing G_GNUC_UNUSED)
+{
+	_churn(_many_paths[0]);
+	return TRUE;
+}
+
+static gboolean _subs_churn_many(void *nothing G_GNUC_UNUSED)
+{
+	_churn(_many_paths[_many_i++ % MANY_HANDLERS]);
+	return TRUE;
+}
+
+static void _init_many_handlers()
+{
+	guint i;
+	GString *prefix = qev_buffer_get();
+	GString *path = qev_buffer_get();
+
+	/*
+	 * Mimic a bunch of apps, each with a bunch of handlers
+	 */
+	for (i = 0; i < MANY_HANDLERS; i++) {
+		g_string_printf(prefix, "/bench/app-%u", i / 128);
+		g_string_printf(path, "/handler-%04u", i % 128);
+
+		evs_add_handler(prefix->str, path->str, NULL, NULL, NULL, TRUE);
+		_many_paths[i] = g_strdup_printf("%s%s", prefix->str, path->str);
+	}
+
+	qev_buffer_put(prefix);
+	qev_buffer_put(path);
+}
+
+static void _free_many_handlers()
+{
+	guint i;
+
+	for (i = 0; i < MANY_HANDLERS; i++) {
+		g_free(_many_paths[i]);
+	}
+}
+
 static gboolean _network_raw_single(void *nothing G_GNUC_UNUSED)
 {
 	gint err;
@@ -337,9 +426,14 @@ int main()
 	_init_raw_client();
 	_init_rfc6455_client();
 	_init_http_client();
+	_init_many_handlers();
 
 	bench = qev_bench_new("routing", "bench_routing.xml");
 	qev_bench_fn_for(bench, "base_routing", _base_routing, NULL, 1000);
+	qev_bench_fn_for(bench, "many_handlers.lookup", _many_handlers_lookup, NULL, 1000);
+	qev_bench_fn_for(bench, "many_handlers.lookup_children", _many_handlers_lookup_children, NULL, 1000);
+	qev_bench_fn_for(bench, "subs.churn.single", _subs_churn_single, NULL, 1000);
+	qev_bench_fn_for(bench, "subs.churn.many", _subs_churn_many, NULL, 1000);
 	qev_bench_fn_for(bench, "raw.single.network", _network_raw_single, NULL, 1000);
 	qev_bench_fn_for(bench, "raw.single.immediate", _immediate_raw_single, NULL, 1000);
 	qev_bench_fn_for(bench, "raw.double.network", _network_raw_double, NULL, 1000);
@@ -358,6 +452,7 @@ int main()
 	close(_raw_sock);
 	close(_rfc6455_sock);
 	close(_http_sock);
+	_free_many_handlers();
 
 	unlink(CONFIG_FILE);
 
@@ -9,10 +9,31 @@
 #include "quickio.h"
 
 #define CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890*&"
-#define DECODE (CHARS CHARS CHARS CHARS)
 
-static GString *_buff = NULL;
-static GString *_buff_out = NULL;
+/**
+ * Not quite ASCII: forces validation to look at every block
+ */
+#define CHARS_UTF8 "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567\xc3\xa9*&"
+
+/**
+ * Bytes pushed through each benchmark at every payload size
+ */
+#define BYTES_PER_SIZE (1llu << 28)
+
+struct _payload {
+	GString *in;
+	GString *out;
+};
+
+static const guint64 _sizes[] = {
+	16,
+	64,
+	256,
+	1024,
+	4096,
+	16384,
+	65536,
+};
 
 static gchar _mask[4] = "abcd";
 
@@ -22,67 +43,158 @@ static union {
 } _mask64;
 
 static union {
-	guint32 i64[2];
+	guint64 i64[2];
 	__int128_t i128;
 } _mask128;
 
-static gboolean _base(void *nothing G_GNUC_UNUSED)
+static gboolean _base(void *p_)
 {
 	guint64 i;
+	struct _payload *p = p_;
 
-	for (i = 0; i < _buff->len; i++) {
-		_buff_out->str[i] = _buff->str[i] ^ _mask[i & 3];
+	for (i = 0; i < p->in->len; i++) {
+		p->out->str[i] = p->in->str[i] ^ _mask[i & 3];
 	}
 
 	return TRUE;
 }
 
-static gboolean _64bit(void *nothing G_GNUC_UNUSED)
+static gboolean _64bit(void *p_)
 {
 	guint64 i;
-	guint64 max = _buff->len - (_buff->len & (sizeof(guint64) - 1));
+	struct _payload *p = p_;
+	guint64 max = p->in->len - (p->in->len & (sizeof(guint64) - 1));
 
 	for (i = 0; i < max; i += sizeof(guint64)) {
-		guint64 from = *((guint64*)(_buff->str + i));
-		*((guint64*)(_buff_out->str + i)) = from ^ _mask64.i64;
+		guint64 from = *((guint64*)(p->in->str + i));
+		*((guint64*)(p->out->str + i)) = from ^ _mask64.i64;
 	}
 
 	return TRUE;
 }
 
-static gboolean _128bit(void *nothing G_GNUC_UNUSED)
+static gboolean _128bit(void *p_)
 {
 	guint64 i;
-	guint64 max = _buff->len - (_buff->len & (sizeof(__uint128_t) - 1));
+	struct _payload *p = p_;
+	guint64 max = p->in->len - (p->in->len & (sizeof(__uint128_t) - 1));
 
 	for (i = 0; i < max; i += sizeof(__uint128_t)) {
-		__uint128_t from = *((__uint128_t*)(_buff->str + i));
-		*((__uint128_t*)(_buff_out->str + i)) = from ^ _mask128.i128;
+		__uint128_t from = *((__uint128_t*)(p->in->str + i));
+		*((__uint128_t*)(p->out->str + i)) = from ^ _mask128.i128;
 	}
 
 	return TRUE;
 }
 
-int main()
+/**
+ * How decoding used to be done: unmask, then validate in a second pass
+ */
+static gboolean _128bit_validate(void *p_)
+{
+	struct _payload *p = p_;
+
+	_128bit(p);
+	return g_utf8_validate(p->out->str, p->in->len, NULL);
+}
+
+static gboolean _unmask(void *p_)
+{
+	guint32 mask;
+	struct _payload *p = p_;
+
+	memcpy(&mask, _mask, sizeof(mask));
+
+	return protocol_rfc6455_unmask(p->out->str, p->in->str, p->in->len, mask);
+}
+
+static void _payload_init(
+	struct _payload *p,
+	const gchar *chars,
+	const guint64 size)
 {
-	_buff = qev_buffer_get();
-	_buff_out = qev_buffer_get();
+	guint64 i;
+	const gsize chars_len = strlen(chars);
 
-	g_string_append(_buff, DECODE);
-	qev_buffer_ensure(_buff_out, _buff->len);
+	p->in = qev_buffer_get();
+	p->out = qev_buffer_get();
+
+	while (p->in->len < size) {
+		g_string_append_len(p->in, chars, MIN(chars_len, size - p->in->len));
+	}
 
-	memcpy(_mask64.c, "abcdefgh", sizeof(_mask64.c));
+	qev_buffer_ensure(p->out, p->in->len);
+
+	/*
+	 * Mask the payload so that the validating benchmarks see real text
+	 * once it's unmasked
+	 */
+	for (i = 0; i < p->in->len; i++) {
+		p->in->str[i] ^= _mask[i & 3];
+	}
+}
+
+static void _payload_clear(struct _payload *p)
+{
+	qev_buffer_put0(&p->in);
+	qev_buffer_put0(&p->out);
+}
+
+static void _bench_size(
+	qev_bench_t *bench,
+	GPtrArray *names,
+	const guint64 size)
+{
+	guint i;
+	gchar *name;
+	struct _payload ascii;
+	struct _payload utf8;
+	const guint64 iters = BYTES_PER_SIZE / size;
+	const struct {
+		const gchar *name;
+		gboolean (*fn)(void*);
+		struct _payload *p;
+	} benches[] = {
+		{ "base", _base, &ascii },
+		{ "64bit", _64bit, &ascii },
+		{ "128bit", _128bit, &ascii },
+		{ "128bit_validate", _128bit_validate, &ascii },
+		{ "unmask_validate", _unmask, &ascii },
+		{ "128bit_validate.utf8", _128bit_validate, &utf8 },
+		{ "unmask_validate.utf8", _unmask, &utf8 },
+	};
+
+	_payload_init(&ascii, CHARS, size);
+	_payload_init(&utf8, CHARS_UTF8, size);
+
+	for (i = 0; i < G_N_ELEMENTS(benches); i++) {
+		name = g_strdup_printf("%s.%" G_GUINT64_FORMAT, benches[i].name, size);
+		g_ptr_array_add(names, name);
+		qev_bench_fn(bench, name, benches[i].fn, benches[i].p, iters);
+	}
+
+	_payload_clear(&ascii);
+	_payload_clear(&utf8);
+}
+
+int main()
+{
+	guint i;
+	qev_bench_t *bench;
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+
+	memcpy(_mask64.c, "abcdabcd", sizeof(_mask64.c));
 	_mask128.i64[0] = _mask64.i64;
 	_mask128.i64[1] = _mask64.i64;
 
-	qev_bench_t *bench = qev_bench_new("ws_decode", "bench_ws_decode.xml");
-	qev_bench_fn(bench, "base", _base, NULL, 2000000);
-	qev_bench_fn(bench, "64bit", _64bit, NULL, 2000000);
-	qev_bench_fn(bench, "128bit", _128bit, NULL, 2000000);
-	qev_bench_free(bench);
+	bench = qev_bench_new("ws_decode", "bench_ws_decode.xml");
+
+	for (i = 0; i < G_N_ELEMENTS(_sizes); i++) {
+		_bench_size(bench, names, _sizes[i]);
+	}
 
-	qev_buffer_put0(&_buff);
-	qev_buffer_put0(&_buff_out);
+	qev_bench_free(bench);
+	g_ptr_array_free(names, TRUE);
 
 	return 0;
 }
@@ -8,6 +8,11 @@
 
 #include "quickio.h"
 
+/**
+ * The smallest table a client's subscriptions are moved out to
+ */
+#define SUBS_TABLE_MIN 16
+
 static qev_fair_t *_fair_subs;
 
 static qev_stats_counter_t *_stat_subs_added;
@@ -17,29 +22,131 @@ static qev_stats_counter_t *_stat_callbacks_total;
 static qev_stats_counter_t *_stat_callbacks_created;
 static qev_stats_counter_t *_stat_callbacks_fired;
 static qev_stats_counter_t *_stat_callbacks_evicted;
+static qev_stats_counter_t *_stat_callbacks_expired;
 
 /**
- * Assumes lock on client is held
+ * The client this thread has locked with client_lock(), and how many times
  */
-static struct client_sub* _sub_alloc(struct client *client)
-{
-	struct client_sub *csub = NULL;
-	guint client_used = client->subs == NULL ? 0 : g_hash_table_size(client->subs);
+static __thread struct client *_held = NULL;
+static __thread guint _held_depth = 0;
 
-	if (qev_fair_use(_fair_subs, client_used, 1)) {
-		qev_stats_counter_inc(_stat_subs_added);
+/**
+ * Callbacks evicted from _held while it was locked, waiting for the
+ * outermost client_unlock() to expire them
+ */
+static GPrivate _evicted = G_PRIVATE_INIT((GDestroyNotify)g_array_unref);
 
-		csub = g_slice_alloc0(sizeof(*csub));
+static void _cb_expire(
+	struct client *client,
+	const struct client_cb *cb,
+	const gboolean evicted);
+
+/**
+ * Make room for another subscription on the client, if it's allowed one.
+ * Assumes lock on client is held.
+ */
+static gboolean _sub_reserve(struct client *client)
+{
+	if (!qev_fair_use(_fair_subs, client->subs.len, 1)) {
+		return FALSE;
 	}
 
-	return csub;
+	qev_stats_counter_inc(_stat_subs_added);
+
+	return TRUE;
 }
 
-static void _sub_free(struct client_sub *csub)
+static void _sub_return()
 {
 	qev_fair_return(_fair_subs, 1);
 	qev_stats_counter_inc(_stat_subs_removed);
-	g_slice_free1(sizeof(*csub), csub);
+}
+
+static guint32 _sub_hash(const struct subscription *sub, const guint32 cap)
+{
+	guint64 h = GPOINTER_TO_SIZE(sub) * 0x9e3779b97f4a7c15llu;
+	return (h >> 32) & (cap - 1);
+}
+
+/**
+ * Find the slot in the table where the subscription is, or where it would
+ * go.
+ */
+static struct client_sub* _sub_probe(
+	struct client_sub *table,
+	const guint32 cap,
+	const struct subscription *sub)
+{
+	guint32 i = _sub_hash(sub, cap);
+
+	while (table[i].sub != NULL && table[i].sub != sub) {
+		i = (i + 1) & (cap - 1);
+	}
+
+	return table + i;
+}
+
+/**
+ * Move a subscription to another slot, making sure its subscribers follow
+ * it. Assumes lock on client is held.
+ */
+static void _sub_move(
+	struct client *client,
+	struct client_sub *from,
+	struct client_sub *to)
+{
+	*to = *from;
+
+	if (!to->pending) {
+		subscribers_move(sub_subscribers(to->sub, client), &from->idx, &to->idx);
+	}
+
+	from->sub = NULL;
+}
+
+/**
+ * Move every subscription into a table with the given number of slots, or
+ * back into the client when cap is 0. Assumes lock on client is held.
+ */
+static void _subs_resize(struct client *client, const guint32 cap)
+{
+	guint32 i;
+	struct client_sub *to;
+	guint32 old_cap = client->subs.cap;
+	guint32 old_len = old_cap == 0 ? client->subs.len : old_cap;
+	struct client_sub *old = old_cap == 0 ?
+								client->subs.small : client->subs.table;
+	struct client_sub *table = NULL;
+
+	if (cap > 0) {
+		table = g_slice_alloc0(sizeof(*table) * cap);
+	}
+
+	/*
+	 * When moving into the table, small and table share space, so the
+	 * table can only be set once everything is out of small
+	 */
+	to = client->subs.small;
+	for (i = 0; i < old_len; i++) {
+		if (old[i].sub == NULL) {
+			continue;
+		}
+
+		if (table != NULL) {
+			_sub_move(client, old + i, _sub_probe(table, cap, old[i].sub));
+		} else {
+			_sub_move(client, old + i, to++);
+		}
+	}
+
+	if (old_cap > 0) {
+		g_slice_free1(sizeof(*old) * old_cap, old);
+	}
+
+	client->subs.cap = cap;
+	if (table != NULL) {
+		client->subs.table = table;
+	}
 }
 
 /**
@@ -50,32 +157,124 @@ static struct client_sub* _sub_get(
 	struct client *client,
 	struct subscription *sub)
 {
-	if (client->subs == NULL) {
-		return NULL;
+	guint32 i;
+	struct client_sub *csub;
+
+	if (client->subs.cap > 0) {
+		csub = _sub_probe(client->subs.table, client->subs.cap, sub);
+		return csub->sub == NULL ? NULL : csub;
+	}
+
+	for (i = 0; i < client->subs.len; i++) {
+		if (client->subs.small[i].sub == sub) {
+			return client->subs.small + i;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Add a subscription that the client doesn't have. Assumes lock on client
+ * is held.
+ */
+static struct client_sub* _sub_insert(
+	struct client *client,
+	struct subscription *sub)
+{
+	guint32 cap = client->subs.cap;
+	struct client_sub *csub;
+
+	if (cap == 0 && client->subs.len == CLIENT_SUBS_INLINE) {
+		_subs_resize(client, SUBS_TABLE_MIN);
+	} else if (cap > 0 && (client->subs.len + 1) * 2 > cap) {
+		_subs_resize(client, cap * 2);
+	}
+
+	if (client->subs.cap == 0) {
+		csub = client->subs.small + client->subs.len;
+	} else {
+		csub = _sub_probe(client->subs.table, client->subs.cap, sub);
+	}
+
+	*csub = (struct client_sub){
+		.sub = sub,
+	};
+	client->subs.len++;
+
+	return csub;
+}
+
+/**
+ * Take a subscription's slot away from it. Assumes lock on client is held.
+ */
+static void _sub_delete(struct client *client, struct client_sub *csub)
+{
+	guint32 i;
+	guint32 j;
+	guint32 home;
+	guint32 cap = client->subs.cap;
+	struct client_sub *table = client->subs.table;
+	struct client_sub *last;
+
+	client->subs.len--;
+
+	if (cap == 0) {
+		last = client->subs.small + client->subs.len;
+		if (csub != last) {
+			_sub_move(client, last, csub);
+		}
+
+		last->sub = NULL;
+		return;
+	}
+
+	/*
+	 * Pull back anything that probed past the slot, so that lookups never
+	 * need to skip over holes
+	 */
+	i = csub - table;
+	j = i;
+	while (TRUE) {
+		j = (j + 1) & (cap - 1);
+		if (table[j].sub == NULL) {
+			break;
+		}
+
+		home = _sub_hash(table[j].sub, cap);
+		if (((j - home) & (cap - 1)) >= ((j - i) & (cap - 1))) {
+			_sub_move(client, table + j, table + i);
+			i = j;
+		}
+	}
+
+	table[i].sub = NULL;
+
+	if (client->subs.len <= CLIENT_SUBS_INLINE / 2) {
+		_subs_resize(client, 0);
+	} else if (cap > SUBS_TABLE_MIN && client->subs.len * 8 < cap) {
+		_subs_resize(client, cap / 2);
 	}
-	return g_hash_table_lookup(client->subs, sub);
 }
 
 static void _sub_cleanup(
 	struct client *client,
 	struct subscription *sub,
 	struct client_sub *csub,
-	const gboolean cleanup_hashtable)
+	const gboolean delete)
 {
-	qev_list_remove(sub->subscribers, &csub->idx);
+	if (!csub->pending) {
+		subscribers_remove(sub_subscribers(sub, client), &csub->idx);
+	}
 
 	evs_client_off(client, sub);
 
-	_sub_free(csub);
-	sub_unref(sub);
-
-	if (cleanup_hashtable) {
-		g_hash_table_remove(client->subs, sub);
-		if (g_hash_table_size(client->subs) == 0) {
-			g_hash_table_unref(client->subs);
-			client->subs = NULL;
-		}
+	if (delete) {
+		_sub_delete(client, csub);
 	}
+
+	_sub_return();
+	sub_unref(sub);
 }
 
 static gboolean _sub_remove(
@@ -86,7 +285,7 @@ static gboolean _sub_remove(
 	gboolean removed = FALSE;
 	struct client_sub *csub = NULL;
 
-	qev_lock(client);
+	client_lock(client);
 
 	csub = _sub_get(client, sub);
 	if (csub == NULL) {
@@ -101,11 +300,72 @@ static gboolean _sub_remove(
 	}
 
 out:
-	qev_unlock(client);
+	client_unlock(client);
 
 	return removed;
 }
 
+void client_lock(struct client *client)
+{
+	if (_held == client) {
+		_held_depth++;
+		return;
+	}
+
+	qev_lock(client);
+
+	/*
+	 * Only the first client locked is tracked: anything locked while it's
+	 * held goes straight to its lock, which is just as correct, only not
+	 * as cheap
+	 */
+	if (_held == NULL) {
+		_held = client;
+		_held_depth = 1;
+	}
+}
+
+void client_unlock(struct client *client)
+{
+	guint i;
+	GArray *evicted;
+
+	if (_held != client) {
+		qev_unlock(client);
+		return;
+	}
+
+	_held_depth--;
+	if (_held_depth > 0) {
+		return;
+	}
+
+	_held = NULL;
+	qev_unlock(client);
+
+	evicted = g_private_get(&_evicted);
+	if (evicted == NULL || evicted->len == 0) {
+		return;
+	}
+
+	/*
+	 * Expiring might lock the client and evict more: those are left to
+	 * whatever unlock comes with them
+	 */
+	g_private_set(&_evicted, NULL);
+
+	for (i = 0; i < evicted->len; i++) {
+		_cb_expire(client, &g_array_index(evicted, struct client_cb, i), TRUE);
+	}
+
+	if (g_private_get(&_evicted) == NULL) {
+		g_array_set_size(evicted, 0);
+		g_private_set(&_evicted, evicted);
+	} else {
+		g_array_unref(evicted);
+	}
+}
+
 static void _cb_data_free(void *cb_data, const qev_free_fn free_fn)
 {
 	if (cb_data != NULL && free_fn != NULL) {
@@ -113,17 +373,95 @@ static void _cb_data_free(void *cb_data, const qev_free_fn free_fn)
 	}
 }
 
-static void _cb_remove(struct client *client, const guint i)
+/**
+ * Give the client its callback slots, all free. Assumes lock on client is
+ * held.
+ */
+static void _cbs_alloc(struct client *client)
+{
+	guint16 i;
+	guint16 len = MIN(cfg_clients_cb_max, CLIENT_CBS_MAX);
+
+	client->cbs.slots = g_slice_alloc0(sizeof(*client->cbs.slots) * len);
+	client->cbs.len = len;
+	client->cbs.oldest = CLIENT_CB_NONE;
+	client->cbs.newest = CLIENT_CB_NONE;
+	client->cbs.free = 0;
+
+	for (i = 0; i < len; i++) {
+		client->cbs.slots[i].newer = i + 1 < len ? i + 1 : CLIENT_CB_NONE;
+	}
+}
+
+/**
+ * Take a callback out of its slot, returning the slot to the free list.
+ * Assumes lock on client is held.
+ */
+static void _cb_remove(struct client *client, const guint16 i)
 {
-	g_slice_free1(sizeof(**client->cbs), client->cbs[i]);
-	client->cbs[i] = NULL;
+	struct client_cb *cb = client->cbs.slots + i;
+
+	if (cb->older == CLIENT_CB_NONE) {
+		client->cbs.oldest = cb->newer;
+	} else {
+		client->cbs.slots[cb->older].newer = cb->newer;
+	}
+
+	if (cb->newer == CLIENT_CB_NONE) {
+		client->cbs.newest = cb->older;
+	} else {
+		client->cbs.slots[cb->newer].older = cb->older;
+	}
+
+	*cb = (struct client_cb){
+		.older = CLIENT_CB_NONE,
+		.newer = client->cbs.free,
+	};
+	client->cbs.free = i;
+
 	qev_stats_counter_dec(_stat_callbacks_total);
 }
 
-static void _cb_free(struct client *client, const guint i)
+/**
+ * Tell anyone that cares that a callback is never going to be answered,
+ * and free it. Must be called without the client locked.
+ */
+static void _cb_expire(
+	struct client *client,
+	const struct client_cb *cb,
+	const gboolean evicted)
 {
-	_cb_data_free(client->cbs[i]->cb_data, client->cbs[i]->free_fn);
-	_cb_remove(client, i);
+	evs_cb_expired(client, cb->cb_fn, cb->cb_data, evicted);
+	_cb_data_free(cb->cb_data, cb->free_fn);
+
+	if (evicted) {
+		qev_stats_counter_inc(_stat_callbacks_evicted);
+	} else {
+		qev_stats_counter_inc(_stat_callbacks_expired);
+	}
+}
+
+/**
+ * Expire a callback that was evicted to make room, once nothing on this
+ * thread has the client locked: right away, or from the outermost
+ * client_unlock(), so that nothing runs with the client locked.
+ */
+static void _cb_evict(struct client *client, const struct client_cb *cb)
+{
+	GArray *evicted;
+
+	if (_held != client) {
+		_cb_expire(client, cb, TRUE);
+		return;
+	}
+
+	evicted = g_private_get(&_evicted);
+	if (evicted == NULL) {
+		evicted = g_array_new(FALSE, FALSE, sizeof(struct client_cb));
+		g_private_set(&_evicted, evicted);
+	}
+
+	g_array_append_val(evicted, *cb);
 }
 
 evs_cb_t client_cb_new(
@@ -133,46 +471,66 @@ evs_cb_t client_cb_new(
 	const qev_free_fn free_fn)
 {
 	guint16 i;
-	struct client_cb cb;
+	struct client_cb *cb;
+	struct client_cb evicted = { .cb_fn = NULL };
+	gint64 created = qev_monotonic;
+	evs_cb_t server_cb;
 
 	if (cb_fn == NULL) {
 		_cb_data_free(cb_data, free_fn);
 		return EVS_NO_CALLBACK;
 	}
 
-	qev_lock(client);
+	client_lock(client);
 
-	for (i = 0; i < G_N_ELEMENTS(client->cbs); i++) {
-		if (client->cbs[i] == NULL) {
-			break;
-		}
+	if (client->cbs.slots == NULL) {
+		_cbs_alloc(client);
 	}
 
-	if (i == G_N_ELEMENTS(client->cbs)) {
-		i = (guint)g_random_int_range(0, G_N_ELEMENTS(client->cbs));
-		_cb_free(client, i);
-		qev_stats_counter_inc(_stat_callbacks_evicted);
+	if (client->cbs.free == CLIENT_CB_NONE) {
+		evicted = client->cbs.slots[client->cbs.oldest];
+		_cb_remove(client, client->cbs.oldest);
 	}
 
-	client->cbs_id++;
-	client->cbs_id = MAX(1, client->cbs_id);
+	i = client->cbs.free;
+	cb = client->cbs.slots + i;
+	client->cbs.free = cb->newer;
 
-	cb = (struct client_cb){
-		.id = client->cbs_id,
+	client->cbs.id++;
+	client->cbs.id = MAX(1, client->cbs.id);
+
+	*cb = (struct client_cb){
+		.id = client->cbs.id,
+		.older = client->cbs.newest,
+		.newer = CLIENT_CB_NONE,
 		.cb_fn = cb_fn,
 		.cb_data = cb_data,
 		.free_fn = free_fn,
-		.created = qev_monotonic,
+		.created = created,
 	};
 
-	client->cbs[i] = g_slice_copy(sizeof(cb), &cb);
+	if (client->cbs.newest == CLIENT_CB_NONE) {
+		client->cbs.oldest = i;
+	} else {
+		client->cbs.slots[client->cbs.newest].newer = i;
+	}
 
-	qev_unlock(client);
+	client->cbs.newest = i;
+	server_cb = ((evs_cb_t)i << 16) | cb->id;
+
+	client_unlock(client);
+
+	if (evicted.cb_fn != NULL) {
+		_cb_evict(client, &evicted);
+	}
+
+	periodic_schedule(client,
+		created + QEV_SEC_TO_USEC(cfg_clients_cb_max_age));
 
 	qev_stats_counter_inc(_stat_callbacks_total);
 	qev_stats_counter_inc(_stat_callbacks_created);
 
-	return (i << 16) | cb.id;
+	return server_cb;
 }
 
 enum evs_status client_cb_fire(
@@ -183,21 +541,20 @@ enum evs_status client_cb_fire(
 {
 	struct client_cb cb = { .cb_fn = NULL };
 	enum evs_status status;
-	guint16 slot = server_cb >> 16;
+	evs_cb_t slot = server_cb >> 16;
 	guint16 id = server_cb & 0xffff;
 
-	if (slot >= G_N_ELEMENTS(client->cbs)) {
-		goto error;
-	}
+	client_lock(client);
 
-	qev_lock(client);
+	if (slot < client->cbs.len &&
+		client->cbs.slots[slot].cb_fn != NULL &&
+		client->cbs.slots[slot].id == id) {
 
-	if (client->cbs[slot] != NULL && client->cbs[slot]->id == id) {
-		cb = *client->cbs[slot];
+		cb = client->cbs.slots[slot];
 		_cb_remove(client, slot);
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 
 	if (cb.cb_fn == NULL) {
 		goto error;
@@ -216,30 +573,47 @@ error:
 	return EVS_STATUS_HANDLED;
 }
 
-void client_cb_prune(struct client *client, const gint64 before)
+gint64 client_cb_prune(struct client *client, const gint64 before)
 {
-	guint i;
-	gboolean has_lock = FALSE;
+	guint16 i;
+	struct client_cb cb;
+	gint64 oldest = G_MAXINT64;
 
-	for (i = 0; i < G_N_ELEMENTS(client->cbs); i++) {
-		if (client->cbs[i] != NULL && !has_lock) {
-			has_lock = TRUE;
-			qev_lock(client);
+	/*
+	 * Callbacks are kept in the order they were made, so only the expired
+	 * ones at the old end are ever looked at. Each is expired outside of
+	 * the lock, since whoever's told about it might want the client.
+	 */
+	while (client->cbs.slots != NULL) {
+		cb.cb_fn = NULL;
+
+		client_lock(client);
+
+		i = client->cbs.oldest;
+		if (i != CLIENT_CB_NONE) {
+			if (client->cbs.slots[i].created < before) {
+				cb = client->cbs.slots[i];
+				_cb_remove(client, i);
+			} else {
+				oldest = client->cbs.slots[i].created;
+			}
 		}
 
-		if (client->cbs[i] != NULL && client->cbs[i]->created < before) {
-			_cb_free(client, i);
+		client_unlock(client);
+
+		if (cb.cb_fn == NULL) {
+			break;
 		}
-	}
 
-	if (has_lock) {
-		qev_unlock(client);
+		_cb_expire(client, &cb, FALSE);
 	}
+
+	return oldest;
 }
 
-gint64 client_cb_prune_get_before()
+gint64 client_cb_prune_get_before(const gint64 now)
 {
-	return qev_monotonic - QEV_SEC_TO_USEC(cfg_clients_cb_max_age);
+	return now - QEV_SEC_TO_USEC(cfg_clients_cb_max_age);
 }
 
 gboolean client_sub_active(struct client *client, struct subscription *sub)
@@ -247,12 +621,12 @@ gboolean client_sub_active(struct client *client, struct subscription *sub)
 	gboolean active;
 	struct client_sub *csub;
 
-	qev_lock(client);
+	client_lock(client);
 
 	csub = _sub_get(client, sub);
 	active = csub != NULL && !csub->pending && !csub->tombstone;
 
-	qev_unlock(client);
+	client_unlock(client);
 
 	return active;
 }
@@ -264,7 +638,7 @@ enum client_sub_state client_sub_add(
 	enum client_sub_state sstate;
 	struct client_sub *csub = NULL;
 
-	qev_lock(client);
+	client_lock(client);
 
 	if (qev_is_closing(client)) {
 		sstate = CLIENT_SUB_NULL;
@@ -282,23 +656,17 @@ enum client_sub_state client_sub_add(
 		goto out;
 	}
 
-	csub = _sub_alloc(client);
-	if (csub == NULL) {
+	if (!_sub_reserve(client)) {
 		sstate = CLIENT_SUB_NULL;
 		goto out;
 	}
 
-	if (client->subs == NULL) {
-		client->subs = g_hash_table_new(NULL, NULL);
-	}
-
+	csub = _sub_insert(client, sub_ref(sub));
 	csub->pending = TRUE;
-	sub_ref(sub);
-	g_hash_table_insert(client->subs, sub, csub);
 	sstate = CLIENT_SUB_CREATED;
 
 out:
-	qev_unlock(client);
+	client_unlock(client);
 	return sstate;
 }
 
@@ -310,7 +678,7 @@ enum client_sub_state client_sub_accept(
 	enum client_sub_state sstate = CLIENT_SUB_NULL;
 	struct client_sub *csub = NULL;
 
-	qev_lock(client);
+	client_lock(client);
 
 	csub = _sub_get(client, sub);
 
@@ -319,8 +687,8 @@ enum client_sub_state client_sub_accept(
 		goto out;
 	}
 
-	ok = QEV_MOCK(gboolean, qev_list_add,
-		sub->subscribers, client, &csub->idx);
+	ok = QEV_MOCK(gboolean, subscribers_add,
+		sub_subscribers(sub, client), client, &csub->idx);
 	if (!ok) {
 		goto cleanup;
 	} else {
@@ -335,7 +703,7 @@ enum client_sub_state client_sub_accept(
 	}
 
 out:
-	qev_unlock(client);
+	client_unlock(client);
 	return sstate;
 
 cleanup:
@@ -379,7 +747,7 @@ void client_set(struct client *client, const GQuark key, GVariant *val)
 
 	g_variant_ref_sink(val);
 
-	qev_lock(client);
+	client_lock(client);
 
 	if (client->data == NULL) {
 		client->data = g_hash_table_new_full(NULL, NULL,
@@ -388,20 +756,20 @@ void client_set(struct client *client, const GQuark key, GVariant *val)
 
 	g_hash_table_insert(client->data, GINT_TO_POINTER(key), val);
 
-	qev_unlock(client);
+	client_unlock(client);
 }
 
 GVariant* client_get(struct client *client, const GQuark key)
 {
 	GVariant *ret = NULL;
 
-	qev_lock(client);
+	client_lock(client);
 
 	if (client->data != NULL) {
 		ret = g_hash_table_lookup(client->data, GINT_TO_POINTER(key));
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 
 	if (ret != NULL) {
 		g_variant_ref(ret);
@@ -414,13 +782,13 @@ gboolean client_has(struct client *client, const GQuark key)
 {
 	gboolean has = FALSE;
 
-	qev_lock(client);
+	client_lock(client);
 
 	if (client->data != NULL) {
 		has = g_hash_table_contains(client->data, GINT_TO_POINTER(key));
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 
 	return has;
 }
@@ -429,7 +797,7 @@ void client_del(struct client *client, const GQuark key)
 {
 	GHashTable *tbl = NULL;
 
-	qev_lock(client);
+	client_lock(client);
 
 	if (client->data != NULL) {
 		g_hash_table_remove(client->data, GINT_TO_POINTER(key));
@@ -440,7 +808,7 @@ void client_del(struct client *client, const GQuark key)
 		}
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 
 	if (tbl != NULL) {
 		g_hash_table_unref(tbl);
@@ -449,25 +817,33 @@ void client_del(struct client *client, const GQuark key)
 
 void client_closed(struct client *client)
 {
-	GHashTableIter iter;
-	struct subscription *sub;
-	struct client_sub *csub;
+	guint32 i;
+	guint32 len;
+	struct client_sub *csubs;
 
-	qev_lock(client);
+	client_lock(client);
 
-	if (client->subs != NULL) {
-		g_hash_table_iter_init(&iter, client->subs);
+	if (client->subs.cap == 0) {
+		csubs = client->subs.small;
+		len = client->subs.len;
+	} else {
+		csubs = client->subs.table;
+		len = client->subs.cap;
+	}
 
-		while (g_hash_table_iter_next(&iter, (void**)&sub, (void**)&csub)) {
-			g_hash_table_iter_remove(&iter);
-			_sub_cleanup(client, sub, csub, FALSE);
+	for (i = 0; i < len; i++) {
+		if (csubs[i].sub != NULL) {
+			_sub_cleanup(client, csubs[i].sub, csubs + i, FALSE);
 		}
+	}
 
-		g_hash_table_unref(client->subs);
-		client->subs = NULL;
+	if (client->subs.cap > 0) {
+		g_slice_free1(sizeof(*csubs) * client->subs.cap, csubs);
 	}
 
-	qev_unlock(client);
+	memset(&client->subs, 0, sizeof(client->subs));
+
+	client_unlock(client);
 }
 
 void client_free_all(struct client *client)
@@ -476,12 +852,19 @@ void client_free_all(struct client *client)
 	 * At this point, the client is being freed, so no one can have a reference
 	 * to him and everything can be done without locks.
 	 */
-	guint i;
+	guint16 i;
+	struct client_cb *cb;
 
-	for (i = 0; i < G_N_ELEMENTS(client->cbs); i++) {
-		if (client->cbs[i] != NULL) {
-			_cb_free(client, i);
+	if (client->cbs.slots != NULL) {
+		for (i = client->cbs.oldest; i != CLIENT_CB_NONE; i = cb->newer) {
+			cb = client->cbs.slots + i;
+			_cb_data_free(cb->cb_data, cb->free_fn);
+			qev_stats_counter_dec(_stat_callbacks_total);
 		}
+
+		g_slice_free1(sizeof(*client->cbs.slots) * client->cbs.len,
+						client->cbs.slots);
+		client->cbs.slots = NULL;
 	}
 
 	if (client->data != NULL) {
@@ -515,7 +898,11 @@ void client_init()
 		"How many callbacks were triggered by clients");
 	_stat_callbacks_evicted = qev_stats_counter(
 		"clients.callbacks", "evicted", TRUE,
-		"How many callbacks were evicted");
+		"How many callbacks were evicted, oldest first, to make room for "
+		"new ones");
+	_stat_callbacks_expired = qev_stats_counter(
+		"clients.callbacks", "expired", TRUE,
+		"How many callbacks were never answered in time");
 
 	qev_cleanup_and_null_full((void**)&_fair_subs,
 					(qev_free_fn)qev_fair_free, TRUE);
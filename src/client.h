@@ -12,6 +12,23 @@
 #pragma once
 #include "quickio.h"
 
+/**
+ * Marks the end of the lists in a client's callbacks
+ */
+#define CLIENT_CB_NONE G_MAXUINT16
+
+/**
+ * The most callbacks a client may ever have: every slot needs an index
+ * that isn't CLIENT_CB_NONE
+ */
+#define CLIENT_CBS_MAX (CLIENT_CB_NONE - 1)
+
+/**
+ * How many subscriptions a client keeps in itself before moving them out to
+ * a table
+ */
+#define CLIENT_SUBS_INLINE 4
+
 /**
  * Client subscriptions go through multiple states, explained here.
  */
@@ -48,20 +65,25 @@ enum client_sub_state {
  * Information about the client's subscription to an event.
  */
 struct client_sub {
+	/**
+	 * The subscription. NULL for empty slots in the client's table.
+	 */
+	struct subscription *sub;
+
 	/**
 	 * Where the client lives in the sub list
 	 */
-	qev_list_item_t idx;
+	subscribers_idx_t idx;
 
 	/**
 	 * If the subscription is pending: the on() callback went async
 	 */
-	gboolean pending;
+	guint pending:1;
 
 	/**
 	 * If an unsubscribe came in before evs_on_cb() came through
 	 */
-	gboolean tombstone;
+	guint tombstone:1;
 };
 
 /**
@@ -73,6 +95,14 @@ struct client_cb {
 	 */
 	guint16 id;
 
+	/**
+	 * The callbacks on either side of this one, from oldest to newest, as
+	 * slots in the client's callbacks. For free slots, newer links up the
+	 * next free slot.
+	 */
+	guint16 older;
+	guint16 newer;
+
 	/**
 	 * The function to be called
 	 */
@@ -112,6 +142,29 @@ struct client {
 		 */
 		gboolean handshaked:1;
 
+		/**
+		 * If the client asked for events to be packed together into
+		 * frames, one per line.
+		 */
+		gboolean batch:1;
+
+		/**
+		 * If the client negotiated compressed frames with its protocol.
+		 */
+		gboolean deflate:1;
+
+		/**
+		 * Events waiting to be packed into a single frame, separated by
+		 * newlines. Only touched with the client locked.
+		 */
+		GString *batched;
+
+		/**
+		 * Frames waiting to be written to clients that don't batch, all in
+		 * one go. Only touched with the client locked.
+		 */
+		GString *corked;
+
 		/**
 		 * Once a protocol has accepted the client, this will point to the
 		 * protocol-level functions that can be used.
@@ -123,7 +176,15 @@ struct client {
 		 * bit-field structs.
 		 */
 		union {
-
+			/**
+			 * For raw clients
+			 */
+			struct {
+				/**
+				 * If the client is a link carrying virtual clients
+				 */
+				gboolean mux:1;
+			} raw;
 		} flags;
 	} protocol;
 
@@ -147,9 +208,27 @@ struct client {
 	qev_timeout_t *timeout;
 
 	/**
-	 * Maps: struct subscription -> gint32 (qev_list index)
+	 * Every subscription the client has. The first few are kept right here,
+	 * in no particular order; past that, they're moved out to a linearly
+	 * probed table keyed on the subscription.
 	 */
-	GHashTable *subs;
+	struct {
+		/**
+		 * How many subscriptions the client has
+		 */
+		guint32 len;
+
+		/**
+		 * How many slots are in the table. 0 while the subscriptions are
+		 * kept in small.
+		 */
+		guint32 cap;
+
+		union {
+			struct client_sub small[CLIENT_SUBS_INLINE];
+			struct client_sub *table;
+		};
+	} subs;
 
 	/**
 	 * Any extra data that can be attached to a client using
@@ -225,20 +304,126 @@ struct client {
 	} http;
 
 	/**
-	 * The callbacks for the client.
+	 * For virtual clients multiplexed over a single raw connection, and for
+	 * the connections (links) carrying them. Everything here, other than
+	 * link, is only touched with the link locked.
 	 */
-	struct client_cb *cbs[4];
+	struct {
+		/**
+		 * On a link: maps the id of each of its virtual clients -> the
+		 * virtual client. NULL everywhere else.
+		 */
+		GHashTable *clients;
+
+		/**
+		 * On a virtual client: the link that it's carried over. Set when
+		 * created and cleared, with the virtual client locked, when it
+		 * closes. Must be free'd with qev_unref().
+		 */
+		struct client *link;
+
+		/**
+		 * On a virtual client: its id on the link
+		 */
+		guint64 id;
+
+		/**
+		 * On a link: a broadcast that's going out to some of the virtual
+		 * clients in a single frame, waiting for more of them
+		 */
+		struct protocol_bcast *bcast;
+
+		/**
+		 * On a link: the ids of everyone getting the broadcast so far,
+		 * separated by commas
+		 */
+		GString *bcast_ids;
+	} mux;
 
 	/**
-	 * The ID of the most recent callback
+	 * Where the client waits in the periodic timing wheel. Only touched
+	 * with the wheel locked.
 	 */
-	guint16 cbs_id;
+	struct {
+		/**
+		 * When the client is next due to be looked at
+		 */
+		gint64 due;
+
+		/**
+		 * The slot the client is in. NULL when not in the wheel.
+		 */
+		struct client **slot;
+
+		/**
+		 * The clients around this one in its slot
+		 */
+		struct client *prev;
+		struct client *next;
+	} periodic;
+
+	/**
+	 * The callbacks waiting for the client to answer. Only touched with the
+	 * client locked.
+	 */
+	struct {
+		/**
+		 * Every callback slot, allocated in one piece with the client's
+		 * first callback. Free slots have no cb_fn.
+		 */
+		struct client_cb *slots;
+
+		/**
+		 * How many slots there are
+		 */
+		guint16 len;
+
+		/**
+		 * The ends of the list of callbacks in use, ordered by age
+		 */
+		guint16 oldest;
+		guint16 newest;
+
+		/**
+		 * The first free slot
+		 */
+		guint16 free;
+
+		/**
+		 * The ID of the most recent callback
+		 */
+		guint16 id;
+	} cbs;
 };
 
+/**
+ * Lock the client. Everything that handles a single inbound event (a
+ * subscription being added, its callback, and anything sent along the way)
+ * nests its locks on the client, so once this thread holds the lock, locking
+ * again only counts how deep it is, and only the outermost lock and unlock
+ * ever touch the client's lock. This only saves the nested locks: the
+ * outermost lock is always taken, even on the thread that owns the client.
+ *
+ * @param client
+ *     The client to lock
+ */
+void client_lock(struct client *client);
+
+/**
+ * Undo a client_lock()
+ *
+ * @param client
+ *     The client to unlock
+ */
+void client_unlock(struct client *client);
+
 /**
  * Creates a callback for the client.
  * If cb_fn is NULL and cb_data is not, it is cleaned up with free_fn, and
- * EVS_NO_CALLBACK is returned.
+ * EVS_NO_CALLBACK is returned. If the client already has as many callbacks
+ * as it may, its oldest is evicted to make room. When this thread has the
+ * client locked, the evicted callback is only expired once the outermost
+ * client_unlock() lets the client go.
  *
  * @param client
  *     The client to create a callback for
@@ -279,13 +464,20 @@ enum evs_status client_cb_fire(
 
 /**
  * Prune any client callbacks that have been hanging around too long.
+ *
+ * @return
+ *     When the oldest callback that's left was created. G_MAXINT64 if
+ *     there are none.
  */
-void client_cb_prune(struct client *client, const gint64 before);
+gint64 client_cb_prune(struct client *client, const gint64 before);
 
 /**
  * Get the time before which callbacks should be pruned.
+ *
+ * @param now
+ *     The time callbacks are being pruned at, in monotonic time
  */
-gint64 client_cb_prune_get_before();
+gint64 client_cb_prune_get_before(const gint64 now);
 
 /**
  * Checks if a client is subscribed to the given susbcription.
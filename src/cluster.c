@@ -0,0 +1,1068 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+/**
+ * Sent by dialers as the first frame on every link
+ */
+#define VERSION "quickio-cluster/1"
+
+/**
+ * Size of the length that starts every frame
+ */
+#define HEADER_LEN 4
+
+/**
+ * Largest frame a peer may send before it's assumed to be broken
+ */
+#define MAX_FRAME (16 * 1024 * 1024)
+
+/**
+ * Most bytes that may be waiting for a peer before it's considered too slow
+ * and dropped. It dials back in and re-subscribes on its own.
+ */
+#define MAX_PENDING (64 * 1024 * 1024)
+
+/**
+ * Bounds, in milliseconds, on how long to wait before dialing a peer again
+ */
+#define BACKOFF_MIN 100
+#define BACKOFF_MAX 25600
+
+/**
+ * How long, in milliseconds, to wait for a peer to answer
+ */
+#define CONNECT_TIMEOUT 5000
+
+/**
+ * Size of each read from a peer
+ */
+#define READ_SIZE 16384
+
+#define OP_HELLO 'H'
+#define OP_SUB '+'
+#define OP_UNSUB '-'
+#define OP_BROADCAST 'B'
+
+/**
+ * A connection to a peer, owned by a single thread that does all of its
+ * reading and writing.
+ */
+struct _link {
+	/**
+	 * The connection to the peer; -1 when there isn't one. Only changed by
+	 * the link's thread, with the lock held.
+	 */
+	qev_fd_t sock;
+
+	/**
+	 * Wakes the link's thread when there's something to write
+	 */
+	gint wakeup;
+
+	/**
+	 * Set once the link is being dropped, so nothing else is queued for it
+	 */
+	gboolean dead;
+
+	/**
+	 * Frames waiting to be written
+	 */
+	GString *out;
+
+	/**
+	 * Partially-read frames. Only touched by the link's thread.
+	 */
+	GString *in;
+
+	/**
+	 * Guards everything but `in`
+	 */
+	GMutex lock;
+};
+
+/**
+ * A peer that this server dialed: this server's interests go out, and the
+ * peer's broadcasts come back.
+ */
+struct _upstream {
+	/**
+	 * Must be first: links are cast back to their upstreams
+	 */
+	struct _link link;
+
+	/**
+	 * Where the peer listens
+	 */
+	gchar *addr;
+
+	/**
+	 * If the peer has been told about everything in `_interests`, and so
+	 * needs to be told about changes. Guarded by the link's lock.
+	 */
+	gboolean connected;
+
+	/**
+	 * If this is the server above this one in a tree, rather than a peer:
+	 * its broadcasts are relayed on to anything that dialed in here.
+	 */
+	gboolean relay;
+
+	GThread *thread;
+};
+
+/**
+ * A peer that dialed this server: its interests come in, and broadcasts
+ * go out.
+ */
+struct _downstream {
+	/**
+	 * Must be first: links are cast back to their downstreams
+	 */
+	struct _link link;
+
+	/**
+	 * If the peer introduced itself properly
+	 */
+	gboolean hello;
+
+	/**
+	 * Every path the peer has clients for. Guarded by the link's lock.
+	 */
+	GHashTable *interests;
+};
+
+typedef gboolean (*_frame_cb)(
+	struct _link *l,
+	const gchar op,
+	gchar *payload,
+	const gsize len);
+
+static qev_stats_counter_t *_stat_relayed;
+static qev_stats_counter_t *_stat_received;
+static qev_stats_counter_t *_stat_dropped;
+
+/**
+ * Set when the server is shutting down and every link should close
+ */
+static gboolean _stop = FALSE;
+
+/**
+ * Broadcasts made from threads that receive from peers aren't relayed
+ * again: every server hears from every other directly.
+ */
+static __thread gboolean _inbound = FALSE;
+
+/**
+ * Peers dialed by this server. Never changes once running.
+ */
+static GPtrArray *_upstreams = NULL;
+
+/**
+ * Peers that dialed in
+ */
+static GPtrArray *_downstreams = NULL;
+static GMutex _downstreams_lock;
+static GCond _downstreams_cond;
+
+/**
+ * Number of peers that dialed in, for checking without the lock
+ */
+static guint _downstreams_len = 0;
+
+/**
+ * Number of subscriptions to every path with any, for telling peers what to
+ * send. Guarded by _interests_lock.
+ */
+static GHashTable *_interests = NULL;
+static GMutex _interests_lock;
+
+/**
+ * If this server pulls from `cluster-upstream`, in which case everything
+ * that dialed in here is pulling from it too, through this server
+ */
+static gboolean _relaying = FALSE;
+
+static qev_fd_t _listen_sock = -1;
+static GThread *_listener = NULL;
+
+static void _frame(
+	GString *buff,
+	const gchar op,
+	const gchar *path,
+	const gchar *json)
+{
+	guint32 len;
+	gsize start = buff->len;
+
+	g_string_set_size(buff, start + HEADER_LEN);
+	g_string_append_c(buff, op);
+	g_string_append(buff, path);
+
+	if (json != NULL) {
+		g_string_append_c(buff, '\0');
+		g_string_append(buff, json);
+	}
+
+	len = GUINT32_TO_BE(buff->len - start - HEADER_LEN);
+	memcpy(buff->str + start, &len, HEADER_LEN);
+}
+
+static struct addrinfo* _resolve(const gchar *addr, const gboolean passive)
+{
+	gint err;
+	gchar *host;
+	gchar *port;
+	gchar *end;
+	struct addrinfo *res = NULL;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = passive ? AI_PASSIVE : 0,
+	};
+
+	host = g_strdup(addr);
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		WARN("Invalid cluster address, must be host:port: %s", addr);
+		goto out;
+	}
+
+	*port++ = '\0';
+
+	/*
+	 * IPv6 addresses come wrapped up: [::1]:8080
+	 */
+	if (*host == '[') {
+		end = strchr(host, ']');
+		if (end != NULL) {
+			*end = '\0';
+		}
+
+		memmove(host, host + 1, strlen(host));
+	}
+
+	err = getaddrinfo(*host == '\0' ? NULL : host, port, &hints, &res);
+	if (err != 0) {
+		WARN("Could not resolve cluster address %s: %s",
+			addr, gai_strerror(err));
+		res = NULL;
+	}
+
+out:
+	g_free(host);
+	return res;
+}
+
+static void _nodelay(qev_fd_t sock)
+{
+	gint on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on));
+}
+
+static qev_fd_t _listen(const gchar *addr)
+{
+	gint on = 1;
+	qev_fd_t sock = -1;
+	struct addrinfo *res = _resolve(addr, TRUE);
+
+	if (res == NULL) {
+		return -1;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+					res->ai_protocol);
+	if (sock == -1) {
+		goto out;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+
+	if (bind(sock, res->ai_addr, res->ai_addrlen) != 0 ||
+		listen(sock, SOMAXCONN) != 0) {
+		close(sock);
+		sock = -1;
+	}
+
+out:
+	freeaddrinfo(res);
+	return sock;
+}
+
+/**
+ * Dial a peer without blocking shutdown for too long
+ */
+static qev_fd_t _connect(struct _upstream *u)
+{
+	gint err;
+	gint flags;
+	socklen_t len = sizeof(err);
+	qev_fd_t sock = -1;
+	struct addrinfo *res = _resolve(u->addr, FALSE);
+	struct pollfd fds[2] = {
+		{	.events = POLLOUT },
+		{	.fd = u->link.wakeup,
+			.events = POLLIN,
+		},
+	};
+
+	if (res == NULL) {
+		return -1;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+					res->ai_protocol);
+	if (sock == -1) {
+		goto out;
+	}
+
+	flags = fcntl(sock, F_GETFL);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+	err = connect(sock, res->ai_addr, res->ai_addrlen);
+	if (err != 0 && errno == EINPROGRESS) {
+		fds[0].fd = sock;
+
+		if (poll(fds, G_N_ELEMENTS(fds), CONNECT_TIMEOUT) > 0 &&
+			(fds[0].revents & POLLOUT) &&
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0) {
+			errno = err;
+		} else {
+			err = -1;
+		}
+	}
+
+	if (err != 0) {
+		close(sock);
+		sock = -1;
+		goto out;
+	}
+
+	fcntl(sock, F_SETFL, flags);
+	_nodelay(sock);
+
+out:
+	freeaddrinfo(res);
+	return sock;
+}
+
+static void _link_init(struct _link *l, const qev_fd_t sock)
+{
+	l->sock = sock;
+	l->wakeup = eventfd(0, EFD_CLOEXEC);
+	l->out = g_string_sized_new(READ_SIZE);
+	l->in = g_string_sized_new(READ_SIZE);
+	g_mutex_init(&l->lock);
+
+	ASSERT(l->wakeup != -1, "Could not create cluster link wakeup: %s",
+			strerror(errno));
+}
+
+static void _link_clear(struct _link *l)
+{
+	close(l->wakeup);
+	g_string_free(l->out, TRUE);
+	g_string_free(l->in, TRUE);
+	g_mutex_clear(&l->lock);
+}
+
+static void _link_wake(struct _link *l)
+{
+	eventfd_write(l->wakeup, 1);
+}
+
+/**
+ * Wake the link's thread if there's anything for it to write
+ */
+static void _link_flush(struct _link *l)
+{
+	gboolean pending;
+
+	g_mutex_lock(&l->lock);
+	pending = l->out->len > 0;
+	g_mutex_unlock(&l->lock);
+
+	if (pending) {
+		_link_wake(l);
+	}
+}
+
+/**
+ * Drop the link from any thread. Its thread notices and cleans up.
+ * Call with the link's lock held.
+ */
+static void _link_kill(struct _link *l)
+{
+	l->dead = TRUE;
+	if (l->sock != -1) {
+		shutdown(l->sock, SHUT_RDWR);
+	}
+	_link_wake(l);
+}
+
+static gboolean _link_write(struct _link *l, GString *buff)
+{
+	gssize wrote;
+	gsize at = 0;
+
+	while (at < buff->len) {
+		wrote = send(l->sock, buff->str + at, buff->len - at, MSG_NOSIGNAL);
+		if (wrote == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		at += wrote;
+	}
+
+	return TRUE;
+}
+
+static gboolean _link_read(struct _link *l, _frame_cb on_frame)
+{
+	gssize len;
+	gchar *payload;
+	gchar after;
+	guint32 frame_len;
+	gsize at = 0;
+	gboolean good = TRUE;
+	gchar buff[READ_SIZE];
+
+	len = recv(l->sock, buff, sizeof(buff), 0);
+	if (len <= 0) {
+		return len == -1 && errno == EINTR;
+	}
+
+	g_string_append_len(l->in, buff, len);
+
+	while (good && l->in->len - at >= HEADER_LEN) {
+		memcpy(&frame_len, l->in->str + at, HEADER_LEN);
+		frame_len = GUINT32_FROM_BE(frame_len);
+
+		if (frame_len == 0 || frame_len > MAX_FRAME) {
+			WARN("Cluster peer sent a broken frame, dropping it");
+			return FALSE;
+		}
+
+		if (l->in->len - at - HEADER_LEN < frame_len) {
+			break;
+		}
+
+		/*
+		 * Payloads are handed out as strings, so borrow the first byte of
+		 * whatever comes next for a terminator
+		 */
+		payload = l->in->str + at + HEADER_LEN;
+		after = payload[frame_len];
+		payload[frame_len] = '\0';
+
+		good = on_frame(l, *payload, payload + 1, frame_len - 1);
+
+		payload[frame_len] = after;
+		at += HEADER_LEN + frame_len;
+	}
+
+	g_string_erase(l->in, 0, at);
+
+	return good;
+}
+
+/**
+ * Shuffle frames between the peer and the server until either side is done
+ */
+static void _link_run(struct _link *l, _frame_cb on_frame)
+{
+	eventfd_t val;
+	GString *tmp;
+	gboolean good = TRUE;
+	GString *writing = g_string_sized_new(READ_SIZE);
+	struct pollfd fds[2] = {
+		{	.fd = l->sock,
+			.events = POLLIN,
+		},
+		{	.fd = l->wakeup,
+			.events = POLLIN,
+		},
+	};
+
+	while (good && !g_atomic_int_get(&_stop)) {
+		if (poll(fds, G_N_ELEMENTS(fds), -1) == -1) {
+			good = errno == EINTR;
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			eventfd_read(l->wakeup, &val);
+
+			g_mutex_lock(&l->lock);
+			tmp = l->out;
+			l->out = writing;
+			writing = tmp;
+			good = !l->dead;
+			g_mutex_unlock(&l->lock);
+
+			good = good && _link_write(l, writing);
+			g_string_truncate(writing, 0);
+		}
+
+		if (good && fds[0].revents != 0) {
+			good = _link_read(l, on_frame);
+		}
+	}
+
+	g_string_free(writing, TRUE);
+}
+
+/**
+ * Wait before dialing again, unless woken for shutdown
+ */
+static void _upstream_sleep(struct _upstream *u, const guint ms)
+{
+	eventfd_t val;
+	struct pollfd wakeup = {
+		.fd = u->link.wakeup,
+		.events = POLLIN,
+	};
+
+	if (poll(&wakeup, 1, ms) > 0) {
+		eventfd_read(u->link.wakeup, &val);
+	}
+}
+
+static gboolean _upstream_frame(
+	struct _link *l G_GNUC_UNUSED,
+	const gchar op,
+	gchar *payload,
+	const gsize len)
+{
+	gchar *json;
+
+	if (op != OP_BROADCAST) {
+		WARN("Cluster peer sent something other than a broadcast, dropping it");
+		return FALSE;
+	}
+
+	json = memchr(payload, '\0', len);
+	if (json == NULL) {
+		WARN("Cluster peer sent a broadcast without data, dropping it");
+		return FALSE;
+	}
+
+	evs_broadcast_path(payload, json + 1);
+	qev_stats_counter_inc(_stat_received);
+
+	return TRUE;
+}
+
+static void* _upstream_run(void *u_)
+{
+	qev_fd_t sock;
+	const gchar *path;
+	GHashTableIter iter;
+	gboolean warned = FALSE;
+	guint backoff = BACKOFF_MIN;
+	struct _upstream *u = u_;
+	struct _link *l = &u->link;
+
+	_inbound = !u->relay;
+	qev_pool_register_thread();
+
+	while (!g_atomic_int_get(&_stop)) {
+		sock = _connect(u);
+		if (sock == -1) {
+			if (!warned) {
+				WARN("Could not reach cluster peer %s, retrying: %s",
+					u->addr, strerror(errno));
+				warned = TRUE;
+			}
+
+			_upstream_sleep(u, backoff);
+			backoff = MIN(backoff * 2, BACKOFF_MAX);
+			continue;
+		}
+
+		INFO("Linked to cluster peer %s", u->addr);
+
+		warned = FALSE;
+		backoff = BACKOFF_MIN;
+
+		/*
+		 * With _interests_lock held, nothing can change between telling
+		 * the peer everything and being marked as needing changes
+		 */
+		g_mutex_lock(&_interests_lock);
+		g_mutex_lock(&l->lock);
+
+		l->sock = sock;
+		l->dead = FALSE;
+		u->connected = TRUE;
+
+		_frame(l->out, OP_HELLO, VERSION, NULL);
+
+		g_hash_table_iter_init(&iter, _interests);
+		while (g_hash_table_iter_next(&iter, (void**)&path, NULL)) {
+			_frame(l->out, OP_SUB, path, NULL);
+		}
+
+		g_mutex_unlock(&l->lock);
+		g_mutex_unlock(&_interests_lock);
+
+		_link_wake(l);
+		_link_run(l, _upstream_frame);
+
+		g_mutex_lock(&l->lock);
+		l->sock = -1;
+		u->connected = FALSE;
+		g_string_truncate(l->out, 0);
+		g_string_truncate(l->in, 0);
+		g_mutex_unlock(&l->lock);
+
+		close(sock);
+
+		if (!g_atomic_int_get(&_stop)) {
+			WARN("Lost cluster peer %s, redialing", u->addr);
+		}
+	}
+
+	return NULL;
+}
+
+static void _interest(const gchar *path, const gboolean interested)
+{
+	guint i;
+	guint count;
+	gboolean changed;
+
+	g_mutex_lock(&_interests_lock);
+
+	if (_interests == NULL) {
+		g_mutex_unlock(&_interests_lock);
+		return;
+	}
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(_interests, path));
+
+	if (interested) {
+		changed = count++ == 0;
+	} else {
+		changed = count == 1;
+		count = count > 0 ? count - 1 : 0;
+	}
+
+	if (count == 0) {
+		g_hash_table_remove(_interests, path);
+	} else {
+		g_hash_table_insert(_interests, g_strdup(path),
+							GUINT_TO_POINTER(count));
+	}
+
+	for (i = 0; changed && i < _upstreams->len; i++) {
+		struct _upstream *u = g_ptr_array_index(_upstreams, i);
+
+		g_mutex_lock(&u->link.lock);
+
+		if (u->connected) {
+			_frame(u->link.out, interested ? OP_SUB : OP_UNSUB, path, NULL);
+		}
+
+		g_mutex_unlock(&u->link.lock);
+	}
+
+	g_mutex_unlock(&_interests_lock);
+}
+
+static gboolean _downstream_frame(
+	struct _link *l,
+	const gchar op,
+	gchar *payload,
+	const gsize len G_GNUC_UNUSED)
+{
+	gboolean changed;
+	struct _downstream *d = (struct _downstream*)l;
+
+	if (!d->hello) {
+		d->hello = op == OP_HELLO && g_strcmp0(payload, VERSION) == 0;
+		if (!d->hello) {
+			WARN("Something that isn't a compatible cluster peer dialed in, "
+				"dropping it");
+		}
+
+		return d->hello;
+	}
+
+	switch (op) {
+		case OP_SUB:
+			g_mutex_lock(&l->lock);
+			changed = !g_hash_table_contains(d->interests, payload);
+			if (changed) {
+				g_hash_table_add(d->interests, g_strdup(payload));
+			}
+			g_mutex_unlock(&l->lock);
+			break;
+
+		case OP_UNSUB:
+			g_mutex_lock(&l->lock);
+			changed = g_hash_table_remove(d->interests, payload);
+			g_mutex_unlock(&l->lock);
+			break;
+
+		default:
+			WARN("Cluster peer sent an unknown frame, dropping it");
+			return FALSE;
+	}
+
+	if (changed && _relaying) {
+		_interest(payload, op == OP_SUB);
+	}
+
+	return TRUE;
+}
+
+static void* _downstream_run(void *d_)
+{
+	const gchar *path;
+	GHashTableIter iter;
+	struct _downstream *d = d_;
+
+	_link_run(&d->link, _downstream_frame);
+
+	/*
+	 * Nothing else touches the interests once the link is out of
+	 * _downstreams, but they have to stop being relayed first
+	 */
+	g_mutex_lock(&_downstreams_lock);
+	g_ptr_array_remove_fast(_downstreams, d);
+	g_atomic_int_set(&_downstreams_len, _downstreams->len);
+	g_cond_signal(&_downstreams_cond);
+	g_mutex_unlock(&_downstreams_lock);
+
+	if (_relaying) {
+		g_hash_table_iter_init(&iter, d->interests);
+		while (g_hash_table_iter_next(&iter, (void**)&path, NULL)) {
+			_interest(path, FALSE);
+		}
+	}
+
+	close(d->link.sock);
+	g_hash_table_unref(d->interests);
+	_link_clear(&d->link);
+	g_slice_free1(sizeof(*d), d);
+
+	return NULL;
+}
+
+static void* _listener_run(void *nothing G_GNUC_UNUSED)
+{
+	qev_fd_t sock;
+	struct _downstream *d;
+
+	while (!g_atomic_int_get(&_stop)) {
+		sock = accept4(_listen_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EMFILE || errno == ENFILE ||
+				errno == ENOBUFS || errno == ENOMEM) {
+				g_usleep(BACKOFF_MIN * 1000);
+			}
+
+			continue;
+		}
+
+		_nodelay(sock);
+
+		d = g_slice_alloc0(sizeof(*d));
+		_link_init(&d->link, sock);
+		d->interests = g_hash_table_new_full(g_str_hash, g_str_equal,
+												g_free, NULL);
+
+		g_mutex_lock(&_downstreams_lock);
+		g_ptr_array_add(_downstreams, d);
+		g_atomic_int_set(&_downstreams_len, _downstreams->len);
+		g_mutex_unlock(&_downstreams_lock);
+
+		g_thread_unref(g_thread_new("qio-cluster-down", _downstream_run, d));
+	}
+
+	return NULL;
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	guint i;
+	GPtrArray *upstreams;
+
+	g_atomic_int_set(&_stop, TRUE);
+
+	if (_listener != NULL) {
+		shutdown(_listen_sock, SHUT_RDWR);
+		g_thread_join(_listener);
+		close(_listen_sock);
+		_listener = NULL;
+		_listen_sock = -1;
+	}
+
+	for (i = 0; i < _upstreams->len; i++) {
+		struct _upstream *u = g_ptr_array_index(_upstreams, i);
+
+		g_mutex_lock(&u->link.lock);
+		_link_kill(&u->link);
+		g_mutex_unlock(&u->link.lock);
+
+		g_thread_join(u->thread);
+	}
+
+	/*
+	 * Subscriptions might still be going away, so everything they touch
+	 * has to be swapped out under its lock
+	 */
+	g_mutex_lock(&_interests_lock);
+	upstreams = _upstreams;
+	g_hash_table_unref(_interests);
+	_upstreams = NULL;
+	_interests = NULL;
+	g_mutex_unlock(&_interests_lock);
+
+	for (i = 0; i < upstreams->len; i++) {
+		struct _upstream *u = g_ptr_array_index(upstreams, i);
+
+		_link_clear(&u->link);
+		g_free(u->addr);
+		g_slice_free1(sizeof(*u), u);
+	}
+
+	g_ptr_array_free(upstreams, TRUE);
+
+	g_mutex_lock(&_downstreams_lock);
+
+	for (i = 0; i < _downstreams->len; i++) {
+		struct _downstream *d = g_ptr_array_index(_downstreams, i);
+
+		g_mutex_lock(&d->link.lock);
+		_link_kill(&d->link);
+		g_mutex_unlock(&d->link.lock);
+	}
+
+	while (_downstreams->len > 0) {
+		g_cond_wait(&_downstreams_cond, &_downstreams_lock);
+	}
+
+	g_ptr_array_free(_downstreams, TRUE);
+	_downstreams = NULL;
+
+	g_mutex_unlock(&_downstreams_lock);
+}
+
+/**
+ * Clients can't send events to paths that are only subscribed to through
+ * `cluster-upstream`
+ */
+static enum evs_status _relay_handler(
+	struct client *client,
+	const gchar *ev_extra G_GNUC_UNUSED,
+	const evs_cb_t client_cb,
+	gchar *json G_GNUC_UNUSED)
+{
+	evs_err_cb(client, client_cb, CODE_NOT_FOUND, NULL, NULL);
+	return EVS_STATUS_HANDLED;
+}
+
+void cluster_interest(struct subscription *sub, const gboolean interested)
+{
+	GString *path;
+
+	if (g_atomic_pointer_get(&_interests) == NULL) {
+		return;
+	}
+
+	path = qev_buffer_get();
+	g_string_printf(path, "%s%s", sub->ev->ev_path, sub->ev_extra);
+
+	_interest(path->str, interested);
+
+	qev_buffer_put(path);
+}
+
+gboolean cluster_relaying()
+{
+	return !_inbound && g_atomic_int_get(&_downstreams_len) > 0;
+}
+
+gboolean cluster_relay(const gchar *path, const gchar *json)
+{
+	guint i;
+	GString *frame = NULL;
+	gboolean relayed = FALSE;
+
+	if (g_atomic_int_get(&_downstreams_len) == 0) {
+		return FALSE;
+	}
+
+	g_mutex_lock(&_downstreams_lock);
+
+	for (i = 0; _downstreams != NULL && i < _downstreams->len; i++) {
+		struct _downstream *d = g_ptr_array_index(_downstreams, i);
+		struct _link *l = &d->link;
+
+		g_mutex_lock(&l->lock);
+
+		if (!l->dead && g_hash_table_contains(d->interests, path)) {
+			if (frame == NULL) {
+				frame = qev_buffer_get();
+				_frame(frame, OP_BROADCAST, path, json);
+			}
+
+			if (l->out->len + frame->len > MAX_PENDING) {
+				WARN("Cluster peer fell too far behind, dropping it");
+				_link_kill(l);
+				qev_stats_counter_inc(_stat_dropped);
+			} else {
+				g_string_append_len(l->out, frame->str, frame->len);
+				relayed = TRUE;
+			}
+		}
+
+		g_mutex_unlock(&l->lock);
+	}
+
+	g_mutex_unlock(&_downstreams_lock);
+
+	if (relayed) {
+		qev_stats_counter_inc(_stat_relayed);
+	}
+
+	if (frame != NULL) {
+		qev_buffer_put(frame);
+	}
+
+	return relayed;
+}
+
+gboolean cluster_relays(const gchar *path)
+{
+	guint i;
+	gboolean relays = FALSE;
+
+	if (g_atomic_int_get(&_downstreams_len) == 0) {
+		return FALSE;
+	}
+
+	g_mutex_lock(&_downstreams_lock);
+
+	for (i = 0; _downstreams != NULL && i < _downstreams->len; i++) {
+		struct _downstream *d = g_ptr_array_index(_downstreams, i);
+
+		g_mutex_lock(&d->link.lock);
+		relays |= !d->link.dead && g_hash_table_contains(d->interests, path);
+		g_mutex_unlock(&d->link.lock);
+	}
+
+	g_mutex_unlock(&_downstreams_lock);
+
+	return relays;
+}
+
+void cluster_flush()
+{
+	guint i;
+
+	g_mutex_lock(&_interests_lock);
+
+	for (i = 0; _upstreams != NULL && i < _upstreams->len; i++) {
+		struct _upstream *u = g_ptr_array_index(_upstreams, i);
+		_link_flush(&u->link);
+	}
+
+	g_mutex_unlock(&_interests_lock);
+
+	if (g_atomic_int_get(&_downstreams_len) == 0) {
+		return;
+	}
+
+	g_mutex_lock(&_downstreams_lock);
+
+	for (i = 0; _downstreams != NULL && i < _downstreams->len; i++) {
+		struct _downstream *d = g_ptr_array_index(_downstreams, i);
+		_link_flush(&d->link);
+	}
+
+	g_mutex_unlock(&_downstreams_lock);
+}
+
+void cluster_init()
+{
+	guint i;
+	gboolean listen = cfg_cluster_listen != NULL &&
+						*cfg_cluster_listen != '\0';
+	gboolean peers = cfg_cluster_peers != NULL && *cfg_cluster_peers != NULL;
+	gboolean upstream = cfg_cluster_upstream != NULL &&
+						*cfg_cluster_upstream != '\0';
+
+	_stat_relayed = qev_stats_counter(
+		"cluster", "relayed", TRUE,
+		"How many broadcasts were sent on to peers");
+	_stat_received = qev_stats_counter(
+		"cluster", "received", TRUE,
+		"How many broadcasts came in from peers");
+	_stat_dropped = qev_stats_counter(
+		"cluster", "dropped", TRUE,
+		"How many peers were dropped for falling too far behind");
+
+	if (!listen && !peers && !upstream) {
+		return;
+	}
+
+	_stop = FALSE;
+	_interests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	_upstreams = g_ptr_array_new();
+	_downstreams = g_ptr_array_new();
+	_downstreams_len = 0;
+
+	if (listen) {
+		_listen_sock = _listen(cfg_cluster_listen);
+		ASSERT(_listen_sock != -1, "Could not listen for cluster peers on "
+				"%s: %s", cfg_cluster_listen, strerror(errno));
+		_listener = g_thread_new("qio-cluster", _listener_run, NULL);
+	}
+
+	for (i = 0; peers && cfg_cluster_peers[i] != NULL; i++) {
+		struct _upstream *u = g_slice_alloc0(sizeof(*u));
+
+		_link_init(&u->link, -1);
+		u->addr = g_strdup(cfg_cluster_peers[i]);
+		u->thread = g_thread_new("qio-cluster-up", _upstream_run, u);
+
+		g_ptr_array_add(_upstreams, u);
+	}
+
+	if (upstream) {
+		struct _upstream *u = g_slice_alloc0(sizeof(*u));
+
+		_relaying = TRUE;
+
+		_link_init(&u->link, -1);
+		u->addr = g_strdup(cfg_cluster_upstream);
+		u->relay = TRUE;
+		u->thread = g_thread_new("qio-cluster-up", _upstream_run, u);
+
+		g_ptr_array_add(_upstreams, u);
+
+		evs_query_insert_fallback(_relay_handler, NULL, NULL,
+									EVS_HANDLER_NONE);
+	}
+
+	qev_cleanup(&_upstreams, _free);
+}
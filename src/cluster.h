@@ -0,0 +1,97 @@
+/**
+ * Relays broadcasts between the servers in a cluster.
+ * @file
+ *
+ * Every server dials every peer in `cluster-peers` and tells it which
+ * subscriptions it has clients for. Peers then send back, over that same
+ * connection, every broadcast made to those subscriptions, and the
+ * broadcasts are put through the local broadcast tick as if they were made
+ * here. Broadcasts that came from a peer are never relayed again, so every
+ * server must list every other server as a peer.
+ *
+ * Links speak a simple framing: a 4-byte, big-endian length, covering
+ * everything after it, followed by a 1-byte op and its payload:
+ *
+ *     H <version>             (dialer: the first frame on every link)
+ *     + <path>                (dialer: clients subscribed to path)
+ *     - <path>                (dialer: no more clients on path)
+ *     B <path> \0 <json>      (acceptor: a broadcast to path)
+ *
+ * Clusters can also be built as trees, for fanning out to more clients than
+ * a single server could hold. An edge server sets `cluster-upstream` to a
+ * server closer to the core, and dials it just as it would a peer. Every
+ * subscription on the edge becomes an interest on that one link, shared by
+ * all of the edge's clients, and is dropped once its last client leaves.
+ * Subscriptions to paths that no app on the edge handles are accepted as-is
+ * and left to the upstream to fill. Unlike broadcasts from peers, broadcasts
+ * from upstream are relayed again to anything that dialed in to the edge,
+ * and the edge passes their interests upstream too, so trees can be as deep
+ * as needed.
+ *
+ * Broadcasts are framed and queued for peers by the broadcast tick, never by
+ * the thread making them, once no matter how many peers they go to, and
+ * everything waiting for a peer is written at the end of each tick. There's
+ * no authentication: only listen where every peer is trusted.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Note that a subscription was created or destroyed. Peers are told about
+ * a path when the first subscription to it is created, and again once the
+ * last is gone.
+ *
+ * @param sub
+ *     The subscription
+ * @param interested
+ *     If the subscription was created
+ */
+void cluster_interest(struct subscription *sub, const gboolean interested);
+
+/**
+ * If a broadcast being made on this thread should be relayed: there are
+ * peers to relay to, and the broadcast didn't come from one. Takes no locks.
+ */
+gboolean cluster_relaying();
+
+/**
+ * Queue a broadcast for every peer with clients subscribed to it. Only call
+ * from the broadcast tick, for broadcasts that cluster_relaying() allowed
+ * when they were made.
+ *
+ * @param path
+ *     The full path of the subscription: ev_path + ev_extra
+ * @param json
+ *     The data being broadcast
+ *
+ * @return
+ *     If any peer will get the broadcast
+ */
+gboolean cluster_relay(const gchar *path, const gchar *json);
+
+/**
+ * If a broadcast to the path would be relayed to any peer.
+ *
+ * @param path
+ *     The full path of the subscription: ev_path + ev_extra
+ */
+gboolean cluster_relays(const gchar *path);
+
+/**
+ * Send everything waiting for peers. Called at the end of every broadcast
+ * tick.
+ */
+void cluster_flush();
+
+/**
+ * Start listening for peers and dialing out to them. Does nothing if none
+ * of `cluster-listen`, `cluster-peers`, and `cluster-upstream` is set.
+ */
+void cluster_init();
@@ -30,6 +30,30 @@ static void _update_client_subs_pressure(
 		cfg_clients_subs_min);
 }
 
+static void _validate_broadcast_threads(
+	const gchar *name G_GNUC_UNUSED,
+	union qev_cfg_val *val,
+	GError **error)
+{
+	if (val->ui64 > FANOUT_MAX_WORKERS) {
+		*error = g_error_new(G_OPTION_ERROR, 0,
+					"Invalid broadcast threads: must be no more than %d",
+					FANOUT_MAX_WORKERS);
+	} else if (sub_shards() > 0 && val->ui64 != cfg_broadcast_threads) {
+		*error = g_error_new(G_OPTION_ERROR, 0,
+					"Invalid broadcast threads: can't be changed while "
+					"broadcast-sharded is set");
+	}
+}
+
+static void _update_broadcast_threads(
+	const gchar *name G_GNUC_UNUSED,
+	union qev_cfg_valptr curr_val G_GNUC_UNUSED,
+	union qev_cfg_val new_val)
+{
+	fanout_set_workers(new_val.ui64);
+}
+
 static void _update_client_subs_min(
 	const gchar *name G_GNUC_UNUSED,
 	union qev_cfg_valptr curr_val G_GNUC_UNUSED,
@@ -41,6 +65,18 @@ static void _update_client_subs_min(
 		new_val.ui64);
 }
 
+static void _validate_client_cb_max(
+	const gchar *name G_GNUC_UNUSED,
+	union qev_cfg_val *val,
+	GError **error)
+{
+	if (val->ui64 == 0 || val->ui64 > CLIENT_CBS_MAX) {
+		*error = g_error_new(G_OPTION_ERROR, 0,
+					"Invalid callbacks per client: must be between 1 and %d",
+					CLIENT_CBS_MAX);
+	}
+}
+
 static void _validate_client_cb_max_age(
 	const gchar *name G_GNUC_UNUSED,
 	union qev_cfg_val *val,
@@ -90,6 +126,18 @@ static void _validate_sub_min_size(
 	}
 }
 
+static void _validate_journal_segment_size(
+	const gchar *name G_GNUC_UNUSED,
+	union qev_cfg_val *val,
+	GError **error)
+{
+	if (val->ui64 < 4096 || val->ui64 > G_MAXUINT32) {
+		*error = g_error_new(G_OPTION_ERROR, 0,
+					"Invalid journal segment size: must be between 4096 and "
+					"%u bytes", G_MAXUINT32);
+	}
+}
+
 static struct qev_cfg _overrides[] = {
 	{	.name = "listen",
 		.type = QEV_CFG_STRV,
@@ -101,12 +149,55 @@ static struct qev_cfg _overrides[] = {
 
 static struct qev_cfg _cfg[] = {
 	{	.name = "broadcast-threads",
-		.description = "Number of threads used to pump out each broadcasted message.",
+		.description = "Number of threads that help send broadcasts to large "
+						"subscriptions. Small subscriptions are always sent "
+						"from the thread sending broadcasts. Can't be "
+						"changed while running if `broadcast-sharded` is "
+						"set.",
 		.type = QEV_CFG_UINT64,
 		.val.ui64 = &cfg_broadcast_threads,
 		.defval.ui64 = 2,
+		.validate = _validate_broadcast_threads,
+		.cb = _update_broadcast_threads,
+		.read_only = FALSE,
+	},
+	{	.name = "broadcast-low-latency",
+		.description = "Wake a dedicated thread to send broadcasts as soon "
+						"as they're made, instead of waiting for the next "
+						"tick. Costs a wakeup per burst of broadcasts.",
+		.type = QEV_CFG_BOOL,
+		.val.bool = &cfg_broadcast_low_latency,
+		.defval.bool = FALSE,
 		.validate = NULL,
 		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "broadcast-sharded",
+		.description = "Assign every client to a single broadcast thread, "
+						"and split subscriptions up by thread, so that each "
+						"client is only ever broadcast to from one thread. "
+						"Sends still take each client's lock, since that "
+						"thread isn't the one doing the client's IO. Every "
+						"subscription keeps a set of clients for each of "
+						"`broadcast-threads`, so this costs memory on "
+						"servers with many small subscriptions.",
+		.type = QEV_CFG_BOOL,
+		.val.bool = &cfg_broadcast_sharded,
+		.defval.bool = FALSE,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "clients-cb-max",
+		.description = "How many callbacks each client may have waiting for "
+						"an answer. Once full, the oldest is evicted. Only "
+						"applies to clients that haven't been sent a callback "
+						"yet.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_clients_cb_max,
+		.defval.ui64 = 4,
+		.validate = _validate_client_cb_max,
+		.cb = NULL,
 		.read_only = FALSE,
 	},
 	{	.name = "clients-cb-max-age",
@@ -151,6 +242,77 @@ static struct qev_cfg _cfg[] = {
 		.cb = _update_client_subs_min,
 		.read_only = FALSE,
 	},
+	{	.name = "cluster-listen",
+		.description = "Where to listen for other servers in the cluster, "
+						"as host:port. Peers can broadcast to every client "
+						"on this server, so only listen where every peer is "
+						"trusted. Leave empty to not take broadcasts from "
+						"peers.",
+		.type = QEV_CFG_STR,
+		.val.str = &cfg_cluster_listen,
+		.defval.str = NULL,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "cluster-peers",
+		.description = "Every other server in the cluster, as the host:port "
+						"given for its `cluster-listen`. Broadcasts made on "
+						"any peer are sent to clients here.",
+		.type = QEV_CFG_STRV,
+		.val.strv = &cfg_cluster_peers,
+		.defval.strv = NULL,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "cluster-upstream",
+		.description = "A server, as host:port, to pull broadcasts from. "
+						"Every subscription here is passed upstream, shared "
+						"by all of the clients subscribed to it, and paths "
+						"that no app here handles are accepted and left to "
+						"the upstream to fill.",
+		.type = QEV_CFG_STR,
+		.val.str = &cfg_cluster_upstream,
+		.defval.str = NULL,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "journal-dir",
+		.description = "Where to keep a journal of broadcasts, so that "
+						"subscriptions get their last values back after a "
+						"restart. Leave empty to disable journaling.",
+		.type = QEV_CFG_STR,
+		.val.str = &cfg_journal_dir,
+		.defval.str = NULL,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "journal-retention",
+		.description = "How long broadcasts are kept in the journal, in "
+						"seconds. Subscriptions that haven't been broadcast "
+						"to in this long don't get their last values back "
+						"after a restart.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_journal_retention,
+		.defval.ui64 = 86400,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
+	{	.name = "journal-segment-size",
+		.description = "Size of each file in the journal, in bytes. Files "
+						"are only removed once everything in them has "
+						"expired.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_journal_segment_size,
+		.defval.ui64 = 67108864,
+		.validate = _validate_journal_segment_size,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
 	{	.name = "periodic-threads",
 		.description = "Number of threads used to run periodic tasks.",
 		.type = QEV_CFG_UINT64,
@@ -169,6 +331,41 @@ static struct qev_cfg _cfg[] = {
 		.cb = NULL,
 		.read_only = TRUE,
 	},
+	{	.name = "publish-udp",
+		.description = "Broadcast events that come in on quick-event's UDP "
+						"listeners, one `<ev_path>=<json>` per line. Anyone "
+						"that can reach those listeners can broadcast, so "
+						"only listen where every sender is trusted.",
+		.type = QEV_CFG_BOOL,
+		.val.bool = &cfg_publish_udp,
+		.defval.bool = FALSE,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
+	{	.name = "publish-unix",
+		.description = "Path of a unix socket that takes broadcasts, one "
+						"`<ev_path>=<json>` per line, from services on this "
+						"machine. Anyone that can write to the socket can "
+						"broadcast. Leave empty to not make one.",
+		.type = QEV_CFG_STR,
+		.val.str = &cfg_publish_unix,
+		.defval.str = NULL,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
+	{	.name = "publish-unix-stream",
+		.description = "Make `publish-unix` a stream socket, where every "
+						"record ends with a newline, instead of taking "
+						"datagrams.",
+		.type = QEV_CFG_BOOL,
+		.val.bool = &cfg_publish_unix_stream,
+		.defval.bool = FALSE,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = TRUE,
+	},
 	{	.name = "run-app-tests",
 		.description = "If QuickIO should run app tests instead of running "
 						"the server.",
@@ -180,9 +377,11 @@ static struct qev_cfg _cfg[] = {
 		.read_only = TRUE,
 	},
 	{	.name = "sub-min-size",
-		.description = "The minimum size for subscription arrays. Should be "
-						"a power of 2. Any changes at runtime are only applied "
-						"to new subscriptions.",
+		.description = "The number of clients in each segment of a "
+						"subscription once it outgrows its small array. "
+						"Should be a power of 2. Any changes at runtime are "
+						"only applied to subscriptions that become segmented "
+						"after the change.",
 		.type = QEV_CFG_UINT64,
 		.val.ui64 = &cfg_sub_min_size,
 		.defval.ui64 = 8192,
@@ -190,6 +389,54 @@ static struct qev_cfg _cfg[] = {
 		.cb = NULL,
 		.read_only = FALSE,
 	},
+	{	.name = "sub-replay-bytes",
+		.description = "Most bytes of recent broadcasts that each "
+						"subscription keeps around for clients that resume "
+						"a subscription after reconnecting.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_sub_replay_bytes,
+		.defval.ui64 = 65536,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
+	{	.name = "sub-replay-count",
+		.description = "Most recent broadcasts that each subscription to a "
+						"resumable event keeps around for clients that resume "
+						"it after reconnecting. Every broadcast kept is "
+						"shared with the clients it was sent to, but this "
+						"costs memory on servers with many busy "
+						"subscriptions. 0 disables replaying: resumed "
+						"subscriptions are always reset.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_sub_replay_count,
+		.defval.ui64 = 0,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
+	{	.name = "websocket-deflate",
+		.description = "Compress frames for WebSocket clients that ask for "
+						"permessage-deflate. Broadcasts are compressed once "
+						"and shared by every client.",
+		.type = QEV_CFG_BOOL,
+		.val.bool = &cfg_websocket_deflate,
+		.defval.bool = TRUE,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
+	{	.name = "websocket-deflate-min-size",
+		.description = "Events smaller than this many bytes are sent "
+						"uncompressed, even to clients that asked for "
+						"compression.",
+		.type = QEV_CFG_UINT64,
+		.val.ui64 = &cfg_websocket_deflate_min_size,
+		.defval.ui64 = 256,
+		.validate = NULL,
+		.cb = NULL,
+		.read_only = FALSE,
+	},
 };
 
 void config_init()
@@ -13,11 +13,30 @@
 #include "quickio.h"
 
 /**
- * Number of threads used to pump out each broadcasted message. These threads
- * come from the qev_pool of threads.
+ * Number of threads in the fanout pool that help send broadcasts to large
+ * subscriptions.
  */
 guint64 cfg_broadcast_threads;
 
+/**
+ * If broadcasts should be sent as soon as they're made, rather than
+ * waiting for the next tick.
+ */
+gboolean cfg_broadcast_low_latency;
+
+/**
+ * If clients are split up between broadcast threads, with each client only
+ * ever broadcast to from the same one. That's not the thread that does the
+ * client's IO, so sends still take the client's lock.
+ */
+gboolean cfg_broadcast_sharded;
+
+/**
+ * How many callbacks each client may have waiting for an answer. Once
+ * full, the oldest is evicted.
+ */
+guint64 cfg_clients_cb_max;
+
 /**
  * How long a callback should be allowed to live on the server before
  * being killed.
@@ -41,6 +60,37 @@ guint64 cfg_clients_subs_pressure;
  */
 guint64 cfg_clients_subs_min;
 
+/**
+ * Where to listen for peers in the cluster, or NULL to not listen.
+ */
+gchar *cfg_cluster_listen;
+
+/**
+ * Every other server in the cluster.
+ */
+gchar **cfg_cluster_peers;
+
+/**
+ * The server that every subscription here is passed up to, which also fills
+ * paths nothing here handles, or NULL.
+ */
+gchar *cfg_cluster_upstream;
+
+/**
+ * Where broadcasts are journaled, or NULL if they aren't.
+ */
+gchar *cfg_journal_dir;
+
+/**
+ * How long, in seconds, broadcasts are kept in the journal.
+ */
+guint64 cfg_journal_retention;
+
+/**
+ * The size, in bytes, of each file in the journal.
+ */
+guint64 cfg_journal_segment_size;
+
 /**
  * Number of threads to use to run periodic tasks
  */
@@ -51,16 +101,52 @@ guint64 cfg_periodic_threads;
  */
 gchar *cfg_public_address;
 
+/**
+ * If broadcasts may be published over UDP.
+ */
+gboolean cfg_publish_udp;
+
+/**
+ * Where the unix socket that takes published broadcasts lives, or NULL to
+ * not have one.
+ */
+gchar *cfg_publish_unix;
+
+/**
+ * If the unix socket is a stream, rather than taking datagrams.
+ */
+gboolean cfg_publish_unix_stream;
+
 /**
  * If the server should run app tests and exit.
  */
 gboolean cfg_run_app_tests;
 
 /**
- * The initial size for subscriptions.
+ * The size of each segment of a large subscription.
  */
 guint64 cfg_sub_min_size;
 
+/**
+ * Most bytes of broadcasts each subscription keeps for replaying.
+ */
+guint64 cfg_sub_replay_bytes;
+
+/**
+ * Most broadcasts each subscription keeps for replaying.
+ */
+guint64 cfg_sub_replay_count;
+
+/**
+ * If WebSocket clients may negotiate permessage-deflate.
+ */
+gboolean cfg_websocket_deflate;
+
+/**
+ * Smallest event, in bytes, that's compressed for WebSocket clients.
+ */
+guint64 cfg_websocket_deflate_min_size;
+
 /**
  * Registers all configuration options with QEV.
  */
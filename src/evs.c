@@ -7,6 +7,7 @@
  */
 
 #include "quickio.h"
+#include <sys/eventfd.h>
 
 /**
  * Path used for all callbacks
@@ -31,9 +32,96 @@
 	json = (json == NULL ? "null" : \
 				(*json == '\0' ? "null" : json))
 
+/**
+ * The most broadcasts taken from any one thread each tick
+ */
+#define BROADCAST_BATCH 1024
+
+/**
+ * Number of locks that conflated broadcasts are spread across
+ */
+#define CONFLATE_STRIPES 64
+
 struct _broadcast {
+	/**
+	 * NULL when nothing on this server is subscribed and the broadcast is
+	 * only going to peers
+	 */
 	struct subscription *sub;
 	gchar *json;
+
+	/**
+	 * The full path to relay the broadcast to peers under, from the tick;
+	 * NULL if it isn't going to peers.
+	 */
+	gchar *relay;
+
+	/**
+	 * When the broadcast was queued
+	 */
+	gint64 queued;
+
+	/**
+	 * If newer broadcasts to the subscription replace this one
+	 */
+	gboolean conflate;
+
+	/**
+	 * When set, this isn't a broadcast: it's a client resuming the
+	 * subscription, waiting for its turn between broadcasts.
+	 */
+	struct evs_on_info *resume;
+};
+
+/**
+ * A broadcast being sent by the fanout pool. Nothing waits for it: whatever
+ * sends the last piece frees the broadcast. When not sharded, the fanout
+ * itself stays in _fanouts until the tick sees that its group is done.
+ */
+struct _fanout {
+	struct fanout_group grp;
+	struct _broadcast *bc;
+	struct protocol_bcast *bcast;
+
+	/**
+	 * Pieces still being sent, plus one held by the tick while it's handing
+	 * them out
+	 */
+	gint sending;
+
+	/**
+	 * Sharded fanouts are never in _fanouts, so they're freed along with
+	 * the broadcast
+	 */
+	gboolean sharded;
+};
+
+/**
+ * A chunk of a large subscription, for one of the pool's workers
+ */
+struct _fanout_part {
+	struct _fanout *fo;
+	struct subscribers_chunk *chunk;
+};
+
+/**
+ * A broadcast to one shard of a subscription
+ */
+struct _shard_send {
+	struct subscribers *subs;
+	struct _fanout *fo;
+};
+
+/**
+ * Conflated broadcasts still waiting in the queue
+ */
+struct _conflating {
+	GMutex lock;
+
+	/**
+	 * Mapping: struct subscription -> struct _broadcast
+	 */
+	GHashTable *pending;
 };
 
 /**
@@ -56,45 +144,335 @@ static qev_stats_counter_t *_stat_evs_callbacks_sent;
 static qev_stats_counter_t *_stat_evs_received;
 static qev_stats_counter_t *_stat_evs_broadcasts_unique;
 static qev_stats_counter_t *_stat_evs_broadcasts_events;
+static qev_stats_counter_t *_stat_evs_broadcasts_conflated;
+static qev_stats_counter_t *_stat_evs_broadcasts_lvc;
+static qev_stats_counter_t *_stat_evs_broadcasts_replayed;
+static qev_stats_counter_t *_stat_evs_broadcasts_resets;
+static qev_stats_gauge_t *_stat_evs_broadcasts_pending;
+static qev_stats_gauge_t *_stat_evs_broadcasts_latency;
+
+/**
+ * Moving average of how long broadcasts wait before they're first written
+ * to a client, in microseconds.
+ */
+static gint64 _latency = 0;
+
+/**
+ * When broadcasts that the calling thread first sent were queued, waiting
+ * for its batch to end
+ */
+static GPrivate _written = G_PRIVATE_INIT((GDestroyNotify)g_array_unref);
+
+/**
+ * Wakes the dispatcher, when running in low-latency mode
+ */
+static gint _wakeup = -1;
+
+/**
+ * If a wakeup was sent that the dispatcher hasn't gotten to yet: no need
+ * to send another.
+ */
+static gboolean _wakeup_pending = FALSE;
+
+/**
+ * Tells the dispatcher to exit
+ */
+static gboolean _dispatcher_stop = FALSE;
+
+static GThread *_dispatcher = NULL;
+
+/**
+ * Only one thread sends broadcasts at a time
+ */
+static GMutex _tick_lock;
+
+/**
+ * Broadcasts being sent by the fanout pool, by subscription. Only touched
+ * with _tick_lock held. Finished fanouts are swept out every tick.
+ *
+ * Mapping: struct subscription -> struct _fanout
+ */
+static GHashTable *_fanouts = NULL;
+
+/**
+ * evs_cb_fn -> evs_cb_expire_fn, for anything that wants to know about
+ * callbacks that go unanswered
+ */
+static GHashTable *_cb_expires = NULL;
+static GRWLock _cb_expires_lock;
+
+/**
+ * When sharded: what each shard has to send this tick, in order. Only
+ * touched with _tick_lock held. Each array is handed off to its shard's
+ * thread, which frees it.
+ *
+ * Each is an array of struct _shard_send.
+ */
+static GArray **_shard_sends = NULL;
 
 /**
- * All pending broadcasts
+ * When sharded: everything handed off to the shards that's still going out
  */
-static GAsyncQueue *_broadcasts = NULL;
+static struct fanout_group _shard_grp;
+
+/**
+ * Pending broadcasts to conflating events, spread across locks by
+ * subscription
+ */
+static struct _conflating _conflating[CONFLATE_STRIPES];
+
+static struct _conflating* _conflating_get(struct subscription *sub)
+{
+	return _conflating +
+		((GPOINTER_TO_SIZE(sub) / sizeof(*sub)) % CONFLATE_STRIPES);
+}
 
-static void _broadcast(void *client_, void *frames_)
+static void _conflating_free(void *nothing G_GNUC_UNUSED)
 {
-	struct client *client = client_;
-	struct protocol_frames *frames = frames_;
+	guint i;
+
+	for (i = 0; i < CONFLATE_STRIPES; i++) {
+		g_hash_table_unref(_conflating[i].pending);
+		_conflating[i].pending = NULL;
+		g_mutex_clear(&_conflating[i].lock);
+	}
+}
 
-	protocols_bcast_write(client, frames);
+/**
+ * Fold how long a broadcast waited into the average. Broadcasts may first be
+ * written from any of the broadcast threads.
+ */
+static void _latency_add(const gint64 queued, const gint64 now)
+{
+	gint64 old;
+	gint64 new;
+	gint64 waited = now - queued;
+
+	do {
+		old = __sync_add_and_fetch(&_latency, 0);
+		new = old + ((waited - old) / 8);
+	} while (!__sync_bool_compare_and_swap(&_latency, old, new));
+}
+
+/**
+ * Note when a broadcast this thread is the first to send was queued. It's
+ * only gathered until the thread's batch ends, so it's timed then.
+ */
+static void _written_add(const gint64 queued)
+{
+	GArray *written = g_private_get(&_written);
+
+	if (written == NULL) {
+		written = g_array_new(FALSE, FALSE, sizeof(gint64));
+		g_private_set(&_written, written);
+	}
+
+	g_array_append_val(written, queued);
+}
+
+/**
+ * End the thread's batch and, once everything's actually been written,
+ * time the broadcasts that went out in it.
+ */
+static void _batch_end()
+{
+	guint i;
+	gint64 now;
+	GArray *written;
+
+	if (!protocols_batch_end()) {
+		return;
+	}
+
+	written = g_private_get(&_written);
+	if (written == NULL || written->len == 0) {
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	for (i = 0; i < written->len; i++) {
+		_latency_add(g_array_index(written, gint64, i), now);
+	}
+
+	g_array_set_size(written, 0);
+}
+
+static void _broadcast(struct client *client, void *bcast_)
+{
+	struct protocol_bcast *bcast = bcast_;
+
+	if (g_once_init_enter(&bcast->written)) {
+		_written_add(bcast->queued);
+		g_once_init_leave(&bcast->written, 1);
+	}
+
+	protocols_bcast_write(client, bcast);
 	qev_stats_counter_inc(_stat_evs_broadcasts_events);
 }
 
+static void _drain(struct client *client, void *sub)
+{
+	client_sub_remove(client, sub);
+}
+
 static void _broadcast_free(void *bc_)
 {
 	struct _broadcast *bc = bc_;
 
+	if (bc->resume != NULL) {
+		evs_on_info_free(bc->resume);
+	}
+
+	if (bc->sub != NULL) {
+		sub_unref(bc->sub);
+	}
+
 	g_free(bc->json);
-	sub_unref(bc->sub);
+	g_free(bc->relay);
 	g_slice_free1(sizeof(*bc), bc);
 }
 
+static struct _broadcast* _broadcast_new(
+	struct subscription *sub,
+	const gchar *json,
+	const gchar *relay,
+	const gboolean conflate)
+{
+	struct _broadcast bc = {
+		.sub = sub,
+		.json = g_strdup(json),
+		.relay = g_strdup(relay),
+		.queued = g_get_monotonic_time(),
+		.conflate = conflate,
+	};
+
+	return g_slice_copy(sizeof(bc), &bc);
+}
+
+/**
+ * Replace the broadcast waiting for the subscription, or queue a new
+ * one if nothing is waiting.
+ *
+ * @return
+ *     If a waiting broadcast was replaced. The caller keeps its reference
+ *     to the subscription.
+ */
+static gboolean _broadcast_conflate(
+	struct subscription *sub,
+	const gchar *json,
+	const gchar *relay)
+{
+	struct _broadcast *bc;
+	struct _conflating *c = _conflating_get(sub);
+
+	g_mutex_lock(&c->lock);
+
+	bc = g_hash_table_lookup(c->pending, sub);
+	if (bc != NULL) {
+		/*
+		 * The newer broadcast wins outright: it's what peers should see
+		 * too, and if it came from a peer, it's not to be relayed back.
+		 */
+		g_free(bc->json);
+		bc->json = g_strdup(json);
+
+		g_free(bc->relay);
+		bc->relay = g_strdup(relay);
+	} else {
+		/*
+		 * Queued with the lock held: the tick takes it back out of pending
+		 * before sending it, so it can't be sent before it's pending.
+		 */
+		bc = _broadcast_new(sub, json, relay, TRUE);
+		g_hash_table_insert(c->pending, sub, bc);
+		evs_queue_push(bc);
+		bc = NULL;
+	}
+
+	g_mutex_unlock(&c->lock);
+
+	return bc != NULL;
+}
+
+static void _dispatcher_wake()
+{
+	if (_wakeup == -1) {
+		return;
+	}
+
+	/*
+	 * The dispatcher clears the flag before draining, so anything queued
+	 * before this either gets picked up by that drain, or this wins the
+	 * flag and wakes it again.
+	 */
+	if (g_atomic_int_compare_and_exchange(&_wakeup_pending, FALSE, TRUE)) {
+		eventfd_write(_wakeup, 1);
+	}
+}
+
+static void* _dispatcher_run(void *nothing G_GNUC_UNUSED)
+{
+	eventfd_t val;
+
+	qev_pool_register_thread();
+
+	while (!g_atomic_int_get(&_dispatcher_stop)) {
+		if (eventfd_read(_wakeup, &val) != 0) {
+			continue;
+		}
+
+		g_atomic_int_set(&_wakeup_pending, FALSE);
+		evs_broadcast_tick();
+	}
+
+	return NULL;
+}
+
+static void _dispatcher_free(void *nothing G_GNUC_UNUSED)
+{
+	g_atomic_int_set(&_dispatcher_stop, TRUE);
+	eventfd_write(_wakeup, 1);
+	g_thread_join(_dispatcher);
+
+	close(_wakeup);
+	_wakeup = -1;
+	_dispatcher = NULL;
+}
+
+static void _dispatcher_init()
+{
+	_wakeup = eventfd(0, EFD_CLOEXEC);
+	if (_wakeup == -1) {
+		WARN("Could not create broadcast wakeup, falling back to ticks: %s",
+			strerror(errno));
+		return;
+	}
+
+	_dispatcher_stop = FALSE;
+	_wakeup_pending = FALSE;
+	_dispatcher = g_thread_new("qio-broadcast", _dispatcher_run, NULL);
+	qev_cleanup(&_dispatcher, _dispatcher_free);
+}
+
 void event_init(
 	struct event *ev,
 	const gchar *ev_path,
 	const evs_handler_fn handler_fn,
 	const evs_on_fn on_fn,
 	const evs_off_fn off_fn,
-	const gboolean handle_children)
+	const gboolean handle_children,
+	const enum evs_handler_flags flags)
 {
 	ev->ev_path = g_strdup(ev_path);
 	ev->handler_fn = handler_fn;
 	ev->on_fn = on_fn;
 	ev->off_fn = off_fn;
 	ev->handle_children = handle_children;
+	ev->flags = flags;
 	ev->subs = g_hash_table_new(g_str_hash, g_str_equal);
 	g_rw_lock_init(&ev->subs_lock);
+	ev->refs = 1;
+	ev->removed = FALSE;
 }
 
 void event_clear(struct event *ev)
@@ -108,6 +486,19 @@ void event_clear(struct event *ev)
 	g_rw_lock_clear(&ev->subs_lock);
 }
 
+struct event* event_ref(struct event *ev)
+{
+	__sync_add_and_fetch(&ev->refs, 1);
+	return ev;
+}
+
+void event_unref(struct event *ev)
+{
+	if (g_atomic_int_dec_and_test(&ev->refs)) {
+		evs_query_retire(ev);
+	}
+}
+
 struct event* evs_add_handler(
 	const gchar *prefix,
 	const gchar *ev_path,
@@ -115,11 +506,25 @@ struct event* evs_add_handler(
 	const evs_on_fn on_fn,
 	const evs_off_fn off_fn,
 	const gboolean handle_children)
+{
+	return evs_add_handler_full(prefix, ev_path, handler_fn, on_fn, off_fn,
+								handle_children, EVS_HANDLER_NONE);
+}
+
+struct event* evs_add_handler_full(
+	const gchar *prefix,
+	const gchar *ev_path,
+	const evs_handler_fn handler_fn,
+	const evs_on_fn on_fn,
+	const evs_off_fn off_fn,
+	const gboolean handle_children,
+	const enum evs_handler_flags flags)
 {
 	struct event *ev;
 	GString *ep = evs_make_path(prefix, ev_path, NULL);
 
-	ev = evs_query_insert(ep->str, handler_fn, on_fn, off_fn, handle_children);
+	ev = evs_query_insert(ep->str, handler_fn, on_fn, off_fn,
+							handle_children, flags);
 	if (ev == NULL) {
 		WARN("Failed to create event \"%s\": event already exists.", ep->str);
 	}
@@ -129,6 +534,51 @@ struct event* evs_add_handler(
 	return ev;
 }
 
+void evs_remove_handler(struct event *ev)
+{
+	guint i;
+	GHashTableIter iter;
+	struct subscription *sub;
+	GPtrArray *subs = g_ptr_array_new();
+
+	g_rw_lock_writer_lock(&ev->subs_lock);
+
+	if (ev->removed) {
+		g_rw_lock_writer_unlock(&ev->subs_lock);
+		g_ptr_array_free(subs, TRUE);
+		return;
+	}
+
+	g_atomic_int_set(&ev->removed, TRUE);
+
+	g_hash_table_iter_init(&iter, ev->subs);
+	while (g_hash_table_iter_next(&iter, NULL, (void**)&sub)) {
+		if (atomic_inc_not_zero(&sub->refs)) {
+			g_ptr_array_add(subs, sub);
+		}
+	}
+
+	g_rw_lock_writer_unlock(&ev->subs_lock);
+
+	if (!evs_query_remove(ev)) {
+		WARN("Removing event \"%s\", but it wasn't in the event tree.",
+			ev->ev_path);
+	}
+
+	/*
+	 * No new subscriptions can be created, so anything that's left is
+	 * either here, or pending and will be rejected in evs_on_cb().
+	 */
+	for (i = 0; i < subs->len; i++) {
+		sub = g_ptr_array_index(subs, i);
+		sub_subscribers_foreach(sub, _drain, sub);
+		sub_unref(sub);
+	}
+
+	g_ptr_array_free(subs, TRUE);
+	event_unref(ev);
+}
+
 guint evs_clean_path(gchar *ev_path)
 {
 	register gchar *curr = ev_path;
@@ -197,6 +647,12 @@ void evs_route(
 	enum evs_code code = CODE_UNKNOWN;
 
 	evs_clean_path(ev_path);
+
+	/*
+	 * The event can't be freed out from under its handler
+	 */
+	evs_query_begin();
+
 	ev = evs_query(ev_path, &ev_extra);
 	if (ev == NULL) {
 		DEBUG("Could not find handler for event: %s", ev_path);
@@ -227,14 +683,19 @@ out:
 		case EVS_STATUS_HANDLED:
 			break;
 	}
+
+	evs_query_end();
 }
 
-void evs_on(
+static void _on(
 	struct client *client,
 	struct event *ev,
 	gchar *ev_extra,
 	const evs_cb_t client_cb,
-	gchar *json)
+	gchar *json,
+	const gboolean resume,
+	const guint64 resume_epoch,
+	const guint64 resume_seq)
 {
 	struct subscription *sub = sub_get(ev, ev_extra, TRUE);
 	struct evs_on_info info = {
@@ -243,11 +704,19 @@ void evs_on(
 		.sub = sub,
 		.client = client,
 		.client_cb = client_cb,
+		.resume = resume,
+		.resume_epoch = resume_epoch,
+		.resume_seq = resume_seq,
 	};
 
+	if (sub == NULL) {
+		evs_err_cb(client, client_cb, CODE_NOT_FOUND, NULL, NULL);
+		return;
+	}
+
 	DEBUG("Subscribing to: ev_path=%s, ev_extra=%s", ev->ev_path, ev_extra);
 
-	qev_lock(client);
+	client_lock(client);
 
 	switch (client_sub_add(client, sub)) {
 		case CLIENT_SUB_PENDING:
@@ -278,10 +747,37 @@ void evs_on(
 		}
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 	sub_unref(sub);
 }
 
+void evs_on(
+	struct client *client,
+	struct event *ev,
+	gchar *ev_extra,
+	const evs_cb_t client_cb,
+	gchar *json)
+{
+	_on(client, ev, ev_extra, client_cb, json, FALSE, 0, 0);
+}
+
+void evs_on_resume(
+	struct client *client,
+	struct event *ev,
+	gchar *ev_extra,
+	const evs_cb_t client_cb,
+	gchar *json,
+	const guint64 epoch,
+	const guint64 seq)
+{
+	if (!(ev->flags & EVS_HANDLER_RESUMABLE)) {
+		evs_err_cb(client, client_cb, CODE_BAD, "event can't be resumed", NULL);
+		return;
+	}
+
+	_on(client, ev, ev_extra, client_cb, json, TRUE, epoch, seq);
+}
+
 void evs_send(
 	struct client *client,
 	struct event *ev,
@@ -347,12 +843,22 @@ void evs_send_sub_full(
 	void *cb_data,
 	const qev_free_fn free_fn)
 {
+	evs_cb_t server_cb;
+
+	/*
+	 * Checking the subscription, making the callback, and sending all need
+	 * the client: lock it once for all of them
+	 */
+	client_lock(client);
+
 	if (client_sub_active(client, sub)) {
 		JSON_OR_NULL(json);
-		evs_cb_t server_cb = client_cb_new(client, cb_fn, cb_data, free_fn);
+		server_cb = client_cb_new(client, cb_fn, cb_data, free_fn);
 		protocols_send(client, sub->ev->ev_path, sub->ev_extra, server_cb, json);
 		qev_stats_counter_inc(_stat_evs_sent);
 	}
+
+	client_unlock(client);
 }
 
 void evs_send_bruteforce(
@@ -377,23 +883,70 @@ void evs_send_bruteforce(
 	qev_buffer_put(path);
 }
 
+/**
+ * Move the client's pending subscription into the subscription. The client
+ * must be locked.
+ *
+ * @return
+ *     If the client is now in the subscription
+ */
+static gboolean _on_accept(
+	const struct evs_on_info *info,
+	enum evs_code *code)
+{
+	*code = CODE_OK;
+
+	switch (client_sub_accept(info->client, info->sub)) {
+		case CLIENT_SUB_NULL:
+			*code = CODE_ENHANCE_CALM;
+			return FALSE;
+
+		case CLIENT_SUB_ACTIVE:
+			/*
+			 * If the handler was removed while this was pending, the
+			 * drain might have already walked past: either it sees the
+			 * client now, or the client sees that it's gone.
+			 */
+			__sync_synchronize();
+			if (g_atomic_int_get(&info->sub->ev->removed)) {
+				client_sub_remove(info->client, info->sub);
+				*code = CODE_NOT_FOUND;
+				return FALSE;
+			}
+			return TRUE;
+
+		default:
+			return FALSE;
+	}
+}
+
 void evs_on_cb(
 	const gboolean success,
 	const struct evs_on_info *info)
 {
+	struct _broadcast *bc;
+	struct protocol_bcast *lvc = NULL;
 	enum evs_code code = CODE_OK;
 
-	qev_lock(info->client);
+	/*
+	 * The client can only be put into the subscription between broadcasts,
+	 * or there's no telling which ones it already got.
+	 */
+	if (success && info->resume) {
+		bc = _broadcast_new(sub_ref(info->sub), NULL, NULL, FALSE);
+		bc->resume = evs_on_info_copy(info, FALSE, FALSE);
+		evs_queue_push(bc);
+		_dispatcher_wake();
+		return;
+	}
+
+	client_lock(info->client);
 
 	if (success) {
-		switch (client_sub_accept(info->client, info->sub)) {
-			case CLIENT_SUB_NULL:
-				code = CODE_ENHANCE_CALM;
-
-			default:
-				break;
+		if (_on_accept(info, &code) &&
+				!(info->sub->ev->flags & EVS_HANDLER_NO_LVC)) {
+			lvc = sub_lvc_get(info->sub);
 		}
-
 	} else {
 		if (info->sub->ev->handle_children) {
 			code = CODE_NOT_FOUND;
@@ -404,9 +957,26 @@ void evs_on_cb(
 		client_sub_reject(info->client, info->sub);
 	}
 
-	qev_unlock(info->client);
+	if (lvc == NULL) {
+		client_unlock(info->client);
+		evs_err_cb(info->client, info->client_cb, code, NULL, NULL);
+		return;
+	}
 
+	/*
+	 * The client is already in the subscription, and the tick caches a
+	 * broadcast before sending it to anyone, so anything newer than this
+	 * goes out to the client too. Writing with the client locked makes sure
+	 * that anything newer goes out after this. At worst, the client gets
+	 * the newest value twice.
+	 */
 	evs_err_cb(info->client, info->client_cb, code, NULL, NULL);
+	protocols_bcast_write(info->client, lvc);
+
+	client_unlock(info->client);
+
+	protocols_bcast_unref(lvc);
+	qev_stats_counter_inc(_stat_evs_broadcasts_lvc);
 }
 
 struct evs_on_info* evs_on_info_copy(
@@ -457,13 +1027,13 @@ void evs_off(
 
 void evs_client_off(struct client *client, struct subscription *sub)
 {
-	qev_lock(client);
+	client_lock(client);
 
 	if (sub->ev->off_fn != NULL) {
 		sub->ev->off_fn(client, sub->ev_extra);
 	}
 
-	qev_unlock(client);
+	client_unlock(client);
 }
 
 void evs_cb(
@@ -548,62 +1118,481 @@ void evs_cb_full(
 	qev_buffer_put(jbuff);
 }
 
+void evs_cb_on_expire(const evs_cb_fn cb_fn, const evs_cb_expire_fn expire_fn)
+{
+	g_rw_lock_writer_lock(&_cb_expires_lock);
+
+	if (expire_fn == NULL) {
+		g_hash_table_remove(_cb_expires, cb_fn);
+	} else {
+		g_hash_table_insert(_cb_expires, cb_fn, expire_fn);
+	}
+
+	g_rw_lock_writer_unlock(&_cb_expires_lock);
+}
+
+void evs_cb_expired(
+	struct client *client,
+	const evs_cb_fn cb_fn,
+	const void *cb_data,
+	const gboolean evicted)
+{
+	evs_cb_expire_fn expire_fn;
+
+	g_rw_lock_reader_lock(&_cb_expires_lock);
+	expire_fn = g_hash_table_lookup(_cb_expires, cb_fn);
+	g_rw_lock_reader_unlock(&_cb_expires_lock);
+
+	if (expire_fn != NULL) {
+		expire_fn(client, cb_data, evicted);
+	}
+}
+
 void evs_broadcast(
 	struct event *ev,
 	const gchar *ev_extra,
 	const gchar *json)
 {
+	gchar *relay = NULL;
 	struct subscription *sub = sub_get(ev, ev_extra, FALSE);
 	JSON_OR_NULL(json);
 
-	if (sub != NULL) {
-		struct _broadcast bc = {
-			.sub = sub,
-			.json = g_strdup(json),
-		};
+	/*
+	 * Whether peers get it is decided here, where it's known if it came
+	 * from one; what they get is left to the tick
+	 */
+	if (cluster_relaying()) {
+		relay = g_strconcat(ev->ev_path, ev_extra == NULL ? "" : ev_extra,
+							NULL);
+	}
 
-		g_async_queue_push(_broadcasts, g_slice_copy(sizeof(bc), &bc));
+	if (sub == NULL) {
+		/*
+		 * Nothing here wants it, but peers still might
+		 */
+		if (relay != NULL) {
+			evs_queue_push(_broadcast_new(NULL, json, relay, FALSE));
+			_dispatcher_wake();
+		}
+	} else if (!(ev->flags & EVS_HANDLER_CONFLATE)) {
+		evs_queue_push(_broadcast_new(sub, json, relay, FALSE));
+		_dispatcher_wake();
+	} else if (_broadcast_conflate(sub, json, relay)) {
+		qev_stats_counter_inc(_stat_evs_broadcasts_conflated);
+		sub_unref(sub);
+	} else {
+		_dispatcher_wake();
 	}
+
+	g_free(relay);
 }
 
 void evs_broadcast_path(const gchar *ev_path, const gchar *json)
 {
 	gchar *ev_extra;
-	struct event *ev = evs_query(ev_path, &ev_extra);
+	struct event *ev;
+
+	evs_query_begin();
 
+	ev = evs_query(ev_path, &ev_extra);
 	if (ev != NULL) {
 		evs_broadcast(ev, ev_extra, json);
 	}
+
+	evs_query_end();
+}
+
+static struct _fanout* _fanout_new(
+	struct _broadcast *bc,
+	struct protocol_bcast *bcast,
+	const gboolean sharded)
+{
+	struct _fanout *fo = g_slice_alloc0(sizeof(*fo));
+
+	fo->bc = bc;
+	fo->bcast = bcast;
+	fo->sending = 1;
+	fo->sharded = sharded;
+
+	return fo;
+}
+
+/**
+ * Done sending a piece of the broadcast. The last piece frees it.
+ */
+static void _fanout_sent(struct _fanout *fo)
+{
+	if (!g_atomic_int_dec_and_test(&fo->sending)) {
+		return;
+	}
+
+	protocols_bcast_unref(fo->bcast);
+	_broadcast_free(fo->bc);
+	fo->bcast = NULL;
+	fo->bc = NULL;
+
+	qev_stats_counter_inc(_stat_evs_broadcasts_unique);
+
+	if (fo->sharded) {
+		g_slice_free1(sizeof(*fo), fo);
+	}
+}
+
+/**
+ * Remove a fanout from _fanouts, waiting for it if it's still going out
+ */
+static void _fanout_free(void *fo_)
+{
+	struct _fanout *fo = fo_;
+
+	fanout_wait(&fo->grp);
+	g_slice_free1(sizeof(*fo), fo);
+}
+
+static gboolean _fanout_done(
+	void *sub G_GNUC_UNUSED,
+	void *fo_,
+	void *nothing G_GNUC_UNUSED)
+{
+	struct _fanout *fo = fo_;
+	return g_atomic_int_get(&fo->grp.pending) == 0;
+}
+
+static void _fanout_run(void *part_)
+{
+	struct _fanout_part *part = part_;
+
+	protocols_batch_begin();
+	subscribers_chunk_run(part->chunk);
+	_batch_end();
+
+	_fanout_sent(part->fo);
+	g_slice_free1(sizeof(*part), part);
+}
+
+static void _fanout_chunk(struct subscribers_chunk *chunk, void *fo_)
+{
+	struct _fanout *fo = fo_;
+	struct _fanout_part part = {
+		.fo = fo,
+		.chunk = chunk,
+	};
+
+	g_atomic_int_inc(&fo->sending);
+	fanout_push(&fo->grp, _fanout_run, g_slice_copy(sizeof(part), &part));
+}
+
+static GArray* _shard_sends_new()
+{
+	return g_array_new(FALSE, FALSE, sizeof(struct _shard_send));
+}
+
+static void _shards_free(void *nothing G_GNUC_UNUSED)
+{
+	guint i;
+
+	fanout_wait(&_shard_grp);
+
+	for (i = 0; i < sub_shards(); i++) {
+		g_array_free(_shard_sends[i], TRUE);
+	}
+
+	g_free(_shard_sends);
+	_shard_sends = NULL;
+}
+
+static void _shards_init()
+{
+	guint i;
+
+	if (_shard_sends != NULL) {
+		return;
+	}
+
+	_shard_sends = g_malloc(sizeof(*_shard_sends) * sub_shards());
+	for (i = 0; i < sub_shards(); i++) {
+		_shard_sends[i] = _shard_sends_new();
+	}
+
+	qev_cleanup(&_shard_sends, _shards_free);
+}
+
+/**
+ * Queue the broadcast up for every shard's thread
+ */
+static void _broadcast_shard(
+	struct _broadcast *bc,
+	struct protocol_bcast *bcast)
+{
+	guint i;
+	struct _fanout *fo = _fanout_new(bc, bcast, TRUE);
+
+	_shards_init();
+
+	for (i = 0; i < sub_shards(); i++) {
+		struct _shard_send send = {
+			.subs = bc->sub->shards + i,
+			.fo = fo,
+		};
+
+		if (subscribers_size(send.subs) > 0) {
+			g_atomic_int_inc(&fo->sending);
+			g_array_append_val(_shard_sends[i], send);
+		}
+	}
+
+	_fanout_sent(fo);
+}
+
+static void _shard_run(void *sends_)
+{
+	guint i;
+	GArray *sends = sends_;
+
+	protocols_batch_begin();
+
+	for (i = 0; i < sends->len; i++) {
+		struct _shard_send *send = &g_array_index(sends, struct _shard_send, i);
+		subscribers_foreach(send->subs, _broadcast, send->fo->bcast);
+	}
+
+	_batch_end();
+
+	for (i = 0; i < sends->len; i++) {
+		_fanout_sent(g_array_index(sends, struct _shard_send, i).fo);
+	}
+
+	g_array_free(sends, TRUE);
+}
+
+/**
+ * Hand every shard its broadcasts. Each shard's are always run by the same
+ * thread, in order, so nothing needs to wait for them.
+ */
+static void _shards_flush()
+{
+	guint i;
+
+	if (_shard_sends == NULL) {
+		return;
+	}
+
+	for (i = 0; i < sub_shards(); i++) {
+		if (_shard_sends[i]->len > 0) {
+			fanout_push_to(&_shard_grp, i, _shard_run, _shard_sends[i]);
+			_shard_sends[i] = _shard_sends_new();
+		}
+	}
+}
+
+static void _replay(void *bcast, void *client)
+{
+	protocols_bcast_write(client, bcast);
+	qev_stats_counter_inc(_stat_evs_broadcasts_replayed);
+}
+
+/**
+ * Put a resuming client into the subscription and send it everything it
+ * missed. Nothing is going out to the subscription while this runs, so
+ * every broadcast is either replayed or sent live, never both.
+ */
+static void _broadcast_resume(const struct evs_on_info *info)
+{
+	guint64 next;
+	gboolean reset;
+	enum evs_code code;
+	gchar json[96];
+	struct protocol_bcast *lvc = NULL;
+	struct subscription *sub = info->sub;
+
+	/*
+	 * Sharded broadcasts from earlier in this tick, or still going out from
+	 * earlier ticks, would reach the client on top of the replay.
+	 */
+	if (sub->shards != NULL) {
+		_shards_flush();
+		fanout_wait(&_shard_grp);
+	}
+
+	client_lock(info->client);
+
+	if (!_on_accept(info, &code)) {
+		client_unlock(info->client);
+		evs_err_cb(info->client, info->client_cb, code, NULL, NULL);
+		return;
+	}
+
+	reset = !sub_replay_has(sub, info->resume_epoch, info->resume_seq);
+	if (reset) {
+		next = sub->seq + 1;
+		if (!(sub->ev->flags & EVS_HANDLER_NO_LVC)) {
+			lvc = sub_lvc_get(sub);
+		}
+
+		/*
+		 * The cached broadcast is always the newest one
+		 */
+		if (lvc != NULL) {
+			next = sub->seq;
+		}
+
+		qev_stats_counter_inc(_stat_evs_broadcasts_resets);
+	} else {
+		next = info->resume_seq + 1;
+	}
+
+	g_snprintf(json, sizeof(json),
+		"{\"epoch\":\"" SUB_EPOCH_FORMAT "\",\"seq\":%" G_GUINT64_FORMAT
+		",\"reset\":%s}",
+		sub->epoch, next, reset ? "true" : "false");
+	evs_cb(info->client, info->client_cb, json);
+
+	if (lvc != NULL) {
+		protocols_bcast_write(info->client, lvc);
+		protocols_bcast_unref(lvc);
+		qev_stats_counter_inc(_stat_evs_broadcasts_lvc);
+	} else if (!reset) {
+		sub_replay(sub, info->resume_seq, _replay, info->client);
+	}
+
+	client_unlock(info->client);
+}
+
+static void _broadcast_send(void *bc_, void *path_)
+{
+	struct _fanout *fo;
+	struct subscription *sub;
+	struct protocol_bcast *bcast;
+	struct _broadcast *bc = bc_;
+	GString *path = path_;
+
+	if (bc->relay != NULL) {
+		cluster_relay(bc->relay, bc->json);
+	}
+
+	if (bc->sub == NULL) {
+		_broadcast_free(bc);
+		return;
+	}
+
+	/*
+	 * Clients must see a subscription's broadcasts in order, so anything
+	 * still going out to the subscription has to finish first (the table
+	 * finishes whatever it removes).
+	 */
+	g_hash_table_remove(_fanouts, bc->sub);
+
+	if (bc->resume != NULL) {
+		_broadcast_resume(bc->resume);
+		_broadcast_free(bc);
+		return;
+	}
+
+	if (bc->conflate) {
+		struct _conflating *c = _conflating_get(bc->sub);
+
+		g_mutex_lock(&c->lock);
+		g_hash_table_remove(c->pending, bc->sub);
+		g_mutex_unlock(&c->lock);
+	}
+
+	g_string_printf(path, "%s%s", bc->sub->ev->ev_path, bc->sub->ev_extra);
+	bcast = sub_bcast(bc->sub, path->str, bc->json, bc->sub->seq + 1);
+	bcast->queued = bc->queued;
+
+	sub_replay_push(bc->sub, bcast);
+
+	if (!(bc->sub->ev->flags & EVS_HANDLER_NO_LVC)) {
+		sub_lvc_set(bc->sub, bcast);
+		journal_append(path->str, bc->json);
+	}
+
+	if (bc->sub->shards != NULL) {
+		_broadcast_shard(bc, bcast);
+		return;
+	}
+
+	/*
+	 * Small subscriptions are sent right here; large ones are split up and
+	 * left to the pool, which frees the broadcast once it's out.
+	 */
+	sub = bc->sub;
+	fo = _fanout_new(bc, bcast, FALSE);
+
+	if (subscribers_foreach_chunked(
+			&sub->subscribers, _broadcast, bcast,
+			_fanout_chunk, fo) > 0) {
+		g_hash_table_insert(_fanouts, sub, fo);
+		_fanout_sent(fo);
+	} else {
+		_fanout_sent(fo);
+		g_slice_free1(sizeof(*fo), fo);
+	}
 }
 
 void evs_broadcast_tick()
 {
-	struct _broadcast *bc;
-	struct protocol_frames *frames;
+	guint64 drained;
 	GString *path = qev_buffer_get();
 
-	while ((bc = g_async_queue_try_pop(_broadcasts)) != NULL) {
-		g_string_printf(path, "%s%s", bc->sub->ev->ev_path, bc->sub->ev_extra);
-		frames = protocols_bcast(path->str, bc->json);
+	g_mutex_lock(&_tick_lock);
 
-		qev_list_foreach(
-			bc->sub->subscribers, _broadcast,
-			cfg_broadcast_threads, frames);
+	/*
+	 * Clients that batch get everything sent to them from here in a
+	 * single frame
+	 */
+	protocols_batch_begin();
 
-		protocols_bcast_free(frames);
-		_broadcast_free(bc);
+	drained = evs_queue_drain(_broadcast_send, path, BROADCAST_BATCH);
+
+	_shards_flush();
 
-		qev_stats_counter_inc(_stat_evs_broadcasts_unique);
+	/*
+	 * Nothing waits on the pool unless it has no workers, in which case
+	 * nothing handed to it goes out until something does
+	 */
+	if (fanout_workers() == 0) {
+		g_hash_table_remove_all(_fanouts);
+		fanout_wait(&_shard_grp);
+	} else {
+		g_hash_table_foreach_remove(_fanouts, _fanout_done, NULL);
+	}
+
+	_batch_end();
+
+	if (drained > 0) {
+		qev_stats_gauge_set(_stat_evs_broadcasts_latency,
+			__sync_add_and_fetch(&_latency, 0));
 	}
 
+	journal_tick();
+	cluster_flush();
+
+	g_mutex_unlock(&_tick_lock);
+
+	qev_stats_gauge_set(_stat_evs_broadcasts_pending, evs_queue_depth());
+
 	qev_buffer_put(path);
 }
 
 void evs_pre_init()
 {
-	_broadcasts = g_async_queue_new_full(_broadcast_free);
-	qev_cleanup_and_null((void**)&_broadcasts,
-						(qev_free_fn)g_async_queue_unref);
+	guint i;
+
+	evs_queue_init(_broadcast_free);
+
+	for (i = 0; i < CONFLATE_STRIPES; i++) {
+		g_mutex_init(&_conflating[i].lock);
+		_conflating[i].pending = g_hash_table_new(NULL, NULL);
+	}
+	qev_cleanup(_conflating, _conflating_free);
+
+	_fanouts = g_hash_table_new_full(NULL, NULL, NULL, _fanout_free);
+	qev_cleanup_and_null((void**)&_fanouts, (qev_free_fn)g_hash_table_unref);
+
+	_cb_expires = g_hash_table_new(NULL, NULL);
+	qev_cleanup_and_null((void**)&_cb_expires,
+							(qev_free_fn)g_hash_table_unref);
 
 	evs_query_init();
 }
@@ -627,4 +1616,30 @@ void evs_init()
 	_stat_evs_broadcasts_events = qev_stats_counter(
 		"evs.broadcasts", "events", TRUE,
 		"How many events were broadcasted to clients in total");
+	_stat_evs_broadcasts_conflated = qev_stats_counter(
+		"evs.broadcasts", "conflated", TRUE,
+		"How many broadcasts were replaced by a newer one before being sent");
+	_stat_evs_broadcasts_lvc = qev_stats_counter(
+		"evs.broadcasts", "lvc", TRUE,
+		"How many cached broadcasts were sent to clients as they subscribed");
+	_stat_evs_broadcasts_replayed = qev_stats_counter(
+		"evs.broadcasts", "replayed", TRUE,
+		"How many missed broadcasts were replayed to clients resuming "
+		"subscriptions");
+	_stat_evs_broadcasts_resets = qev_stats_counter(
+		"evs.broadcasts", "resets", TRUE,
+		"How many resumed subscriptions had missed too much to be replayed");
+	_stat_evs_broadcasts_pending = qev_stats_gauge(
+		"evs.broadcasts", "pending",
+		"How many broadcasts were waiting to be sent after the last tick");
+	_stat_evs_broadcasts_latency = qev_stats_gauge(
+		"evs.broadcasts", "latency",
+		"Moving average of microseconds between a broadcast being made and "
+		"it first being written to a client");
+
+	fanout_init();
+
+	if (cfg_broadcast_low_latency) {
+		_dispatcher_init();
+	}
 }
@@ -53,6 +53,23 @@ typedef enum evs_status (*evs_cb_fn)(
 	const evs_cb_t client_cb,
 	gchar *json);
 
+/**
+ * Function called when a server callback will never be answered: either
+ * it was evicted to make room for a newer callback, or the client took too
+ * long to respond. The callback's data is freed as soon as this returns.
+ *
+ * @param client
+ *     The client that was supposed to respond
+ * @param data
+ *     The data that would have been given to the callback
+ * @param evicted
+ *     If the callback was pushed out by a newer one, rather than expiring
+ */
+typedef void (*evs_cb_expire_fn)(
+	struct client *client,
+	const void *data,
+	const gboolean evicted);
+
 /**
  * From handlers, these values instruct the server how to handle everything
  */
@@ -163,6 +180,25 @@ struct evs_on_info {
 	 * The callback id to be sent. Don't mess with this.
 	 */
 	evs_cb_t client_cb;
+
+	/**
+	 * If the client is resuming the subscription, in which case it's told
+	 * where it stands and sent what it missed once accepted. Don't mess
+	 * with this.
+	 */
+	gboolean resume;
+
+	/**
+	 * When resuming: the epoch of the subscription the client last saw, or
+	 * 0 if it doesn't know one. Don't mess with this.
+	 */
+	guint64 resume_epoch;
+
+	/**
+	 * When resuming: the sequence number of the newest broadcast the client
+	 * saw. Don't mess with this.
+	 */
+	guint64 resume_seq;
 };
 
 /**
@@ -183,6 +219,41 @@ struct evs_on_info {
  */
 typedef enum evs_status (*evs_on_fn)(const struct evs_on_info *info);
 
+/**
+ * Options for how an event behaves, given to evs_add_handler_full()
+ */
+enum evs_handler_flags {
+	/**
+	 * Nothing special
+	 */
+	EVS_HANDLER_NONE = 0,
+
+	/**
+	 * Broadcasts are last-value-wins: if a subscription already has a
+	 * broadcast waiting to go out when another comes in, the waiting one
+	 * is replaced, and only the newest is ever sent. Good for things
+	 * like tickers, where only the latest value matters.
+	 */
+	EVS_HANDLER_CONFLATE = 1 << 0,
+
+	/**
+	 * Don't keep the last broadcast to each subscription around. Normally,
+	 * clients are sent the newest broadcast as soon as they subscribe, so
+	 * that apps don't have to look up and send the current state
+	 * themselves. Events whose broadcasts only make sense as they happen
+	 * should set this.
+	 */
+	EVS_HANDLER_NO_LVC = 1 << 1,
+
+	/**
+	 * Clients may resume their subscriptions after reconnecting. Every
+	 * broadcast carries where it is in the subscription, so its data goes
+	 * out as `{"epoch":"...","seq":N,"data":...}`, and the most recent are
+	 * kept around for replaying (see `sub-replay-count`).
+	 */
+	EVS_HANDLER_RESUMABLE = 1 << 2,
+};
+
 /**
  * Events are stored in a prefix tree for fast, nice lookups.
  */
@@ -212,6 +283,11 @@ struct event {
 	 */
 	gboolean handle_children;
 
+	/**
+	 * Options for the event
+	 */
+	enum evs_handler_flags flags;
+
 	/**
 	 * All of the children subscriptions to this event, referenced by
 	 * extra path segments.
@@ -227,6 +303,18 @@ struct event {
 	 * Lock for subs
 	 */
 	GRWLock subs_lock;
+
+	/**
+	 * The router holds one reference, and every subscription holds
+	 * another. The event is freed once these are all gone.
+	 */
+	guint refs;
+
+	/**
+	 * If the event was removed with evs_remove_handler(). Once set, no
+	 * new subscriptions may be created.
+	 */
+	gboolean removed;
 };
 
 /**
@@ -238,13 +326,25 @@ void event_init(
 	const evs_handler_fn handler_fn,
 	const evs_on_fn on_fn,
 	const evs_off_fn off_fn,
-	const gboolean handle_children);
+	const gboolean handle_children,
+	const enum evs_handler_flags flags);
 
 /**
  * Clean up all memory inside a `struct event`
  */
 void event_clear(struct event *ev);
 
+/**
+ * Increase the reference count on the event
+ */
+struct event* event_ref(struct event *ev);
+
+/**
+ * Release a reference to the event. When the last is released, the event
+ * is freed once nothing can still be looking at it.
+ */
+void event_unref(struct event *ev);
+
 /**
  * Creates a handler for an event
  *
@@ -272,6 +372,35 @@ struct event* evs_add_handler(
 	const evs_off_fn off_fn,
 	const gboolean handle_children);
 
+/**
+ * Creates a handler for an event, with options.
+ *
+ * @see evs_add_handler
+ *
+ * @param flags
+ *     Options for the event, OR'd together.
+ */
+struct event* evs_add_handler_full(
+	const gchar *ev_prefix,
+	const gchar *ev_path,
+	const evs_handler_fn handler_fn,
+	const evs_on_fn on_fn,
+	const evs_off_fn off_fn,
+	const gboolean handle_children,
+	const enum evs_handler_flags flags);
+
+/**
+ * Removes a handler that was created with evs_add_handler(). Every client
+ * subscribed to the event is unsubscribed (off_fn is called for each), and
+ * any subscriptions still pending are rejected when their callbacks come
+ * through.
+ *
+ * @param ev
+ *     The event to remove. After this returns, the event MUST NOT be used
+ *     anymore: it is freed as soon as the last subscription to it is gone.
+ */
+void evs_remove_handler(struct event *ev);
+
 /**
  * Doesn't allow anyone to subscribe to the event.
  * Use this for qio.add_handler for the on_fn to disable subscriptions
@@ -352,6 +481,50 @@ void evs_on(
 	const evs_cb_t client_cb,
 	gchar *json);
 
+/**
+ * Subscribes the client to the event, as with evs_on(), picking up where
+ * the client left off on a previous connection.
+ *
+ * Once the subscription is accepted, the client's callback is sent with
+ * `{"epoch":<epoch>,"seq":<next>,"reset":<bool>}`, where `epoch` is the
+ * subscription's, written with SUB_EPOCH_FORMAT, and `next` is the sequence
+ * number of the first broadcast that follows the callback. When `reset` is
+ * false, every broadcast the client missed is replayed right after the
+ * callback, in order, and `next` is `seq + 1`. When the gap is no longer
+ * kept around, or the epoch isn't the subscription's (it was created again
+ * since, or the client was on another server), `reset` is true: nothing is
+ * replayed, and the client gets the newest broadcast, as usual, if the
+ * event caches them.
+ *
+ * Only events created with EVS_HANDLER_RESUMABLE may be resumed: the
+ * client is sent an error for any other.
+ *
+ * @param client
+ *     The client to subscribe to the event
+ * @param ev
+ *     The event to add the client to
+ * @param ev_extra
+ *     Any extra path segments
+ * @param client_cb
+ *     The id of the callback to send to the client
+ * @param json
+ *     Any extra json that came with the subscription
+ * @param epoch
+ *     The epoch the client was last given for the subscription, or 0 if it
+ *     was never given one
+ * @param seq
+ *     The sequence number of the newest broadcast the client saw, or 0 if
+ *     it never saw any
+ */
+void evs_on_resume(
+	struct client *client,
+	struct event *ev,
+	gchar *ev_extra,
+	const evs_cb_t client_cb,
+	gchar *json,
+	const guint64 epoch,
+	const guint64 seq);
+
 /**
  * Sends an event to a specific client.
  *
@@ -506,6 +679,10 @@ void evs_send_bruteforce(
  * Subscribes a client to an event without any callback checks. This should
  * only be used in the callback case.
  *
+ * Once subscribed, the client is sent the newest broadcast to the
+ * subscription, if there has been one, right after its callback, unless the
+ * event was created with EVS_HANDLER_NO_LVC.
+ *
  * @param success
  *     If the checks were successful and the client should be added to the
  *     subscription. An error callback is sent if false.
@@ -675,6 +852,36 @@ void evs_cb_full(
 	void *cb_data,
 	const qev_free_fn free_fn);
 
+/**
+ * Be told whenever a server callback made with cb_fn goes unanswered.
+ * Register these when setting up, before any callbacks are made.
+ *
+ * @param cb_fn
+ *     The callback function to watch for
+ * @param expire_fn
+ *     Called instead of cb_fn when the client never answers. Pass NULL to
+ *     stop being told.
+ */
+void evs_cb_on_expire(const evs_cb_fn cb_fn, const evs_cb_expire_fn expire_fn);
+
+/**
+ * Tell whoever's interested that a server callback went unanswered.
+ *
+ * @param client
+ *     The client the callback was for
+ * @param cb_fn
+ *     The callback function that will never be called
+ * @param cb_data
+ *     The data the callback was made with
+ * @param evicted
+ *     If the callback was pushed out by a newer one
+ */
+void evs_cb_expired(
+	struct client *client,
+	const evs_cb_fn cb_fn,
+	const void *cb_data,
+	const gboolean evicted);
+
 /**
  * Broadcast a message to all clients listening on the event
  *
@@ -52,6 +52,9 @@ static enum evs_status _on(
 	struct event *ev;
 	enum qev_json_status status;
 	gchar *data = NULL;
+	gchar *resume = NULL;
+	gchar *epoch = NULL;
+	guint64 seq = 0;
 
 	switch (*json) {
 		case '"':
@@ -60,6 +63,20 @@ static enum evs_status _on(
 			break;
 
 		case '[': {
+			/*
+			 * Unpacking works in place, so a failed attempt leaves the
+			 * JSON mangled: the resume form gets a copy of its own.
+			 */
+			resume = g_strdup(json);
+			status = qev_json_unpack(resume, NULL, "[%s,%a,%d,%s]",
+										&ev_path, &data, &seq, &epoch);
+			if (status == QEV_JSON_OK) {
+				break;
+			}
+
+			g_free(resume);
+			resume = NULL;
+
 			status = qev_json_unpack(json, NULL, "[%s,%a]", &ev_path, &data);
 			if (status == QEV_JSON_OK) {
 				break;
@@ -79,9 +96,18 @@ static enum evs_status _on(
 		goto out;
 	}
 
-	evs_on(client, ev, ev_extra, client_cb, data);
+	if (resume != NULL) {
+		/*
+		 * Anything that isn't an epoch is 0, which never matches
+		 */
+		evs_on_resume(client, ev, ev_extra, client_cb, data,
+						g_ascii_strtoull(epoch, NULL, 16), seq);
+	} else {
+		evs_on(client, ev, ev_extra, client_cb, data);
+	}
 
 out:
+	g_free(resume);
 	return EVS_STATUS_HANDLED;
 }
 
@@ -6,53 +6,758 @@
  * the MIT License: http://opensource.org/licenses/MIT
  */
 
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
 #include "quickio.h"
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+/**
+ * The different sizes of nodes in the tree
+ */
+enum _node_type {
+	_NODE4,
+	_NODE16,
+	_NODE48,
+	_NODE256,
+};
+
+/**
+ * What every node in the tree starts with. The node's compressed prefix
+ * is stored directly after the type-specific node, so that checking it
+ * never costs another pointer chase.
+ */
+struct _node {
+	/**
+	 * Which type of node this is
+	 */
+	guint8 type;
+
+	/**
+	 * Number of children the node has
+	 */
+	guint16 count;
+
+	/**
+	 * Length of the path segment that every child of this node shares
+	 */
+	guint32 prefix_len;
+
+	/**
+	 * The event that lives at this node, if any
+	 */
+	struct event *ev;
+};
+
+struct _node4 {
+	struct _node n;
+	guchar keys[4];
+	struct _node *children[4];
+};
+
+struct _node16 {
+	struct _node n;
+	guchar keys[16];
+	struct _node *children[16];
+};
+
+struct _node48 {
+	struct _node n;
+
+	/**
+	 * Index into children + 1. 0 means that there is no child.
+	 */
+	guchar index[256];
+	struct _node *children[48];
+};
+
+struct _node256 {
+	struct _node n;
+	struct _node *children[256];
+};
+
+static const gsize _node_sizes[] = {
+	[_NODE4] = sizeof(struct _node4),
+	[_NODE16] = sizeof(struct _node16),
+	[_NODE48] = sizeof(struct _node48),
+	[_NODE256] = sizeof(struct _node256),
+};
+
+static const guint _node_max[] = {
+	[_NODE4] = 4,
+	[_NODE16] = 16,
+	[_NODE48] = 48,
+	[_NODE256] = 256,
+};
+
 /**
- * The internal ptrie node
+ * Something that was taken out of the tree, waiting to be freed
  */
-struct _ptrie {
+struct _retiree {
 	/**
-	 * The actual event that lives at this node.
+	 * The scan that was last started when it was removed. It's freed once a
+	 * later scan finds that no reader could still be using it.
 	 */
-	struct event ev;
+	guint64 gen;
 
 	/**
-	 * The character at this node
+	 * The node that was replaced, or NULL
 	 */
-	gchar ch;
+	struct _node *node;
 
 	/**
-	 * Any array of possible children.
-	 * index 0 = '-'
+	 * The event that was released, or NULL
 	 */
-	struct _ptrie *childs['z' - '-' + 1];
+	struct event *ev;
 };
 
-static struct _ptrie _events;
+/**
+ * The root of the tree. It never has a prefix.
+ */
+static struct _node *_root = NULL;
+
+/**
+ * Takes every path that nothing in the tree does; NULL when unknown paths
+ * should just miss. Its ev_path is empty, so ev_extra is always the full
+ * path.
+ */
+static struct event *_fallback = NULL;
+
+/**
+ * Everything that was taken out of the tree, oldest first
+ */
+static GQueue _retired = G_QUEUE_INIT;
+
+/**
+ * A thread that does lookups
+ */
+struct _reader {
+	/**
+	 * Bumped when the thread starts and stops reading: odd while it's
+	 * reading. Only written by the reader.
+	 */
+	guint64 seq;
+
+	/**
+	 * How many evs_query_begin() calls the thread is nested in. Only
+	 * touched by the reader.
+	 */
+	guint depth;
+
+	/**
+	 * What seq was when the current scan started. Protected by _lock.
+	 */
+	guint64 snap;
+
+	/**
+	 * If the reader's thread exited, leaving it for the next new thread
+	 */
+	gboolean orphaned;
+
+	struct _reader *next;
+};
+
+static void _orphan(void *reader_);
+
+/**
+ * Every reader ever created. Readers are never freed, only reused by new
+ * threads. Only grown with _lock held.
+ */
+static struct _reader *_readers = NULL;
+
+/**
+ * The calling thread's reader. The GPrivate is only there to orphan the
+ * reader when the thread exits; _self is what lookups use.
+ */
+static GPrivate _reader = G_PRIVATE_INIT(_orphan);
+static __thread struct _reader *_self = NULL;
+
+/**
+ * Until membarrier(2) is known to work, readers have to fence on their own
+ * so that scans can see them.
+ */
+static gboolean _reader_fence = TRUE;
+
+/**
+ * The membarrier(2) command that forces a barrier on every running thread
+ */
+static int _membarrier_cmd = 0;
+
+/**
+ * Number of scans started. A scan snapshots every reader, and it's done
+ * once every reader that was reading has stopped at least once.
+ */
+static guint64 _gen = 0;
+static gboolean _scanning = FALSE;
+
+/**
+ * Serializes all writers
+ */
+static GMutex _lock;
+
+static gsize _node_size(const struct _node *node)
+{
+	return _node_sizes[node->type] + node->prefix_len;
+}
+
+static gchar* _prefix(struct _node *node)
+{
+	return ((gchar*)node) + _node_sizes[node->type];
+}
+
+static struct _node* _node_new(
+	const enum _node_type type,
+	const gchar *prefix,
+	const guint32 prefix_len)
+{
+	struct _node *node = g_slice_alloc0(_node_sizes[type] + prefix_len);
+
+	node->type = type;
+	node->prefix_len = prefix_len;
+
+	if (prefix != NULL) {
+		memcpy(_prefix(node), prefix, prefix_len);
+	}
+
+	return node;
+}
+
+static void _node_free(struct _node *node)
+{
+	g_slice_free1(_node_size(node), node);
+}
+
+static void _event_free(struct event *ev)
+{
+	event_clear(ev);
+	g_slice_free1(sizeof(*ev), ev);
+}
+
+static void _retiree_free(struct _retiree *r)
+{
+	if (r->node != NULL) {
+		_node_free(r->node);
+	}
+
+	if (r->ev != NULL) {
+		_event_free(r->ev);
+	}
+
+	g_slice_free1(sizeof(*r), r);
+}
+
+/**
+ * Queue something to be freed. Must be holding _lock.
+ */
+static void _retire_full(struct _node *node, struct event *ev)
+{
+	struct _retiree *r = g_slice_alloc(sizeof(*r));
+
+	r->gen = _gen;
+	r->node = node;
+	r->ev = ev;
+
+	g_queue_push_tail(&_retired, r);
+}
+
+static void _retire(struct _node *node)
+{
+	_retire_full(node, NULL);
+}
+
+static void _orphan(void *reader_)
+{
+	struct _reader *reader = reader_;
+	g_atomic_int_set(&reader->orphaned, TRUE);
+}
+
+static struct _reader* _reader_get()
+{
+	struct _reader *reader = _self;
+
+	if (G_LIKELY(reader != NULL)) {
+		return reader;
+	}
+
+	reader = g_atomic_pointer_get(&_readers);
+	for (; reader != NULL; reader = reader->next) {
+		if (g_atomic_int_compare_and_exchange(&reader->orphaned, TRUE, FALSE)) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Added with the lock held, so it can't show up halfway through a
+	 * scan's snapshot. It hasn't read anything yet, so whatever snap is,
+	 * it's never waited on.
+	 */
+	reader = g_slice_alloc0(sizeof(*reader));
+
+	g_mutex_lock(&_lock);
+	reader->next = _readers;
+	g_atomic_pointer_set(&_readers, reader);
+	g_mutex_unlock(&_lock);
+
+out:
+	g_private_set(&_reader, reader);
+	_self = reader;
+	return reader;
+}
+
+/**
+ * Snapshot every reader. Must be holding _lock.
+ */
+static void _scan_start()
+{
+	struct _reader *reader;
+
+	/*
+	 * Everything retired so far was taken out of the tree before this:
+	 * any reader not reading now can't be holding on to it. Readers only
+	 * do plain stores, so this is where every thread gets its barrier.
+	 */
+	if (_reader_fence) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	} else {
+		syscall(__NR_membarrier, _membarrier_cmd, 0);
+	}
+
+	for (reader = _readers; reader != NULL; reader = reader->next) {
+		reader->snap = __atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE);
+	}
+
+	_gen++;
+	_scanning = TRUE;
+}
+
+/**
+ * If every reader that was reading when the scan started has since
+ * stopped. Must be holding _lock.
+ */
+static gboolean _scan_done()
+{
+	struct _reader *reader;
+
+	for (reader = _readers; reader != NULL; reader = reader->next) {
+		if ((reader->snap & 1) &&
+				__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) ==
+					reader->snap) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static struct _node** _children(struct _node *node)
+{
+	switch (node->type) {
+		case _NODE4:
+			return ((struct _node4*)node)->children;
+		case _NODE16:
+			return ((struct _node16*)node)->children;
+		case _NODE48:
+			return ((struct _node48*)node)->children;
+		case _NODE256:
+		default:
+			return ((struct _node256*)node)->children;
+	}
+}
+
+/**
+ * Copy everything but the header and prefix from one node to another of the
+ * same type
+ */
+static void _copy_children(struct _node *to, const struct _node *from)
+{
+	to->ev = from->ev;
+	to->count = from->count;
+	memcpy(((gchar*)to) + sizeof(*to),
+		((gchar*)from) + sizeof(*from),
+		_node_sizes[from->type] - sizeof(*from));
+}
+
+/**
+ * Get all of the children of the node, in no particular order
+ *
+ * @return
+ *     The number of children put into keys and children
+ */
+static guint _entries(
+	struct _node *node,
+	guchar *keys,
+	struct _node **children)
+{
+	guint i;
+	guint n = 0;
+	struct _node **from = _children(node);
+
+	switch (node->type) {
+		case _NODE4:
+			memcpy(keys, ((struct _node4*)node)->keys, node->count);
+			memcpy(children, from, sizeof(*from) * node->count);
+			return node->count;
+
+		case _NODE16:
+			memcpy(keys, ((struct _node16*)node)->keys, node->count);
+			memcpy(children, from, sizeof(*from) * node->count);
+			return node->count;
+
+		case _NODE48: {
+			struct _node48 *n48 = (struct _node48*)node;
+			for (i = 0; i < G_N_ELEMENTS(n48->index); i++) {
+				if (n48->index[i] != 0) {
+					keys[n] = i;
+					children[n++] = from[n48->index[i] - 1];
+				}
+			}
+			return n;
+		}
+
+		case _NODE256:
+		default:
+			for (i = 0; i < 256; i++) {
+				if (from[i] != NULL) {
+					keys[n] = i;
+					children[n++] = from[i];
+				}
+			}
+			return n;
+	}
+}
+
+static struct _node** _find_child(struct _node *node, const guchar ch)
+{
+	guint i;
+	struct _node4 *n4;
+	struct _node16 *n16;
+	struct _node48 *n48;
+	struct _node256 *n256;
+
+	switch (node->type) {
+		case _NODE4:
+			n4 = (struct _node4*)node;
+			for (i = 0; i < node->count; i++) {
+				if (n4->keys[i] == ch) {
+					return n4->children + i;
+				}
+			}
+			return NULL;
+
+		case _NODE16: {
+			n16 = (struct _node16*)node;
+
+		#ifdef __SSE2__
+			guint mask;
+			__m128i cmp = _mm_cmpeq_epi8(
+				_mm_set1_epi8(ch),
+				_mm_loadu_si128((__m128i*)n16->keys));
+
+			mask = _mm_movemask_epi8(cmp) & ((1 << node->count) - 1);
+			if (mask != 0) {
+				return n16->children + __builtin_ctz(mask);
+			}
+		#else
+			for (i = 0; i < node->count; i++) {
+				if (n16->keys[i] == ch) {
+					return n16->children + i;
+				}
+			}
+		#endif
+
+			return NULL;
+		}
+
+		case _NODE48:
+			n48 = (struct _node48*)node;
+			i = n48->index[ch];
+			if (i != 0) {
+				return n48->children + i - 1;
+			}
+			return NULL;
+
+		case _NODE256:
+		default:
+			n256 = (struct _node256*)node;
+			if (n256->children[ch] != NULL) {
+				return n256->children + ch;
+			}
+			return NULL;
+	}
+}
+
+/**
+ * Make a copy of the node as a bigger type of node
+ */
+static struct _node* _grow(struct _node *node)
+{
+	guint i;
+	struct _node *bigger = _node_new(
+		node->type + 1, _prefix(node), node->prefix_len);
+	struct _node **from = _children(node);
+
+	bigger->ev = node->ev;
+	bigger->count = node->count;
+
+	switch (node->type) {
+		case _NODE4: {
+			struct _node4 *n4 = (struct _node4*)node;
+			struct _node16 *n16 = (struct _node16*)bigger;
+
+			memcpy(n16->keys, n4->keys, node->count);
+			memcpy(n16->children, from, sizeof(*from) * node->count);
+			break;
+		}
+
+		case _NODE16: {
+			struct _node16 *n16 = (struct _node16*)node;
+			struct _node48 *n48 = (struct _node48*)bigger;
+
+			for (i = 0; i < node->count; i++) {
+				n48->index[n16->keys[i]] = i + 1;
+				n48->children[i] = from[i];
+			}
+			break;
+		}
 
-static void _ptrie_free(void *ptrie_)
+		case _NODE48:
+		default: {
+			struct _node48 *n48 = (struct _node48*)node;
+			struct _node256 *n256 = (struct _node256*)bigger;
+
+			for (i = 0; i < G_N_ELEMENTS(n48->index); i++) {
+				if (n48->index[i] != 0) {
+					n256->children[i] = from[n48->index[i] - 1];
+				}
+			}
+			break;
+		}
+	}
+
+	return bigger;
+}
+
+/**
+ * Add a child to the node that lives at *ref. If the node is full, it is
+ * replaced with a bigger node.
+ */
+static void _add_child(
+	struct _node **ref,
+	const guchar ch,
+	struct _node *child)
 {
 	guint i;
-	struct _ptrie *ptrie = ptrie_;
+	struct _node *node = *ref;
+
+	if (node->count == _node_max[node->type]) {
+		struct _node *bigger = _grow(node);
+
+		_add_child(&bigger, ch, child);
+		g_atomic_pointer_set(ref, bigger);
+		_retire(node);
 
-	if (ptrie == NULL) {
 		return;
 	}
 
-	for (i = 0; i < G_N_ELEMENTS(ptrie->childs); i++) {
-		_ptrie_free(ptrie->childs[i]);
+	i = node->count;
+
+	/*
+	 * Lookups don't lock, so the child must be in place before anything
+	 * points to it.
+	 */
+	switch (node->type) {
+		case _NODE4:
+			((struct _node4*)node)->children[i] = child;
+			((struct _node4*)node)->keys[i] = ch;
+			break;
+
+		case _NODE16:
+			((struct _node16*)node)->children[i] = child;
+			((struct _node16*)node)->keys[i] = ch;
+			break;
+
+		case _NODE48:
+			((struct _node48*)node)->children[i] = child;
+			__sync_synchronize();
+			((struct _node48*)node)->index[ch] = i + 1;
+			break;
+
+		case _NODE256:
+			g_atomic_pointer_set(((struct _node256*)node)->children + ch, child);
+			break;
 	}
 
-	if (ptrie->ev.ev_path != NULL) {
-		event_clear(&ptrie->ev);
+	__sync_synchronize();
+	node->count++;
+}
+
+static struct event* _event_new(
+	const gchar *ev_path,
+	const evs_handler_fn handler_fn,
+	const evs_on_fn on_fn,
+	const evs_off_fn off_fn,
+	const gboolean handle_children,
+	const enum evs_handler_flags flags)
+{
+	struct event *ev = g_slice_alloc0(sizeof(*ev));
+	event_init(ev, ev_path, handler_fn, on_fn, off_fn, handle_children, flags);
+	return ev;
+}
+
+static void _tree_free(struct _node *node)
+{
+	guint i;
+	struct _node **children;
+
+	if (node == NULL) {
+		return;
 	}
 
-	memset(ptrie, 0, sizeof(*ptrie));
+	children = _children(node);
 
-	if (ptrie != &_events) {
-		g_slice_free1(sizeof(*ptrie), ptrie);
+	switch (node->type) {
+		case _NODE4:
+		case _NODE16:
+		case _NODE48:
+			for (i = 0; i < node->count; i++) {
+				_tree_free(children[i]);
+			}
+			break;
+
+		case _NODE256:
+			for (i = 0; i < 256; i++) {
+				_tree_free(children[i]);
+			}
+			break;
+	}
+
+	if (node->ev != NULL) {
+		_event_free(node->ev);
 	}
+
+	_node_free(node);
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	struct _retiree *r;
+
+	_tree_free(_root);
+	_root = NULL;
+
+	if (_fallback != NULL) {
+		_event_free(_fallback);
+		_fallback = NULL;
+	}
+
+	while ((r = g_queue_pop_head(&_retired)) != NULL) {
+		_retiree_free(r);
+	}
+}
+
+/**
+ * Replace the node at *ref with a copy that doesn't have the given child
+ */
+static void _remove_child(struct _node **ref, const guchar ch)
+{
+	guint i;
+	guint n;
+	guchar keys[256];
+	struct _node *children[256];
+	enum _node_type type = _NODE4;
+	struct _node *node = *ref;
+	struct _node *smaller;
+
+	while (_node_max[type] < (guint)(node->count - 1)) {
+		type++;
+	}
+
+	smaller = _node_new(type, _prefix(node), node->prefix_len);
+	smaller->ev = node->ev;
+
+	n = _entries(node, keys, children);
+	for (i = 0; i < n; i++) {
+		if (keys[i] != ch) {
+			_add_child(&smaller, keys[i], children[i]);
+		}
+	}
+
+	g_atomic_pointer_set(ref, smaller);
+	_retire(node);
+}
+
+/**
+ * The node at *ref has no event and a single child: fold the two together
+ * so that lookups don't have to walk through an empty node.
+ */
+static void _merge(struct _node **ref)
+{
+	guchar key;
+	gchar *prefix;
+	struct _node *child;
+	struct _node *merged;
+	struct _node *node = *ref;
+
+	_entries(node, &key, &child);
+
+	merged = _node_new(child->type, NULL,
+		node->prefix_len + 1 + child->prefix_len);
+	prefix = _prefix(merged);
+
+	memcpy(prefix, _prefix(node), node->prefix_len);
+	prefix[node->prefix_len] = key;
+	memcpy(prefix + node->prefix_len + 1, _prefix(child), child->prefix_len);
+	_copy_children(merged, child);
+
+	g_atomic_pointer_set(ref, merged);
+	_retire(node);
+	_retire(child);
+}
+
+/**
+ * Find the event in the tree and take it out, pruning anything that's left
+ * empty along the way.
+ */
+static gboolean _remove(
+	struct _node **ref,
+	const gchar *key,
+	const struct event *ev)
+{
+	struct _node **child;
+	struct _node *node = *ref;
+
+	if (strncmp(key, _prefix(node), node->prefix_len) != 0) {
+		return FALSE;
+	}
+
+	key += node->prefix_len;
+
+	if (*key == '\0') {
+		if (node->ev != ev) {
+			return FALSE;
+		}
+
+		g_atomic_pointer_set(&node->ev, NULL);
+	} else {
+		child = _find_child(node, *key);
+		if (child == NULL || !_remove(child, key + 1, ev)) {
+			return FALSE;
+		}
+
+		if ((*child)->ev == NULL && (*child)->count == 0) {
+			_retire(*child);
+			_remove_child(ref, *key);
+		}
+	}
+
+	node = *ref;
+	if (ref != &_root && node->ev == NULL && node->count == 1) {
+		_merge(ref);
+	}
+
+	return TRUE;
 }
 
 struct event* evs_query_insert(
@@ -60,100 +765,314 @@ struct event* evs_query_insert(
 	const evs_handler_fn handler_fn,
 	const evs_on_fn on_fn,
 	const evs_off_fn off_fn,
-	const gboolean handle_children)
+	const gboolean handle_children,
+	const enum evs_handler_flags flags)
 {
-	static GMutex _lock;
-
-	const gchar *curr = ev_path;
-	struct _ptrie *parent = &_events;
+	guint32 i;
+	struct _node *node;
+	struct _node *split;
+	struct _node *leaf;
+	struct _node **child;
+	struct _node **ref = &_root;
+	struct event *ev = NULL;
+	const gchar *key = ev_path;
 
-	if (*curr == '/') {
-		curr++;
+	if (*key == '/') {
+		key++;
 	}
 
-	if (*curr == '\0') {
+	if (*key == '\0') {
 		return NULL;
 	}
 
 	g_mutex_lock(&_lock);
 
-	while (*curr != '\0') {
-		guchar ch = *curr - '-';
-		struct _ptrie *child = parent->childs[ch];
+	while (TRUE) {
+		gchar *prefix;
+
+		node = *ref;
+		prefix = _prefix(node);
+
+		for (i = 0; i < node->prefix_len; i++) {
+			if (key[i] != prefix[i]) {
+				break;
+			}
+		}
+
+		/*
+		 * The path diverges somewhere in this node's prefix: split the node
+		 * at that point so that both can hang off the split.
+		 */
+		if (i < node->prefix_len) {
+			ev = _event_new(ev_path, handler_fn, on_fn, off_fn,
+				handle_children, flags);
 
+			split = _node_new(_NODE4, prefix, i);
+
+			/*
+			 * The rest of the node, everything after the character it now
+			 * hangs from in the split
+			 */
+			leaf = _node_new(node->type, prefix + i + 1, node->prefix_len - i - 1);
+			_copy_children(leaf, node);
+
+			_add_child(&split, prefix[i], leaf);
+
+			if (key[i] == '\0') {
+				split->ev = ev;
+			} else {
+				leaf = _node_new(_NODE4, key + i + 1, strlen(key + i + 1));
+				leaf->ev = ev;
+				_add_child(&split, key[i], leaf);
+			}
+
+			g_atomic_pointer_set(ref, split);
+			_retire(node);
+			break;
+		}
+
+		key += node->prefix_len;
+
+		if (*key == '\0') {
+			if (node->ev == NULL) {
+				ev = _event_new(ev_path, handler_fn, on_fn, off_fn,
+					handle_children, flags);
+				g_atomic_pointer_set(&node->ev, ev);
+			}
+			break;
+		}
+
+		child = _find_child(node, *key);
 		if (child == NULL) {
-			child = g_slice_alloc0(sizeof(*child));
-			child->ch = ch;
-			parent->childs[ch] = child;
+			ev = _event_new(ev_path, handler_fn, on_fn, off_fn,
+				handle_children, flags);
+
+			leaf = _node_new(_NODE4, key + 1, strlen(key + 1));
+			leaf->ev = ev;
+
+			_add_child(ref, *key, leaf);
+			break;
 		}
 
-		parent = child;
-		curr++;
+		ref = child;
+		key++;
 	}
 
 	g_mutex_unlock(&_lock);
 
-	if (parent->ev.ev_path != NULL) {
-		return NULL;
+	return ev;
+}
+
+struct event* evs_query_insert_fallback(
+	const evs_handler_fn handler_fn,
+	const evs_on_fn on_fn,
+	const evs_off_fn off_fn,
+	const enum evs_handler_flags flags)
+{
+	struct event *ev = NULL;
+
+	g_mutex_lock(&_lock);
+
+	if (_fallback == NULL) {
+		ev = _event_new("", handler_fn, on_fn, off_fn, TRUE, flags);
+		g_atomic_pointer_set(&_fallback, ev);
 	}
 
-	event_init(&parent->ev, ev_path, handler_fn, on_fn, off_fn, handle_children);
+	g_mutex_unlock(&_lock);
 
-	return &parent->ev;
+	return ev;
+}
+
+static struct event* _miss(const gchar *ev_path, gchar **ev_extra)
+{
+	struct event *ev = g_atomic_pointer_get(&_fallback);
+
+	if (ev != NULL) {
+		*ev_extra = (gchar*)ev_path;
+	}
+
+	return ev;
+}
+
+void evs_query_begin()
+{
+	struct _reader *reader = _reader_get();
+
+	if (reader->depth++ == 0) {
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+
+		/*
+		 * The scan has to see that this thread is reading before this
+		 * thread reads anything from the tree: the scan's membarrier
+		 * orders it, so long as the compiler doesn't move the reads up.
+		 */
+		if (G_UNLIKELY(_reader_fence)) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		} else {
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		}
+	}
+}
+
+void evs_query_end()
+{
+	struct _reader *reader = _self;
+
+	if (--reader->depth == 0) {
+		__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
+	}
 }
 
 struct event* evs_query(
 	const gchar *ev_path,
 	gchar **ev_extra)
 {
-	const gchar *curr = ev_path;
-	struct _ptrie *parent = &_events;
+	guint32 i;
+	struct _node **child;
+	struct _node *node = _root;
+	const gchar *key = ev_path;
 	const gchar *child_start = NULL;
-	struct _ptrie *child_handler = NULL;
+	struct event *child_handler = NULL;
+
+	ASSERT(_self != NULL && _self->depth > 0,
+		"evs_query() called outside of evs_query_begin(): %s", ev_path);
 
-	if (*curr == '/') {
-		curr++;
+	if (*key == '/') {
+		key++;
 	}
 
-	while (*curr != '\0') {
-		guchar ch = *curr - '-';
-		struct _ptrie *child = parent->childs[ch];
+	while (TRUE) {
+		const gchar *prefix = _prefix(node);
+
+		for (i = 0; i < node->prefix_len; i++) {
+			/*
+			 * The path ends somewhere inside of a node: it's a partial
+			 * path of other events, which doesn't make it a child of
+			 * anything.
+			 */
+			if (key[i] == '\0') {
+				return _miss(ev_path, ev_extra);
+			}
+
+			if (key[i] != prefix[i]) {
+				goto miss;
+			}
+		}
+
+		key += node->prefix_len;
+
+		if (*key == '\0') {
+			if (node->ev == NULL) {
+				return _miss(ev_path, ev_extra);
+			}
+
+			*ev_extra = (gchar*)key;
+			return node->ev;
+		}
 
-		if (parent->ev.handle_children) {
-			child_start = curr;
-			child_handler = parent;
+		if (node->ev != NULL && node->ev->handle_children) {
+			child_start = key;
+			child_handler = node->ev;
 		}
 
+		child = _find_child(node, *key);
 		if (child == NULL) {
-			parent = NULL;
-			break;
+			goto miss;
 		}
 
-		parent = child;
-		curr++;
+		node = *child;
+		key++;
 	}
 
-	if (parent == NULL) {
-		/*
-		 * Should only match if it's a child path, for example:
-		 *   0) /ev2 should not match on /ev because '2' would be its `child_start`.
-		 *   1) /ev/another would match because '/' is its `child_start`.
-		 */
-		if (child_handler != NULL && *child_start == '/') {
-			*ev_extra = (gchar*)child_start;
-			return &child_handler->ev;
+miss:
+	/*
+	 * Should only match if it's a child path, for example:
+	 *   0) /ev2 should not match on /ev because '2' would be its `child_start`.
+	 *   1) /ev/another would match because '/' is its `child_start`.
+	 */
+	if (child_handler != NULL && *child_start == '/') {
+		*ev_extra = (gchar*)child_start;
+		return child_handler;
+	}
+
+	return _miss(ev_path, ev_extra);
+}
+
+gboolean evs_query_remove(struct event *ev)
+{
+	gboolean removed;
+	const gchar *key = ev->ev_path;
+
+	if (*key == '/') {
+		key++;
+	}
+
+	g_mutex_lock(&_lock);
+	removed = _remove(&_root, key, ev);
+	g_mutex_unlock(&_lock);
+
+	return removed;
+}
+
+void evs_query_retire(struct event *ev)
+{
+	g_mutex_lock(&_lock);
+	_retire_full(NULL, ev);
+	g_mutex_unlock(&_lock);
+}
+
+guint evs_query_retired()
+{
+	guint retired;
+
+	g_mutex_lock(&_lock);
+	retired = g_queue_get_length(&_retired);
+	g_mutex_unlock(&_lock);
+
+	return retired;
+}
+
+void evs_query_reclaim()
+{
+	struct _retiree *r;
+
+	g_mutex_lock(&_lock);
+
+	if (_scanning && _scan_done()) {
+		while ((r = g_queue_peek_head(&_retired)) != NULL && r->gen < _gen) {
+			g_queue_pop_head(&_retired);
+			_retiree_free(r);
 		}
 
-		return NULL;
-	} else if (parent->ev.ev_path != NULL) {
-		*ev_extra = (gchar*)curr;
-		return &parent->ev;
-	} else {
-		return NULL;
+		_scanning = FALSE;
+	}
+
+	/*
+	 * Anything retired since the last scan started waits for the next
+	 */
+	if (!_scanning && !g_queue_is_empty(&_retired)) {
+		_scan_start();
 	}
+
+	g_mutex_unlock(&_lock);
 }
 
 void evs_query_init()
 {
-	qev_cleanup(&_events, _ptrie_free);
+	/*
+	 * Readers that started before this are still fencing, and they keep
+	 * doing so until they see the flag cleared, at which point every scan
+	 * is already using membarrier.
+	 */
+	if (syscall(__NR_membarrier,
+			MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+		_membarrier_cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+		__atomic_store_n(&_reader_fence, FALSE, __ATOMIC_RELEASE);
+	} else {
+		WARN("membarrier(2) unavailable, event lookups will fence: %s",
+			strerror(errno));
+	}
+
+	_root = _node_new(_NODE4, "", 0);
+	qev_cleanup(&_root, _free);
 }
@@ -2,6 +2,22 @@
  * For doing fast lookups of ev_path -> handler.
  * @file
  *
+ * Lookups take no locks and touch nothing but plain loads. Writers are
+ * serialized, and they never change a node that a lookup could be reading
+ * in a way that the lookup could notice: new nodes are fully built before
+ * they're published with a single pointer store, and nodes (and events)
+ * that are taken out of the tree are only freed once every thread that was
+ * reading when they were taken out has since stopped.
+ *
+ * Every thread that reads counts when it starts and stops, in a counter of
+ * its own that nothing else writes. evs_query_reclaim() snapshots every
+ * counter, and on a later call, frees what was retired before the snapshot
+ * once every thread that was reading then has moved on.
+ *
+ * Counting is just a plain store: readers never fence. Instead, the
+ * snapshot forces a barrier on every thread with membarrier(2), so a thread
+ * marking where it reads costs no more than the store.
+ *
  * @author Andrew Stone <andrew@clovar.com>
  * @copyright 2012-2014 Clear Channel Inc.
  *
@@ -25,6 +41,8 @@
  *     Called when a client unsubscribes from the event
  * @param handle_children
  *     If the event would like to handle all unhandled children events
+ * @param flags
+ *     Options for the event
  *
  * @return
  *     If the event was inserted. FALSE indicates that the event already exists.
@@ -34,10 +52,47 @@ struct event* evs_query_insert(
 	const evs_handler_fn handler_fn,
 	const evs_on_fn on_fn,
 	const evs_off_fn off_fn,
-	const gboolean handle_children);
+	const gboolean handle_children,
+	const enum evs_handler_flags flags);
+
+/**
+ * Create the event that handles every path no other event does. Its
+ * ev_path is empty, so ev_extra is always the full path that was queried.
+ *
+ * @param handler_fn
+ *     The function to be called when an event of this type comes in
+ * @param on_fn
+ *     Called when a client attempts to subscribe to the event
+ * @param off_fn
+ *     Called when a client unsubscribes from the event
+ * @param flags
+ *     Options for the event
+ *
+ * @return
+ *     The event, or NULL if there's already a fallback.
+ */
+struct event* evs_query_insert_fallback(
+	const evs_handler_fn handler_fn,
+	const evs_on_fn on_fn,
+	const evs_off_fn off_fn,
+	const enum evs_handler_flags flags);
+
+/**
+ * Start reading from the tree. Everything found until the matching
+ * evs_query_end() stays valid until then. May be nested, so it's cheapest
+ * to bracket a whole batch of lookups rather than each one.
+ */
+void evs_query_begin();
 
 /**
- * Finds an event by its path
+ * Done reading from the tree
+ */
+void evs_query_end();
+
+/**
+ * Finds an event by its path. Must be called between evs_query_begin() and
+ * evs_query_end() (it asserts that it is), and the event may only be used
+ * until the end.
  *
  * @param ev_path
  *     The event path to find
@@ -52,6 +107,39 @@ struct event* evs_query(
 	gchar **ev_extra);
 
 /**
- * Intializes the ptrie for usage
+ * Takes an event out of the tree. Lookups already in progress may still
+ * find it; the event itself is only freed through evs_query_retire().
+ *
+ * @param ev
+ *     The event to remove
+ *
+ * @return
+ *     If the event was in the tree.
+ */
+gboolean evs_query_remove(struct event *ev);
+
+/**
+ * Free an event once no lookup can still be using it.
+ *
+ * @param ev
+ *     The event to free. Nothing may reference it anymore.
+ */
+void evs_query_retire(struct event *ev);
+
+/**
+ * How many nodes and events were taken out of the tree and are waiting to
+ * be freed
+ */
+guint evs_query_retired();
+
+/**
+ * Free everything that was removed from the tree that no thread could still
+ * be reading. Called periodically: something retired is freed within two
+ * calls of the last reader that could have seen it moving on.
+ */
+void evs_query_reclaim();
+
+/**
+ * Intializes the event tree for usage
  */
 void evs_query_init();
@@ -0,0 +1,294 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+
+/**
+ * Slots in each ring. Must be a power of 2.
+ */
+#define RING_SIZE 1024
+
+/**
+ * Enough to keep the producer and consumer sides off of each other's cache
+ * lines
+ */
+#define CACHE_LINE 64
+
+/**
+ * A single thread's queue
+ */
+struct _ring {
+	/**
+	 * The next slot to be read. Only ever written by the consumer.
+	 */
+	guint64 head;
+
+	gchar _pad_head[CACHE_LINE - sizeof(guint64)];
+
+	/**
+	 * The next slot to be written. Only ever written by the producer.
+	 */
+	guint64 tail;
+
+	gchar _pad_tail[CACHE_LINE - sizeof(guint64)];
+
+	void *slots[RING_SIZE];
+
+	/**
+	 * Set by the producer when it spills into overflow, and only cleared
+	 * by the consumer once overflow is empty again. While it's set, the
+	 * producer doesn't touch the ring, so nothing can jump ahead of what's
+	 * waiting in overflow.
+	 */
+	gboolean overflowing;
+
+	/**
+	 * Guards overflow and overflowing
+	 */
+	GMutex overflow_lock;
+
+	/**
+	 * Where items go when the ring is full
+	 */
+	GQueue overflow;
+
+	/**
+	 * If the thread that owned this ring has exited. The next new thread
+	 * takes it over.
+	 */
+	gboolean orphaned;
+
+	/**
+	 * The next ring in the list. Never changes once the ring is published.
+	 */
+	struct _ring *next;
+};
+
+static void _orphan(void *ring_);
+
+/**
+ * Every ring ever created. Rings are never freed: they're reused by new
+ * threads instead, so there are never more than the most threads that
+ * have ever broadcast at once.
+ */
+static struct _ring *_rings = NULL;
+
+/**
+ * The calling thread's ring
+ */
+static GPrivate _ring = G_PRIVATE_INIT(_orphan);
+
+/**
+ * Only one consumer at a time
+ */
+static GMutex _drain_lock;
+
+static qev_free_fn _free_fn = NULL;
+
+static void _orphan(void *ring_)
+{
+	struct _ring *ring = ring_;
+	g_atomic_int_set(&ring->orphaned, TRUE);
+}
+
+static struct _ring* _ring_get()
+{
+	struct _ring *ring = g_private_get(&_ring);
+
+	if (G_LIKELY(ring != NULL)) {
+		return ring;
+	}
+
+	ring = g_atomic_pointer_get(&_rings);
+	for (; ring != NULL; ring = ring->next) {
+		if (g_atomic_int_compare_and_exchange(&ring->orphaned, TRUE, FALSE)) {
+			goto out;
+		}
+	}
+
+	ring = g_slice_alloc0(sizeof(*ring));
+	g_mutex_init(&ring->overflow_lock);
+	g_queue_init(&ring->overflow);
+
+	do {
+		ring->next = g_atomic_pointer_get(&_rings);
+	} while (!g_atomic_pointer_compare_and_exchange(&_rings, ring->next, ring));
+
+out:
+	g_private_set(&_ring, ring);
+	return ring;
+}
+
+void evs_queue_push(void *item)
+{
+	struct _ring *ring = _ring_get();
+	guint64 tail = ring->tail;
+
+	if (!g_atomic_int_get(&ring->overflowing) &&
+			tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < RING_SIZE) {
+		ring->slots[tail & (RING_SIZE - 1)] = item;
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	g_mutex_lock(&ring->overflow_lock);
+
+	g_atomic_int_set(&ring->overflowing, TRUE);
+	g_queue_push_tail(&ring->overflow, item);
+
+	g_mutex_unlock(&ring->overflow_lock);
+}
+
+static guint64 _drain_overflow(
+	struct _ring *ring,
+	evs_queue_fn fn,
+	void *data,
+	const guint64 max)
+{
+	void *item;
+	guint64 taken = 0;
+	GQueue items = G_QUEUE_INIT;
+
+	g_mutex_lock(&ring->overflow_lock);
+
+	while (taken < max && (item = g_queue_pop_head(&ring->overflow)) != NULL) {
+		g_queue_push_tail(&items, item);
+		taken++;
+	}
+
+	if (g_queue_is_empty(&ring->overflow)) {
+		g_atomic_int_set(&ring->overflowing, FALSE);
+	}
+
+	g_mutex_unlock(&ring->overflow_lock);
+
+	while ((item = g_queue_pop_head(&items)) != NULL) {
+		fn(item, data);
+	}
+
+	return taken;
+}
+
+/**
+ * Take what's in the ring, up to the tail as it is right now
+ */
+static guint64 _drain_ring(
+	struct _ring *ring,
+	evs_queue_fn fn,
+	void *data,
+	const guint64 batch)
+{
+	void *item;
+	guint64 taken = 0;
+	guint64 head = ring->head;
+	const guint64 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && taken < batch) {
+		item = ring->slots[head & (RING_SIZE - 1)];
+		head++;
+		taken++;
+
+		/*
+		 * Give the slot back before doing any work with the item so that
+		 * the producer has as much room as possible
+		 */
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+		fn(item, data);
+	}
+
+	return taken;
+}
+
+static guint64 _drain(
+	struct _ring *ring,
+	evs_queue_fn fn,
+	void *data,
+	const guint64 batch)
+{
+	guint64 taken = _drain_ring(ring, fn, data, batch);
+
+	if (taken == batch || !g_atomic_int_get(&ring->overflowing)) {
+		return taken;
+	}
+
+	/*
+	 * Overflow is only ever newer than what's in the ring, so it has to
+	 * wait until the ring is empty. The producer may have filled the ring
+	 * again before it spilled over, so the tail has to be looked at again:
+	 * now that it's overflowing, the producer won't touch the ring until
+	 * overflow is empty.
+	 */
+	taken += _drain_ring(ring, fn, data, batch - taken);
+
+	if (taken < batch &&
+			ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+		taken += _drain_overflow(ring, fn, data, batch - taken);
+	}
+
+	return taken;
+}
+
+guint64 evs_queue_drain(evs_queue_fn fn, void *data, const guint64 batch)
+{
+	struct _ring *ring;
+	guint64 taken = 0;
+
+	g_mutex_lock(&_drain_lock);
+
+	ring = g_atomic_pointer_get(&_rings);
+	for (; ring != NULL; ring = ring->next) {
+		taken += _drain(ring, fn, data, batch);
+	}
+
+	g_mutex_unlock(&_drain_lock);
+
+	return taken;
+}
+
+guint64 evs_queue_depth()
+{
+	guint64 head;
+	struct _ring *ring;
+	guint64 depth = 0;
+
+	ring = g_atomic_pointer_get(&_rings);
+	for (; ring != NULL; ring = ring->next) {
+		/*
+		 * Head first: the tail can only be further along by the time
+		 * it's read, so this never goes negative
+		 */
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		depth += __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head;
+
+		g_mutex_lock(&ring->overflow_lock);
+		depth += ring->overflow.length;
+		g_mutex_unlock(&ring->overflow_lock);
+	}
+
+	return depth;
+}
+
+static void _free_item(void *item, void *nothing G_GNUC_UNUSED)
+{
+	_free_fn(item);
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	/*
+	 * Threads hang on to their rings, so only what's in them can go
+	 */
+	while (evs_queue_drain(_free_item, NULL, G_MAXUINT64) > 0);
+}
+
+void evs_queue_init(const qev_free_fn free_fn)
+{
+	_free_fn = free_fn;
+	qev_cleanup(&_free_fn, _free);
+}
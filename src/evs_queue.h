@@ -0,0 +1,65 @@
+/**
+ * The queue of broadcasts waiting to be sent out.
+ * @file
+ *
+ * Every thread that broadcasts gets its own ring that only it pushes to,
+ * so producers never contend with each other or take a lock. The tick is
+ * the only consumer, and it takes a bounded batch from each ring so that
+ * one busy producer can't hold everyone else up.
+ *
+ * If a ring fills up, its thread spills into a locked overflow list until
+ * the consumer catches up, so nothing is ever dropped and each thread's
+ * broadcasts still go out in the order they were made.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Called for every item taken from the queue
+ */
+typedef void (*evs_queue_fn)(void *item, void *data);
+
+/**
+ * Add an item to the calling thread's ring
+ *
+ * @param item
+ *     What to queue. Ownership passes to the queue.
+ */
+void evs_queue_push(void *item);
+
+/**
+ * Take items from every thread's ring. Only one thread drains at a time;
+ * anyone else waits their turn.
+ *
+ * @param fn
+ *     Called for every item taken. Ownership of the item passes to fn.
+ * @param data
+ *     Passed directly to fn
+ * @param batch
+ *     The most items to take from any one thread
+ *
+ * @return
+ *     The number of items taken
+ */
+guint64 evs_queue_drain(evs_queue_fn fn, void *data, const guint64 batch);
+
+/**
+ * The number of items waiting across all threads. This is only a snapshot:
+ * producers don't stop while it's counted.
+ */
+guint64 evs_queue_depth();
+
+/**
+ * Get the queue ready for use
+ *
+ * @param free_fn
+ *     Frees anything still queued at exit
+ */
+void evs_queue_init(const qev_free_fn free_fn);
@@ -0,0 +1,440 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+
+struct _task {
+	/**
+	 * Where the task sits in a deque. link.data points back to the task.
+	 */
+	GList link;
+
+	fanout_fn fn;
+	void *data;
+	struct fanout_group *grp;
+};
+
+struct _worker {
+	guint id;
+	GThread *thread;
+
+	/**
+	 * Protects the deque: the owner works from the tail, thieves take
+	 * from the head.
+	 */
+	GMutex lock;
+	GQueue tasks;
+
+	/**
+	 * Tasks that only this worker may run, and how many there are. Also
+	 * protected by lock.
+	 */
+	GQueue pinned;
+	gint npinned;
+
+	/**
+	 * Wakes just this worker. Both are protected by _lock; asleep is
+	 * cleared by whoever wakes the worker, so that the next push wakes
+	 * someone else.
+	 */
+	GCond cond;
+	gboolean asleep;
+};
+
+static struct _worker _workers[FANOUT_MAX_WORKERS];
+
+/**
+ * Number of worker threads that have been started. Only ever grows.
+ */
+static guint _started = 0;
+
+/**
+ * Number of workers that should be running tasks. Those past this just
+ * sleep until they're needed again.
+ */
+static guint _active = 0;
+
+/**
+ * Number of tasks sitting in all of the deques
+ */
+static gint _queued = 0;
+
+/**
+ * Number of threads, workers and waiters alike, sleeping
+ */
+static gint _sleeping = 0;
+
+/**
+ * For spreading tasks pushed from outside of the pool
+ */
+static guint _next = 0;
+
+static gboolean _stop = FALSE;
+
+/**
+ * Only used for sleeping and waking. Workers sleep on their own conds,
+ * everyone waiting on a group sleeps on _waiting.
+ */
+static GMutex _lock;
+static GCond _waiting;
+
+static __thread struct _worker *_self = NULL;
+
+/**
+ * Wake every worker. Must be called with _lock held.
+ */
+static void _wake_workers()
+{
+	guint i;
+
+	for (i = 0; i < _started; i++) {
+		_workers[i].asleep = FALSE;
+		g_cond_signal(&_workers[i].cond);
+	}
+}
+
+/**
+ * Wake a single thread for a task that was just pushed: the worker it was
+ * given to, if that one's asleep; otherwise, for tasks that may be stolen,
+ * any sleeping worker, and failing that, anyone waiting on a group.
+ */
+static void _wake(struct _worker *w, const gboolean pinned)
+{
+	guint i;
+	guint active;
+
+	if (g_atomic_int_get(&_sleeping) == 0) {
+		return;
+	}
+
+	g_mutex_lock(&_lock);
+
+	if (w->asleep) {
+		w->asleep = FALSE;
+		g_cond_signal(&w->cond);
+	} else if (!pinned) {
+		active = g_atomic_int_get(&_active);
+		for (i = 0; i < active && !_workers[i].asleep; i++);
+
+		if (i < active) {
+			_workers[i].asleep = FALSE;
+			g_cond_signal(&_workers[i].cond);
+		} else {
+			g_cond_signal(&_waiting);
+		}
+	}
+
+	g_mutex_unlock(&_lock);
+}
+
+/**
+ * Go to sleep until there's something to do.
+ *
+ * @param self
+ *     The worker going to sleep, or NULL if not a worker
+ * @param grp
+ *     The group being waited on, or NULL if not waiting
+ */
+static void _sleep(struct _worker *self, struct fanout_group *grp)
+{
+	gboolean wake;
+
+	g_mutex_lock(&_lock);
+
+	/*
+	 * Anything that changes these conditions does so before checking for
+	 * sleepers, and it takes the lock to wake them, so either the change is
+	 * seen here, or the wakeup comes after the wait begins.
+	 */
+	g_atomic_int_inc(&_sleeping);
+
+	if (grp != NULL) {
+		wake = g_atomic_int_get(&grp->pending) == 0 ||
+			g_atomic_int_get(&_queued) > 0;
+	} else {
+		wake = g_atomic_int_get(&_stop) ||
+			g_atomic_int_get(&self->npinned) > 0 ||
+			(g_atomic_int_get(&_queued) > 0 &&
+				self->id < (guint)g_atomic_int_get(&_active));
+	}
+
+	if (!wake && grp != NULL) {
+		g_cond_wait(&_waiting, &_lock);
+	} else if (!wake) {
+		self->asleep = TRUE;
+		g_cond_wait(&self->cond, &_lock);
+		self->asleep = FALSE;
+	}
+
+	g_atomic_int_add(&_sleeping, -1);
+
+	g_mutex_unlock(&_lock);
+}
+
+static struct _task* _pop(struct _worker *w, const gboolean newest)
+{
+	GList *link;
+
+	g_mutex_lock(&w->lock);
+
+	if (newest) {
+		link = g_queue_pop_tail_link(&w->tasks);
+	} else {
+		link = g_queue_pop_head_link(&w->tasks);
+	}
+
+	if (link != NULL) {
+		g_atomic_int_add(&_queued, -1);
+	}
+
+	g_mutex_unlock(&w->lock);
+
+	return link == NULL ? NULL : link->data;
+}
+
+static struct _task* _pop_pinned(struct _worker *w)
+{
+	GList *link = NULL;
+
+	if (g_atomic_int_get(&w->npinned) == 0) {
+		return NULL;
+	}
+
+	g_mutex_lock(&w->lock);
+
+	link = g_queue_pop_head_link(&w->pinned);
+	if (link != NULL) {
+		g_atomic_int_add(&w->npinned, -1);
+	}
+
+	g_mutex_unlock(&w->lock);
+
+	return link == NULL ? NULL : link->data;
+}
+
+/**
+ * Find something to do: first from the worker's own deque, then from
+ * everyone else's, starting with its neighbour.
+ */
+static struct _task* _take(struct _worker *self)
+{
+	guint i;
+	guint n;
+	guint start = 0;
+	struct _task *task = NULL;
+
+	if (g_atomic_int_get(&_queued) <= 0) {
+		return NULL;
+	}
+
+	if (self != NULL) {
+		task = _pop(self, TRUE);
+		start = self->id + 1;
+	}
+
+	n = MAX(g_atomic_int_get(&_started), 1);
+	for (i = 0; task == NULL && i < n; i++) {
+		task = _pop(_workers + ((start + i) % n), FALSE);
+	}
+
+	return task;
+}
+
+static void _run(struct _task *task)
+{
+	struct fanout_group *grp = task->grp;
+
+	task->fn(task->data);
+	g_slice_free1(sizeof(*task), task);
+
+	/*
+	 * Once pending hits 0, the waiter is free to return and throw the group
+	 * away, so it can't be touched after this.
+	 */
+	if (grp == NULL) {
+		return;
+	}
+
+	if (g_atomic_int_dec_and_test(&grp->pending) &&
+			g_atomic_int_get(&_sleeping) > 0) {
+		g_mutex_lock(&_lock);
+		g_cond_broadcast(&_waiting);
+		g_mutex_unlock(&_lock);
+	}
+}
+
+static void* _worker_run(void *self_)
+{
+	struct _task *task;
+	struct _worker *self = self_;
+
+	_self = self;
+	qev_pool_register_thread();
+
+	while (!g_atomic_int_get(&_stop)) {
+		/*
+		 * Pinned tasks are run even by workers that are no longer active:
+		 * they were pinned before the pool shrank, and no one else can
+		 * run them.
+		 */
+		task = _pop_pinned(self);
+		if (task != NULL) {
+			_run(task);
+			continue;
+		}
+
+		if (self->id < (guint)g_atomic_int_get(&_active)) {
+			task = _take(self);
+			if (task != NULL) {
+				_run(task);
+				continue;
+			}
+		}
+
+		_sleep(self, NULL);
+	}
+
+	return NULL;
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	guint i;
+
+	g_mutex_lock(&_lock);
+	g_atomic_int_set(&_stop, TRUE);
+	_wake_workers();
+	g_cond_broadcast(&_waiting);
+	g_mutex_unlock(&_lock);
+
+	for (i = 0; i < _started; i++) {
+		g_thread_join(_workers[i].thread);
+		_workers[i].thread = NULL;
+	}
+
+	_started = 0;
+	_active = 0;
+	_stop = FALSE;
+}
+
+static struct _task* _task_new(
+	struct fanout_group *grp,
+	fanout_fn fn,
+	void *data)
+{
+	struct _task *task = g_slice_alloc0(sizeof(*task));
+
+	task->link.data = task;
+	task->fn = fn;
+	task->data = data;
+	task->grp = grp;
+
+	if (grp != NULL) {
+		g_atomic_int_inc(&grp->pending);
+	}
+
+	return task;
+}
+
+void fanout_push(struct fanout_group *grp, fanout_fn fn, void *data)
+{
+	guint active;
+	struct _worker *w = _self;
+	struct _task *task = _task_new(grp, fn, data);
+
+	/*
+	 * Workers keep what they make for themselves (it's likely to be hot in
+	 * cache); everything else is dealt out to the workers in turn.
+	 */
+	if (w == NULL) {
+		active = g_atomic_int_get(&_active);
+		if (active == 0) {
+			w = _workers;
+		} else {
+			w = _workers + ((guint)g_atomic_int_add(&_next, 1) % active);
+		}
+	}
+
+	g_mutex_lock(&w->lock);
+	g_atomic_int_inc(&_queued);
+	g_queue_push_tail_link(&w->tasks, &task->link);
+	g_mutex_unlock(&w->lock);
+
+	_wake(w, FALSE);
+}
+
+void fanout_push_to(
+	struct fanout_group *grp,
+	const guint owner,
+	fanout_fn fn,
+	void *data)
+{
+	struct _task *task;
+	struct _worker *w;
+	guint active = g_atomic_int_get(&_active);
+
+	if (active == 0) {
+		fanout_push(grp, fn, data);
+		return;
+	}
+
+	w = _workers + (owner % active);
+	task = _task_new(grp, fn, data);
+
+	g_mutex_lock(&w->lock);
+	g_atomic_int_inc(&w->npinned);
+	g_queue_push_tail_link(&w->pinned, &task->link);
+	g_mutex_unlock(&w->lock);
+
+	_wake(w, TRUE);
+}
+
+void fanout_wait(struct fanout_group *grp)
+{
+	struct _task *task;
+
+	while (g_atomic_int_get(&grp->pending) > 0) {
+		task = _take(_self);
+		if (task != NULL) {
+			_run(task);
+		} else {
+			_sleep(_self, grp);
+		}
+	}
+}
+
+guint fanout_workers()
+{
+	return g_atomic_int_get(&_active);
+}
+
+void fanout_set_workers(const guint workers)
+{
+	guint i;
+	guint n = MIN(workers, FANOUT_MAX_WORKERS);
+
+	g_mutex_lock(&_lock);
+
+	for (i = _started; i < n; i++) {
+		_workers[i].id = i;
+		_workers[i].thread = g_thread_new(
+			"qio-fanout", _worker_run, _workers + i);
+	}
+
+	g_atomic_int_set(&_started, MAX(_started, n));
+	g_atomic_int_set(&_active, n);
+	_wake_workers();
+
+	g_mutex_unlock(&_lock);
+}
+
+void fanout_init()
+{
+	fanout_set_workers(cfg_broadcast_threads);
+	qev_cleanup(_workers, _free);
+}
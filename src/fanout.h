@@ -0,0 +1,98 @@
+/**
+ * A work-stealing pool for sending broadcasts to large subscriptions.
+ * @file
+ *
+ * Every worker has its own deque of tasks: it takes its newest work from
+ * the back, and when it runs dry, it steals the oldest work from the front
+ * of everyone else's. Work pushed from outside of the pool is spread across
+ * the workers, and anyone waiting on a group of tasks helps run them rather
+ * than sitting idle, so a single huge broadcast and many small ones can keep
+ * every core busy at once. Each push wakes at most one sleeping thread.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * The most workers the pool may ever have
+ */
+#define FANOUT_MAX_WORKERS 256
+
+/**
+ * A unit of work
+ */
+typedef void (*fanout_fn)(void *data);
+
+/**
+ * Tasks that are waited on together. A zeroed-out group is ready for use.
+ */
+struct fanout_group {
+	/**
+	 * Number of tasks in the group that haven't finished
+	 */
+	guint pending;
+};
+
+/**
+ * Run a task on the pool.
+ *
+ * @param grp
+ *     The group the task belongs to. Must remain valid until
+ *     fanout_wait() returns. NULL for tasks that no one waits on.
+ * @param fn
+ *     What to run
+ * @param data
+ *     Passed directly to fn
+ */
+void fanout_push(struct fanout_group *grp, fanout_fn fn, void *data);
+
+/**
+ * Run a task on the pool, always on the same worker for the same owner,
+ * and in the order pushed. Pinned tasks are never stolen. Resizing the pool
+ * moves owners to other workers, so there are no guarantees for tasks
+ * pushed on either side of a resize.
+ *
+ * @param grp
+ *     The group the task belongs to. Must remain valid until
+ *     fanout_wait() returns. NULL for tasks that no one waits on.
+ * @param owner
+ *     Picks the worker. With no workers, the task is run like any other.
+ * @param fn
+ *     What to run
+ * @param data
+ *     Passed directly to fn
+ */
+void fanout_push_to(
+	struct fanout_group *grp,
+	const guint owner,
+	fanout_fn fn,
+	void *data);
+
+/**
+ * Wait for every task in the group to finish, running any tasks in the
+ * pool while waiting.
+ */
+void fanout_wait(struct fanout_group *grp);
+
+/**
+ * The number of workers running tasks. With none, nothing pushed is run
+ * until it's waited on.
+ */
+guint fanout_workers();
+
+/**
+ * Change the number of workers in the pool. With 0 workers, tasks are only
+ * run by those waiting on them.
+ */
+void fanout_set_workers(const guint workers);
+
+/**
+ * Start up the pool with `cfg_broadcast_threads` workers.
+ */
+void fanout_init();
@@ -0,0 +1,587 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/**
+ * Every segment starts with this
+ */
+#define SEGMENT_MAGIC "QIOJRNL1"
+
+/**
+ * Segments are named by their id, in hex, with this at the end
+ */
+#define SEGMENT_SUFFIX ".journal"
+
+/**
+ * Records are aligned to this many bytes
+ */
+#define RECORD_ALIGN 8
+
+struct _segment_header {
+	gchar magic[8];
+
+	/**
+	 * When the segment was created, in seconds since the epoch
+	 */
+	gint64 created;
+};
+
+/**
+ * A single broadcast. Followed by the path and the JSON, each with a
+ * trailing NULL, then padding up to RECORD_ALIGN. A record with no path marks
+ * the end of the segment.
+ */
+struct _record {
+	/**
+	 * Checksum of everything in the record after this field
+	 */
+	guint32 crc;
+	guint32 path_len;
+	guint32 json_len;
+	guint32 reserved;
+
+	/**
+	 * When the broadcast went out, in seconds since the epoch
+	 */
+	gint64 time;
+};
+
+/**
+ * A segment that was filled and is just waiting to expire
+ */
+struct _segment {
+	guint64 id;
+	gint64 created;
+};
+
+/**
+ * The newest value found for a subscription
+ */
+struct _restored {
+	gint64 time;
+	gchar *json;
+};
+
+static qev_stats_counter_t *_stat_appended;
+static qev_stats_counter_t *_stat_restored;
+
+/**
+ * The segment being written to. Only touched by the broadcast tick.
+ */
+static gchar *_map = NULL;
+static gsize _off = 0;
+static guint64 _id = 0;
+static gint64 _created = 0;
+
+/**
+ * Filled segments, oldest first. Only touched by the broadcast tick.
+ */
+static GQueue _segments = G_QUEUE_INIT;
+
+/**
+ * Values waiting for their subscriptions to be created again
+ *
+ * Mapping: ev_path + ev_extra -> struct _restored
+ */
+static GMutex _restore_lock;
+static GHashTable *_restore = NULL;
+
+/**
+ * Number of values in _restore, so that the lock can be skipped once
+ * they've all been taken
+ */
+static guint _restoring = 0;
+
+/**
+ * When old segments were last looked for, in seconds since the epoch. Only
+ * touched by the broadcast tick.
+ */
+static gint64 _expired_at = 0;
+
+static gint64 _now()
+{
+	return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static gchar* _segment_path(const guint64 id)
+{
+	return g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x" SEGMENT_SUFFIX,
+							cfg_journal_dir, id);
+}
+
+static gsize _record_size(const gsize path_len, const gsize json_len)
+{
+	gsize size = sizeof(struct _record) + path_len + 1 + json_len + 1;
+	return (size + RECORD_ALIGN - 1) & ~(gsize)(RECORD_ALIGN - 1);
+}
+
+static guint32 _record_crc(const struct _record *rec)
+{
+	uLong crc = crc32(0, (const Bytef*)&rec->path_len,
+						sizeof(*rec) - sizeof(rec->crc));
+
+	return crc32(crc, (const Bytef*)(rec + 1),
+					rec->path_len + 1 + rec->json_len + 1);
+}
+
+static void _restored_free(void *r_)
+{
+	struct _restored *r = r_;
+
+	g_free(r->json);
+	g_slice_free1(sizeof(*r), r);
+}
+
+/**
+ * Keep the value if it's the newest one seen for the subscription
+ */
+static void _remember(const gchar *path, const gchar *json, const gint64 time)
+{
+	struct _restored *r;
+
+	g_mutex_lock(&_restore_lock);
+
+	r = g_hash_table_lookup(_restore, path);
+	if (r == NULL) {
+		r = g_slice_alloc0(sizeof(*r));
+		g_hash_table_insert(_restore, g_strdup(path), r);
+		g_atomic_int_set(&_restoring, g_hash_table_size(_restore));
+	}
+
+	if (r->json == NULL || time >= r->time) {
+		g_free(r->json);
+		r->json = g_strdup(json);
+		r->time = time;
+	}
+
+	g_mutex_unlock(&_restore_lock);
+}
+
+static gboolean _restore_expired(
+	void *path G_GNUC_UNUSED,
+	void *r_,
+	void *before_)
+{
+	struct _restored *r = r_;
+	gint64 *before = before_;
+
+	return r->time < *before;
+}
+
+/**
+ * Read every valid record in a segment.
+ *
+ * @param id
+ *     The segment to read
+ * @param since
+ *     Records older than this are skipped
+ * @param created
+ *     Where to put when the segment was created
+ *
+ * @return
+ *     The number of records read
+ */
+static guint64 _replay_segment(
+	const guint64 id,
+	const gint64 since,
+	gint64 *created)
+{
+	gint fd;
+	gsize off;
+	struct stat st;
+	guint64 records = 0;
+	gchar *map = MAP_FAILED;
+	gchar *path = _segment_path(id);
+	const struct _segment_header *header;
+
+	*created = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) != 0 ||
+			(gsize)st.st_size < sizeof(*header)) {
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		goto out;
+	}
+
+	header = (const struct _segment_header*)map;
+	if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0) {
+		WARN("Journal segment %s is corrupt, skipping", path);
+		goto out;
+	}
+
+	*created = header->created;
+	off = sizeof(*header);
+
+	while (off + sizeof(struct _record) <= (gsize)st.st_size) {
+		gsize size;
+		const gchar *data;
+		const struct _record *rec = (const struct _record*)(map + off);
+
+		if (rec->path_len == 0) {
+			break;
+		}
+
+		size = _record_size(rec->path_len, rec->json_len);
+		if (size > (gsize)st.st_size - off || rec->crc != _record_crc(rec)) {
+			WARN("Journal segment %s is corrupt after %" G_GUINT64_FORMAT
+				" records, skipping the rest", path, records);
+			break;
+		}
+
+		data = (const gchar*)(rec + 1);
+		if (rec->time >= since) {
+			_remember(data, data + rec->path_len + 1, rec->time);
+		}
+
+		off += size;
+		records++;
+	}
+
+out:
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+
+	g_free(path);
+
+	return records;
+}
+
+static gint _id_cmp(const void *a_, const void *b_)
+{
+	const guint64 *a = a_;
+	const guint64 *b = b_;
+
+	return *a < *b ? -1 : (*a > *b ? 1 : 0);
+}
+
+/**
+ * Get the id of every segment on disk, oldest first
+ */
+static GArray* _segment_ids()
+{
+	GDir *dir;
+	const gchar *name;
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+	dir = g_dir_open(cfg_journal_dir, 0, NULL);
+	if (dir == NULL) {
+		return ids;
+	}
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		gchar *end;
+		guint64 id = g_ascii_strtoull(name, &end, 16);
+
+		if (end != name && g_strcmp0(end, SEGMENT_SUFFIX) == 0) {
+			g_array_append_val(ids, id);
+		}
+	}
+
+	g_dir_close(dir);
+
+	g_array_sort(ids, _id_cmp);
+
+	return ids;
+}
+
+/**
+ * Read back every segment on disk.
+ *
+ * @param track
+ *     If the segments should be remembered for expiring
+ */
+static guint64 _replay(const gboolean track)
+{
+	guint i;
+	GArray *ids;
+	guint64 records = 0;
+	const gint64 since = _now() - cfg_journal_retention;
+
+	if (_restore == NULL) {
+		return 0;
+	}
+
+	ids = _segment_ids();
+
+	for (i = 0; i < ids->len; i++) {
+		struct _segment seg = {
+			.id = g_array_index(ids, guint64, i),
+		};
+
+		records += _replay_segment(seg.id, since, &seg.created);
+
+		if (track) {
+			g_queue_push_tail(&_segments, g_slice_copy(sizeof(seg), &seg));
+			_id = MAX(_id, seg.id);
+		}
+	}
+
+	g_array_free(ids, TRUE);
+
+	return records;
+}
+
+/**
+ * Remove every segment whose records are all older than the retention,
+ * along with any values that were never claimed.
+ */
+static void _expire()
+{
+	gint64 before = _now() - cfg_journal_retention;
+
+	while (!g_queue_is_empty(&_segments)) {
+		gchar *path;
+		struct _segment *seg = g_queue_peek_head(&_segments);
+		struct _segment *next = g_queue_peek_nth(&_segments, 1);
+
+		/*
+		 * Nothing in a segment is newer than the one created after it
+		 */
+		if ((next == NULL ? _created : next->created) >= before) {
+			break;
+		}
+
+		path = _segment_path(seg->id);
+		if (unlink(path) != 0 && errno != ENOENT) {
+			WARN("Could not remove expired journal segment %s: %s",
+				path, g_strerror(errno));
+		}
+
+		g_free(path);
+		g_slice_free1(sizeof(*seg), g_queue_pop_head(&_segments));
+	}
+
+	if (g_atomic_int_get(&_restoring) > 0) {
+		g_mutex_lock(&_restore_lock);
+		g_hash_table_foreach_remove(_restore, _restore_expired, &before);
+		g_atomic_int_set(&_restoring, g_hash_table_size(_restore));
+		g_mutex_unlock(&_restore_lock);
+	}
+}
+
+static gboolean _segment_open(const guint64 id)
+{
+	gint fd;
+	gchar *path = _segment_path(id);
+	gboolean ok = FALSE;
+	struct _segment_header *header;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		goto out;
+	}
+
+	if (ftruncate(fd, cfg_journal_segment_size) != 0) {
+		goto out;
+	}
+
+	_map = mmap(NULL, cfg_journal_segment_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (_map == MAP_FAILED) {
+		_map = NULL;
+		goto out;
+	}
+
+	_id = id;
+	_created = _now();
+
+	header = (struct _segment_header*)_map;
+	memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+	header->created = _created;
+
+	_off = sizeof(*header);
+	ok = TRUE;
+
+out:
+	if (!ok) {
+		WARN("Could not open journal segment %s, journaling disabled: %s",
+			path, g_strerror(errno));
+	}
+
+	if (fd != -1) {
+		close(fd);
+	}
+
+	g_free(path);
+
+	return ok;
+}
+
+static void _segment_close()
+{
+	struct _segment seg = {
+		.id = _id,
+		.created = _created,
+	};
+
+	munmap(_map, cfg_journal_segment_size);
+	_map = NULL;
+
+	g_queue_push_tail(&_segments, g_slice_copy(sizeof(seg), &seg));
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	if (_map != NULL) {
+		munmap(_map, cfg_journal_segment_size);
+		_map = NULL;
+	}
+
+	while (!g_queue_is_empty(&_segments)) {
+		g_slice_free1(sizeof(struct _segment), g_queue_pop_head(&_segments));
+	}
+
+	g_hash_table_unref(_restore);
+	_restore = NULL;
+	_restoring = 0;
+	_off = 0;
+	_id = 0;
+	_expired_at = 0;
+}
+
+void journal_tick()
+{
+	gint64 now;
+
+	if (_map == NULL) {
+		return;
+	}
+
+	now = _now();
+	if (now != _expired_at) {
+		_expired_at = now;
+		_expire();
+	}
+}
+
+void journal_append(const gchar *path, const gchar *json)
+{
+	gsize size;
+	gchar *data;
+	struct _record *rec;
+	gsize path_len = strlen(path);
+	gsize json_len = strlen(json);
+
+	if (_map == NULL || path_len == 0) {
+		return;
+	}
+
+	size = _record_size(path_len, json_len);
+	if (size > cfg_journal_segment_size - sizeof(struct _segment_header)) {
+		WARN("Broadcast to %s is too large for a journal segment, "
+			"not journaling", path);
+		return;
+	}
+
+	if (_off + size > cfg_journal_segment_size) {
+		_segment_close();
+		if (!_segment_open(_id + 1)) {
+			return;
+		}
+
+		_expire();
+	}
+
+	rec = (struct _record*)(_map + _off);
+	data = (gchar*)(rec + 1);
+
+	memcpy(data, path, path_len + 1);
+	memcpy(data + path_len + 1, json, json_len + 1);
+
+	rec->path_len = path_len;
+	rec->json_len = json_len;
+	rec->reserved = 0;
+	rec->time = _now();
+	rec->crc = _record_crc(rec);
+
+	_off += size;
+
+	qev_stats_counter_inc(_stat_appended);
+}
+
+gchar* journal_restore(const gchar *path)
+{
+	struct _restored *r;
+	gchar *json = NULL;
+
+	if (g_atomic_int_get(&_restoring) == 0) {
+		return NULL;
+	}
+
+	g_mutex_lock(&_restore_lock);
+
+	r = g_hash_table_lookup(_restore, path);
+	if (r != NULL) {
+		json = r->json;
+		r->json = NULL;
+		g_hash_table_remove(_restore, path);
+		g_atomic_int_set(&_restoring, g_hash_table_size(_restore));
+	}
+
+	g_mutex_unlock(&_restore_lock);
+
+	if (json != NULL) {
+		qev_stats_counter_inc(_stat_restored);
+	}
+
+	return json;
+}
+
+guint64 journal_replay()
+{
+	return _replay(FALSE);
+}
+
+void journal_init()
+{
+	guint64 records;
+
+	_stat_appended = qev_stats_counter(
+		"journal", "appended", TRUE,
+		"How many broadcasts were written to the journal");
+	_stat_restored = qev_stats_counter(
+		"journal", "restored", TRUE,
+		"How many last values from the journal were given to subscriptions");
+
+	if (cfg_journal_dir == NULL || *cfg_journal_dir == '\0') {
+		return;
+	}
+
+	if (g_mkdir_with_parents(cfg_journal_dir, 0755) != 0) {
+		WARN("Could not create journal directory %s, journaling disabled: %s",
+			cfg_journal_dir, g_strerror(errno));
+		return;
+	}
+
+	_restore = g_hash_table_new_full(g_str_hash, g_str_equal,
+										g_free, _restored_free);
+	qev_cleanup(&_restore, _free);
+
+	records = _replay(TRUE);
+	INFO("Read %" G_GUINT64_FORMAT " records from the journal, with %u "
+		"last values to restore", records, g_hash_table_size(_restore));
+
+	if (_segment_open(_id + 1)) {
+		_expire();
+	}
+}
@@ -0,0 +1,73 @@
+/**
+ * An append-only record of broadcasts, kept on disk so that a restarted
+ * server can pick up where it left off.
+ * @file
+ *
+ * Every broadcast that goes out is appended, from the broadcast tick, to
+ * memory-mapped segments in `journal-dir`. Segments are never modified once
+ * filled, and whole segments are removed, from the broadcast tick, once
+ * everything in them is older than `journal-retention`. On startup, the
+ * journal is read back, and the newest value for every subscription is kept
+ * around until the subscription is created again, at which point it becomes
+ * the subscription's last value.
+ *
+ * Records are written in native byte order, so a journal can only be read
+ * back by a server on the same architecture. Every record is checksummed,
+ * and reading a segment stops at the first record that doesn't check out.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Record a broadcast. Only call from the broadcast tick. Does nothing if
+ * journaling is disabled.
+ *
+ * @param path
+ *     The full path of the subscription: ev_path + ev_extra
+ * @param json
+ *     The data broadcast
+ */
+void journal_append(const gchar *path, const gchar *json);
+
+/**
+ * Remove anything that has outlived `journal-retention`, at most once a
+ * second, so that a quiet journal still ages out. Only call from the
+ * broadcast tick.
+ */
+void journal_tick();
+
+/**
+ * Take the newest value found in the journal for a subscription. Each
+ * value is only given out once.
+ *
+ * @param path
+ *     The full path of the subscription: ev_path + ev_extra
+ *
+ * @return
+ *     The JSON last broadcast to the subscription, or NULL if there's
+ *     nothing. Free with g_free().
+ */
+gchar* journal_restore(const gchar *path);
+
+/**
+ * Read every record in the journal, remembering the newest value for each
+ * subscription for journal_restore(). Values older than `journal-retention`
+ * are skipped.
+ *
+ * @return
+ *     The number of records read
+ */
+guint64 journal_replay();
+
+/**
+ * Read back the journal and open a new segment to write to. Journaling is
+ * left disabled if `journal-dir` isn't set or can't be written to.
+ */
+void journal_init();
@@ -8,30 +8,435 @@
 
 #include "quickio.h"
 
+/**
+ * How long each tick of the wheel is. Clients are looked at no later than
+ * a tick after they're due.
+ */
+#define TICK_USEC QEV_SEC_TO_USEC(1)
+
+/**
+ * Each level of the wheel has 2^WHEEL_BITS slots, and each of its slots
+ * covers as many ticks as the entire level below it.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/**
+ * 4 levels cover 2^24 ticks: plenty more than anything waits for
+ */
+#define WHEEL_LEVELS 4
+
+/**
+ * The fewest clients worth handing to another thread
+ */
+#define CHUNK_MIN 1024
+
 struct _intervals {
 	struct protocol_heartbeat hb;
+
+	/**
+	 * Callbacks created before this are pruned
+	 */
 	gint64 cb;
+
+	/**
+	 * How long callbacks may live
+	 */
+	gint64 cb_age;
 };
 
-static void _foreach_cb(struct client *client, void *is_)
+struct _chunk {
+	const struct _intervals *is;
+	struct client **clients;
+	guint len;
+};
+
+/**
+ * Clients waiting to come due, each holding a reference
+ */
+static struct {
+	GMutex lock;
+
+	/**
+	 * The next tick to run
+	 */
+	guint64 now;
+
+	/**
+	 * Each slot is a list of clients, linked through client->periodic
+	 */
+	struct client *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} _wheel;
+
+static qev_stats_counter_t *_stat_scheduled;
+static qev_stats_counter_t *_stat_due;
+
+static guint64 _tick(const gint64 when)
+{
+	return MAX(when, 0) / TICK_USEC;
+}
+
+/**
+ * Put a client into the slot for when it's due. The wheel must be locked.
+ */
+static void _link(struct client *client)
 {
-	struct _intervals *is = is_;
+	guint level;
+	struct client **slot;
+	guint64 when = MAX(_tick(client->periodic.due), _wheel.now);
+	guint64 delta = when - _wheel.now;
 
-	protocols_heartbeat(client, &is->hb);
-	client_cb_prune(client, is->cb);
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (1llu << (WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	/*
+	 * Anything due past the end of the wheel goes in the last slot, and it's
+	 * put back in again when that slot comes around
+	 */
+	if (level == WHEEL_LEVELS - 1) {
+		delta = MIN(delta, (1llu << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+		when = _wheel.now + delta;
+	}
+
+	slot = &_wheel.slots[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	client->periodic.slot = slot;
+	client->periodic.prev = NULL;
+	client->periodic.next = *slot;
+
+	if (*slot != NULL) {
+		(*slot)->periodic.prev = client;
+	}
+
+	*slot = client;
 }
 
-void periodic_run(void *nothing G_GNUC_UNUSED)
+/**
+ * Take a client out of its slot. The wheel must be locked.
+ */
+static void _unlink(struct client *client)
+{
+	struct client *prev = client->periodic.prev;
+	struct client *next = client->periodic.next;
+
+	if (prev == NULL) {
+		*client->periodic.slot = next;
+	} else {
+		prev->periodic.next = next;
+	}
+
+	if (next != NULL) {
+		next->periodic.prev = prev;
+	}
+
+	client->periodic.slot = NULL;
+	client->periodic.prev = NULL;
+	client->periodic.next = NULL;
+}
+
+/**
+ * Empty out a slot. The wheel must be locked.
+ *
+ * @return
+ *     Every client that was in the slot, still linked together.
+ */
+static struct client* _take(struct client **slot)
+{
+	struct client *client;
+	struct client *clients = *slot;
+
+	*slot = NULL;
+
+	for (client = clients; client != NULL; client = client->periodic.next) {
+		client->periodic.slot = NULL;
+	}
+
+	return clients;
+}
+
+/**
+ * Move everyone in the level's current slot down to the levels below, now
+ * that the levels below have come all the way around. The wheel must be
+ * locked.
+ */
+static void _cascade(const guint level)
+{
+	struct client *next;
+	guint i = (_wheel.now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct client *client = _take(&_wheel.slots[level][i]);
+
+	while (client != NULL) {
+		next = client->periodic.next;
+		_link(client);
+		client = next;
+	}
+}
+
+/**
+ * Turn the wheel through the given tick, collecting everyone that came
+ * due. Their references go with them. The wheel must be locked.
+ */
+static void _turn(const guint64 until, GPtrArray *due)
+{
+	guint level;
+	struct client *next;
+	struct client *client;
+
+	while (_wheel.now <= until) {
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			if ((_wheel.now & ((1llu << (WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+
+			_cascade(level);
+		}
+
+		client = _take(&_wheel.slots[0][_wheel.now & WHEEL_MASK]);
+		while (client != NULL) {
+			next = client->periodic.next;
+			client->periodic.prev = NULL;
+			client->periodic.next = NULL;
+
+			g_ptr_array_add(due, client);
+			qev_stats_counter_dec(_stat_scheduled);
+
+			client = next;
+		}
+
+		_wheel.now++;
+	}
+}
+
+/**
+ * Run everything a client came due for, and put it back in the wheel for
+ * whenever it's next needed. Releases the wheel's reference.
+ */
+static void _run_client(struct client *client, const struct _intervals *is)
 {
+	gint64 oldest;
+	gint64 due = protocols_heartbeat(client, &is->hb);
+
+	oldest = client_cb_prune(client, is->cb);
+	if (oldest != G_MAXINT64) {
+		due = MIN(due, oldest + is->cb_age);
+	}
+
+	if (due != G_MAXINT64 && !qev_is_closing(client)) {
+		periodic_schedule(client, due);
+	}
+
+	qev_unref(client);
+	qev_stats_counter_inc(_stat_due);
+}
+
+static void _run_chunk(void *chunk_)
+{
+	guint i;
+	struct _chunk *chunk = chunk_;
+
+	for (i = 0; i < chunk->len; i++) {
+		_run_client(chunk->clients[i], chunk->is);
+	}
+}
+
+static void _run_due(GPtrArray *due, const struct _intervals *is)
+{
+	guint i;
+	guint chunks;
+	guint per_chunk;
+	struct _chunk *cs;
+	struct fanout_group grp = { .pending = 0 };
+
+	chunks = MIN(MAX(cfg_periodic_threads, 1), due->len / CHUNK_MIN);
+	if (chunks <= 1) {
+		struct _chunk chunk = {
+			.is = is,
+			.clients = (struct client**)due->pdata,
+			.len = due->len,
+		};
+
+		_run_chunk(&chunk);
+		return;
+	}
+
+	cs = g_new(struct _chunk, chunks);
+	per_chunk = (due->len + chunks - 1) / chunks;
+
+	for (i = 0; i < chunks; i++) {
+		guint start = i * per_chunk;
+
+		cs[i] = (struct _chunk){
+			.is = is,
+			.clients = ((struct client**)due->pdata) + start,
+			.len = MIN(per_chunk, due->len - start),
+		};
+
+		fanout_push(&grp, _run_chunk, cs + i);
+	}
+
+	fanout_wait(&grp);
+	g_free(cs);
+}
+
+/**
+ * Turn the wheel through the given time and run everyone that came due.
+ *
+ * @return
+ *     How many clients came due
+ */
+static guint _run_until(const gint64 now)
+{
+	guint len;
+	GPtrArray *due = g_ptr_array_new();
 	struct _intervals is = {
-		.hb = protocols_heartbeat_get_intervals(),
-		.cb = client_cb_prune_get_before(),
+		.hb = protocols_heartbeat_get_intervals(now),
+		.cb = client_cb_prune_get_before(now),
 	};
 
-	qev_foreach(_foreach_cb, cfg_periodic_threads, &is);
+	is.cb_age = is.hb.now - is.cb;
+
+	g_mutex_lock(&_wheel.lock);
+	_turn(_tick(is.hb.now), due);
+	g_mutex_unlock(&_wheel.lock);
+
+	_run_due(due, &is);
+
+	len = due->len;
+	g_ptr_array_free(due, TRUE);
+
+	return len;
+}
+
+static void _run_wheel(void *nothing G_GNUC_UNUSED)
+{
+	_run_until(qev_monotonic);
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	guint i;
+	guint level;
+	struct client *next;
+	struct client *client;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (i = 0; i < WHEEL_SLOTS; i++) {
+			g_mutex_lock(&_wheel.lock);
+			client = _take(&_wheel.slots[level][i]);
+			g_mutex_unlock(&_wheel.lock);
+
+			while (client != NULL) {
+				next = client->periodic.next;
+				client->periodic.prev = NULL;
+				client->periodic.next = NULL;
+				qev_unref(client);
+				client = next;
+			}
+		}
+	}
+}
+
+void periodic_schedule(struct client *client, const gint64 when)
+{
+	gboolean added;
+
+	/*
+	 * Nearly every callback lands here, and nearly every client is already
+	 * due before its callbacks expire. Reading this without the lock is
+	 * fine: a client that's taken out of the wheel right now is about to
+	 * be looked at anyway, and it will find whatever expires.
+	 */
+	if (client->periodic.slot != NULL && client->periodic.due <= when) {
+		return;
+	}
+
+	g_mutex_lock(&_wheel.lock);
+
+	added = client->periodic.slot == NULL;
+	if (added) {
+		qev_ref(client);
+	} else if (client->periodic.due > when) {
+		_unlink(client);
+	}
+
+	if (client->periodic.slot == NULL) {
+		client->periodic.due = when;
+		_link(client);
+	}
+
+	g_mutex_unlock(&_wheel.lock);
+
+	if (added) {
+		qev_stats_counter_inc(_stat_scheduled);
+	}
+}
+
+void periodic_unschedule(struct client *client)
+{
+	gboolean removed;
+
+	g_mutex_lock(&_wheel.lock);
+
+	removed = client->periodic.slot != NULL;
+	if (removed) {
+		_unlink(client);
+	}
+
+	g_mutex_unlock(&_wheel.lock);
+
+	if (removed) {
+		qev_stats_counter_dec(_stat_scheduled);
+		qev_unref(client);
+	}
+}
+
+guint periodic_turn(const gint64 when)
+{
+	return _run_until(when);
+}
+
+gint periodic_level(struct client *client)
+{
+	gint level = -1;
+
+	g_mutex_lock(&_wheel.lock);
+
+	if (client->periodic.slot != NULL) {
+		level = (client->periodic.slot - &_wheel.slots[0][0]) / WHEEL_SLOTS;
+	}
+
+	g_mutex_unlock(&_wheel.lock);
+
+	return level;
+}
+
+void periodic_run(void *nothing G_GNUC_UNUSED)
+{
+	_run_wheel(NULL);
+	sub_update_stats();
+	protocols_update_stats();
+	slab_update_stats();
+	evs_query_reclaim();
 }
 
 void periodic_init()
 {
-	qev_timer(10 * 1000, periodic_run, NULL);
+	g_mutex_init(&_wheel.lock);
+	_wheel.now = _tick(qev_monotonic);
+
+	_stat_scheduled = qev_stats_counter(
+		"periodic", "scheduled", FALSE,
+		"How many clients are waiting in the timing wheel");
+	_stat_due = qev_stats_counter(
+		"periodic", "due", TRUE,
+		"How many times clients came due and were looked at");
+
+	qev_cleanup(&_wheel, _free);
+
+	qev_timer(TICK_USEC / 1000, _run_wheel, NULL);
+	qev_timer(PERIODIC_INTERVAL * 1000, periodic_run, NULL);
 }
@@ -1,7 +1,16 @@
 /**
- * Periodically runs tasks on every client.
+ * Periodically runs tasks on clients.
  * @file
  *
+ * Clients only need looking at when they're due for a heartbeat or when a
+ * callback is about to expire, so they wait in a hierarchical timing wheel
+ * until then. Each turn of the wheel only touches clients that are due, no
+ * matter how many are connected.
+ *
+ * Clients are never moved in the wheel as they send and receive: the time
+ * they're due only ever moves later, so a client that comes due early is
+ * just put back in for whenever it's really due.
+ *
  * @author Andrew Stone <andrew@clovar.com>
  * @copyright 2012-2014 Clear Channel Inc.
  *
@@ -23,7 +32,44 @@
 #define PERIODIC_INTERVAL_USEC QEV_SEC_TO_USEC(PERIODIC_INTERVAL)
 
 /**
- * Run periodic tasks immediately.
+ * Make sure the client is looked at no later than the given time. Does
+ * nothing if it's already due before then.
+ *
+ * @param client
+ *     The client to look at
+ * @param when
+ *     The latest it may be looked at, in monotonic time
+ */
+void periodic_schedule(struct client *client, const gint64 when);
+
+/**
+ * Take the client out of the wheel. Called when the client closes.
+ */
+void periodic_unschedule(struct client *client);
+
+/**
+ * Turn the wheel through the given time, as if it had come, running every
+ * client that comes due on the way. Meant for tests: once turned, the wheel
+ * does nothing until the clock catches up with it.
+ *
+ * @param when
+ *     The time to turn through, in monotonic time
+ *
+ * @return
+ *     How many clients came due
+ */
+guint periodic_turn(const gint64 when);
+
+/**
+ * Which level of the wheel the client is waiting in. Meant for tests.
+ *
+ * @return
+ *     The level, from 0, or -1 if the client isn't in the wheel
+ */
+gint periodic_level(struct client *client);
+
+/**
+ * Run periodic tasks immediately, along with any clients that are due.
  */
 void periodic_run();
 
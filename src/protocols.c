@@ -33,6 +33,28 @@
  */
 #define HEARTBEAT_DEAD (HEARTBEAT_CHALLENGE_INTERVAL + QEV_SEC_TO_USEC(60))
 
+/**
+ * How deep the calling thread is in protocols_batch_begin()
+ */
+static __thread guint _batch_depth = 0;
+
+/**
+ * Clients with events gathered by this thread, each holding a reference
+ */
+static GPrivate _batch_pending = G_PRIVATE_INIT((GDestroyNotify)g_ptr_array_unref);
+
+/**
+ * The writes counters as of the last stats update
+ */
+static guint64 _last_events = 0;
+static guint64 _last_writes = 0;
+
+static qev_stats_counter_t *_stat_batch_events;
+static qev_stats_counter_t *_stat_batch_frames;
+static qev_stats_counter_t *_stat_writes_events;
+static qev_stats_counter_t *_stat_writes;
+static qev_stats_gauge_t *_stat_events_per_write;
+
 /*
  * All of the known protocols, in order of their preference (index 0 being
  * most preferred, N being least).
@@ -45,7 +67,11 @@ static struct protocol _protocols[] = {
 		.route = protocol_http_route,
 		.heartbeat = protocol_http_heartbeat,
 		.frame = protocol_http_frame,
+		.wrap = NULL,
+		.deflate = NULL,
 		.send = protocol_http_send,
+		.bcast = NULL,
+		.flush = NULL,
 		.close = protocol_http_close,
 	},
 	{	.global = &protocol_flash,
@@ -55,7 +81,11 @@ static struct protocol _protocols[] = {
 		.route = NULL,
 		.heartbeat = NULL,
 		.frame = NULL,
+		.wrap = NULL,
+		.deflate = NULL,
 		.send = NULL,
+		.bcast = NULL,
+		.flush = NULL,
 		.close = NULL,
 	},
 	{	.global = &protocol_raw,
@@ -65,8 +95,12 @@ static struct protocol _protocols[] = {
 		.route = protocol_raw_route,
 		.heartbeat = protocol_raw_heartbeat,
 		.frame = protocol_raw_frame,
+		.wrap = protocol_raw_wrap,
+		.deflate = NULL,
 		.send = NULL,
-		.close = NULL,
+		.bcast = NULL,
+		.flush = protocol_raw_flush,
+		.close = protocol_raw_close,
 	},
 	{	.global = &protocol_rfc6455,
 		.init = protocol_rfc6455_init,
@@ -75,11 +109,35 @@ static struct protocol _protocols[] = {
 		.route = protocol_rfc6455_route,
 		.heartbeat = protocol_rfc6455_heartbeat,
 		.frame = protocol_rfc6455_frame,
+		.wrap = protocol_rfc6455_wrap,
+		.deflate = protocol_rfc6455_deflate,
 		.send = NULL,
+		.bcast = NULL,
+		.flush = NULL,
 		.close = protocol_rfc6455_close,
 	},
+	{	.global = &protocol_raw_mux,
+		.init = NULL,
+		.handles = protocol_raw_mux_handles,
+		.handshake = NULL,
+		.route = NULL,
+		.heartbeat = NULL,
+		.frame = protocol_raw_mux_frame,
+		.wrap = NULL,
+		.deflate = NULL,
+		.send = protocol_raw_mux_send,
+		.bcast = protocol_raw_mux_bcast,
+		.flush = NULL,
+		.close = protocol_raw_mux_close,
+	},
 };
 
+static gsize _bcast_size()
+{
+	return sizeof(struct protocol_bcast) +
+		(sizeof(struct protocol_frames) * G_N_ELEMENTS(_protocols));
+}
+
 static gboolean _find_handler(struct client *client)
 {
 	guint i;
@@ -109,15 +167,193 @@ static gboolean _find_handler(struct client *client)
 	return FALSE;
 }
 
-static void _send(struct client *client, const struct protocol_frames *pframes)
+/**
+ * Get the frame that should go out to the client
+ */
+static const GString* _frame(
+	struct client *client,
+	const struct protocol_frames *pframes)
+{
+	if (client->protocol.deflate && pframes->deflated != NULL) {
+		return pframes->deflated;
+	}
+
+	return pframes->def;
+}
+
+/**
+ * Wrap up a payload for a client that batches, compressing it if the client
+ * asked for that. Takes ownership of the payload.
+ */
+static GString* _wrap(struct client *client, GString *payload)
+{
+	GString *deflated;
+	struct protocol *prot = client->protocol.prot;
+	GString *frame = prot->wrap(payload);
+
+	if (client->protocol.deflate && prot->deflate != NULL) {
+		deflated = prot->deflate(frame);
+		if (deflated != NULL) {
+			qev_buffer_put(frame);
+			frame = deflated;
+		}
+	}
+
+	return frame;
+}
+
+/**
+ * Write a single event to a client, right away.
+ */
+static void _write(struct client *client, const GString *frame)
 {
 	client->last_send = qev_monotonic;
+	qev_write(client, frame->str, frame->len);
+
+	qev_stats_counter_inc(_stat_writes_events);
+	qev_stats_counter_inc(_stat_writes);
+}
+
+/**
+ * Note that this thread has gathered something for the client, so that it
+ * gets flushed once the thread stops gathering.
+ */
+static void _pend(struct client *client)
+{
+	GPtrArray *pending = g_private_get(&_batch_pending);
+
+	if (pending == NULL) {
+		pending = g_ptr_array_new();
+		g_private_set(&_batch_pending, pending);
+	}
+
+	g_ptr_array_add(pending, qev_ref(client));
+}
 
+/**
+ * Gather an event for a client, to be written once the thread stops
+ * gathering.
+ *
+ * @param client
+ *     Where the event is going
+ * @param into
+ *     Which of the client's buffers to gather into
+ * @param event
+ *     What to gather
+ * @param newlines
+ *     If gathered events are separated by newlines
+ *
+ * @return
+ *     If the event was gathered. If not, it should be written right away:
+ *     this thread isn't gathering and nothing else is waiting to go out to
+ *     the client. The client is left locked so that nothing can get ahead
+ *     of it.
+ */
+static gboolean _gather(
+	struct client *client,
+	GString **into,
+	const GString *event,
+	const gboolean newlines)
+{
+	GString *buff;
+
+	client_lock(client);
+
+	buff = *into;
+
+	if (buff == NULL) {
+		if (_batch_depth == 0) {
+			return FALSE;
+		}
+
+		_pend(client);
+
+		buff = qev_buffer_get();
+		*into = buff;
+	} else if (newlines) {
+		g_string_append_c(buff, '\n');
+	}
+
+	qev_buffer_append_buff(buff, event);
+	qev_stats_counter_inc(_stat_writes_events);
+
+	if (newlines) {
+		qev_stats_counter_inc(_stat_batch_events);
+	}
+
+	client_unlock(client);
+
+	return TRUE;
+}
+
+/**
+ * Write everything gathered for the client. The client must be locked.
+ */
+static void _flush(struct client *client)
+{
+	GString *frame;
+	struct protocol *prot = client->protocol.prot;
+
+	if (prot != NULL && prot->flush != NULL) {
+		prot->flush(client);
+	}
+
+	if (client->protocol.batched != NULL) {
+		frame = _wrap(client, client->protocol.batched);
+		client->protocol.batched = NULL;
+		qev_stats_counter_inc(_stat_batch_frames);
+	} else if (client->protocol.corked != NULL) {
+		frame = client->protocol.corked;
+		client->protocol.corked = NULL;
+	} else {
+		return;
+	}
+
+	if (frame->len > 0) {
+		client->last_send = qev_monotonic;
+		qev_write(client, frame->str, frame->len);
+	}
+
+	qev_buffer_put(frame);
+
+	qev_stats_counter_inc(_stat_writes);
+}
+
+static void _send(struct client *client, const struct protocol_frames *pframes)
+{
 	if (client->protocol.prot->send) {
+		client->last_send = qev_monotonic;
 		client->protocol.prot->send(client, pframes);
 	} else if (pframes->def != NULL) {
-		qev_write(client, pframes->def->str, pframes->def->len);
+		const GString *frame = _frame(client, pframes);
+
+		if (!_gather(client, &client->protocol.corked, frame, FALSE)) {
+			_write(client, frame);
+			client_unlock(client);
+		}
+	}
+}
+
+/**
+ * Format an event for a batch. Events are separated by newlines, so any in
+ * the JSON (where they can only ever be whitespace) are replaced.
+ */
+static GString* _batch_format(
+	const gchar *ev_path,
+	const gchar *ev_extra,
+	const evs_cb_t server_cb,
+	const gchar *json)
+{
+	gchar *nl;
+	GString *buff = protocol_raw_format(ev_path, ev_extra, server_cb, json);
+
+	nl = memchr(buff->str, '\n', buff->len);
+	while (nl != NULL) {
+		*nl = ' ';
+		nl = memchr(nl, '\n', buff->len - (nl - buff->str));
 	}
+
+	return buff;
 }
 
 static void _set_handshaked(struct client *client)
@@ -125,6 +361,12 @@ static void _set_handshaked(struct client *client)
 	client->last_send = qev_monotonic;
 	client->protocol.handshaked = TRUE;
 	qev_timeout_clear(&client->timeout);
+
+	/*
+	 * The protocol gets its first say on heartbeats here, and it decides
+	 * when it's needed after that
+	 */
+	periodic_schedule(client, qev_monotonic + PERIODIC_INTERVAL_USEC);
 }
 
 static void _handshake(struct client *client)
@@ -213,7 +455,13 @@ void protocols_route(struct client *client)
 		}
 	}
 
+	/*
+	 * Anything sent while handling everything the client sent goes back
+	 * in as few frames as possible
+	 */
+	protocols_batch_begin();
 	_route(client);
+	protocols_batch_end();
 }
 
 void protocols_send(
@@ -226,17 +474,87 @@ void protocols_send(
 	if (client->protocol.handshaked) {
 		ev_extra = ev_extra ? : "";
 
-		struct protocol_frames pframes = client->protocol.prot->frame(
+		if (client->protocol.batch) {
+			GString *event = _batch_format(ev_path, ev_extra, server_cb, json);
+
+			if (_gather(client, &client->protocol.batched, event, TRUE)) {
+				qev_buffer_put(event);
+			} else {
+				GString *frame = _wrap(client, event);
+				_write(client, frame);
+				client_unlock(client);
+
+				qev_buffer_put(frame);
+			}
+
+			return;
+		}
+
+		struct protocol *prot = client->protocol.prot;
+		struct protocol_frames pframes = prot->frame(
 										ev_path, ev_extra, server_cb, json);
+
+		if (client->protocol.deflate && prot->deflate != NULL) {
+			pframes.deflated = prot->deflate(pframes.def);
+		}
+
 		_send(client, &pframes);
 
 		qev_buffer_put(pframes.def);
 		qev_buffer_put(pframes.raw);
+		qev_buffer_put(pframes.deflated);
 	}
 }
 
+void protocols_batch_begin()
+{
+	_batch_depth++;
+}
+
+gboolean protocols_batch_end()
+{
+	guint i;
+	GPtrArray *pending;
+
+	_batch_depth--;
+	if (_batch_depth > 0) {
+		return FALSE;
+	}
+
+	pending = g_private_get(&_batch_pending);
+	if (pending == NULL) {
+		return TRUE;
+	}
+
+	for (i = 0; i < pending->len; i++) {
+		struct client *client = g_ptr_array_index(pending, i);
+
+		/*
+		 * Another thread might have gathered for the client and written
+		 * everything before this thread got here, in which case there's
+		 * nothing left to flush.
+		 */
+		client_lock(client);
+		_flush(client);
+		client_unlock(client);
+		qev_unref(client);
+	}
+
+	g_ptr_array_set_size(pending, 0);
+
+	return TRUE;
+}
+
 void protocols_closed(struct client *client, guint reason)
 {
+	/*
+	 * Whatever was gathered was sent before the close, so it gets its
+	 * chance to go out ahead of any goodbye from the protocol.
+	 */
+	client_lock(client);
+	_flush(client);
+	client_unlock(client);
+
 	if (client->protocol.prot != NULL && client->protocol.prot->close != NULL) {
 		client->protocol.prot->close(client, reason);
 	}
@@ -244,59 +562,153 @@ void protocols_closed(struct client *client, guint reason)
 	memset(&client->protocol.flags, 0, sizeof(client->protocol.flags));
 }
 
-struct protocol_frames* protocols_bcast(const gchar *ev_path, const gchar *json)
+/**
+ * Get a broadcast's frames for the client, compressing them if the client
+ * is the first that wants them that way. They're compressed exactly once,
+ * no matter how many clients want them.
+ */
+static const struct protocol_frames* _bcast_frames(
+	struct client *client,
+	struct protocol_bcast *bcast)
 {
-	guint i;
-	struct protocol_frames *frames = g_slice_alloc0(sizeof(*frames) * G_N_ELEMENTS(_protocols));
+	struct protocol *prot = client->protocol.prot;
+	struct protocol_frames *pframes = bcast->frames + prot->id;
 
-	for (i = 0; i < G_N_ELEMENTS(_protocols); i++) {
-		struct protocol *p = _protocols + i;
-		if (p->frame != NULL) {
-			*(frames + i) = p->frame(ev_path, "", EVS_NO_CALLBACK, json);
+	protocols_bcast_frames(bcast, prot);
+
+	if (client->protocol.deflate && prot->deflate != NULL &&
+			g_once_init_enter(&pframes->deflate_tried)) {
+
+		if (pframes->def != NULL) {
+			pframes->deflated = prot->deflate(pframes->def);
 		}
+
+		g_once_init_leave(&pframes->deflate_tried, 1);
 	}
 
-	return frames;
+	return pframes;
+}
+
+/**
+ * Get the broadcast formatted for clients that batch, formatting it if this
+ * is the first.
+ */
+static const GString* _bcast_batched(struct protocol_bcast *bcast)
+{
+	if (g_once_init_enter(&bcast->batched_made)) {
+		bcast->batched = _batch_format(bcast->ev_path, "",
+										EVS_NO_CALLBACK, bcast->json);
+		g_once_init_leave(&bcast->batched_made, 1);
+	}
+
+	return bcast->batched;
+}
+
+struct protocol_bcast* protocols_bcast(const gchar *ev_path, const gchar *json)
+{
+	struct protocol_bcast *bcast = g_slice_alloc0(_bcast_size());
+
+	bcast->refs = 1;
+	bcast->ev_path = g_strdup(ev_path);
+	bcast->json = g_strdup(json);
+	bcast->len = strlen(ev_path) + strlen(json);
+
+	return bcast;
+}
+
+const struct protocol_frames* protocols_bcast_frames(
+	struct protocol_bcast *bcast,
+	const struct protocol *prot)
+{
+	struct protocol_frames made;
+	struct protocol_frames *pframes = bcast->frames + prot->id;
+
+	if (g_once_init_enter(&pframes->made)) {
+		if (prot->frame != NULL) {
+			made = prot->frame(bcast->ev_path, "", EVS_NO_CALLBACK, bcast->json);
+			pframes->def = made.def;
+			pframes->raw = made.raw;
+		}
+
+		g_once_init_leave(&pframes->made, 1);
+	}
+
+	return pframes;
 }
 
 void protocols_bcast_write(
 	struct client *client,
-	const struct protocol_frames *frames)
+	struct protocol_bcast *bcast)
 {
-	const struct protocol_frames *pframes = frames + client->protocol.prot->id;
-	if (client->protocol.handshaked) {
-		_send(client, pframes);
+	struct protocol *prot = client->protocol.prot;
+
+	if (!client->protocol.handshaked) {
+		return;
+	}
+
+	if (prot->bcast != NULL) {
+		client->last_send = qev_monotonic;
+		prot->bcast(client, bcast);
+		return;
+	}
+
+	if (client->protocol.batch) {
+		if (!_gather(client, &client->protocol.batched,
+						_bcast_batched(bcast), TRUE)) {
+			_write(client, _frame(client, _bcast_frames(client, bcast)));
+			client_unlock(client);
+		}
+
+		return;
 	}
+
+	_send(client, _bcast_frames(client, bcast));
+}
+
+struct protocol_bcast* protocols_bcast_ref(struct protocol_bcast *bcast)
+{
+	g_atomic_int_inc(&bcast->refs);
+	return bcast;
 }
 
-void protocols_bcast_free(struct protocol_frames *frames)
+void protocols_bcast_unref(struct protocol_bcast *bcast)
 {
 	guint i;
+
+	if (bcast == NULL || !g_atomic_int_dec_and_test(&bcast->refs)) {
+		return;
+	}
+
 	for (i = 0; i < G_N_ELEMENTS(_protocols); i++) {
-		struct protocol_frames *frame = frames + i;
+		struct protocol_frames *frame = bcast->frames + i;
 		qev_buffer_put(frame->def);
 		qev_buffer_put(frame->raw);
+		qev_buffer_put(frame->deflated);
 	}
 
-	g_slice_free1(sizeof(*frames) * G_N_ELEMENTS(_protocols), frames);
+	qev_buffer_put(bcast->batched);
+	g_free(bcast->ev_path);
+	g_free(bcast->json);
+	g_slice_free1(_bcast_size(), bcast);
 }
 
-void protocols_heartbeat(
+gint64 protocols_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb)
 {
 	if (client->protocol.handshaked &&
 		client->protocol.prot->heartbeat != NULL) {
 
-		client->protocol.prot->heartbeat(client, hb);
+		return client->protocol.prot->heartbeat(client, hb);
 	}
+
+	return G_MAXINT64;
 }
 
-struct protocol_heartbeat protocols_heartbeat_get_intervals()
+struct protocol_heartbeat protocols_heartbeat_get_intervals(const gint64 now)
 {
-	gint64 now = qev_monotonic;
-
 	return (struct protocol_heartbeat){
+		.now = now,
 		.timeout = now - QEV_MS_TO_USEC(qev_cfg_get_timeout()),
 		.poll = now - HEARTBEAT_POLL + PERIODIC_INTERVAL_USEC,
 		.heartbeat = now - HEARTBEAT_INTERVAL + PERIODIC_INTERVAL_USEC,
@@ -305,10 +717,40 @@ struct protocol_heartbeat protocols_heartbeat_get_intervals()
 	};
 }
 
+GString* protocols_gathering(struct client *client)
+{
+	if (client->protocol.corked == NULL) {
+		if (_batch_depth == 0) {
+			return NULL;
+		}
+
+		_pend(client);
+		client->protocol.corked = qev_buffer_get();
+	}
+
+	return client->protocol.corked;
+}
+
+void protocols_update_stats()
+{
+	guint64 events = qev_stats_counter_get(_stat_writes_events);
+	guint64 writes = qev_stats_counter_get(_stat_writes);
+	guint64 d_events = events - _last_events;
+	guint64 d_writes = writes - _last_writes;
+
+	_last_events = events;
+	_last_writes = writes;
+
+	qev_stats_gauge_set(_stat_events_per_write,
+		d_writes == 0 ? 0 : (d_events * 100) / d_writes);
+}
+
 void protocols_switch(struct client *client, struct protocol *prot)
 {
 	client->protocol.prot = prot;
 	client->protocol.handshaked = FALSE;
+	client->protocol.batch = FALSE;
+	client->protocol.deflate = FALSE;
 	memset(&client->protocol.flags, 0, sizeof(client->protocol.flags));
 }
 
@@ -316,6 +758,23 @@ void protocols_init()
 {
 	guint i;
 
+	_stat_batch_events = qev_stats_counter(
+		"protocols.batch", "events", TRUE,
+		"How many events were packed into batched frames");
+	_stat_batch_frames = qev_stats_counter(
+		"protocols.batch", "frames", TRUE,
+		"How many batched frames were sent");
+	_stat_writes_events = qev_stats_counter(
+		"protocols.writes", "events", TRUE,
+		"How many events were written to clients, batched or not");
+	_stat_writes = qev_stats_counter(
+		"protocols.writes", "writes", TRUE,
+		"How many writes it took to send those events");
+	_stat_events_per_write = qev_stats_gauge(
+		"protocols.writes", "events_per_write",
+		"Average number of events sent with each write, in hundredths, "
+		"since the last stats update");
+
 	for (i = 0; i < G_N_ELEMENTS(_protocols); i++) {
 		struct protocol *p = _protocols + i;
 		p->id = i;
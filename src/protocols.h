@@ -62,6 +62,12 @@ enum protocol_status {
  * Useful information about heartbeat timings.
  */
 struct protocol_heartbeat {
+	/**
+	 * When the intervals were taken. Every other time here is this, less
+	 * some interval.
+	 */
+	gint64 now;
+
 	/**
 	 * If client->last_send is less than this, then the client can be
 	 * considered as timed out of the protocol chose to implement timeouts
@@ -106,6 +112,77 @@ struct protocol_frames {
 	 * A raw frame. Contains whatever raw means to the protocol.
 	 */
 	GString *raw;
+
+	/**
+	 * The default frame, compressed, for clients that asked for that. NULL
+	 * when the event isn't worth compressing.
+	 */
+	GString *deflated;
+
+	/**
+	 * For broadcasts: set once the frames have been made. They're only made
+	 * the first time a client of the protocol gets the broadcast.
+	 */
+	gsize made;
+
+	/**
+	 * For broadcasts: set once compressing has been tried. Broadcasts are
+	 * only compressed the first time a client that asked for that gets one,
+	 * so nothing is compressed when no one wants it.
+	 */
+	gsize deflate_tried;
+};
+
+/**
+ * A broadcast that has been framed once for every protocol. Frames are never
+ * modified once made, so they may be shared, by reference, by everything that
+ * needs to write them out, no matter how many clients that is. Nothing is
+ * framed until the first client that needs it, so protocols and formats
+ * that no one is using cost nothing.
+ *
+ * What's shared is the framing, not the bytes on the wire: quick-event owns
+ * every client's write buffer, so qev_write() still copies the frame into
+ * each client's buffer, once per client.
+ */
+struct protocol_bcast {
+	/**
+	 * Number of references held to these frames
+	 */
+	guint refs;
+
+	/**
+	 * What was broadcast, kept for making frames as they're needed
+	 */
+	gchar *ev_path;
+	gchar *json;
+
+	/**
+	 * Roughly how many bytes the broadcast is: its path and its data
+	 */
+	gsize len;
+
+	/**
+	 * When the broadcast was queued to be sent, in monotonic time, and a
+	 * flag set once it's first written out to a subscriber. Maintained by
+	 * whoever broadcasts it.
+	 */
+	gint64 queued;
+	gsize written;
+
+	/**
+	 * Set once batched has been made
+	 */
+	gsize batched_made;
+
+	/**
+	 * The event, formatted but not framed, for clients that batch
+	 */
+	GString *batched;
+
+	/**
+	 * Frames for each protocol, indexed by protocol->id
+	 */
+	struct protocol_frames frames[];
 };
 
 /**
@@ -151,9 +228,12 @@ struct protocol {
 	enum protocol_status (*route)(struct client *client, gsize *used);
 
 	/**
-	 * Send a heartbeat to a client, if necessary
+	 * Send a heartbeat to a client, if necessary, and say when it next
+	 * needs to be looked at, in monotonic time. G_MAXINT64 if never.
 	 */
-	void (*heartbeat)(struct client *client, const struct protocol_heartbeat *hb);
+	gint64 (*heartbeat)(
+		struct client *client,
+		const struct protocol_heartbeat *hb);
 
 	/**
 	 * Frames the data in whatever the protocol dictates such that it
@@ -165,11 +245,40 @@ struct protocol {
 		const evs_cb_t server_cb,
 		const gchar *json);
 
+	/**
+	 * Puts a payload of formatted events, joined by newlines, into a frame
+	 * that can be directly written via qev_write(). Takes ownership of the
+	 * payload. Protocols without this can't batch.
+	 */
+	GString* (*wrap)(GString *payload);
+
+	/**
+	 * Compresses a frame made by frame() or wrap() for clients that asked
+	 * for compression. Returns NULL if the frame isn't worth compressing.
+	 * Protocols without this never compress.
+	 */
+	GString* (*deflate)(const GString *frame);
+
 	/**
 	 * Send a frame to a client.
 	 */
 	void (*send)(struct client *client, const struct protocol_frames *frames);
 
+	/**
+	 * Sends a broadcast to a client. Protocols without this are sent their
+	 * frame from the broadcast with send(), or as a normal frame if they
+	 * have no send(). The broadcast may be referenced for as long as the
+	 * protocol needs it.
+	 */
+	void (*bcast)(struct client *client, struct protocol_bcast *bcast);
+
+	/**
+	 * Finishes anything the protocol has been putting together for the
+	 * client, right before everything gathered for it is written. Called
+	 * with the client locked.
+	 */
+	void (*flush)(struct client *client);
+
 	/**
 	 * Sends a final farewell message to clients before they close.
 	 */
@@ -220,6 +329,45 @@ void protocols_send(
 	const evs_cb_t server_cb,
 	const gchar *json);
 
+/**
+ * Start gathering events to clients, from the calling thread, instead of
+ * writing each as it's sent. Calls may be nested.
+ */
+void protocols_batch_begin();
+
+/**
+ * Stop gathering events. When the outermost gathering ends, every client
+ * that events were gathered for is sent all of them in a single write: as
+ * one frame for clients that batch, or as their frames back-to-back for
+ * everyone else.
+ *
+ * @return
+ *     If this ended the outermost gathering, and everything gathered has
+ *     been written.
+ */
+gboolean protocols_batch_end();
+
+/**
+ * Get the buffer that frames for the client are being gathered into, for
+ * protocols that put together frames of their own. Anything added to it is
+ * written along with everything else gathered for the client, once the
+ * calling thread stops gathering. The client must be locked.
+ *
+ * @param client
+ *     The client to gather for
+ *
+ * @return
+ *     The buffer, or NULL if the calling thread isn't gathering and nothing
+ *     is waiting to go out to the client: frames should be written right
+ *     away.
+ */
+GString* protocols_gathering(struct client *client);
+
+/**
+ * Update the writes stats
+ */
+void protocols_update_stats();
+
 /**
  * Notification that a client was closed.
  *
@@ -231,7 +379,10 @@ void protocols_send(
 void protocols_closed(struct client *client, guint reason);
 
 /**
- * Get an array of framed events, one for each protocol.
+ * Set up a broadcast for framing. Each protocol's frames are built exactly
+ * once, by the first client that needs them, and are then shared by every
+ * client that receives the broadcast (though still copied into each
+ * client's write buffer).
  *
  * @param ev_path
  *     The path of the event
@@ -240,34 +391,60 @@ void protocols_closed(struct client *client, guint reason);
  *
  * @return
  *     The frames that can be passed to protocols_bcast_write() to send
- *     to a client. Must be freed with protocols_bcast_free() when done.
+ *     to a client. Starts with 1 reference that must be released with
+ *     protocols_bcast_unref().
  */
-struct protocol_frames* protocols_bcast(const gchar *ev_path, const gchar *json);
+struct protocol_bcast* protocols_bcast(const gchar *ev_path, const gchar *json);
 
 /**
- * Writes the broadcast to the given client
+ * Get the broadcast's frames for a protocol, making them if no client of the
+ * protocol has needed them yet.
+ */
+const struct protocol_frames* protocols_bcast_frames(
+	struct protocol_bcast *bcast,
+	const struct protocol *prot);
+
+/**
+ * Writes the broadcast to the given client. The client's protocol might
+ * hold on to a reference to the broadcast until it's done with it.
  */
 void protocols_bcast_write(
 	struct client *client,
-	const struct protocol_frames *frames);
+	struct protocol_bcast *bcast);
 
 /**
- * Frees up the frames allocated by protocols_bcast().
+ * Get another reference to the frames.
+ *
+ * @return
+ *     The frames, for chaining.
  */
-void protocols_bcast_free(struct protocol_frames *frames);
+struct protocol_bcast* protocols_bcast_ref(struct protocol_bcast *bcast);
+
+/**
+ * Release a reference to the frames. When the final reference is released,
+ * the frames are freed.
+ */
+void protocols_bcast_unref(struct protocol_bcast *bcast);
 
 /**
  * Run any necessary heartbeating on the given client.
+ *
+ * @return
+ *     When the client next needs a heartbeat, in monotonic time. G_MAXINT64
+ *     if it never will.
  */
-void protocols_heartbeat(
+gint64 protocols_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb);
 
 /**
  * Get the heartbeat intervals that should be used in this round of periodic
  * tasks.
+ *
+ * @param now
+ *     The time the round is being run for, in monotonic time
  */
-struct protocol_heartbeat protocols_heartbeat_get_intervals();
+struct protocol_heartbeat protocols_heartbeat_get_intervals(const gint64 now);
 
 /**
  * Switch a client to a different protocol.
@@ -23,6 +23,11 @@
  */
 #define HTTP_PROTOCOL_KEY "Sec-WebSocket-Protocol"
 
+/**
+ * The header key that lists the extensions the client would like to use
+ */
+#define HTTP_EXTENSIONS_KEY "Sec-WebSocket-Extensions"
+
 /**
  * Where HTTP stores its `Connection` header
  */
@@ -479,6 +484,7 @@ static enum protocol_status _do_headers_websocket(
 	gchar *protocol = qev_http_request_header(headers, HTTP_PROTOCOL_KEY);
 	gchar *upgrade = qev_http_request_header(headers, HTTP_UPGRADE);
 	gchar *version = qev_http_request_header(headers, HTTP_VERSION_KEY);
+	gchar *extensions = qev_http_request_header(headers, HTTP_EXTENSIONS_KEY);
 
 	if (upgrade == NULL ||
 		connection == NULL ||
@@ -493,7 +499,7 @@ static enum protocol_status _do_headers_websocket(
 		qev_stats_counter_inc(_stat_headers_upgrade_invalid);
 		_send_error(client, STATUS_400);
 	} else {
-		protocol_rfc6455_upgrade(client, key);
+		protocol_rfc6455_upgrade(client, key, extensions);
 		return PROT_AGAIN;
 	}
 
@@ -731,29 +737,44 @@ enum protocol_status protocol_http_route(struct client *client, gsize *used)
 	return status;
 }
 
-void protocol_http_heartbeat(
+gint64 protocol_http_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb)
 {
 	if (qev_is_surrogate(client)) {
 		struct client *surrogate = client;
 
-		if (surrogate->http.client == NULL &&
-			surrogate->last_send < hb->timeout) {
+		/*
+		 * While a poller is attached, it's the one heartbeating, and the
+		 * surrogate just needs another look once the poll could be done.
+		 */
+		if (surrogate->http.client != NULL) {
+			return hb->now + (hb->now - hb->timeout);
+		}
 
+		if (surrogate->last_send < hb->timeout) {
 			qev_close(surrogate, RAW_HEARTATTACK);
+			return G_MAXINT64;
+		}
+
+		return surrogate->last_send + (hb->now - hb->timeout);
+	}
+
+	if (client->http.client == NULL) {
+		if (client->last_send < hb->heartbeat) {
+			qev_close(client, RAW_HEARTATTACK);
+			return G_MAXINT64;
 		}
 	} else {
-		if (client->http.client == NULL) {
-			if (client->last_send < hb->heartbeat) {
-				qev_close(client, RAW_HEARTATTACK);
-			}
-		} else {
-			if (client->last_send < hb->poll) {
-				_send_error(client, STATUS_200);
-			}
+		if (client->last_send < hb->poll) {
+			_send_error(client, STATUS_200);
 		}
 	}
+
+	/*
+	 * A poller could attach at any time, so always be ready to flush it
+	 */
+	return client->last_send + (hb->now - hb->poll);
 }
 
 struct protocol_frames protocol_http_frame(
@@ -75,7 +75,7 @@ enum protocol_status protocol_http_route(struct client *client, gsize *used);
 /**
  * Sends a heartbeat to a client
  */
-void protocol_http_heartbeat(
+gint64 protocol_http_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb);
 
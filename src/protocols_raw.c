@@ -12,10 +12,24 @@
 
 #define HANDSHAKE "/qio/ohai"
 
+/**
+ * Asks for events to be batched. The client must send this in one piece:
+ * it's indistinguishable from HANDSHAKE until the whole thing is there.
+ */
+#define HANDSHAKE_BATCH "/qio/ohai/batch"
+
+/**
+ * Asks for virtual clients to be multiplexed over the connection. Like
+ * HANDSHAKE_BATCH, it must be sent in one piece.
+ */
+#define HANDSHAKE_MUX "/qio/ohai/mux"
+
 #define HEARTBEAT "\x00\x00\x00\x00\x00\x00\x00\x15" PROTOCOLS_HEARTBEAT
 
 static qev_stats_counter_t *_stat_handshakes;
 static qev_stats_timer_t *_stat_route_time;
+static qev_stats_counter_t *_stat_mux_clients;
+static qev_stats_counter_t *_stat_mux_collapsed;
 
 static enum evs_status _heartbeat_cb(
 	struct client *client G_GNUC_UNUSED,
@@ -26,6 +40,183 @@ static enum evs_status _heartbeat_cb(
 	return EVS_STATUS_OK;
 }
 
+/**
+ * Get the link a virtual client is carried over.
+ *
+ * @return
+ *     The link, referenced, or NULL if the virtual client was closed.
+ */
+static struct client* _mux_link(struct client *client)
+{
+	struct client *link;
+
+	qev_lock(client);
+	link = client->mux.link == NULL ? NULL : qev_ref(client->mux.link);
+	qev_unlock(client);
+
+	return link;
+}
+
+/**
+ * Frame an event for virtual clients and send it down their link, along
+ * with everything else gathered for the link. The link must be locked.
+ *
+ * @param link
+ *     The link the virtual clients are on
+ * @param event
+ *     The formatted event, or NULL to say the virtual clients are gone
+ * @param ids
+ *     Every virtual client the event is for, separated by commas
+ * @param ids_len
+ *     The length of ids
+ */
+static void _mux_write(
+	struct client *link,
+	const GString *event,
+	const gchar *ids,
+	const gsize ids_len)
+{
+	union {
+		guint64 i;
+		gchar s[sizeof(guint64)];
+	} size;
+	GString *frame = protocols_gathering(link);
+	gboolean now = frame == NULL;
+
+	if (now) {
+		frame = qev_buffer_get();
+	}
+
+	size.i = GUINT64_TO_BE((event == NULL ? 0 : event->len) + 1 + ids_len);
+	g_string_append_len(frame, size.s, sizeof(size));
+
+	if (event != NULL) {
+		qev_buffer_append_buff(frame, event);
+	}
+
+	g_string_append_c(frame, '\n');
+	g_string_append_len(frame, ids, ids_len);
+
+	if (now) {
+		link->last_send = qev_monotonic;
+		qev_write(link, frame->str, frame->len);
+		qev_buffer_put(frame);
+	}
+}
+
+/**
+ * Write out the broadcast that's waiting for more virtual clients, if there
+ * is one. The link must be locked.
+ */
+static void _mux_finish(struct client *link)
+{
+	struct protocol_bcast *bcast = link->mux.bcast;
+	GString *ids = link->mux.bcast_ids;
+
+	if (bcast == NULL) {
+		return;
+	}
+
+	link->mux.bcast = NULL;
+	link->mux.bcast_ids = NULL;
+
+	_mux_write(link, protocols_bcast_frames(bcast, protocol_raw_mux)->def,
+				ids->str, ids->len);
+
+	protocols_bcast_unref(bcast);
+	qev_buffer_put(ids);
+}
+
+/**
+ * Find a virtual client on a link, creating it if asked.
+ *
+ * @return
+ *     The virtual client, referenced, or NULL if there's no such client
+ *     and one couldn't be created.
+ */
+static struct client* _mux_get(
+	struct client *link,
+	const guint64 id,
+	const gboolean create)
+{
+	struct client *client = NULL;
+
+	qev_lock(link);
+
+	if (link->mux.clients != NULL) {
+		client = g_hash_table_lookup(link->mux.clients, &id);
+
+		if (client == NULL && create) {
+			client = protocols_new_surrogate(protocol_raw_mux);
+			if (client != NULL) {
+				client->mux.link = qev_ref(link);
+				client->mux.id = id;
+				g_hash_table_insert(link->mux.clients,
+									&client->mux.id, client);
+				qev_stats_counter_inc(_stat_mux_clients);
+			}
+		}
+
+		if (client != NULL) {
+			qev_ref(client);
+		}
+	}
+
+	qev_unlock(link);
+
+	return client;
+}
+
+static enum protocol_status _handle(struct client *client, gchar *event);
+
+/**
+ * Handles a frame from a link: an event for one of its virtual clients, or
+ * a note that one is gone.
+ */
+static enum protocol_status _mux_handle(struct client *link, gchar *frame)
+{
+	gchar *end;
+	guint64 id;
+	gchar ids[24];
+	gsize ids_len;
+	struct client *client;
+
+	id = g_ascii_strtoull(frame, &end, 10);
+	if ((*end != ' ' && *end != '\0') || frame == end ||
+		(id == G_MAXUINT64 && errno == ERANGE)) {
+		qev_close(link, RAW_INVALID_EVENT_FORMAT);
+		return PROT_FATAL;
+	}
+
+	client = _mux_get(link, id, *end != '\0');
+
+	if (client == NULL) {
+		/*
+		 * No room for another client: let the other side know it's gone
+		 */
+		if (*end != '\0') {
+			ids_len = g_snprintf(ids, sizeof(ids), "%" G_GUINT64_FORMAT, id);
+
+			qev_lock(link);
+			_mux_write(link, NULL, ids, ids_len);
+			qev_unlock(link);
+		}
+
+		return PROT_OK;
+	}
+
+	if (*end == '\0') {
+		qev_close(client, RAW_MUX_CLOSED);
+	} else {
+		client->last_recv = qev_monotonic;
+		_handle(client, end + 1);
+	}
+
+	qev_unref(client);
+
+	return PROT_OK;
+}
+
 void protocol_raw_init()
 {
 	_stat_handshakes = qev_stats_counter(
@@ -34,17 +225,27 @@ void protocol_raw_init()
 	_stat_route_time = qev_stats_timer(
 		"protocol.raw", "route",
 		"How long it took to route an event");
+	_stat_mux_clients = qev_stats_counter(
+		"protocol.raw", "mux_clients", FALSE,
+		"How many virtual clients are open on links");
+	_stat_mux_collapsed = qev_stats_counter(
+		"protocol.raw", "mux_collapsed", TRUE,
+		"How many broadcasts to virtual clients were added to a frame "
+		"already headed down their link");
 }
 
 enum protocol_handles protocol_raw_handles(struct client *client)
 {
 	gchar *str = client->qev_client.rbuff->str;
 
-	if (g_strcmp0(str, HANDSHAKE) == 0) {
+	if (g_strcmp0(str, HANDSHAKE) == 0 ||
+		g_strcmp0(str, HANDSHAKE_BATCH) == 0 ||
+		g_strcmp0(str, HANDSHAKE_MUX) == 0) {
 		return PROT_YES;
 	}
 
-	if (g_str_has_prefix(HANDSHAKE, str)) {
+	if (g_str_has_prefix(HANDSHAKE_BATCH, str) ||
+		g_str_has_prefix(HANDSHAKE_MUX, str)) {
 		return PROT_MAYBE;
 	}
 
@@ -58,7 +259,17 @@ enum protocol_status protocol_raw_handshake(struct client *client)
      * to make sure it exists first.
      */
 
-	qev_write(client, HANDSHAKE, sizeof(HANDSHAKE) -1);
+	if (g_strcmp0(client->qev_client.rbuff->str, HANDSHAKE_BATCH) == 0) {
+		client->protocol.batch = TRUE;
+		qev_write(client, HANDSHAKE_BATCH, sizeof(HANDSHAKE_BATCH) - 1);
+	} else if (g_strcmp0(client->qev_client.rbuff->str, HANDSHAKE_MUX) == 0) {
+		client->protocol.flags.raw.mux = TRUE;
+		client->mux.clients = g_hash_table_new(g_int64_hash, g_int64_equal);
+		qev_write(client, HANDSHAKE_MUX, sizeof(HANDSHAKE_MUX) - 1);
+	} else {
+		qev_write(client, HANDSHAKE, sizeof(HANDSHAKE) -1);
+	}
+
 	g_string_truncate(client->qev_client.rbuff, 0);
 
 	qev_stats_counter_inc(_stat_handshakes);
@@ -92,18 +303,23 @@ enum protocol_status protocol_raw_route(struct client *client, gsize *used)
 
 	qev_stats_time(_stat_route_time, {
 		start[len] = '\0';
-		status = protocol_raw_handle(client, start);
+		if (client->protocol.flags.raw.mux) {
+			status = _mux_handle(client, start);
+		} else {
+			status = protocol_raw_handle(client, start);
+		}
 		*used += total_len;
 	});
 
 	return status;
 }
 
-void protocol_raw_heartbeat(
+gint64 protocol_raw_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb)
 {
-	protocol_raw_do_heartbeat(client, hb, HEARTBEAT, sizeof(HEARTBEAT) - 1);
+	return protocol_raw_do_heartbeat(client, hb,
+					HEARTBEAT, sizeof(HEARTBEAT) - 1);
 }
 
 struct protocol_frames protocol_raw_frame(
@@ -111,20 +327,26 @@ struct protocol_frames protocol_raw_frame(
 	const gchar *ev_extra,
 	const evs_cb_t server_cb,
 	const gchar *json)
+{
+	GString *buff = protocol_raw_format(ev_path, ev_extra, server_cb, json);
+
+	return (struct protocol_frames){
+		.def = protocol_raw_wrap(buff),
+		.raw = NULL,
+	};
+}
+
+GString* protocol_raw_wrap(GString *payload)
 {
 	union {
 		guint64 i;
 		gchar s[sizeof(guint64)];
 	} size;
-	GString *buff = protocol_raw_format(ev_path, ev_extra, server_cb, json);
 
-	size.i = GUINT64_TO_BE(buff->len);
-	g_string_prepend_len(buff, size.s, sizeof(size));
+	size.i = GUINT64_TO_BE(payload->len);
+	g_string_prepend_len(payload, size.s, sizeof(size));
 
-	return (struct protocol_frames){
-		.def = buff,
-		.raw = NULL,
-	};
+	return payload;
 }
 
 GString* protocol_raw_format(
@@ -151,29 +373,46 @@ gboolean protocol_raw_check_handshake(struct client *client)
 	GString *rbuff = client->qev_client.rbuff;
 
 	good = g_strcmp0(rbuff->str, HANDSHAKE) == 0;
+	if (!good && g_strcmp0(rbuff->str, HANDSHAKE_BATCH) == 0) {
+		good = TRUE;
+		client->protocol.batch = TRUE;
+	}
+
 	qev_buffer_clear(rbuff);
 
 	return good;
 }
 
-void protocol_raw_do_heartbeat(
+gint64 protocol_raw_do_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb,
 	const gchar *heartbeat,
 	const gsize heartbeat_len)
 {
+	gint64 next;
+
 	if (client->last_recv < hb->dead) {
 		qev_close(client, RAW_HEARTATTACK);
-	} else if (client->last_recv < hb->challenge) {
+		return G_MAXINT64;
+	}
+
+	if (client->last_recv < hb->challenge) {
 		evs_send_bruteforce(client, "/qio", "/heartbeat", NULL, NULL,
 						_heartbeat_cb, NULL, NULL);
-	} else if (client->last_send < hb->heartbeat) {
-		qev_write(client, heartbeat, heartbeat_len);
-		client->last_send = qev_monotonic;
+		next = client->last_recv + (hb->now - hb->dead);
+	} else {
+		if (client->last_send < hb->heartbeat) {
+			qev_write(client, heartbeat, heartbeat_len);
+			client->last_send = qev_monotonic;
+		}
+
+		next = client->last_recv + (hb->now - hb->challenge);
 	}
+
+	return MIN(next, client->last_send + (hb->now - hb->heartbeat));
 }
 
-enum protocol_status protocol_raw_handle(struct client *client, gchar *event)
+static enum protocol_status _handle(struct client *client, gchar *event)
 {
 	gchar *ev_path;
 	evs_cb_t client_cb;
@@ -206,3 +445,199 @@ error:
 	qev_close(client, RAW_INVALID_EVENT_FORMAT);
 	return PROT_FATAL;
 }
+
+enum protocol_status protocol_raw_handle(struct client *client, gchar *event)
+{
+	gchar *next;
+	enum protocol_status status = PROT_OK;
+
+	if (!client->protocol.batch) {
+		return _handle(client, event);
+	}
+
+	while (event != NULL && status == PROT_OK) {
+		next = strchr(event, '\n');
+		if (next != NULL) {
+			*next = '\0';
+			next++;
+		}
+
+		if (*event != '\0') {
+			status = _handle(client, event);
+		}
+
+		event = next;
+	}
+
+	return status;
+}
+
+void protocol_raw_flush(struct client *client)
+{
+	_mux_finish(client);
+}
+
+void protocol_raw_close(struct client *client, guint reason G_GNUC_UNUSED)
+{
+	GHashTable *clients;
+	GHashTableIter iter;
+	struct client *vclient;
+
+	if (!client->protocol.flags.raw.mux) {
+		return;
+	}
+
+	/*
+	 * Once the table is gone, virtual clients stop looking for themselves
+	 * in it, so they're only safe to touch if referenced before it's gone.
+	 */
+	qev_lock(client);
+
+	clients = client->mux.clients;
+	client->mux.clients = NULL;
+
+	g_hash_table_iter_init(&iter, clients);
+	while (g_hash_table_iter_next(&iter, NULL, (void**)&vclient)) {
+		qev_ref(vclient);
+	}
+
+	qev_unlock(client);
+
+	g_hash_table_iter_init(&iter, clients);
+	while (g_hash_table_iter_next(&iter, NULL, (void**)&vclient)) {
+		qev_close(vclient, RAW_MUX_CLOSED);
+		qev_unref(vclient);
+	}
+
+	g_hash_table_unref(clients);
+}
+
+enum protocol_handles protocol_raw_mux_handles(
+	struct client *client G_GNUC_UNUSED)
+{
+	return PROT_NO;
+}
+
+struct protocol_frames protocol_raw_mux_frame(
+	const gchar *ev_path,
+	const gchar *ev_extra,
+	const evs_cb_t server_cb,
+	const gchar *json)
+{
+	return (struct protocol_frames){
+		.def = protocol_raw_format(ev_path, ev_extra, server_cb, json),
+		.raw = NULL,
+	};
+}
+
+void protocol_raw_mux_send(
+	struct client *client,
+	const struct protocol_frames *pframes)
+{
+	gchar id[24];
+	gsize id_len;
+	struct client *link = _mux_link(client);
+
+	if (link == NULL) {
+		return;
+	}
+
+	id_len = g_snprintf(id, sizeof(id), "%" G_GUINT64_FORMAT, client->mux.id);
+
+	qev_lock(link);
+
+	if (!qev_is_closing(link)) {
+		/*
+		 * Anything already headed to the client has to get there first
+		 */
+		_mux_finish(link);
+		_mux_write(link, pframes->def, id, id_len);
+	}
+
+	qev_unlock(link);
+	qev_unref(link);
+}
+
+void protocol_raw_mux_bcast(
+	struct client *client,
+	struct protocol_bcast *bcast)
+{
+	gchar id[24];
+	gsize id_len;
+	struct client *link = _mux_link(client);
+
+	if (link == NULL) {
+		return;
+	}
+
+	id_len = g_snprintf(id, sizeof(id), "%" G_GUINT64_FORMAT, client->mux.id);
+
+	qev_lock(link);
+
+	if (qev_is_closing(link)) {
+		qev_unlock(link);
+		qev_unref(link);
+		return;
+	}
+
+	if (link->mux.bcast == bcast) {
+		g_string_append_c(link->mux.bcast_ids, ',');
+		g_string_append_len(link->mux.bcast_ids, id, id_len);
+		qev_stats_counter_inc(_stat_mux_collapsed);
+	} else {
+		_mux_finish(link);
+
+		/*
+		 * Only worth waiting for more clients if the frame can't go out
+		 * right away anyway. Whatever's waiting goes out when the link is
+		 * flushed, at the latest.
+		 */
+		if (protocols_gathering(link) != NULL) {
+			link->mux.bcast = protocols_bcast_ref(bcast);
+			link->mux.bcast_ids = qev_buffer_get();
+			g_string_append_len(link->mux.bcast_ids, id, id_len);
+		} else {
+			_mux_write(link, protocols_bcast_frames(bcast, protocol_raw_mux)->def,
+						id, id_len);
+		}
+	}
+
+	qev_unlock(link);
+	qev_unref(link);
+}
+
+void protocol_raw_mux_close(struct client *client, guint reason)
+{
+	gchar id[24];
+	gsize id_len;
+	struct client *link;
+
+	qev_lock(client);
+	link = client->mux.link;
+	client->mux.link = NULL;
+	qev_unlock(client);
+
+	if (link == NULL) {
+		return;
+	}
+
+	id_len = g_snprintf(id, sizeof(id), "%" G_GUINT64_FORMAT, client->mux.id);
+
+	qev_lock(link);
+
+	if (link->mux.clients != NULL &&
+		g_hash_table_lookup(link->mux.clients, &client->mux.id) == client) {
+
+		g_hash_table_remove(link->mux.clients, &client->mux.id);
+	}
+
+	if (reason != RAW_MUX_CLOSED && !qev_is_closing(link)) {
+		_mux_finish(link);
+		_mux_write(link, NULL, id, id_len);
+	}
+
+	qev_unlock(link);
+	qev_unref(link);
+
+	qev_stats_counter_dec(_stat_mux_clients);
+}
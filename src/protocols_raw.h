@@ -3,6 +3,22 @@
  * plain text using the QIO protocol.
  * @file
  *
+ * Connections that handshake with `/qio/ohai/mux` become links that carry
+ * any number of virtual clients, each a client of its own, with its own
+ * subscriptions and callbacks, but all sharing the one socket. Every frame
+ * on a link is tagged with the virtual clients it belongs to:
+ *
+ *     <id> <event>            (to the server: an event from virtual client id,
+ *                              which is created if it's new)
+ *     <id>                    (to the server: virtual client id is gone)
+ *     <event>\n<id>[,<id>]*   (from the server: an event for every id listed)
+ *     \n<id>                  (from the server: virtual client id was closed)
+ *
+ * A broadcast going to many of the virtual clients on a link goes out as a
+ * single frame, listing all of them. The ids come last so that they can be
+ * added to as the broadcast goes out, and the event may contain newlines:
+ * everything after the last one is the id list.
+ *
  * @author Andrew Stone <andrew@clovar.com>
  * @copyright 2012-2014 Clear Channel Inc.
  *
@@ -28,6 +44,11 @@ enum raw_close_reasons {
 	 * when a heartbeat challenge was sent.)
 	 */
 	RAW_HEARTATTACK,
+
+	/**
+	 * The virtual client was closed by its link, or the link itself closed
+	 */
+	RAW_MUX_CLOSED,
 };
 
 /**
@@ -44,6 +65,11 @@ enum protocol_raw_hb {
  */
 struct protocol *protocol_raw;
 
+/**
+ * The functions for virtual clients carried over raw links.
+ */
+struct protocol *protocol_raw_mux;
+
 /**
  * Sets up everything to run
  */
@@ -67,10 +93,20 @@ enum protocol_status protocol_raw_route(struct client *client, gsize *used);
 /**
  * Sends a heartbeat to a client
  */
-void protocol_raw_heartbeat(
+gint64 protocol_raw_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb);
 
+/**
+ * Writes out anything put together for the virtual clients on a link.
+ */
+void protocol_raw_flush(struct client *client);
+
+/**
+ * Closes every virtual client on a link.
+ */
+void protocol_raw_close(struct client *client, guint reason);
+
 /**
  * Frames data to send out to a client.
  *
@@ -83,6 +119,11 @@ struct protocol_frames protocol_raw_frame(
 	const evs_cb_t server_cb,
 	const gchar *json);
 
+/**
+ * Put a payload into a raw frame, in place.
+ */
+GString* protocol_raw_wrap(GString *payload);
+
 /**
  * Formats an event into the QIO protocol
  *
@@ -105,21 +146,28 @@ GString* protocol_raw_format(
 	const gchar *json);
 
 /**
- * Checks that the data received is indeed a valid QIO handshake
+ * Checks that the data received is indeed a valid QIO handshake, noting if
+ * the client asked for batching.
  */
 gboolean protocol_raw_check_handshake(struct client *client);
 
 /**
- * Checks that the data received is indeed a valid QIO handshake
+ * Heartbeats a client that speaks the QIO protocol: a simple heartbeat when
+ * nothing has been sent for a while, and a challenge when nothing has been
+ * heard.
+ *
+ * @return
+ *     When the client next needs to be looked at
  */
-void protocol_raw_do_heartbeat(
+gint64 protocol_raw_do_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb,
 	const gchar *heartbeat,
 	const gsize heartbeat_len);
 
 /**
- * Handles a raw frame from a client.
+ * Handles a raw frame from a client. Clients that batch may send several
+ * events in a frame, one per line.
  *
  * @param client
  *     The client that sent the event
@@ -127,3 +175,43 @@ void protocol_raw_do_heartbeat(
  *     The raw event from the client. MUST be NULL-terminated.
  */
 enum protocol_status protocol_raw_handle(struct client *client, gchar *event);
+
+/**
+ * Virtual clients only ever come from links: this never handles a client.
+ */
+enum protocol_handles protocol_raw_mux_handles(struct client *client);
+
+/**
+ * Formats an event for a virtual client. It's tagged with the virtual
+ * client's id and framed when it's written to the link.
+ *
+ * @return
+ *     A buffer containing the formatted event. @arg{transfer-full}
+ */
+struct protocol_frames protocol_raw_mux_frame(
+	const gchar *ev_path,
+	const gchar *ev_extra,
+	const evs_cb_t server_cb,
+	const gchar *json);
+
+/**
+ * Sends an event to a virtual client, over its link.
+ */
+void protocol_raw_mux_send(
+	struct client *client,
+	const struct protocol_frames *pframes);
+
+/**
+ * Sends a broadcast to a virtual client, over its link. While the calling
+ * thread is gathering, the same broadcast to other virtual clients on the
+ * link is added to the same frame.
+ */
+void protocol_raw_mux_bcast(
+	struct client *client,
+	struct protocol_bcast *bcast);
+
+/**
+ * Detaches a virtual client from its link, telling the other side about it
+ * unless the close came from there.
+ */
+void protocol_raw_mux_close(struct client *client, guint reason);
@@ -7,6 +7,16 @@
  */
 
 #include "quickio.h"
+#include <zlib.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define HAVE_AVX2
+#endif
 
 /**
  * Ready for the B64-encoded key to be appended. Must be followed with \r\n\r\n
@@ -20,6 +30,16 @@
 	HTTP_NOCACHE \
 	"Sec-WebSocket-Accept: "
 
+/**
+ * Sent back to clients that offered permessage-deflate. Without any context
+ * takeover on either side, every message is compressed on its own, so a
+ * single compressed broadcast is good for every client, and nothing has to
+ * be kept around for each client between messages.
+ */
+#define HTTP_DEFLATE \
+	"Sec-WebSocket-Extensions: permessage-deflate; " \
+	"server_no_context_takeover; client_no_context_takeover\r\n"
+
 /**
  * From: http://tools.ietf.org/html/rfc6455#section-1.3
  */
@@ -29,6 +49,7 @@
  * Predefined and formatted RFC6455 messages
  */
 #define QIO_HANDSHAKE "\x81\x09/qio/ohai"
+#define QIO_HANDSHAKE_BATCH "\x81\x0f/qio/ohai/batch"
 #define HEARTBEAT "\x81""\x15" PROTOCOLS_HEARTBEAT
 
 /**
@@ -38,6 +59,7 @@
 #define PAYLOAD_MEDIUM 126
 #define PAYLOAD_LONG 127
 #define MASK_FIN 0x80
+#define MASK_RSV1 0x40
 #define MASK_OPCODE 0x0f
 #define MASKED_BIT 0x80
 #define MASK_LEN 0x7f
@@ -46,39 +68,493 @@
 #define OPCODE_TEXT 0x01
 #define OPCODE_CLOSE 0x08
 
+/**
+ * Text frames, with and without RSV1 marking them as compressed
+ */
+#define FRAME_TEXT (MASK_FIN | OPCODE_TEXT)
+#define FRAME_TEXT_DEFLATED (MASK_FIN | MASK_RSV1 | OPCODE_TEXT)
+
+/**
+ * What every compressed message ends with, and what's stripped from them,
+ * from: http://tools.ietf.org/html/rfc7692#section-7.2.1
+ */
+#define DEFLATE_TAIL "\x00\x00\xff\xff"
+
+/**
+ * Largest a compressed message from a client may inflate to
+ */
+#define INFLATED_MAX (1 << 20)
+
 static qev_stats_counter_t *_stat_upgrades;
 static qev_stats_counter_t *_stat_handshakes_good;
 static qev_stats_counter_t *_stat_handshakes_bad;
 static qev_stats_timer_t *_stat_route_time;
+static qev_stats_counter_t *_stat_deflate_in;
+static qev_stats_counter_t *_stat_deflate_out;
+
+static void _deflater_free(void *z);
+static void _inflater_free(void *z);
+
+/**
+ * Each thread keeps its own zlib streams, reset after every message
+ */
+static GPrivate _deflater = G_PRIVATE_INIT(_deflater_free);
+static GPrivate _inflater = G_PRIVATE_INIT(_inflater_free);
+
+/**
+ * Where UTF-8 validation is at between blocks
+ */
+struct _utf8 {
+	/**
+	 * Number of continuation bytes still expected
+	 */
+	guint8 need;
+
+	/**
+	 * Range the next continuation byte must fall in. Only the first
+	 * continuation byte is ever narrowed: that's where overlong encodings,
+	 * surrogates, and anything past U+10FFFF are caught.
+	 */
+	guint8 lo;
+	guint8 hi;
+};
+
+typedef gboolean (*_unmask_fn)(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask);
+
+static gboolean _unmask_resolve(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask);
+
+/**
+ * The unmasking kernel for this CPU, picked on first use
+ */
+static _unmask_fn _unmask = _unmask_resolve;
+
+/**
+ * Validate a run of bytes, the slow way. Same rules as g_utf8_validate():
+ * no overlongs, surrogates, code points past U+10FFFF, or NULs.
+ */
+static gboolean _utf8_run(
+	struct _utf8 *u,
+	const guchar *s,
+	const guint64 len)
+{
+	guint64 i;
+
+	for (i = 0; i < len; i++) {
+		guchar c = s[i];
+
+		if (u->need > 0) {
+			if (c < u->lo || c > u->hi) {
+				return FALSE;
+			}
+
+			u->lo = 0x80;
+			u->hi = 0xbf;
+			u->need--;
+		} else if (c < 0x80) {
+			if (c == '\0') {
+				return FALSE;
+			}
+		} else if (c < 0xc2) {
+			return FALSE;
+		} else if (c < 0xe0) {
+			u->need = 1;
+			u->lo = 0x80;
+			u->hi = 0xbf;
+		} else if (c < 0xf0) {
+			u->need = 2;
+			u->lo = c == 0xe0 ? 0xa0 : 0x80;
+			u->hi = c == 0xed ? 0x9f : 0xbf;
+		} else if (c < 0xf5) {
+			u->need = 3;
+			u->lo = c == 0xf0 ? 0x90 : 0x80;
+			u->hi = c == 0xf4 ? 0x8f : 0xbf;
+		} else {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Unmask and validate whatever the vector kernels left over, 8 bytes at
+ * a time. Blocks that are plain ASCII without any NULs (nearly everything
+ * clients send) skip the byte-at-a-time validation.
+ */
+static gboolean _unmask_tail(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask,
+	guint64 i,
+	struct _utf8 *u)
+{
+	guint64 w;
+	guint64 start;
+	guint64 mask64 = ((guint64)mask << 32) | mask;
+	union {
+		guint32 i;
+		gchar c[4];
+	} m = { .i = mask };
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, from + i, sizeof(w));
+		w ^= mask64;
+		memcpy(to + i, &w, sizeof(w));
+
+		/*
+		 * High bits set, or a zero byte anywhere in the word
+		 */
+		if (u->need != 0 ||
+				(w & 0x8080808080808080llu) != 0 ||
+				((w - 0x0101010101010101llu) & ~w & 0x8080808080808080llu) != 0) {
+			if (!_utf8_run(u, (guchar*)to + i, sizeof(w))) {
+				return FALSE;
+			}
+		}
+	}
+
+	for (start = i; i < len; i++) {
+		to[i] = from[i] ^ m.c[i & 3];
+	}
+
+	return _utf8_run(u, (guchar*)to + start, len - start) && u->need == 0;
+}
+
+static gboolean _unmask_scalar(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask)
+{
+	struct _utf8 u = { .need = 0 };
+	return _unmask_tail(to, from, len, mask, 0, &u);
+}
+
+#ifdef __SSE2__
+
+	static gboolean _unmask_sse2(
+		gchar *to,
+		const gchar *from,
+		const guint64 len,
+		const guint32 mask)
+	{
+		guint64 i;
+		struct _utf8 u = { .need = 0 };
+		const __m128i m = _mm_set1_epi32(mask);
+		const __m128i zero = _mm_setzero_si128();
+
+		for (i = 0; i + sizeof(m) <= len; i += sizeof(m)) {
+			__m128i v = _mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)(from + i)), m);
+			_mm_storeu_si128((__m128i*)(to + i), v);
+
+			if (u.need != 0 ||
+					(_mm_movemask_epi8(v) |
+						_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) != 0) {
+				if (!_utf8_run(&u, (guchar*)to + i, sizeof(m))) {
+					return FALSE;
+				}
+			}
+		}
+
+		return _unmask_tail(to, from, len, mask, i, &u);
+	}
+
+#endif
+
+#ifdef HAVE_AVX2
+
+	__attribute__((target("avx2")))
+	static gboolean _unmask_avx2(
+		gchar *to,
+		const gchar *from,
+		const guint64 len,
+		const guint32 mask)
+	{
+		guint64 i;
+		struct _utf8 u = { .need = 0 };
+		const __m256i m = _mm256_set1_epi32(mask);
+		const __m256i zero = _mm256_setzero_si256();
+
+		for (i = 0; i + sizeof(m) <= len; i += sizeof(m)) {
+			__m256i v = _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*)(from + i)), m);
+			_mm256_storeu_si256((__m256i*)(to + i), v);
+
+			if (u.need != 0 ||
+					(_mm256_movemask_epi8(v) |
+						_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) != 0) {
+				if (!_utf8_run(&u, (guchar*)to + i, sizeof(m))) {
+					return FALSE;
+				}
+			}
+		}
+
+		return _unmask_tail(to, from, len, mask, i, &u);
+	}
+
+#endif
+
+static gboolean _unmask_resolve(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask)
+{
+	_unmask_fn fn = _unmask_scalar;
+
+	#ifdef __SSE2__
+		fn = _unmask_sse2;
+	#endif
+
+	#ifdef HAVE_AVX2
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			fn = _unmask_avx2;
+		}
+	#endif
+
+	g_atomic_pointer_set(&_unmask, fn);
+
+	return fn(to, from, len, mask);
+}
+
+static void _deflater_free(void *z)
+{
+	deflateEnd(z);
+	g_slice_free1(sizeof(z_stream), z);
+}
+
+static void _inflater_free(void *z)
+{
+	inflateEnd(z);
+	g_slice_free1(sizeof(z_stream), z);
+}
+
+/**
+ * Get the calling thread's stream for compressing, or for inflating.
+ */
+static z_stream* _zstream(const gboolean deflater)
+{
+	gint err;
+	GPrivate *key = deflater ? &_deflater : &_inflater;
+	z_stream *z = g_private_get(key);
+
+	if (z != NULL) {
+		return z;
+	}
+
+	z = g_slice_alloc0(sizeof(*z));
+
+	if (deflater) {
+		err = deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+						-MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	} else {
+		err = inflateInit2(z, -MAX_WBITS);
+	}
+
+	if (err != Z_OK) {
+		CRITICAL("Could not setup zlib stream: %s", z->msg ? : "unknown error");
+		g_slice_free1(sizeof(*z), z);
+		return NULL;
+	}
+
+	g_private_set(key, z);
+
+	return z;
+}
+
+static void _frame_header(GString *frame, const guint8 first, const gsize len)
+{
+	g_string_append_c(frame, first);
+
+	if (len <= PAYLOAD_SHORT) {
+		g_string_append_c(frame, (guint8)len);
+	} else if (len <= 0xffff) {
+		guint16 belen = GUINT16_TO_BE(len);
+		g_string_append_c(frame, (gchar)PAYLOAD_MEDIUM);
+		qev_buffer_append_len(frame, (gchar*)&belen, sizeof(belen));
+	} else {
+		guint64 belen = GUINT64_TO_BE(len);
+		g_string_append_c(frame, (gchar)PAYLOAD_LONG);
+		qev_buffer_append_len(frame, (gchar*)&belen, sizeof(belen));
+	}
+}
+
+/**
+ * Find the payload of a frame built by _frame_header()
+ */
+static const gchar* _frame_payload(const GString *frame, gsize *len)
+{
+	guint8 len7 = frame->str[1] & MASK_LEN;
+	gsize header_len = 2;
+
+	if (len7 == PAYLOAD_MEDIUM) {
+		header_len += sizeof(guint16);
+	} else if (len7 == PAYLOAD_LONG) {
+		header_len += sizeof(guint64);
+	}
+
+	*len = frame->len - header_len;
+	return frame->str + header_len;
+}
+
+/**
+ * Just unmask, without validating anything, for payloads that still have to
+ * be inflated before they mean anything.
+ */
+static void _unmask_only(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask)
+{
+	guint64 i;
+	guint64 w;
+	guint64 mask64 = ((guint64)mask << 32) | mask;
+	union {
+		guint32 i;
+		gchar c[4];
+	} m = { .i = mask };
 
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, from + i, sizeof(w));
+		w ^= mask64;
+		memcpy(to + i, &w, sizeof(w));
+	}
+
+	for (; i < len; i++) {
+		to[i] = from[i] ^ m.c[i & 3];
+	}
+}
+
+/**
+ * Inflate an unmasked message from a client.
+ *
+ * @return
+ *     The message, NUL-terminated, or NULL if it couldn't be inflated.
+ */
+static GString* _inflate(
+	struct client *client,
+	gchar *payload,
+	const guint64 len)
+{
+	gint err;
+	GString *msg;
+	gboolean tailed = FALSE;
+	static guchar tail[] = DEFLATE_TAIL;
+	z_stream *z = _zstream(FALSE);
+
+	if (z == NULL) {
+		qev_close(client, QEV_CLOSE_OUT_OF_MEM);
+		return NULL;
+	}
+
+	msg = qev_buffer_get();
+	/*
+	 * Never more than the limit, not even to start
+	 */
+	qev_buffer_ensure(msg, MIN(MAX(len * 4, 128), INFLATED_MAX));
+
+	z->next_in = (guchar*)payload;
+	z->avail_in = len;
+
+	/*
+	 * The tail stripped by the client goes back on once the payload is in,
+	 * and inflate() keeps going until everything is in and it had room to
+	 * spare.
+	 */
+	do {
+		if (z->avail_in == 0 && !tailed) {
+			z->next_in = tail;
+			z->avail_in = sizeof(tail) - 1;
+			tailed = TRUE;
+		}
+
+		if (msg->len + 1 >= msg->allocated_len) {
+			if (msg->len >= INFLATED_MAX) {
+				err = Z_MEM_ERROR;
+				break;
+			}
+
+			qev_buffer_ensure(msg,
+				MIN(msg->allocated_len * 2, INFLATED_MAX + 1));
+		}
+
+		z->next_out = (guchar*)msg->str + msg->len;
+		z->avail_out = msg->allocated_len - msg->len - 1;
+
+		err = inflate(z, Z_SYNC_FLUSH);
+		g_string_set_size(msg, (gchar*)z->next_out - msg->str);
+	} while ((err == Z_OK || err == Z_BUF_ERROR) &&
+		(!tailed || z->avail_in > 0 || z->avail_out == 0));
+
+	inflateReset(z);
+
+	if (err == Z_DATA_ERROR || err == Z_NEED_DICT || err == Z_STREAM_ERROR) {
+		qev_buffer_put(msg);
+		qev_close(client, RFC6455_BAD_DEFLATE);
+		return NULL;
+	}
+
+	if (err == Z_MEM_ERROR) {
+		qev_buffer_put(msg);
+		qev_close(client, QEV_CLOSE_OUT_OF_MEM);
+		return NULL;
+	}
+
+	if (!g_utf8_validate(msg->str, msg->len, NULL) ||
+			memchr(msg->str, '\0', msg->len) != NULL) {
+		qev_buffer_put(msg);
+		qev_close(client, RFC6455_NOT_UTF8);
+		return NULL;
+	}
+
+	qev_stats_counter_inc(_stat_deflate_in);
+
+	return msg;
+}
+
+/**
+ * Decode the frame sitting at offset in the client's buffer. Uncompressed
+ * messages are unmasked in place, at the start of the frame, and
+ * NUL-terminated; compressed messages are given back in inflated.
+ */
 static enum protocol_status _decode(
 	struct client *client,
 	const guint64 offset,
 	guint64 *len_,
-	guint64 *frame_len)
+	guint64 *frame_len,
+	GString **inflated)
 {
 	/*
 	 * See http://tools.ietf.org/html/rfc6455#section-5.2 for more on what's
 	 * going on here
 	 */
 
-	guint64 i;
 	guint64 len;
-	guint64 max;
 	guint64 total_len;
 	union {
 		guint32 i;
 		gchar c[4];
 	} mask;
-	union {
-		guint32 is[4];
-		__uint128_t i;
-	} mask128;
 	GString *rbuff = client->qev_client.rbuff;
 	gchar *str = rbuff->str + offset;
 	gchar *msg = rbuff->str + offset;
 	guint64 rbuff_len = rbuff->len - offset;
 	guint16 header_len = 0;
+	gboolean deflated = (str[0] & MASK_RSV1) != 0;
+
+	*inflated = NULL;
 
 	if ((str[0] & OPCODE) == OPCODE_CLOSE) {
 		qev_close(client, QEV_CLOSE_HUP);
@@ -94,6 +570,11 @@ static enum protocol_status _decode(
 		return PROT_FATAL;
 	}
 
+	if (deflated && !client->protocol.deflate) {
+		qev_close(client, RFC6455_BAD_DEFLATE);
+		return PROT_FATAL;
+	}
+
 	if (!(str[1] & MASKED_BIT)) {
 		qev_close(client, RFC6455_NO_MASK);
 		return PROT_FATAL;
@@ -134,47 +615,66 @@ static enum protocol_status _decode(
 	*frame_len = total_len;
 	str += header_len;
 
+	if (deflated) {
+		_unmask_only(msg, str, len, mask.i);
+		*inflated = _inflate(client, msg, len);
+		return *inflated == NULL ? PROT_FATAL : PROT_OK;
+	}
+
 	/*
-	 * The following mess warrants an explanation: it's quite a bit
-	 * faster than the naive decode.
-	 *
-	 * Take a look at bench/bench_ws_decode.c for how much faster it is.
-	 *
-	 * The following steps are taken:
-	 *   0) Create a 128 bit masking key from 4 32bit ones.
-	 *   1) Gob through 128 bits at a time, until the next XOR would go past
-	 *      the end of the buffer.
-	 *   2) Gob through 64 bits at a time, until the next XOR would overflow
-	 *   3) Finish off going through any last characters.
+	 * Unmasking and validating are done together so that the payload is
+	 * only walked once: see bench/bench_ws_decode.c for how much that
+	 * saves.
 	 */
-	for (i = 0; i < sizeof(mask128) / sizeof(mask); i++) {
-		mask128.is[i] = mask.i;
+	if (!protocol_rfc6455_unmask(msg, str, len, mask.i)) {
+		qev_close(client, RFC6455_NOT_UTF8);
+		return PROT_FATAL;
 	}
 
-	max = len - (len & (sizeof(__uint128_t) - 1));
-	for (i = 0; i < max; i += sizeof(__uint128_t)) {
-		__uint128_t from = *((__uint128_t*)(str + i));
-		*((__uint128_t*)(msg + i)) = from ^ mask128.i;
-	}
+	*(msg + len) = '\0';
 
-	max = len - (len & (sizeof(guint64) - 1));
-	for (; i < max; i += sizeof(guint64)) {
-		guint64 from = *((guint64*)(str + i));
-		*((guint64*)(msg + i)) = from ^ mask128.i;
-	}
+	return PROT_OK;
+}
 
-	for (; i < len; i++) {
-		msg[i] = str[i] ^ mask.c[i & 3];
+/**
+ * If any of the client's extension offers is a permessage-deflate that can
+ * be accepted as-is. The only thing that can't be is asking the server to
+ * use a smaller window than it does.
+ */
+static gboolean _offers_deflate(const gchar *extensions)
+{
+	guint i;
+	guint j;
+	gchar **offers;
+	gboolean good = FALSE;
+
+	if (extensions == NULL) {
+		return FALSE;
 	}
 
-	*(msg + len) = '\0';
+	offers = g_strsplit(extensions, ",", -1);
 
-	if (!g_utf8_validate(msg, len, NULL)) {
-		qev_close(client, RFC6455_NOT_UTF8);
-		return PROT_FATAL;
+	for (i = 0; !good && offers[i] != NULL; i++) {
+		gchar **params = g_strsplit(offers[i], ";", -1);
+
+		good = params[0] != NULL &&
+			g_strcmp0(g_strstrip(params[0]), "permessage-deflate") == 0;
+
+		for (j = 1; good && params[j] != NULL; j++) {
+			gchar *param = g_strstrip(params[j]);
+
+			good = g_strcmp0(param, "server_no_context_takeover") == 0 ||
+				g_strcmp0(param, "client_no_context_takeover") == 0 ||
+				g_str_has_prefix(param, "client_max_window_bits") ||
+				g_strcmp0(param, "server_max_window_bits=15") == 0;
+		}
+
+		g_strfreev(params);
 	}
 
-	return PROT_OK;
+	g_strfreev(offers);
+
+	return good;
 }
 
 void protocol_rfc6455_init()
@@ -191,6 +691,21 @@ void protocol_rfc6455_init()
 	_stat_route_time = qev_stats_timer(
 		"protocol.rfc6455", "route",
 		"How long it took to decode the frame and route the event");
+	_stat_deflate_in = qev_stats_counter(
+		"protocol.rfc6455", "deflate.in", TRUE,
+		"How many compressed messages were inflated");
+	_stat_deflate_out = qev_stats_counter(
+		"protocol.rfc6455", "deflate.out", TRUE,
+		"How many frames were compressed to send out");
+}
+
+gboolean protocol_rfc6455_unmask(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask)
+{
+	return _unmask(to, from, len, mask);
 }
 
 enum protocol_handles protocol_rfc6455_handles(struct client *client G_GNUC_UNUSED)
@@ -203,14 +718,28 @@ enum protocol_status protocol_rfc6455_handshake(struct client *client)
 	guint64 len;
 	guint64 frame_len;
 	gboolean good;
+	GString *inflated;
 	enum protocol_status status;
 
-	status = _decode(client, 0, &len, &frame_len);
+	status = _decode(client, 0, &len, &frame_len, &inflated);
 	if (status == PROT_OK) {
+		if (inflated != NULL) {
+			GString *rbuff = client->qev_client.rbuff;
+			qev_buffer_clear(rbuff);
+			qev_buffer_append_buff(rbuff, inflated);
+			qev_buffer_put(inflated);
+		}
+
 		good = protocol_raw_check_handshake(client);
 		if (good) {
 			qev_stats_counter_inc(_stat_handshakes_good);
-			qev_write(client, QIO_HANDSHAKE, sizeof(QIO_HANDSHAKE) - 1);
+
+			if (client->protocol.batch) {
+				qev_write(client, QIO_HANDSHAKE_BATCH,
+					sizeof(QIO_HANDSHAKE_BATCH) - 1);
+			} else {
+				qev_write(client, QIO_HANDSHAKE, sizeof(QIO_HANDSHAKE) - 1);
+			}
 			status = PROT_OK;
 		} else {
 			qev_stats_counter_inc(_stat_handshakes_bad);
@@ -226,27 +755,35 @@ enum protocol_status protocol_rfc6455_route(struct client *client, gsize *used)
 {
 	guint64 len;
 	guint64 frame_len;
+	GString *inflated;
 	enum protocol_status status;
 	GString *rbuff = client->qev_client.rbuff;
 
 	qev_stats_time(_stat_route_time, {
-		status = _decode(client, *used, &len, &frame_len);
+		status = _decode(client, *used, &len, &frame_len, &inflated);
 		if (status == PROT_OK) {
 			gchar *start = rbuff->str + *used;
 			start[len] = '\0';
+
+			if (inflated != NULL) {
+				start = inflated->str;
+			}
+
 			status = protocol_raw_handle(client, start);
 			*used += frame_len;
+
+			qev_buffer_put(inflated);
 		}
 	});
 
 	return status;
 }
 
-void protocol_rfc6455_heartbeat(
+gint64 protocol_rfc6455_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb)
 {
-	protocol_raw_do_heartbeat(client, hb,
+	return protocol_raw_do_heartbeat(client, hb,
 					HEARTBEAT, sizeof(HEARTBEAT) - 1);
 }
 
@@ -256,32 +793,88 @@ struct protocol_frames protocol_rfc6455_frame(
 	const evs_cb_t server_cb,
 	const gchar *json)
 {
-	GString *def = qev_buffer_get();
 	GString *raw = protocol_raw_format(ev_path, ev_extra, server_cb, json);
-	const gsize len = raw->len;
 
-	g_string_append_c(def, '\x81');
+	return (struct protocol_frames){
+		.def = protocol_rfc6455_wrap(raw),
+		.raw = NULL,
+	};
+}
 
-	if (len <= PAYLOAD_SHORT) {
-		g_string_append_c(def, (guint8)len);
-	} else if (len <= 0xffff) {
-		guint16 belen = GUINT16_TO_BE(len);
-		g_string_append_c(def, (gchar)PAYLOAD_MEDIUM);
-		qev_buffer_append_len(def, (gchar*)&belen, sizeof(belen));
-	} else {
-		guint64 belen = GUINT64_TO_BE(len);
-		g_string_append_c(def, (gchar)PAYLOAD_LONG);
-		qev_buffer_append_len(def, (gchar*)&belen, sizeof(belen));
+GString* protocol_rfc6455_wrap(GString *payload)
+{
+	GString *def = qev_buffer_get();
+
+	_frame_header(def, FRAME_TEXT, payload->len);
+	qev_buffer_append_buff(def, payload);
+
+	qev_buffer_put(payload);
+
+	return def;
+}
+
+GString* protocol_rfc6455_deflate(const GString *frame)
+{
+	gint err;
+	gboolean done;
+	gsize len;
+	gsize bound;
+	GString *out;
+	GString *deflated;
+	z_stream *z;
+	const gchar *payload = _frame_payload(frame, &len);
+
+	if (!cfg_websocket_deflate || len < cfg_websocket_deflate_min_size) {
+		return NULL;
 	}
 
-	qev_buffer_append_buff(def, raw);
+	z = _zstream(TRUE);
+	if (z == NULL) {
+		return NULL;
+	}
 
-	qev_buffer_put(raw);
+	/*
+	 * deflateBound() only accounts for finishing the stream, not for the
+	 * empty block a sync flush adds
+	 */
+	bound = deflateBound(z, len) + 16;
+	out = qev_buffer_get();
+	qev_buffer_ensure(out, bound + 1);
 
-	return (struct protocol_frames){
-		.def = def,
-		.raw = NULL,
-	};
+	z->next_in = (guchar*)payload;
+	z->avail_in = len;
+	z->next_out = (guchar*)out->str;
+	z->avail_out = bound;
+
+	err = deflate(z, Z_SYNC_FLUSH);
+	g_string_set_size(out, bound - z->avail_out);
+	done = err == Z_OK && z->avail_in == 0 && z->avail_out > 0;
+	deflateReset(z);
+
+	/*
+	 * Every sync flush ends with the same empty block, which the client
+	 * puts back before inflating. If compressing didn't save anything, it's
+	 * not worth making the client inflate it.
+	 */
+	if (!done ||
+			out->len < sizeof(DEFLATE_TAIL) - 1 ||
+			memcmp(out->str + out->len - (sizeof(DEFLATE_TAIL) - 1),
+				DEFLATE_TAIL, sizeof(DEFLATE_TAIL) - 1) != 0 ||
+			out->len - (sizeof(DEFLATE_TAIL) - 1) >= len) {
+		qev_buffer_put(out);
+		return NULL;
+	}
+
+	g_string_truncate(out, out->len - (sizeof(DEFLATE_TAIL) - 1));
+
+	deflated = qev_buffer_get();
+	_frame_header(deflated, FRAME_TEXT_DEFLATED, out->len);
+	qev_buffer_append_buff(deflated, out);
+	qev_buffer_put(out);
+
+	qev_stats_counter_inc(_stat_deflate_out);
+
+	return deflated;
 }
 
 void protocol_rfc6455_close(struct client *client, guint reason)
@@ -317,6 +910,11 @@ void protocol_rfc6455_close(struct client *client, guint reason)
 			qev_write(client, "\x88\x02\x03\xef", 4);
 			break;
 
+		case RFC6455_BAD_DEFLATE:
+			// error code: 1002
+			qev_write(client, "\x88\x15\x03\xea""invalid compression", 23);
+			break;
+
 		case QEV_CLOSE_TIMEOUT:
 			qev_write(client, "\x88\x10\x03\xf0""client timeout", 18);
 			break;
@@ -332,9 +930,13 @@ void protocol_rfc6455_close(struct client *client, guint reason)
 	}
 }
 
-void protocol_rfc6455_upgrade(struct client *client, const gchar *key)
+void protocol_rfc6455_upgrade(
+	struct client *client,
+	const gchar *key,
+	const gchar *extensions)
 {
 	gsize b64len;
+	gboolean deflate = cfg_websocket_deflate && _offers_deflate(extensions);
 	gint state = 0;
 	gint save = 0;
 	GString *buff = qev_buffer_get();
@@ -361,13 +963,20 @@ void protocol_rfc6455_upgrade(struct client *client, const gchar *key)
 	qev_buffer_clear(buff);
 	g_string_append(buff, HTTP_101);
 	qev_buffer_append_buff(buff, b64);
-	g_string_append(buff, "\r\n\r\n");
+	g_string_append(buff, "\r\n");
+
+	if (deflate) {
+		g_string_append(buff, HTTP_DEFLATE);
+	}
+
+	g_string_append(buff, "\r\n");
 	qev_write(client, buff->str, buff->len);
 
 	qev_buffer_put(buff);
 	qev_buffer_put(b64);
 
 	protocols_switch(client, protocol_rfc6455);
+	client->protocol.deflate = deflate;
 
 	qev_stats_counter_inc(_stat_upgrades);
 }
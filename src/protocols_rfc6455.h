@@ -35,6 +35,12 @@ enum rfc6455_close_reasons {
 	 * Client sent data that was not UTF8
 	 */
 	RFC6455_NOT_UTF8,
+
+	/**
+	 * Client sent a compressed frame without negotiating compression, or
+	 * one that couldn't be inflated
+	 */
+	RFC6455_BAD_DEFLATE,
 };
 
 /**
@@ -47,6 +53,29 @@ struct protocol *protocol_rfc6455;
  */
 void protocol_rfc6455_init();
 
+/**
+ * Unmask a frame's payload and check that it's valid UTF-8, in a single
+ * pass over the data. Uses the widest vector instructions the CPU supports.
+ *
+ * @param to
+ *     Where to write the unmasked payload. May overlap with from, so long
+ *     as it doesn't come after it.
+ * @param from
+ *     The masked payload
+ * @param len
+ *     Length of the payload
+ * @param mask
+ *     The frame's masking key, exactly as it appeared in the frame
+ *
+ * @return
+ *     If the payload is valid UTF-8 and contains no NULs.
+ */
+gboolean protocol_rfc6455_unmask(
+	gchar *to,
+	const gchar *from,
+	const guint64 len,
+	const guint32 mask);
+
 /**
  * If rfc6455 can handle this client
  */
@@ -65,7 +94,7 @@ enum protocol_status protocol_rfc6455_route(struct client *client, gsize *used);
 /**
  * Sends a heartbeat to a client
  */
-void protocol_rfc6455_heartbeat(
+gint64 protocol_rfc6455_heartbeat(
 	struct client *client,
 	const struct protocol_heartbeat *hb);
 
@@ -78,6 +107,22 @@ struct protocol_frames protocol_rfc6455_frame(
 	const evs_cb_t server_cb,
 	const gchar *json);
 
+/**
+ * Put a payload into a text frame. Takes ownership of the payload.
+ */
+GString* protocol_rfc6455_wrap(GString *payload);
+
+/**
+ * Compress a text frame with permessage-deflate, without context takeover,
+ * so that the result may be sent to any client that negotiated it.
+ *
+ * @return
+ *     The compressed frame, or NULL if compression is disabled, the payload
+ *     is smaller than `cfg_websocket_deflate_min_size`, or compressing
+ *     didn't make it any smaller.
+ */
+GString* protocol_rfc6455_deflate(const GString *frame);
+
 /**
  * Terminates all communications with the client
  */
@@ -90,5 +135,11 @@ void protocol_rfc6455_close(struct client *client, guint reason);
  *     The client to upgrade
  * @param key
  *     Sec-WebSocket-Key from the HTTP Headers
+ * @param extensions
+ *     Sec-WebSocket-Extensions from the HTTP Headers, if any. permessage-deflate
+ *     is accepted from here.
  */
-void protocol_rfc6455_upgrade(struct client *client, const gchar *key);
+void protocol_rfc6455_upgrade(
+	struct client *client,
+	const gchar *key,
+	const gchar *extensions);
@@ -0,0 +1,404 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * Largest datagram taken on the unix socket; anything bigger is dropped
+ */
+#define DGRAM_MAX 65536
+
+/**
+ * How much is read from a stream connection at once
+ */
+#define STREAM_READ 4096
+
+/**
+ * Most events taken from epoll at once
+ */
+#define STREAM_EVENTS 64
+
+/**
+ * Longest a record on a stream may get while waiting for its newline before
+ * the connection is dropped
+ */
+#define STREAM_PENDING_MAX (1 << 20)
+
+/**
+ * Something writing records to the unix socket as a stream
+ */
+struct _conn {
+	qev_fd_t sock;
+
+	/**
+	 * Whatever came after the last newline
+	 */
+	GString *buff;
+};
+
+static qev_stats_counter_t *_stat_records;
+static qev_stats_counter_t *_stat_invalid;
+
+static qev_fd_t _unix_sock = -1;
+static GThread *_listener = NULL;
+static gboolean _stop = FALSE;
+
+/**
+ * Wakes up the stream listener to stop it
+ */
+static qev_fd_t _wakeup = -1;
+
+/**
+ * Bind the unix socket, replacing any socket left behind by a server that
+ * didn't get to clean up.
+ */
+static qev_fd_t _listen(const gchar *path, const gint type)
+{
+	qev_fd_t sock;
+	struct stat st;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	sock = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		(type == SOCK_STREAM && listen(sock, SOMAXCONN) != 0)) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void* _dgram_run(void *nothing G_GNUC_UNUSED)
+{
+	gssize len;
+	gchar *buff = g_malloc(DGRAM_MAX + 1);
+
+	qev_pool_register_thread();
+
+	while (!g_atomic_int_get(&_stop)) {
+		len = recv(_unix_sock, buff, DGRAM_MAX, MSG_TRUNC);
+		if (len <= 0) {
+			continue;
+		}
+
+		if (len > DGRAM_MAX) {
+			qev_stats_counter_inc(_stat_invalid);
+			continue;
+		}
+
+		publish_handle(buff, len);
+	}
+
+	g_free(buff);
+
+	return NULL;
+}
+
+/**
+ * Broadcast every complete record that's come in on the connection,
+ * keeping anything after the last newline for the next read.
+ */
+static void _conn_handle(struct _conn *conn)
+{
+	gsize len;
+	gchar *last = g_strrstr_len(conn->buff->str, conn->buff->len, "\n");
+
+	if (last == NULL) {
+		return;
+	}
+
+	/*
+	 * publish_handle() caps the records with a NUL, which lands right on
+	 * the newline and leaves the rest alone
+	 */
+	len = last - conn->buff->str;
+	publish_handle(conn->buff->str, len);
+	g_string_erase(conn->buff, 0, len + 1);
+}
+
+/**
+ * Done with the connection: anything left over is the last record, since
+ * it doesn't need a newline once the writer's done.
+ */
+static void _conn_close(struct _conn *conn, const gboolean flush)
+{
+	if (flush && conn->buff->len > 0) {
+		publish_handle(conn->buff->str, conn->buff->len);
+	}
+
+	close(conn->sock);
+	g_string_free(conn->buff, TRUE);
+	g_slice_free1(sizeof(*conn), conn);
+}
+
+/**
+ * Read whatever's waiting on the connection, straight onto the end of its
+ * buffer.
+ *
+ * @return
+ *     If the connection should stay open
+ */
+static gboolean _conn_read(struct _conn *conn)
+{
+	gssize len;
+	gsize had = conn->buff->len;
+
+	g_string_set_size(conn->buff, had + STREAM_READ);
+
+	do {
+		len = recv(conn->sock, conn->buff->str + had, STREAM_READ, 0);
+	} while (len == -1 && errno == EINTR);
+
+	g_string_set_size(conn->buff, had + MAX(len, 0));
+
+	if (len == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+	if (len == 0) {
+		return FALSE;
+	}
+
+	_conn_handle(conn);
+
+	if (conn->buff->len > STREAM_PENDING_MAX) {
+		qev_stats_counter_inc(_stat_invalid);
+		g_string_truncate(conn->buff, 0);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void _stream_accept(const qev_fd_t epoll, GHashTable *conns)
+{
+	qev_fd_t sock;
+	struct _conn *conn;
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	sock = accept4(_unix_sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (sock == -1) {
+		if (errno == EMFILE || errno == ENFILE ||
+			errno == ENOBUFS || errno == ENOMEM) {
+			g_usleep(G_USEC_PER_SEC / 10);
+		}
+
+		return;
+	}
+
+	conn = g_slice_alloc0(sizeof(*conn));
+	conn->sock = sock;
+	conn->buff = g_string_sized_new(STREAM_READ);
+
+	ev.data.ptr = conn;
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &ev) != 0) {
+		_conn_close(conn, FALSE);
+		return;
+	}
+
+	g_hash_table_add(conns, conn);
+}
+
+/**
+ * Every stream connection is read from this one thread: writers are
+ * expected to be a few long-lived processes, not worth a thread each.
+ */
+static void* _stream_run(void *nothing G_GNUC_UNUSED)
+{
+	gint i;
+	gint n;
+	qev_fd_t epoll;
+	GHashTableIter iter;
+	struct _conn *conn;
+	GHashTable *conns = g_hash_table_new(NULL, NULL);
+	struct epoll_event evs[STREAM_EVENTS];
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	qev_pool_register_thread();
+
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	ASSERT(epoll != -1, "Could not create epoll for published records: %s",
+			strerror(errno));
+
+	ev.data.ptr = &_unix_sock;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, _unix_sock, &ev);
+	ev.data.ptr = &_wakeup;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+
+	while (!g_atomic_int_get(&_stop)) {
+		n = epoll_wait(epoll, evs, G_N_ELEMENTS(evs), -1);
+
+		for (i = 0; i < n; i++) {
+			conn = evs[i].data.ptr;
+
+			if (evs[i].data.ptr == &_wakeup) {
+				continue;
+			}
+
+			if (evs[i].data.ptr == &_unix_sock) {
+				_stream_accept(epoll, conns);
+				continue;
+			}
+
+			if (!_conn_read(conn)) {
+				g_hash_table_remove(conns, conn);
+				_conn_close(conn, TRUE);
+			}
+		}
+	}
+
+	g_hash_table_iter_init(&iter, conns);
+	while (g_hash_table_iter_next(&iter, (void**)&conn, NULL)) {
+		_conn_close(conn, FALSE);
+	}
+
+	close(epoll);
+	g_hash_table_unref(conns);
+
+	return NULL;
+}
+
+static void _free(void *nothing G_GNUC_UNUSED)
+{
+	g_atomic_int_set(&_stop, TRUE);
+
+	if (_wakeup != -1) {
+		eventfd_write(_wakeup, 1);
+	} else {
+		shutdown(_unix_sock, SHUT_RDWR);
+	}
+
+	g_thread_join(_listener);
+	_listener = NULL;
+
+	if (_wakeup != -1) {
+		close(_wakeup);
+		_wakeup = -1;
+	}
+
+	close(_unix_sock);
+	_unix_sock = -1;
+	unlink(cfg_publish_unix);
+}
+
+guint64 publish_handle(gchar *buff, const gsize len)
+{
+	gchar *json;
+	gchar *line_end;
+	guint64 published = 0;
+	gchar *end = buff + len;
+
+	*end = '\0';
+
+	for (; buff < end; buff = line_end + 1) {
+		line_end = memchr(buff, '\n', end - buff);
+		if (line_end == NULL) {
+			line_end = end;
+		}
+
+		*line_end = '\0';
+
+		if (line_end > buff && *(line_end - 1) == '\r') {
+			*(line_end - 1) = '\0';
+		}
+
+		if (*buff == '\0') {
+			continue;
+		}
+
+		json = strchr(buff, '=');
+		if (json == NULL) {
+			qev_stats_counter_inc(_stat_invalid);
+			continue;
+		}
+
+		*json++ = '\0';
+
+		if (evs_clean_path(buff) == 0) {
+			qev_stats_counter_inc(_stat_invalid);
+			continue;
+		}
+
+		evs_broadcast_path(buff, json);
+		qev_stats_counter_inc(_stat_records);
+		published++;
+	}
+
+	return published;
+}
+
+void publish_datagram(const gchar *msg, const gsize len)
+{
+	GString *buff;
+
+	if (!cfg_publish_udp || msg == NULL || len == 0) {
+		return;
+	}
+
+	/*
+	 * The datagram belongs to quick-event, and records are split in place
+	 */
+	buff = qev_buffer_get();
+	g_string_append_len(buff, msg, len);
+
+	publish_handle(buff->str, buff->len);
+
+	qev_buffer_put(buff);
+}
+
+void publish_init()
+{
+	_stat_records = qev_stats_counter(
+		"publish", "records", TRUE,
+		"How many broadcasts were published from outside of the server");
+	_stat_invalid = qev_stats_counter(
+		"publish", "invalid", TRUE,
+		"How many published records couldn't be understood");
+
+	if (cfg_publish_unix == NULL || *cfg_publish_unix == '\0') {
+		return;
+	}
+
+	_stop = FALSE;
+	_unix_sock = _listen(cfg_publish_unix,
+						cfg_publish_unix_stream ? SOCK_STREAM : SOCK_DGRAM);
+	ASSERT(_unix_sock != -1, "Could not listen for published records on "
+			"%s: %s", cfg_publish_unix, strerror(errno));
+
+	if (cfg_publish_unix_stream) {
+		_wakeup = eventfd(0, EFD_CLOEXEC);
+		ASSERT(_wakeup != -1, "Could not create publish wakeup: %s",
+				strerror(errno));
+	}
+
+	_listener = g_thread_new("qio-publish",
+						cfg_publish_unix_stream ? _stream_run : _dgram_run,
+						NULL);
+
+	qev_cleanup(&_listener, _free);
+}
@@ -0,0 +1,58 @@
+/**
+ * Broadcasts published by services outside of the server.
+ * @file
+ *
+ * Backends that aren't apps can still broadcast by sending datagrams to
+ * quick-event's UDP listener, or by writing to the unix socket at
+ * `publish-unix`. The unix socket has a thread of its own, and either takes
+ * datagrams or, with `publish-unix-stream`, connections, which that same
+ * thread reads from. Every datagram or connection carries any number of
+ * records, one per line, each formatted as `<ev_path>=<json>`, for
+ * something like:
+ *
+ *     /some/event={"json":"data"}
+ *     /some/other/event=null
+ *
+ * JSON must be on a single line, and on a stream, every record but the last
+ * ends with a newline. Records are fed straight into evs_broadcast_path():
+ * nothing is checked beyond that, so only listen where every sender is
+ * trusted.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Broadcast every record in the buffer. Records are split apart in place,
+ * so the buffer is mangled once this returns.
+ *
+ * @param buff
+ *     The records. buff[len] MUST be writable (GStrings are fine).
+ * @param len
+ *     Length of the records
+ *
+ * @return
+ *     The number of records broadcast
+ */
+guint64 publish_handle(gchar *buff, const gsize len);
+
+/**
+ * Broadcast every record in a datagram, if `publish-udp` is enabled.
+ *
+ * @param msg
+ *     The datagram
+ * @param len
+ *     Length of the datagram
+ */
+void publish_datagram(const gchar *msg, const gsize len);
+
+/**
+ * Get publishing ready to run, listening on `publish-unix` if it's set
+ */
+void publish_init();
@@ -26,6 +26,7 @@ void qev_on_open(struct client *client)
 void qev_on_close(struct client *client, guint reason)
 {
 	qev_timeout_clear(&client->timeout);
+	periodic_unschedule(client);
 	protocols_closed(client, reason);
 	client_closed(client);
 }
@@ -41,19 +42,22 @@ void qev_on_tick()
 }
 
 void qev_on_udp(
-	const gchar *msg G_GNUC_UNUSED,
-	const gsize len G_GNUC_UNUSED,
-	const gchar *ip G_GNUC_UNUSED) {}
+	const gchar *msg,
+	const gsize len,
+	const gchar *ip G_GNUC_UNUSED)
+{
+	publish_datagram(msg, len);
+}
 
 void qev_on_exit() {}
 
 struct client* qev_client_new()
 {
-	return g_slice_alloc0(sizeof(struct client));
+	return slab_client_new();
 }
 
 void qev_client_free(struct client *client)
 {
 	client_free_all(client);
-	g_slice_free1(sizeof(*client), client);
+	slab_client_free(client);
 }
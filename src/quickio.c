@@ -14,8 +14,12 @@ void qio_main(int argc, char **argv)
 	evs_pre_init();
 	qev_init("quickio", argv, argc);
 	config_init();
+	slab_init();
 	evs_init();
 	sub_init();
+	journal_init();
+	publish_init();
+	cluster_init();
 	protocols_init();
 	client_init();
 	periodic_init();
@@ -32,13 +32,20 @@
 #include <gmodule.h>
 #include "compat.h"
 #include "atomic.h"
+#include "subscribers.h"
 #include "evs.h"
 #include "apps.h"
 #include "client.h"
+#include "cluster.h"
 #include "config.h"
 #include "evs_qio.h"
 #include "evs_query.h"
+#include "evs_queue.h"
+#include "fanout.h"
+#include "journal.h"
 #include "periodic.h"
+#include "publish.h"
+#include "slab.h"
 #include "sub.h"
 #include "protocols.h"
 #include "protocols_flash.h"
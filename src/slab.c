@@ -0,0 +1,353 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+#include <sys/mman.h>
+
+/**
+ * How much of the reservation a thread takes at once: a single hugepage
+ */
+#define BLOCK_SIZE (2 << 20)
+
+/**
+ * Clients never share a cache line
+ */
+#define SLOT_ALIGN 64
+
+/**
+ * A free slot, linked through its first bytes
+ */
+struct _free {
+	struct _free *next;
+};
+
+/**
+ * A thread's share of the reservation
+ */
+struct _slab {
+	/**
+	 * Only ever touched by the owning thread
+	 */
+	struct _free *free;
+
+	/**
+	 * Clients freed by other threads, waiting for the owner to take them
+	 * back
+	 */
+	GMutex lock;
+	struct _free *remote;
+
+	/**
+	 * The next slab waiting for a thread to take it over
+	 */
+	struct _slab *next;
+};
+
+static struct {
+	gchar *base;
+	gsize size;
+
+	/**
+	 * Size of each client, rounded up to SLOT_ALIGN
+	 */
+	gsize slot_size;
+
+	guint32 per_block;
+	guint32 blocks;
+
+	/**
+	 * The next block that hasn't been handed out
+	 */
+	guint32 next_block;
+
+	/**
+	 * The slab each block was handed to
+	 */
+	struct _slab **owners;
+} _region;
+
+static void _orphan(void *slab_);
+
+/**
+ * The calling thread's slab
+ */
+static GPrivate _slab = G_PRIVATE_INIT(_orphan);
+
+/**
+ * Slabs left behind by threads that exited. Slabs are never freed: the
+ * next new thread takes one over, free slots, blocks and all, so nothing
+ * is lost when threads come and go.
+ */
+static GMutex _orphans_lock;
+static struct _slab *_orphans = NULL;
+
+/**
+ * How many slots have been handed out to threads
+ */
+static guint64 _claimed = 0;
+
+static qev_stats_counter_t *_stat_used;
+static qev_stats_counter_t *_stat_fallbacks;
+static qev_stats_gauge_t *_stat_capacity;
+static qev_stats_gauge_t *_stat_claimed;
+static qev_stats_gauge_t *_stat_occupancy;
+static qev_stats_gauge_t *_stat_fragmentation;
+
+static void _orphan(void *slab_)
+{
+	struct _slab *slab = slab_;
+
+	g_mutex_lock(&_orphans_lock);
+	slab->next = _orphans;
+	_orphans = slab;
+	g_mutex_unlock(&_orphans_lock);
+}
+
+static struct _slab* _slab_get()
+{
+	struct _slab *slab = g_private_get(&_slab);
+
+	if (G_LIKELY(slab != NULL)) {
+		return slab;
+	}
+
+	g_mutex_lock(&_orphans_lock);
+	slab = _orphans;
+	if (slab != NULL) {
+		_orphans = slab->next;
+		slab->next = NULL;
+	}
+	g_mutex_unlock(&_orphans_lock);
+
+	if (slab == NULL) {
+		slab = g_new0(struct _slab, 1);
+		g_mutex_init(&slab->lock);
+	}
+
+	g_private_set(&_slab, slab);
+	return slab;
+}
+
+/**
+ * Take the next block from the reservation and carve it into slots. This
+ * thread writes to every page in the block, so the kernel places them on
+ * its NUMA node.
+ *
+ * @return
+ *     The block's slots, linked together. NULL if the reservation is used up.
+ */
+static struct _free* _claim(struct _slab *slab)
+{
+	guint32 i;
+	guint32 block;
+	gchar *start;
+	struct _free *f;
+	struct _free *head = NULL;
+
+	do {
+		block = g_atomic_int_get(&_region.next_block);
+		if (block >= _region.blocks) {
+			return NULL;
+		}
+	} while (!__sync_bool_compare_and_swap(
+					&_region.next_block, block, block + 1));
+
+	_region.owners[block] = slab;
+	start = _region.base + ((gsize)block * BLOCK_SIZE);
+
+	/*
+	 * Linked backwards so that slots go out in address order
+	 */
+	for (i = _region.per_block; i > 0; i--) {
+		f = (struct _free*)(start + ((i - 1) * _region.slot_size));
+		f->next = head;
+		head = f;
+	}
+
+	__sync_add_and_fetch(&_claimed, _region.per_block);
+
+	return head;
+}
+
+/**
+ * Find more free slots for the thread's slab: first whatever other threads
+ * gave back, then a new block.
+ */
+static struct _free* _refill(struct _slab *slab)
+{
+	struct _free *f;
+
+	g_mutex_lock(&slab->lock);
+	f = slab->remote;
+	slab->remote = NULL;
+	g_mutex_unlock(&slab->lock);
+
+	if (f == NULL) {
+		f = _claim(slab);
+	}
+
+	return f;
+}
+
+struct client* slab_client_new()
+{
+	struct _free *f = NULL;
+	struct _slab *slab = NULL;
+
+	if (_region.base != NULL) {
+		slab = _slab_get();
+		f = slab->free;
+		if (f == NULL) {
+			f = _refill(slab);
+		}
+	}
+
+	if (f == NULL) {
+		if (_region.base != NULL) {
+			qev_stats_counter_inc(_stat_fallbacks);
+		}
+
+		return g_slice_alloc0(sizeof(struct client));
+	}
+
+	slab->free = f->next;
+	memset(f, 0, sizeof(struct client));
+
+	qev_stats_counter_inc(_stat_used);
+
+	return (struct client*)f;
+}
+
+void slab_client_free(struct client *client)
+{
+	struct _slab *slab;
+	struct _free *f = (struct _free*)client;
+
+	if (!slab_contains(client)) {
+		g_slice_free1(sizeof(*client), client);
+		return;
+	}
+
+	slab = _region.owners[((gchar*)client - _region.base) / BLOCK_SIZE];
+
+	if (slab == g_private_get(&_slab)) {
+		f->next = slab->free;
+		slab->free = f;
+	} else {
+		g_mutex_lock(&slab->lock);
+		f->next = slab->remote;
+		slab->remote = f;
+		g_mutex_unlock(&slab->lock);
+	}
+
+	qev_stats_counter_dec(_stat_used);
+}
+
+gboolean slab_contains(const struct client *client)
+{
+	const gchar *p = (const gchar*)client;
+	return p >= _region.base && p < _region.base + _region.size;
+}
+
+void slab_update_stats()
+{
+	guint64 used;
+	guint64 claimed;
+	guint64 capacity;
+
+	if (_region.base == NULL) {
+		return;
+	}
+
+	used = qev_stats_counter_get(_stat_used);
+	claimed = __sync_add_and_fetch(&_claimed, 0);
+	capacity = (guint64)_region.blocks * _region.per_block;
+
+	qev_stats_gauge_set(_stat_claimed, claimed);
+
+	qev_stats_gauge_set(_stat_occupancy,
+		capacity == 0 ? 0 : (used * 100) / capacity);
+
+	/*
+	 * Slots that are free but stuck with the thread that claimed them: no
+	 * other thread can use them
+	 */
+	qev_stats_gauge_set(_stat_fragmentation,
+		claimed == 0 ? 0 : ((claimed - used) * 100) / claimed);
+}
+
+void slab_init()
+{
+	void *base;
+	gsize size;
+	guint64 clients = qev_cfg_get_max_clients();
+
+	_stat_used = qev_stats_counter(
+		"clients.slab", "used", FALSE,
+		"How many clients live in the slab");
+	_stat_fallbacks = qev_stats_counter(
+		"clients.slab", "fallbacks", TRUE,
+		"How many clients didn't fit in the slab");
+	_stat_capacity = qev_stats_gauge(
+		"clients.slab", "capacity",
+		"How many clients the slab has room for");
+	_stat_claimed = qev_stats_gauge(
+		"clients.slab", "claimed",
+		"How many client slots have been handed out to threads");
+	_stat_occupancy = qev_stats_gauge(
+		"clients.slab", "occupancy",
+		"Percent of the slab's room for clients that's in use");
+	_stat_fragmentation = qev_stats_gauge(
+		"clients.slab", "fragmentation",
+		"Percent of slots handed out to threads that are sitting free");
+
+	_region.slot_size = (sizeof(struct client) + SLOT_ALIGN - 1) &
+						~((gsize)SLOT_ALIGN - 1);
+	_region.per_block = BLOCK_SIZE / _region.slot_size;
+	_region.blocks = MIN((clients + _region.per_block - 1) / _region.per_block,
+							G_MAXUINT32);
+
+	if (_region.blocks == 0) {
+		return;
+	}
+
+	size = (gsize)_region.blocks * BLOCK_SIZE;
+
+	/*
+	 * Explicit hugepages are only used if the kernel has enough set aside
+	 * for everything: reserving them without backing would crash on fault.
+	 * Otherwise, transparent hugepages are the next best thing.
+	 */
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED) {
+			WARN("Could not reserve room for %" G_GUINT64_FORMAT " clients, "
+				"allocating them as they come: %s",
+				clients, strerror(errno));
+			_region.blocks = 0;
+			return;
+		}
+
+		madvise(base, size, MADV_HUGEPAGE);
+	}
+
+	_region.owners = g_new0(struct _slab*, _region.blocks);
+	_region.size = size;
+	g_atomic_pointer_set(&_region.base, base);
+
+	qev_stats_gauge_set(_stat_capacity,
+		(guint64)_region.blocks * _region.per_block);
+
+	/*
+	 * Clients may be freed right up until the process exits, so the
+	 * reservation stays mapped for as long as it runs
+	 */
+}
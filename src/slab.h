@@ -0,0 +1,51 @@
+/**
+ * Where every struct client lives.
+ * @file
+ *
+ * Room for `max-clients` clients is reserved up front, on hugepages when the
+ * kernel has them to spare, and handed out in blocks to the threads that
+ * create clients. Each thread allocates from its own free list without
+ * locking, and the pages in its blocks are first touched by that thread, so
+ * they land on its NUMA node. Clients freed on some other thread go back to
+ * the thread that owns them, the next time it runs dry. When a thread
+ * exits, its slab is kept for the next new thread to take over.
+ *
+ * Once the reservation is used up, clients come from the slice allocator
+ * like anything else.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Get a zeroed-out client.
+ */
+struct client* slab_client_new();
+
+/**
+ * Give back a client from slab_client_new(). May be called from any thread.
+ */
+void slab_client_free(struct client *client);
+
+/**
+ * If the client lives in the reservation, rather than having come from the
+ * slice allocator.
+ */
+gboolean slab_contains(const struct client *client);
+
+/**
+ * Update the occupancy and fragmentation stats
+ */
+void slab_update_stats();
+
+/**
+ * Reserve room for every client. Until this is called, clients come from
+ * the slice allocator.
+ */
+void slab_init();
@@ -8,9 +8,100 @@
 
 #include "quickio.h"
 
+/**
+ * Number of locks that last values are spread across
+ */
+#define LVC_STRIPES 64
+
 static qev_stats_counter_t *_stat_total;
 static qev_stats_counter_t *_stat_added;
 static qev_stats_counter_t *_stat_removed;
+static qev_stats_gauge_t *_stat_bytes;
+static qev_stats_gauge_t *_stat_bytes_per_sub;
+
+/**
+ * Bytes used by all subscriptions, not counting their subscriber storage
+ */
+static guint64 _bytes = 0;
+
+/**
+ * Number of shards each subscription is split into; 0 when not sharded.
+ */
+static guint _shards = 0;
+
+/**
+ * Identifies this server in every subscription's epoch
+ */
+static guint32 _node = 0;
+
+/**
+ * Guards every subscription's last value, spread out by subscription
+ */
+static GMutex _lvc_locks[LVC_STRIPES];
+
+static GMutex* _lvc_lock(struct subscription *sub)
+{
+	return _lvc_locks + ((GPOINTER_TO_SIZE(sub) / sizeof(*sub)) % LVC_STRIPES);
+}
+
+static gsize _sub_bytes(struct subscription *sub)
+{
+	return sizeof(*sub) + strlen(sub->ev_extra) + 1 +
+		(sizeof(*sub->shards) * _shards);
+}
+
+static guint64 _epoch_new()
+{
+	guint64 epoch;
+
+	do {
+		epoch = ((guint64)_node << 32) | g_random_int();
+	} while (epoch == 0);
+
+	return epoch;
+}
+
+/**
+ * Give a new subscription the last value it had before a restart, if the
+ * journal has one.
+ */
+static void _lvc_restore(struct subscription *sub)
+{
+	gchar *json;
+	GString *path;
+	GMutex *lock = _lvc_lock(sub);
+	struct protocol_bcast *bcast = NULL;
+
+	if (sub->ev->flags & EVS_HANDLER_NO_LVC) {
+		return;
+	}
+
+	path = qev_buffer_get();
+	g_string_printf(path, "%s%s", sub->ev->ev_path, sub->ev_extra);
+
+	json = journal_restore(path->str);
+	if (json != NULL) {
+		/*
+		 * Nothing has been broadcast in this epoch yet: the restored value
+		 * comes before all of it
+		 */
+		bcast = sub_bcast(sub, path->str, json, 0);
+
+		/*
+		 * A broadcast might have beaten this here, and it's newer
+		 */
+		g_mutex_lock(lock);
+		if (sub->lvc == NULL) {
+			sub->lvc = bcast;
+			bcast = NULL;
+		}
+		g_mutex_unlock(lock);
+	}
+
+	protocols_bcast_unref(bcast);
+	qev_buffer_put(path);
+	g_free(json);
+}
 
 static gboolean _get_if_exists(
 	struct event *ev,
@@ -35,11 +126,16 @@ struct subscription* sub_get(
 	const gboolean or_create)
 {
 	struct subscription *sub;
+	gboolean created = FALSE;
 
 	if (ev_extra == NULL) {
 		ev_extra = "";
 	}
 
+	if (or_create && g_atomic_int_get(&ev->removed)) {
+		return NULL;
+	}
+
 	// @todo should this use qev_lock? bench it out
 	g_rw_lock_reader_lock(&ev->subs_lock);
 
@@ -50,25 +146,41 @@ struct subscription* sub_get(
 	if (sub == NULL && or_create) {
 		g_rw_lock_writer_lock(&ev->subs_lock);
 
-		if (!_get_if_exists(ev, ev_extra, &sub)) {
+		if (!_get_if_exists(ev, ev_extra, &sub) && !ev->removed) {
 			sub = g_slice_alloc0(sizeof(*sub));
-			sub->ev = ev;
+			sub->ev = event_ref(ev);
 			sub->ev_extra = g_strdup(ev_extra);
-			sub->subscribers = qev_list_new(
-				qev_cfg_get_max_clients(),
-				cfg_broadcast_threads,
-				NULL);
+			sub->epoch = _epoch_new();
+			subscribers_init(&sub->subscribers);
 			sub->refs = 1;
 
+			if (_shards > 0) {
+				guint i;
+
+				sub->shards = g_malloc(sizeof(*sub->shards) * _shards);
+				for (i = 0; i < _shards; i++) {
+					subscribers_init(sub->shards + i);
+				}
+			}
+
+			__sync_add_and_fetch(&_bytes, _sub_bytes(sub));
+
 			g_hash_table_replace(ev->subs, sub->ev_extra, sub);
 
 			qev_stats_counter_inc(_stat_total);
 			qev_stats_counter_inc(_stat_added);
+
+			created = TRUE;
 		}
 
 		g_rw_lock_writer_unlock(&ev->subs_lock);
 	}
 
+	if (created) {
+		cluster_interest(sub, TRUE);
+		_lvc_restore(sub);
+	}
+
 	return sub;
 }
 
@@ -98,16 +210,193 @@ void sub_unref(struct subscription *sub)
 
 	g_rw_lock_writer_unlock(&ev->subs_lock);
 
+	cluster_interest(sub, FALSE);
+
+	__sync_sub_and_fetch(&_bytes, _sub_bytes(sub));
+
 	g_free(sub->ev_extra);
-	qev_list_free(sub->subscribers);
+	subscribers_clear(&sub->subscribers);
+
+	if (sub->shards != NULL) {
+		guint i;
+
+		for (i = 0; i < _shards; i++) {
+			subscribers_clear(sub->shards + i);
+		}
+
+		g_free(sub->shards);
+	}
+
+	protocols_bcast_unref(sub->lvc);
+
+	while (!g_queue_is_empty(&sub->replay)) {
+		protocols_bcast_unref(g_queue_pop_head(&sub->replay));
+	}
+
 	g_slice_free1(sizeof(*sub), sub);
 
+	event_unref(ev);
+
 	qev_stats_counter_dec(_stat_total);
 	qev_stats_counter_inc(_stat_removed);
 }
 
+struct subscribers* sub_subscribers(
+	struct subscription *sub,
+	struct client *client)
+{
+	if (sub->shards == NULL) {
+		return &sub->subscribers;
+	}
+
+	return sub->shards + sub_shard(client);
+}
+
+void sub_subscribers_foreach(
+	struct subscription *sub,
+	subscribers_foreach_fn fn,
+	void *data)
+{
+	guint i;
+
+	if (sub->shards == NULL) {
+		subscribers_foreach(&sub->subscribers, fn, data);
+		return;
+	}
+
+	for (i = 0; i < _shards; i++) {
+		subscribers_foreach(sub->shards + i, fn, data);
+	}
+}
+
+guint sub_shards()
+{
+	return _shards;
+}
+
+guint sub_shard(struct client *client)
+{
+	/*
+	 * Clients are slice-allocated, so neighbours in memory are spread
+	 * evenly across the shards.
+	 */
+	return (GPOINTER_TO_SIZE(client) / sizeof(*client)) % MAX(_shards, 1);
+}
+
+void sub_lvc_set(struct subscription *sub, struct protocol_bcast *bcast)
+{
+	struct protocol_bcast *old;
+	GMutex *lock = _lvc_lock(sub);
+
+	protocols_bcast_ref(bcast);
+
+	g_mutex_lock(lock);
+	old = sub->lvc;
+	sub->lvc = bcast;
+	g_mutex_unlock(lock);
+
+	protocols_bcast_unref(old);
+}
+
+struct protocol_bcast* sub_lvc_get(struct subscription *sub)
+{
+	struct protocol_bcast *bcast = NULL;
+	GMutex *lock = _lvc_lock(sub);
+
+	g_mutex_lock(lock);
+
+	if (sub->lvc != NULL) {
+		bcast = protocols_bcast_ref(sub->lvc);
+	}
+
+	g_mutex_unlock(lock);
+
+	return bcast;
+}
+
+struct protocol_bcast* sub_bcast(
+	struct subscription *sub,
+	const gchar *ev_path,
+	const gchar *json,
+	const guint64 seq)
+{
+	gchar *framed;
+	struct protocol_bcast *bcast;
+
+	if (!(sub->ev->flags & EVS_HANDLER_RESUMABLE)) {
+		return protocols_bcast(ev_path, json);
+	}
+
+	framed = g_strdup_printf(
+		"{\"epoch\":\"" SUB_EPOCH_FORMAT "\",\"seq\":%" G_GUINT64_FORMAT
+		",\"data\":%s}",
+		sub->epoch, seq, json);
+	bcast = protocols_bcast(ev_path, framed);
+	g_free(framed);
+
+	return bcast;
+}
+
+void sub_replay_push(struct subscription *sub, struct protocol_bcast *bcast)
+{
+	struct protocol_bcast *old;
+
+	sub->seq++;
+
+	if (cfg_sub_replay_count > 0 && (sub->ev->flags & EVS_HANDLER_RESUMABLE)) {
+		g_queue_push_tail(&sub->replay, protocols_bcast_ref(bcast));
+		sub->replay_bytes += bcast->len;
+	}
+
+	while (sub->replay.length > cfg_sub_replay_count ||
+			sub->replay_bytes > cfg_sub_replay_bytes) {
+		old = g_queue_pop_head(&sub->replay);
+		sub->replay_bytes -= old->len;
+		protocols_bcast_unref(old);
+	}
+}
+
+gboolean sub_replay_has(
+	struct subscription *sub,
+	const guint64 epoch,
+	const guint64 after)
+{
+	return epoch == sub->epoch &&
+		after <= sub->seq && sub->seq - after <= sub->replay.length;
+}
+
+void sub_replay(
+	struct subscription *sub,
+	const guint64 after,
+	GFunc fn,
+	void *data)
+{
+	GList *link = g_queue_peek_nth_link(&sub->replay,
+								sub->replay.length - (sub->seq - after));
+
+	for (; link != NULL; link = link->next) {
+		fn(link->data, data);
+	}
+}
+
+void sub_update_stats()
+{
+	guint64 total = qev_stats_counter_get(_stat_total);
+	guint64 bytes = __sync_add_and_fetch(&_bytes, 0) + subscribers_heap_bytes();
+
+	qev_stats_gauge_set(_stat_bytes, bytes);
+	qev_stats_gauge_set(_stat_bytes_per_sub, total == 0 ? 0 : bytes / total);
+}
+
 void sub_init()
 {
+	if (cfg_broadcast_sharded) {
+		_shards = MAX(cfg_broadcast_threads, 1);
+	}
+
+	_node = g_str_hash(cfg_public_address != NULL ?
+						cfg_public_address : g_get_host_name());
+
 	_stat_total = qev_stats_counter(
 		"subs", "total", FALSE,
 		"How many active subscriptions exist on the server");
@@ -117,4 +406,10 @@ void sub_init()
 	_stat_removed = qev_stats_counter(
 		"subs", "removed", TRUE,
 		"How many new subscriptions were removed in response to /qio/off");
+	_stat_bytes = qev_stats_gauge(
+		"subs", "bytes",
+		"Bytes used by all subscriptions, including their subscribers");
+	_stat_bytes_per_sub = qev_stats_gauge(
+		"subs", "bytes_per_sub",
+		"Average number of bytes used by each subscription");
 }
@@ -12,6 +12,12 @@
 #pragma once
 #include "quickio.h"
 
+/**
+ * How epochs are written for clients: as a string of hex, since JSON numbers
+ * can't be trusted with 64 bits
+ */
+#define SUB_EPOCH_FORMAT "%016" G_GINT64_MODIFIER "x"
+
 /**
  * Events are what are located at the paths, whereas subscriptions are what
  * are located at ev_path + ev_extra (ev_extra may == ""), and these are
@@ -29,9 +35,49 @@ struct subscription {
 	gchar *ev_extra;
 
 	/**
-	 * All of the clients currently listening for this event
+	 * All of the clients currently listening for this event. Unused when
+	 * broadcasts are sharded.
+	 */
+	struct subscribers subscribers;
+
+	/**
+	 * When broadcasts are sharded: the clients listening for this event,
+	 * split up by the broadcast thread that sends to them. One set for every
+	 * shard, so sharding costs `sizeof(struct subscribers)` for every
+	 * subscription × shard, even when most of those sets are empty.
+	 */
+	struct subscribers *shards;
+
+	/**
+	 * The newest broadcast, already framed, for sending to clients as they
+	 * subscribe. Protected by one of the last-value locks.
+	 */
+	struct protocol_bcast *lvc;
+
+	/**
+	 * Which subscription `seq` counts for: sequence numbers start over
+	 * every time a subscription is created, on every server. This server's
+	 * id is in the high 32 bits, and random bits are in the rest. Never 0.
+	 */
+	guint64 epoch;
+
+	/**
+	 * Sequence number of the newest broadcast. The first broadcast is 1.
+	 * Only touched by the broadcast tick.
+	 */
+	guint64 seq;
+
+	/**
+	 * The most recent broadcasts, oldest first, already framed, for
+	 * replaying to clients that resume. The newest is numbered `seq`, and
+	 * the rest count down from there. Only touched by the broadcast tick.
 	 */
-	qev_list_t *subscribers;
+	GQueue replay;
+
+	/**
+	 * Size of everything in `replay`, measured as the unframed events
+	 */
+	gsize replay_bytes;
 
 	/**
 	 * Reference count to allow unlocked operations when dealing with
@@ -78,6 +124,133 @@ struct subscription* sub_ref(struct subscription *sub);
  */
 void sub_unref(struct subscription *sub);
 
+/**
+ * Get the set of subscribers that the client belongs in
+ */
+struct subscribers* sub_subscribers(
+	struct subscription *sub,
+	struct client *client);
+
+/**
+ * Call a function for every client subscribed, across all shards, from
+ * the calling thread.
+ */
+void sub_subscribers_foreach(
+	struct subscription *sub,
+	subscribers_foreach_fn fn,
+	void *data);
+
+/**
+ * The number of shards every subscription is split into, or 0 if
+ * broadcasts aren't sharded. Fixed once subscriptions exist: the number of
+ * broadcast threads can't change under them.
+ */
+guint sub_shards();
+
+/**
+ * Which shard a client belongs to. Only meaningful when broadcasts are
+ * sharded. This is only where the client's broadcasts are sent from: it has
+ * nothing to do with which of quick-event's threads does its IO.
+ */
+guint sub_shard(struct client *client);
+
+/**
+ * Remember the newest broadcast to the subscription, so that it can be sent
+ * to clients as soon as they subscribe.
+ *
+ * @param sub
+ *     The subscription broadcast to
+ * @param bcast
+ *     The broadcast. A new reference is taken.
+ */
+void sub_lvc_set(struct subscription *sub, struct protocol_bcast *bcast);
+
+/**
+ * Get the newest broadcast to the subscription.
+ *
+ * @return
+ *     A reference to the broadcast, or NULL if nothing has been broadcast.
+ *     Release with protocols_bcast_unref().
+ */
+struct protocol_bcast* sub_lvc_get(struct subscription *sub);
+
+/**
+ * Frame a broadcast to the subscription. Broadcasts to resumable events are
+ * wrapped up with where they are in the subscription.
+ *
+ * @param sub
+ *     The subscription being broadcast to
+ * @param ev_path
+ *     The full path of the subscription
+ * @param json
+ *     What's being broadcast
+ * @param seq
+ *     The broadcast's sequence number
+ *
+ * @return
+ *     A new broadcast. Release with protocols_bcast_unref().
+ */
+struct protocol_bcast* sub_bcast(
+	struct subscription *sub,
+	const gchar *ev_path,
+	const gchar *json,
+	const guint64 seq);
+
+/**
+ * Number the next broadcast to the subscription and, for resumable events,
+ * keep it around for replaying, dropping the oldest kept broadcasts once
+ * there are more than `sub-replay-count` or they take up more than
+ * `sub-replay-bytes`. Only call from the broadcast tick.
+ *
+ * @param sub
+ *     The subscription broadcast to
+ * @param bcast
+ *     The broadcast. A new reference is taken if it's kept.
+ */
+void sub_replay_push(struct subscription *sub, struct protocol_bcast *bcast);
+
+/**
+ * If every broadcast to the subscription newer than the given sequence
+ * number is still kept around. Only call from the broadcast tick.
+ *
+ * @param sub
+ *     The subscription to replay
+ * @param epoch
+ *     The epoch the sequence number came from. Nothing is kept unless it's
+ *     the subscription's own.
+ * @param after
+ *     The newest broadcast that was already seen
+ */
+gboolean sub_replay_has(
+	struct subscription *sub,
+	const guint64 epoch,
+	const guint64 after);
+
+/**
+ * Call a function for every broadcast to the subscription newer than the
+ * given sequence number, oldest first. Only call from the broadcast tick,
+ * and only once sub_replay_has() says they're all there.
+ *
+ * @param sub
+ *     The subscription to replay
+ * @param after
+ *     The newest broadcast that was already seen
+ * @param fn
+ *     Given every broadcast, as `fn(bcast, data)`
+ * @param data
+ *     Passed directly to fn
+ */
+void sub_replay(
+	struct subscription *sub,
+	const guint64 after,
+	GFunc fn,
+	void *data);
+
+/**
+ * Update the memory usage stats for all subscriptions.
+ */
+void sub_update_stats();
+
 /**
  * Get subs ready to run
  */
@@ -0,0 +1,653 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "quickio.h"
+
+/**
+ * Everything needed to walk a segmented set, possibly from many threads
+ */
+struct _walk {
+	struct subscribers *subs;
+	subscribers_foreach_fn fn;
+	void *data;
+	struct subscribers_slot **segs;
+	guint32 seg_size;
+
+	/**
+	 * Chunks that haven't been run yet
+	 */
+	guint remaining;
+};
+
+/**
+ * A range of a segmented set, never crossing a segment boundary
+ */
+struct subscribers_chunk {
+	struct _walk *walk;
+	guint32 from;
+	guint32 to;
+};
+
+/**
+ * Bytes allocated by all sets outside of the sets themselves
+ */
+static guint64 _heap_bytes = 0;
+
+static void* _alloc(const gsize size)
+{
+	__sync_add_and_fetch(&_heap_bytes, size);
+	return g_malloc0(size);
+}
+
+static void _free(struct subscribers *subs, void *ptr, const gsize size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	__sync_sub_and_fetch(&_heap_bytes, size);
+
+	if (subs->readers > 0) {
+		subs->retired = g_slist_prepend(subs->retired, ptr);
+	} else {
+		g_free(ptr);
+	}
+}
+
+static guint32 _cap(struct subscribers *subs)
+{
+	switch (subs->tier) {
+		case SUBSCRIBERS_TIER_INLINE:
+			return SUBSCRIBERS_INLINE;
+
+		case SUBSCRIBERS_TIER_SMALL:
+			return subs->s.small.cap;
+
+		case SUBSCRIBERS_TIER_SEGMENTED:
+		default:
+			return subs->s.seg.nsegs * subs->s.seg.seg_size;
+	}
+}
+
+static struct subscribers_slot* _slot(struct subscribers *subs, const guint32 i)
+{
+	guint32 seg_size;
+
+	switch (subs->tier) {
+		case SUBSCRIBERS_TIER_INLINE:
+			return subs->s.inl + i;
+
+		case SUBSCRIBERS_TIER_SMALL:
+			return subs->s.small.slots + i;
+
+		case SUBSCRIBERS_TIER_SEGMENTED:
+		default:
+			seg_size = subs->s.seg.seg_size;
+			return subs->s.seg.segs[i / seg_size] + (i % seg_size);
+	}
+}
+
+static void _set(
+	struct subscribers *subs,
+	const guint32 i,
+	struct client *client,
+	subscribers_idx_t *idx)
+{
+	struct subscribers_slot *slot = _slot(subs, i);
+
+	slot->idx = idx;
+	g_atomic_pointer_set(&slot->client, client);
+
+	if (idx != NULL) {
+		*idx = i;
+	}
+}
+
+/**
+ * Copy the first len slots out of the set and into the given array
+ */
+static void _copy_out(
+	struct subscribers *subs,
+	struct subscribers_slot *to,
+	const guint32 len)
+{
+	guint32 i;
+
+	for (i = 0; i < len; i++) {
+		to[i] = *_slot(subs, i);
+	}
+}
+
+static void _free_storage(struct subscribers *subs)
+{
+	guint32 i;
+
+	switch (subs->tier) {
+		case SUBSCRIBERS_TIER_INLINE:
+			break;
+
+		case SUBSCRIBERS_TIER_SMALL:
+			_free(subs, subs->s.small.slots,
+				sizeof(*subs->s.small.slots) * subs->s.small.cap);
+			break;
+
+		case SUBSCRIBERS_TIER_SEGMENTED:
+			for (i = 0; i < subs->s.seg.nsegs; i++) {
+				_free(subs, subs->s.seg.segs[i],
+					sizeof(**subs->s.seg.segs) * subs->s.seg.seg_size);
+			}
+
+			_free(subs, subs->s.seg.segs,
+				sizeof(*subs->s.seg.segs) * subs->s.seg.segs_cap);
+			break;
+	}
+
+	memset(&subs->s, 0, sizeof(subs->s));
+}
+
+/**
+ * Move the set into a small array with room for at least `cap` clients.
+ */
+static void _to_small(struct subscribers *subs, const guint32 cap)
+{
+	guint32 len = subs->len;
+	struct subscribers_slot *slots = _alloc(sizeof(*slots) * cap);
+
+	_copy_out(subs, slots, len);
+	_free_storage(subs);
+
+	subs->tier = SUBSCRIBERS_TIER_SMALL;
+	subs->s.small.slots = slots;
+	subs->s.small.cap = cap;
+}
+
+static void _to_inline(struct subscribers *subs)
+{
+	guint32 len = subs->len;
+	struct subscribers_slot slots[SUBSCRIBERS_INLINE];
+
+	_copy_out(subs, slots, len);
+	_free_storage(subs);
+
+	subs->tier = SUBSCRIBERS_TIER_INLINE;
+	memcpy(subs->s.inl, slots, sizeof(*slots) * len);
+}
+
+static void _seg_add(struct subscribers *subs)
+{
+	struct subscribers_slot **segs = subs->s.seg.segs;
+	guint32 nsegs = subs->s.seg.nsegs;
+	guint32 segs_cap = subs->s.seg.segs_cap;
+
+	/*
+	 * Iterators might be walking the old array of segments, so it can't
+	 * be resized in place: it's replaced and retired.
+	 */
+	if (nsegs == segs_cap) {
+		subs->s.seg.segs_cap = MAX(4, segs_cap * 2);
+		subs->s.seg.segs = _alloc(sizeof(*segs) * subs->s.seg.segs_cap);
+
+		if (segs != NULL) {
+			memcpy(subs->s.seg.segs, segs, sizeof(*segs) * nsegs);
+			_free(subs, segs, sizeof(*segs) * segs_cap);
+		}
+	}
+
+	subs->s.seg.segs[nsegs] = _alloc(
+		sizeof(**subs->s.seg.segs) * subs->s.seg.seg_size);
+	subs->s.seg.nsegs++;
+}
+
+static void _to_segmented(struct subscribers *subs)
+{
+	guint32 i;
+	struct subscribers segmented = {
+		.tier = SUBSCRIBERS_TIER_SEGMENTED,
+		.s.seg.seg_size = MAX(cfg_sub_min_size, 1),
+	};
+
+	while (_cap(&segmented) <= subs->len) {
+		_seg_add(&segmented);
+	}
+
+	for (i = 0; i < subs->len; i++) {
+		*_slot(&segmented, i) = *_slot(subs, i);
+	}
+
+	_free_storage(subs);
+
+	subs->tier = SUBSCRIBERS_TIER_SEGMENTED;
+	subs->s = segmented.s;
+}
+
+static void _grow(struct subscribers *subs)
+{
+	switch (subs->tier) {
+		case SUBSCRIBERS_TIER_INLINE:
+			_to_small(subs, SUBSCRIBERS_INLINE * 2);
+			break;
+
+		case SUBSCRIBERS_TIER_SMALL:
+			if (subs->s.small.cap < SUBSCRIBERS_SMALL_MAX) {
+				_to_small(subs, subs->s.small.cap * 2);
+			} else {
+				_to_segmented(subs);
+			}
+			break;
+
+		case SUBSCRIBERS_TIER_SEGMENTED:
+			_seg_add(subs);
+			break;
+	}
+}
+
+/**
+ * Give memory back as the set empties out. Only safe when nothing is
+ * iterating.
+ */
+static void _shrink(struct subscribers *subs)
+{
+	guint32 len = subs->len;
+	guint32 seg_size;
+
+	switch (subs->tier) {
+		case SUBSCRIBERS_TIER_INLINE:
+			break;
+
+		case SUBSCRIBERS_TIER_SMALL:
+			if (len <= SUBSCRIBERS_INLINE / 2) {
+				_to_inline(subs);
+			} else if (len <= subs->s.small.cap / 4) {
+				_to_small(subs, subs->s.small.cap / 2);
+			}
+			break;
+
+		case SUBSCRIBERS_TIER_SEGMENTED:
+			if (len <= SUBSCRIBERS_SMALL_MAX / 2) {
+				_to_small(subs, SUBSCRIBERS_SMALL_MAX);
+				break;
+			}
+
+			/*
+			 * Keep one empty segment around so that a client bouncing right
+			 * at the edge doesn't constantly allocate and free
+			 */
+			seg_size = subs->s.seg.seg_size;
+			while (subs->s.seg.nsegs > 1 &&
+					(subs->s.seg.nsegs - 1) * seg_size > len + seg_size) {
+				subs->s.seg.nsegs--;
+				_free(subs, subs->s.seg.segs[subs->s.seg.nsegs],
+					sizeof(**subs->s.seg.segs) * seg_size);
+				subs->s.seg.segs[subs->s.seg.nsegs] = NULL;
+			}
+			break;
+	}
+}
+
+/**
+ * Remove all holes left behind by removals during iteration. Only safe when
+ * nothing is iterating.
+ */
+static void _compact(struct subscribers *subs)
+{
+	guint32 i;
+	guint32 to = 0;
+
+	for (i = 0; i < subs->len; i++) {
+		struct subscribers_slot *slot = _slot(subs, i);
+
+		if (slot->client == NULL) {
+			continue;
+		}
+
+		if (i != to) {
+			_set(subs, to, slot->client, slot->idx);
+			slot->client = NULL;
+			slot->idx = NULL;
+		}
+
+		to++;
+	}
+
+	subs->len = to;
+	subs->holes = 0;
+}
+
+/**
+ * Call fn with every client, then drop the refs taken when they were
+ * copied out of the set
+ */
+static void _call(
+	subscribers_foreach_fn fn,
+	void *data,
+	struct client **clients,
+	const guint32 len)
+{
+	guint32 i;
+
+	for (i = 0; i < len; i++) {
+		fn(clients[i], data);
+		qev_unref(clients[i]);
+	}
+}
+
+/**
+ * Walk the set a batch at a time: a client is only sure to be alive while
+ * it's in the set, so each batch is copied out, and ref'd, with the set
+ * locked.
+ */
+static void _walk(
+	struct _walk *walk,
+	const guint32 from,
+	const guint32 to)
+{
+	guint32 n;
+	guint32 i = from;
+	guint32 seg_size = walk->seg_size;
+	struct client *clients[SUBSCRIBERS_SMALL_MAX];
+
+	while (i < to) {
+		n = 0;
+
+		g_mutex_lock(&walk->subs->lock);
+
+		for (; i < to && n < G_N_ELEMENTS(clients); i++) {
+			struct subscribers_slot *slot =
+				walk->segs[i / seg_size] + (i % seg_size);
+
+			if (slot->client != NULL) {
+				clients[n++] = qev_ref(slot->client);
+			}
+		}
+
+		g_mutex_unlock(&walk->subs->lock);
+
+		_call(walk->fn, walk->data, clients, n);
+	}
+}
+
+/**
+ * Mark the set as being walked. Must be called with the set locked.
+ *
+ * @return
+ *     The number of slots to walk
+ */
+static guint32 _walk_begin(struct subscribers *subs, struct _walk *walk)
+{
+	walk->subs = subs;
+	walk->segs = subs->s.seg.segs;
+	walk->seg_size = subs->s.seg.seg_size;
+
+	subs->readers++;
+
+	return subs->len;
+}
+
+/**
+ * Done walking: if nothing else is walking, clean up after everything that
+ * happened while walking. Must be called with the set unlocked.
+ */
+static void _walk_end(struct subscribers *subs)
+{
+	GSList *retired;
+
+	g_mutex_lock(&subs->lock);
+
+	subs->readers--;
+	if (subs->readers == 0) {
+		retired = subs->retired;
+		subs->retired = NULL;
+		g_slist_free_full(retired, g_free);
+
+		if (subs->holes > 0) {
+			_compact(subs);
+			_shrink(subs);
+		}
+	}
+
+	g_mutex_unlock(&subs->lock);
+}
+
+/**
+ * Hand out a chunk for every segment that's in use
+ */
+static guint32 _walk_chunked(
+	struct _walk *walk_,
+	const guint32 len,
+	subscribers_chunk_fn chunk_fn,
+	void *chunk_data)
+{
+	guint32 from;
+	guint32 seg_size = walk_->seg_size;
+	guint32 chunks = (len + seg_size - 1) / seg_size;
+	struct _walk *walk = g_slice_copy(sizeof(*walk), walk_);
+
+	/*
+	 * All chunks are counted before any are handed out: the first could
+	 * finish before the last is made.
+	 */
+	walk->remaining = chunks;
+
+	for (from = 0; from < len; from += seg_size) {
+		struct subscribers_chunk *chunk = g_slice_alloc(sizeof(*chunk));
+		chunk->walk = walk;
+		chunk->from = from;
+		chunk->to = MIN(from + seg_size, len);
+
+		chunk_fn(chunk, chunk_data);
+	}
+
+	return chunks;
+}
+
+void subscribers_init(struct subscribers *subs)
+{
+	memset(subs, 0, sizeof(*subs));
+	g_mutex_init(&subs->lock);
+}
+
+void subscribers_clear(struct subscribers *subs)
+{
+	_free_storage(subs);
+	g_slist_free_full(subs->retired, g_free);
+	g_mutex_clear(&subs->lock);
+	memset(subs, 0, sizeof(*subs));
+}
+
+gboolean subscribers_add(
+	struct subscribers *subs,
+	struct client *client,
+	subscribers_idx_t *idx)
+{
+	gboolean ok = FALSE;
+
+	g_mutex_lock(&subs->lock);
+
+	if ((subs->len - subs->holes) >= qev_cfg_get_max_clients()) {
+		goto out;
+	}
+
+	if (subs->len == _cap(subs)) {
+		_grow(subs);
+	}
+
+	_set(subs, subs->len, client, idx);
+	subs->len++;
+	ok = TRUE;
+
+out:
+	g_mutex_unlock(&subs->lock);
+	return ok;
+}
+
+void subscribers_remove(struct subscribers *subs, subscribers_idx_t *idx)
+{
+	guint32 i;
+	guint32 last;
+	struct subscribers_slot *slot;
+
+	g_mutex_lock(&subs->lock);
+
+	i = *idx;
+	last = subs->len - 1;
+
+	if (G_UNLIKELY(i >= subs->len || _slot(subs, i)->idx != idx)) {
+		WARN("Attempted to remove a client from subscribers that isn't there");
+		goto out;
+	}
+
+	/*
+	 * Iterators might be sitting right on this slot, so it can only be
+	 * emptied: the hole is compacted once they're all done.
+	 */
+	if (subs->readers > 0) {
+		slot = _slot(subs, i);
+		g_atomic_pointer_set(&slot->client, NULL);
+		slot->idx = NULL;
+		subs->holes++;
+		goto out;
+	}
+
+	if (i != last) {
+		slot = _slot(subs, last);
+		_set(subs, i, slot->client, slot->idx);
+	}
+
+	slot = _slot(subs, last);
+	slot->client = NULL;
+	slot->idx = NULL;
+	subs->len--;
+
+	_shrink(subs);
+
+out:
+	g_mutex_unlock(&subs->lock);
+}
+
+void subscribers_move(
+	struct subscribers *subs,
+	subscribers_idx_t *from,
+	subscribers_idx_t *to)
+{
+	guint32 i;
+	struct subscribers_slot *slot;
+
+	g_mutex_lock(&subs->lock);
+
+	i = *from;
+
+	if (G_UNLIKELY(i >= subs->len || _slot(subs, i)->idx != from)) {
+		WARN("Attempted to move a client in subscribers that isn't there");
+		goto out;
+	}
+
+	slot = _slot(subs, i);
+	slot->idx = to;
+	*to = i;
+
+out:
+	g_mutex_unlock(&subs->lock);
+}
+
+static guint32 _foreach(
+	struct subscribers *subs,
+	subscribers_foreach_fn fn,
+	void *data,
+	subscribers_chunk_fn chunk_fn,
+	void *chunk_data)
+{
+	guint32 i;
+	guint32 len;
+	guint32 chunks = 0;
+	struct _walk walk = {
+		.fn = fn,
+		.data = data,
+	};
+	struct client *clients[SUBSCRIBERS_SMALL_MAX];
+
+	g_mutex_lock(&subs->lock);
+
+	/*
+	 * Small sets are cheaper to copy out than to coordinate with: once
+	 * copied, only the clients need to be kept alive for the walk.
+	 */
+	if (subs->tier != SUBSCRIBERS_TIER_SEGMENTED) {
+		len = subs->len;
+		for (i = 0; i < len; i++) {
+			clients[i] = qev_ref(_slot(subs, i)->client);
+		}
+
+		g_mutex_unlock(&subs->lock);
+
+		_call(fn, data, clients, len);
+
+		return 0;
+	}
+
+	len = _walk_begin(subs, &walk);
+	g_mutex_unlock(&subs->lock);
+
+	/*
+	 * A single segment isn't worth the trouble of handing off
+	 */
+	if (chunk_fn != NULL && len > walk.seg_size) {
+		chunks = _walk_chunked(&walk, len, chunk_fn, chunk_data);
+	} else {
+		_walk(&walk, 0, len);
+		_walk_end(subs);
+	}
+
+	return chunks;
+}
+
+void subscribers_foreach(
+	struct subscribers *subs,
+	subscribers_foreach_fn fn,
+	void *data)
+{
+	_foreach(subs, fn, data, NULL, NULL);
+}
+
+guint32 subscribers_foreach_chunked(
+	struct subscribers *subs,
+	subscribers_foreach_fn fn,
+	void *data,
+	subscribers_chunk_fn chunk_fn,
+	void *chunk_data)
+{
+	return _foreach(subs, fn, data, chunk_fn, chunk_data);
+}
+
+void subscribers_chunk_run(struct subscribers_chunk *chunk)
+{
+	struct _walk *walk = chunk->walk;
+
+	_walk(walk, chunk->from, chunk->to);
+	g_slice_free1(sizeof(*chunk), chunk);
+
+	if (g_atomic_int_dec_and_test(&walk->remaining)) {
+		_walk_end(walk->subs);
+		g_slice_free1(sizeof(*walk), walk);
+	}
+}
+
+guint32 subscribers_size(struct subscribers *subs)
+{
+	guint32 size;
+
+	g_mutex_lock(&subs->lock);
+	size = subs->len - subs->holes;
+	g_mutex_unlock(&subs->lock);
+
+	return size;
+}
+
+guint64 subscribers_heap_bytes()
+{
+	return __sync_add_and_fetch(&_heap_bytes, 0);
+}
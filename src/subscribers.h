@@ -0,0 +1,271 @@
+/**
+ * A set of clients subscribed to a subscription, sized to fit.
+ * @file
+ *
+ * Most subscriptions only ever see a client or two (think per-user
+ * channels), so the set starts with its clients stored inline, moves to a
+ * small array once that overflows, and only becomes a segmented list once
+ * it really starts to grow. Removals are compacted by moving the last client
+ * into the hole, and the set shrinks back down as clients leave.
+ *
+ * Clients are never written to with any lock on the set held: iterators
+ * copy clients out a batch at a time, taking a ref on each with the set
+ * locked, and only call out once it's unlocked. Any storage that would be
+ * freed or moved while they walk is kept around until the last of them
+ * finishes.
+ *
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * @internal This file is part of QuickIO and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "quickio.h"
+
+/**
+ * Number of clients stored inside the set itself
+ */
+#define SUBSCRIBERS_INLINE 4
+
+/**
+ * Largest the small array may grow before the set is segmented
+ */
+#define SUBSCRIBERS_SMALL_MAX 64
+
+/**
+ * Where a client lives in the set. This is owned by the client but updated
+ * by the set whenever the client is moved.
+ */
+typedef guint32 subscribers_idx_t;
+
+/**
+ * Called for every client in the set
+ */
+typedef void (*subscribers_foreach_fn)(struct client *client, void *data);
+
+/**
+ * A piece of a large set that may be walked on its own
+ */
+struct subscribers_chunk;
+
+/**
+ * Given every chunk of a large set as it's split up
+ */
+typedef void (*subscribers_chunk_fn)(
+	struct subscribers_chunk *chunk,
+	void *data);
+
+/**
+ * A single client in the set
+ */
+struct subscribers_slot {
+	/**
+	 * The subscribed client. NULL if the client was removed while the
+	 * set was being iterated.
+	 */
+	struct client *client;
+
+	/**
+	 * Where the client keeps its index, so that it can be updated when
+	 * the client is moved around.
+	 */
+	subscribers_idx_t *idx;
+};
+
+/**
+ * The storage tiers the set moves through
+ */
+enum subscribers_tier {
+	/**
+	 * Clients are stored in the set itself
+	 */
+	SUBSCRIBERS_TIER_INLINE,
+
+	/**
+	 * Clients are stored in a single, small array
+	 */
+	SUBSCRIBERS_TIER_SMALL,
+
+	/**
+	 * Clients are stored in fixed-size segments
+	 */
+	SUBSCRIBERS_TIER_SEGMENTED,
+};
+
+/**
+ * All of the clients subscribed to something
+ */
+struct subscribers {
+	/**
+	 * Serializes changes to the set. Never held while calling out.
+	 */
+	GMutex lock;
+
+	/**
+	 * Which storage is in use
+	 */
+	enum subscribers_tier tier;
+
+	/**
+	 * Number of slots in use, including any holes
+	 */
+	guint32 len;
+
+	/**
+	 * Number of slots that were emptied while being iterated
+	 */
+	guint32 holes;
+
+	/**
+	 * Number of iterators currently walking the set
+	 */
+	guint32 readers;
+
+	/**
+	 * Storage for each tier
+	 */
+	union {
+		/**
+		 * SUBSCRIBERS_TIER_INLINE
+		 */
+		struct subscribers_slot inl[SUBSCRIBERS_INLINE];
+
+		/**
+		 * SUBSCRIBERS_TIER_SMALL
+		 */
+		struct {
+			struct subscribers_slot *slots;
+			guint32 cap;
+		} small;
+
+		/**
+		 * SUBSCRIBERS_TIER_SEGMENTED
+		 */
+		struct {
+			struct subscribers_slot **segs;
+			guint32 nsegs;
+			guint32 segs_cap;
+			guint32 seg_size;
+		} seg;
+	} s;
+
+	/**
+	 * Storage that was replaced while iterators were walking it
+	 */
+	GSList *retired;
+};
+
+/**
+ * Setup a set for use. A zeroed-out set is also ready for use.
+ */
+void subscribers_init(struct subscribers *subs);
+
+/**
+ * Free everything held by the set. Nothing may be iterating.
+ */
+void subscribers_clear(struct subscribers *subs);
+
+/**
+ * Add a client to the set.
+ *
+ * @param subs
+ *     The set to add to
+ * @param client
+ *     The client to add
+ * @param idx
+ *     Where the client's index is stored. This must remain valid until
+ *     the client is removed, as the set updates it as the client moves.
+ *
+ * @return
+ *     If the client was added. Fails only when the set is as large as the
+ *     maximum number of clients.
+ */
+gboolean subscribers_add(
+	struct subscribers *subs,
+	struct client *client,
+	subscribers_idx_t *idx);
+
+/**
+ * Remove a client from the set.
+ *
+ * @param subs
+ *     The set to remove from
+ * @param idx
+ *     The index given to subscribers_add()
+ */
+void subscribers_remove(struct subscribers *subs, subscribers_idx_t *idx);
+
+/**
+ * Tell the set that a client's index has moved.
+ *
+ * @param subs
+ *     The set the client is in
+ * @param from
+ *     Where the index was kept. It must still be readable.
+ * @param to
+ *     Where the index is kept now
+ */
+void subscribers_move(
+	struct subscribers *subs,
+	subscribers_idx_t *from,
+	subscribers_idx_t *to);
+
+/**
+ * Call a function for every client in the set, from the calling thread.
+ *
+ * @param subs
+ *     The set to iterate
+ * @param fn
+ *     The function to call for every client
+ * @param data
+ *     Passed directly to fn
+ */
+void subscribers_foreach(
+	struct subscribers *subs,
+	subscribers_foreach_fn fn,
+	void *data);
+
+/**
+ * Call a function for every client in the set, splitting large sets into
+ * chunks that may be walked by other threads. Small sets are walked right
+ * away, from the calling thread.
+ *
+ * @param subs
+ *     The set to iterate. Must remain valid until every chunk is run.
+ * @param fn
+ *     The function to call for every client
+ * @param data
+ *     Passed directly to fn. Must remain valid until every chunk is run.
+ * @param chunk_fn
+ *     Given every chunk. Each must be run exactly once with
+ *     subscribers_chunk_run().
+ * @param chunk_data
+ *     Passed directly to chunk_fn
+ *
+ * @return
+ *     The number of chunks given to chunk_fn. If 0, every client was
+ *     walked before returning.
+ */
+guint32 subscribers_foreach_chunked(
+	struct subscribers *subs,
+	subscribers_foreach_fn fn,
+	void *data,
+	subscribers_chunk_fn chunk_fn,
+	void *chunk_data);
+
+/**
+ * Call the function for every client in the chunk, then free it.
+ */
+void subscribers_chunk_run(struct subscribers_chunk *chunk);
+
+/**
+ * Get the number of clients in the set
+ */
+guint32 subscribers_size(struct subscribers *subs);
+
+/**
+ * The number of bytes allocated outside of the set, across all sets.
+ */
+guint64 subscribers_heap_bytes();
@@ -27,7 +27,7 @@ START_TEST(test_client_shutdown_while_subscribing)
 	struct client *client = test_get_client();
 
 	test_send(tc, "/qio/on:1=\"/test/delayed\"");
-	QEV_WAIT_FOR(client->subs != NULL && g_hash_table_size(client->subs) > 0);
+	QEV_WAIT_FOR(client->subs.len > 0);
 
 	client_closed(client);
 
@@ -121,14 +121,15 @@ START_TEST(test_client_callbacks_all)
 {
 	guint i;
 	guint64 cb;
-	gboolean saw_evicted_error = FALSE;
-	guint64 cb_ids[G_N_ELEMENTS(((struct client*)NULL)->cbs) + 1];
+	gboolean evicted;
+	const guint total_cbs = cfg_clients_cb_max + 1;
+	guint64 *cb_ids = g_new0(guint64, total_cbs);
 	GString *buff = qev_buffer_get();
 	qev_fd_t tc = test_client();
 
 	g_string_set_size(buff, 127);
 
-	for (i = 0; i < G_N_ELEMENTS(cb_ids); i++) {
+	for (i = 0; i < total_cbs; i++) {
 		test_send(tc, "/test/client/cb:1=");
 		test_recv(tc, buff->str, buff->allocated_len);
 
@@ -137,19 +138,23 @@ START_TEST(test_client_callbacks_all)
 		cb_ids[i] = cb;
 	}
 
-	for (i = 0; i < G_N_ELEMENTS(cb_ids); i++) {
+	/*
+	 * Only the oldest callback should have been pushed out
+	 */
+	for (i = 0; i < total_cbs; i++) {
 		cb = cb_ids[i];
 		g_string_printf(buff, "/qio/callback/%" G_GUINT64_FORMAT":1=null", cb);
 		test_send(tc, buff->str);
 		test_recv(tc, buff->str, buff->allocated_len);
-		saw_evicted_error |= g_strstr_len(buff->str, -1, "404") != NULL;
-	}
 
-	ck_assert(saw_evicted_error);
+		evicted = g_strstr_len(buff->str, -1, "404") != NULL;
+		ck_assert(evicted == (i == 0));
+	}
 
 	test_ping(tc);
 
 	close(tc);
+	g_free(cb_ids);
 	qev_buffer_put(buff);
 }
 END_TEST
@@ -175,7 +180,7 @@ START_TEST(test_client_callbacks_limits)
 		"/qio/callback/18446744073709551615:0={\"code\":404,\"data\":null,"
 			"\"err_msg\":\"callback doesn't exist\"}");
 
-	for (i = 0; i < G_N_ELEMENTS(((struct client*)NULL)->cbs) * 2; i++) {
+	for (i = 0; i < cfg_clients_cb_max * 2; i++) {
 		g_string_printf(buff, "/qio/callback/%u:1=null", i << 16 | 1);
 		test_cb(tc,
 			buff->str,
@@ -193,7 +198,7 @@ END_TEST
 
 START_TEST(test_client_callbacks_overflow)
 {
-	const guint total_cbs = G_N_ELEMENTS(((struct client*)NULL)->cbs);
+	const guint total_cbs = cfg_clients_cb_max;
 
 	guint i;
 	guint32 cb;
@@ -202,7 +207,7 @@ START_TEST(test_client_callbacks_overflow)
 	GString *buff = qev_buffer_get();
 	g_string_set_size(buff, 127);
 
-	client->cbs_id -= total_cbs / 2;
+	client->cbs.id -= total_cbs / 2;
 
 	for (i = 0; i < total_cbs; i++) {
 		test_send(tc, "/test/client/cb:1=");
@@ -232,28 +237,95 @@ static enum evs_status _test_client_callbacks_prune_cb(
 static void _test_client_callbacks_prune_free(void *i_)
 {
 	guint *i = i_;
+
+	/*
+	 * Anything that cares hears about it before the data is freed
+	 */
+	ck_assert_uint_eq(*i, 50);
 	*i = 100;
 }
 
+static void _test_client_callbacks_prune_expire(
+	struct client *client G_GNUC_UNUSED,
+	const void *i_,
+	const gboolean evicted)
+{
+	guint *i = (guint*)i_;
+
+	ck_assert(!evicted);
+	*i = 50;
+}
+
 START_TEST(test_client_callbacks_prune)
 {
 	guint i = 0;
+	struct client_cb *cb;
 	qev_fd_t tc = test_client();
 	struct client *client = test_get_client();
 
+	evs_cb_on_expire(_test_client_callbacks_prune_cb,
+		_test_client_callbacks_prune_expire);
+
 	client_cb_new(client,
 		_test_client_callbacks_prune_cb,
 		&i,
 		_test_client_callbacks_prune_free);
 
-	ck_assert(client->cbs[0] != NULL);
-	client->cbs[0]->created = qev_monotonic - QEV_SEC_TO_USEC(cfg_clients_cb_max_age * 100);
+	ck_assert(client->cbs.oldest != CLIENT_CB_NONE);
+	cb = client->cbs.slots + client->cbs.oldest;
+	cb->created = qev_monotonic - QEV_SEC_TO_USEC(cfg_clients_cb_max_age * 100);
 
-	periodic_run();
+	test_heartbeat();
 
-	ck_assert(client->cbs[0] == NULL);
+	ck_assert(client->cbs.oldest == CLIENT_CB_NONE);
 	ck_assert_uint_eq(i, 100);
 
+	evs_cb_on_expire(_test_client_callbacks_prune_cb, NULL);
+
+	close(tc);
+}
+END_TEST
+
+static void _test_client_callbacks_evict_expire(
+	struct client *client G_GNUC_UNUSED,
+	const void *evictions_,
+	const gboolean evicted)
+{
+	guint *evictions = (guint*)evictions_;
+
+	ck_assert(evicted);
+	(*evictions)++;
+}
+
+START_TEST(test_client_callbacks_evict_locked)
+{
+	guint i;
+	guint evictions = 0;
+	qev_fd_t tc = test_client();
+	struct client *client = test_get_client();
+
+	evs_cb_on_expire(_test_client_callbacks_prune_cb,
+		_test_client_callbacks_evict_expire);
+
+	client_lock(client);
+	client_lock(client);
+
+	for (i = 0; i < cfg_clients_cb_max + 2; i++) {
+		client_cb_new(client, _test_client_callbacks_prune_cb,
+						&evictions, NULL);
+	}
+
+	/*
+	 * Nothing expires while the client is locked, no matter how deep
+	 */
+	client_unlock(client);
+	ck_assert_uint_eq(evictions, 0);
+
+	client_unlock(client);
+	ck_assert_uint_eq(evictions, 2);
+
+	evs_cb_on_expire(_test_client_callbacks_prune_cb, NULL);
+
 	close(tc);
 }
 END_TEST
@@ -333,7 +405,7 @@ END_TEST
 
 START_TEST(test_client_subs_list_add_fail)
 {
-	qev_mock_add("client_sub_accept", "qev_list_add", FALSE, NULL, 0);
+	qev_mock_add("client_sub_accept", "subscribers_add", FALSE, NULL, 0);
 
 	qev_fd_t tc = test_client();
 	GString *buff = qev_buffer_get();
@@ -350,11 +422,14 @@ END_TEST
 START_TEST(test_client_subs_add_after_close)
 {
 	enum client_sub_state state;
+	struct subscription *sub;
 	gchar *ev_extra = NULL;
-	struct event *ev = evs_query("/test/good", &ev_extra);
-	struct subscription *sub = sub_get(ev, ev_extra, TRUE);
 	struct client *surrogate = protocols_new_surrogate(protocol_rfc6455);
 
+	evs_query_begin();
+	sub = sub_get(evs_query("/test/good", &ev_extra), ev_extra, TRUE);
+	evs_query_end();
+
 	qev_close(surrogate, 0);
 
 	state = client_sub_add(surrogate, sub);
@@ -367,6 +442,108 @@ START_TEST(test_client_subs_add_after_close)
 }
 END_TEST
 
+START_TEST(test_client_subs_table)
+{
+	guint i;
+	const guint total = CLIENT_SUBS_INLINE * 5;
+	GString *buff = qev_buffer_get();
+	GString *expect = qev_buffer_get();
+	qev_fd_t tc = test_client();
+	struct client *client = test_get_client();
+
+	for (i = 0; i < total; i++) {
+		g_string_printf(buff, "/qio/on:%u=\"/test/good-childs/%u\"", i + 1, i);
+		g_string_printf(expect,
+			"/qio/callback/%u:0={\"code\":200,\"data\":null}", i + 1);
+		test_cb(tc, buff->str, expect->str);
+	}
+
+	ck_assert_uint_eq(client->subs.len, total);
+	ck_assert_uint_gt(client->subs.cap, 0);
+
+	/*
+	 * Moving into the table mustn't lose the client in any subscribers
+	 */
+	evs_broadcast_path("/test/good-childs/0", "0");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good-childs/0:0=0");
+
+	evs_broadcast_path("/test/good-childs/7", "7");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good-childs/7:0=7");
+
+	for (i = 1; i < total; i++) {
+		g_string_printf(buff, "/qio/off:%u=\"/test/good-childs/%u\"", i + 1, i);
+		g_string_printf(expect,
+			"/qio/callback/%u:0={\"code\":200,\"data\":null}", i + 1);
+		test_cb(tc, buff->str, expect->str);
+	}
+
+	ck_assert_uint_eq(client->subs.len, 1);
+	ck_assert_uint_eq(client->subs.cap, 0);
+
+	/*
+	 * Nor moving back out of it
+	 */
+	evs_broadcast_path("/test/good-childs/0", "0");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good-childs/0:0=0");
+
+	qev_buffer_put(buff);
+	qev_buffer_put(expect);
+	close(tc);
+}
+END_TEST
+
+static void* _test_client_slab_thread(void *nothing G_GNUC_UNUSED)
+{
+	return slab_client_new();
+}
+
+START_TEST(test_client_slab)
+{
+	GThread *th;
+	struct client *client;
+	struct client *other;
+	static const struct client zero;
+
+	client = slab_client_new();
+	ck_assert(slab_contains(client));
+	ck_assert(memcmp(client, &zero, sizeof(zero)) == 0);
+
+	memset(client, 0xff, sizeof(*client));
+	slab_client_free(client);
+
+	/*
+	 * Freed clients are reused first, and always come back clean
+	 */
+	other = slab_client_new();
+	ck_assert(other == client);
+	ck_assert(memcmp(other, &zero, sizeof(zero)) == 0);
+	slab_client_free(other);
+
+	/*
+	 * Freed on a thread other than the one that made it
+	 */
+	th = g_thread_new("slab", _test_client_slab_thread, NULL);
+	client = g_thread_join(th);
+	ck_assert(slab_contains(client));
+
+	/*
+	 * The thread exited, so the next new thread takes over its slab and
+	 * carries on from the same block
+	 */
+	th = g_thread_new("slab", _test_client_slab_thread, NULL);
+	other = g_thread_join(th);
+	ck_assert(slab_contains(other));
+	ck_assert(other != client);
+	ck_assert((gsize)ABS((gchar*)other - (gchar*)client) < (2 << 20));
+
+	slab_client_free(client);
+	slab_client_free(other);
+}
+END_TEST
+
 START_TEST(test_client_data_sane)
 {
 	GVariant *v;
@@ -416,6 +593,7 @@ int main()
 	tcase_add_test(tcase, test_client_callbacks_limits);
 	tcase_add_test(tcase, test_client_callbacks_overflow);
 	tcase_add_test(tcase, test_client_callbacks_prune);
+	tcase_add_test(tcase, test_client_callbacks_evict_locked);
 
 	tcase = tcase_create("Subs");
 	suite_add_tcase(s, tcase);
@@ -425,6 +603,16 @@ int main()
 	tcase_add_test(tcase, test_client_subs_list_add_fail);
 	tcase_add_test(tcase, test_client_subs_add_after_close);
 
+	tcase = tcase_create("Subs Table");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_client_subs_table);
+
+	tcase = tcase_create("Slab");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_client_slab);
+
 	tcase = tcase_create("Data");
 	suite_add_tcase(s, tcase);
 	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
@@ -0,0 +1,387 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of quick-event and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "test.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+#define CLUSTER_CONFIG "test_cluster_" G_STRINGIFY(PORT) ".ini"
+#define PEER_CONFIG "test_cluster_peer_" G_STRINGIFY(PORT) ".ini"
+
+/**
+ * Set in the environment of the second server: this same binary, run
+ * again, that the server under test links to
+ */
+#define PEER_ENV "QIO_TEST_CLUSTER_PEER"
+
+#define CLUSTER_PORT (PORT + 2)
+#define PEER_CLUSTER_PORT (PORT + 3)
+#define PEER_PORT (PORT + 4)
+
+/**
+ * How long the peer waits for interest to change, in microseconds
+ */
+#define PEER_WAIT (5 * G_USEC_PER_SEC)
+
+static GPid _peer_pid;
+static gint _peer_in;
+static gint _peer_out;
+
+static gboolean _peer_wait(const gchar *path, const gboolean relays)
+{
+	gint64 until = g_get_monotonic_time() + PEER_WAIT;
+
+	while (cluster_relays(path) != relays) {
+		if (g_get_monotonic_time() > until) {
+			return FALSE;
+		}
+
+		g_usleep(1000);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Runs the peer: every line on stdin is a command, and each gets a "1" or
+ * a "0" back on stdout:
+ *
+ *   +<path>         wait for the server under test to want path
+ *   -<path>         wait for the server under test to stop wanting path
+ *   <path>=<json>   broadcast
+ */
+static int _peer()
+{
+	gboolean ok;
+	FILE *replies;
+	gchar line[1024];
+	gchar *args[] = {"test", "--config-file=" PEER_CONFIG};
+
+	/*
+	 * Anything the server has to say goes to stderr, so that replies are
+	 * the only thing on stdout
+	 */
+	replies = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	qio_main(G_N_ELEMENTS(args), args);
+
+	/*
+	 * Something only the peer knows about
+	 */
+	evs_add_handler(NULL, "/core", NULL, NULL, NULL, TRUE);
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		g_strchomp(line);
+
+		switch (*line) {
+			case '+':
+				ok = _peer_wait(line + 1, TRUE);
+				break;
+
+			case '-':
+				ok = _peer_wait(line + 1, FALSE);
+				break;
+
+			default:
+				ok = publish_handle(line, strlen(line)) == 1;
+				evs_broadcast_tick();
+				break;
+		}
+
+		fprintf(replies, "%d\n", ok);
+		fflush(replies);
+	}
+
+	qev_exit();
+
+	return 0;
+}
+
+static void _peer_spawn()
+{
+	gboolean ok;
+	gchar *argv[] = {"/proc/self/exe", NULL};
+	gchar **envp = g_environ_setenv(g_get_environ(), PEER_ENV, "1", TRUE);
+
+	ok = g_spawn_async_with_pipes(NULL, argv, envp, 0, NULL, NULL,
+									&_peer_pid, &_peer_in, &_peer_out,
+									NULL, NULL);
+	ck_assert(ok);
+
+	g_strfreev(envp);
+}
+
+static void _peer_kill()
+{
+	kill(_peer_pid, SIGTERM);
+	waitpid(_peer_pid, NULL, 0);
+	g_spawn_close_pid(_peer_pid);
+
+	close(_peer_in);
+	close(_peer_out);
+}
+
+static gboolean _peer_do(const gchar *cmd)
+{
+	gchar c;
+	gchar reply = '\0';
+	GString *line = qev_buffer_get();
+
+	g_string_printf(line, "%s\n", cmd);
+	ck_assert_int_eq(write(_peer_in, line->str, line->len), line->len);
+	qev_buffer_put(line);
+
+	while (read(_peer_out, &c, 1) == 1 && c != '\n') {
+		reply = c;
+	}
+
+	return reply == '1';
+}
+
+static void _setup_cluster(const gchar *cluster, const gchar *peer_cluster)
+{
+	gboolean ok;
+	gchar *cfg;
+
+	cfg = g_strdup_printf("[quick.io]\n%s", cluster);
+	ok = g_file_set_contents(CLUSTER_CONFIG, cfg, -1, NULL);
+	g_free(cfg);
+	ck_assert(ok);
+
+	cfg = g_strdup_printf(
+		"[quick-event]\n"
+		"listen = localhost:%d\n"
+		"[quick.io]\n"
+		"%s"
+		"[quick.io-apps]\n"
+		"/test = ./app_test_sane\n"
+		"[test_app_sane]\n"
+		"sane-value = 172346\n",
+		PEER_PORT, peer_cluster);
+	ok = g_file_set_contents(PEER_CONFIG, cfg, -1, NULL);
+	g_free(cfg);
+	ck_assert(ok);
+
+	test_setup_with_config(CLUSTER_CONFIG);
+	_peer_spawn();
+}
+
+static void _setup()
+{
+	gchar *cluster = g_strdup_printf(
+		"cluster-listen = localhost:%d\n"
+		"cluster-peers = localhost:%d\n",
+		CLUSTER_PORT, PEER_CLUSTER_PORT);
+	gchar *peer_cluster = g_strdup_printf(
+		"cluster-listen = localhost:%d\n"
+		"cluster-peers = localhost:%d\n",
+		PEER_CLUSTER_PORT, CLUSTER_PORT);
+
+	_setup_cluster(cluster, peer_cluster);
+
+	g_free(cluster);
+	g_free(peer_cluster);
+}
+
+/**
+ * The server under test is an edge, pulling from the peer
+ */
+static void _setup_edge()
+{
+	gchar *cluster = g_strdup_printf(
+		"cluster-upstream = localhost:%d\n",
+		PEER_CLUSTER_PORT);
+	gchar *peer_cluster = g_strdup_printf(
+		"cluster-listen = localhost:%d\n",
+		PEER_CLUSTER_PORT);
+
+	_setup_cluster(cluster, peer_cluster);
+
+	g_free(cluster);
+	g_free(peer_cluster);
+}
+
+static void _teardown()
+{
+	_peer_kill();
+	test_teardown();
+
+	unlink(CLUSTER_CONFIG);
+	unlink(PEER_CONFIG);
+}
+
+START_TEST(test_cluster_relay)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	ck_assert(_peer_do("+/test/good"));
+	ck_assert(_peer_do("/test/good={\"from\":\"peer\"}"));
+
+	test_msg(tc, "/test/good:0={\"from\":\"peer\"}");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_cluster_interest)
+{
+	qev_fd_t tc = test_client();
+
+	ck_assert(_peer_do("-/test/good"));
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/test/good"));
+	ck_assert(_peer_do("-/test/good-child"));
+
+	test_cb(tc,
+		"/qio/off:2=\"/test/good\"",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("-/test/good"));
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_cluster_mixed)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/test/good"));
+
+	/*
+	 * The peer has no clients, so nothing should be headed its way
+	 */
+	ck_assert(!cluster_relays("/test/good"));
+
+	evs_broadcast_path("/test/good", "\"local\"");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good:0=\"local\"");
+
+	ck_assert(_peer_do("/test/good=\"remote\""));
+	test_msg(tc, "/test/good:0=\"remote\"");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_cluster_redial)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/test/good"));
+
+	_peer_kill();
+	_peer_spawn();
+
+	ck_assert(_peer_do("+/test/good"));
+	ck_assert(_peer_do("/test/good=\"again\""));
+	test_msg(tc, "/test/good:0=\"again\"");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_cluster_edge_shared)
+{
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/core/feed\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	test_cb(tc2,
+		"/qio/on:1=\"/core/feed\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/core/feed"));
+
+	ck_assert(_peer_do("/core/feed=\"from the core\""));
+	test_msg(tc, "/core/feed:0=\"from the core\"");
+	test_msg(tc2, "/core/feed:0=\"from the core\"");
+
+	test_cb(tc,
+		"/qio/off:2=\"/core/feed\"",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/core/feed"));
+
+	ck_assert(_peer_do("/core/feed=\"still here\""));
+	test_msg(tc2, "/core/feed:0=\"still here\"");
+
+	test_cb(tc2,
+		"/qio/off:2=\"/core/feed\"",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("-/core/feed"));
+
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_cluster_edge_events)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/core/feed:1=null",
+		"/qio/callback/1:0={\"code\":404,\"data\":null,\"err_msg\":null}");
+
+	test_cb(tc,
+		"/qio/on:2=\"/test/good\"",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}");
+	ck_assert(_peer_do("+/test/good"));
+
+	evs_broadcast_path("/test/good", "\"edge\"");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good:0=\"edge\"");
+
+	close(tc);
+}
+END_TEST
+
+int main()
+{
+	SRunner *sr;
+	Suite *s;
+	TCase *tcase;
+
+	if (g_getenv(PEER_ENV) != NULL) {
+		return _peer();
+	}
+
+	test_new("cluster", &sr, &s);
+
+	tcase = tcase_create("Sane");
+	suite_add_tcase(s, tcase);
+	tcase_set_timeout(tcase, 30);
+	tcase_add_checked_fixture(tcase, _setup, _teardown);
+	tcase_add_test(tcase, test_cluster_relay);
+	tcase_add_test(tcase, test_cluster_interest);
+	tcase_add_test(tcase, test_cluster_mixed);
+	tcase_add_test(tcase, test_cluster_redial);
+
+	tcase = tcase_create("Edge");
+	suite_add_tcase(s, tcase);
+	tcase_set_timeout(tcase, 30);
+	tcase_add_checked_fixture(tcase, _setup_edge, _teardown);
+	tcase_add_test(tcase, test_cluster_edge_shared);
+	tcase_add_test(tcase, test_cluster_edge_events);
+
+	return test_do(sr);
+}
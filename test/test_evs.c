@@ -76,9 +76,12 @@ START_TEST(test_evs_on_info_copy)
 	qev_fd_t tc = test_client();
 	struct evs_on_info in = {
 		.client = test_get_client(),
-		.sub = sub_get(evs_query("/test/good", &ev_extra), NULL, TRUE),
 	};
 
+	evs_query_begin();
+	in.sub = sub_get(evs_query("/test/good", &ev_extra), NULL, TRUE);
+	evs_query_end();
+
 	out = evs_on_info_copy(&in, TRUE, TRUE);
 	ck_assert_ptr_eq(out->ev_extra, NULL);
 	ck_assert_ptr_eq(out->json, NULL);
@@ -114,6 +117,8 @@ START_TEST(test_evs_query_handles_children_lookups)
 	specific = evs_add_handler("/query-test", "/specific",
 					NULL, NULL, NULL, FALSE);
 
+	evs_query_begin();
+
 	found = evs_query("/query-tes", &ev_extra);
 	ck_assert_ptr_eq(NULL, found);
 
@@ -154,6 +159,171 @@ START_TEST(test_evs_query_handles_children_lookups)
 
 	found = evs_query("/query-test/a", &ev_extra);
 	ck_assert_ptr_eq(NULL, found);
+
+	evs_query_end();
+}
+END_TEST
+
+START_TEST(test_evs_query_many_handlers)
+{
+	guint i;
+	gchar path[32];
+	gchar *ev_extra = NULL;
+	struct event *evs[64];
+	struct event *deeper[64];
+	struct event *found;
+	const gchar *chars =
+		"-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+
+	/*
+	 * Enough children under one node to push it through every node size
+	 */
+	for (i = 0; i < strlen(chars); i++) {
+		g_snprintf(path, sizeof(path), "/many/%c", chars[i]);
+		evs[i] = evs_add_handler(path, NULL, NULL, NULL, NULL, TRUE);
+		ck_assert(evs[i] != NULL);
+
+		g_snprintf(path, sizeof(path), "/many/%c/deeper-%c", chars[i], chars[i]);
+		deeper[i] = evs_add_handler(path, NULL, NULL, NULL, NULL, FALSE);
+		ck_assert(deeper[i] != NULL);
+	}
+
+	evs_query_begin();
+
+	for (i = 0; i < strlen(chars); i++) {
+		g_snprintf(path, sizeof(path), "/many/%c", chars[i]);
+		found = evs_query(path, &ev_extra);
+		ck_assert_ptr_eq(found, evs[i]);
+		ck_assert_str_eq(ev_extra, "");
+
+		g_snprintf(path, sizeof(path), "/many/%c/deeper-%c", chars[i], chars[i]);
+		found = evs_query(path, &ev_extra);
+		ck_assert_ptr_eq(found, deeper[i]);
+		ck_assert_str_eq(ev_extra, "");
+
+		g_snprintf(path, sizeof(path), "/many/%c/deep", chars[i]);
+		found = evs_query(path, &ev_extra);
+		ck_assert_ptr_eq(found, NULL);
+
+		g_snprintf(path, sizeof(path), "/many/%c/other", chars[i]);
+		found = evs_query(path, &ev_extra);
+		ck_assert_ptr_eq(found, evs[i]);
+		ck_assert_str_eq(ev_extra, "/other");
+	}
+
+	evs_query_end();
+
+	ck_assert(evs_add_handler("/many", "/a", NULL, NULL, NULL, FALSE) == NULL);
+}
+END_TEST
+
+START_TEST(test_evs_query_split_prefixes)
+{
+	gchar *ev_extra = NULL;
+	struct event *longest;
+	struct event *shorter;
+	struct event *diverged;
+	struct event *shortest;
+
+	longest = evs_add_handler("/split", "/abcdefgh", NULL, NULL, NULL, FALSE);
+	shorter = evs_add_handler("/split", "/abcd", NULL, NULL, NULL, TRUE);
+	diverged = evs_add_handler("/split", "/abcdxyz", NULL, NULL, NULL, FALSE);
+	shortest = evs_add_handler("/split", "/ab", NULL, NULL, NULL, FALSE);
+
+	evs_query_begin();
+
+	ck_assert_ptr_eq(evs_query("/split/abcdefgh", &ev_extra), longest);
+	ck_assert_ptr_eq(evs_query("/split/abcd", &ev_extra), shorter);
+	ck_assert_ptr_eq(evs_query("/split/abcdxyz", &ev_extra), diverged);
+	ck_assert_ptr_eq(evs_query("/split/ab", &ev_extra), shortest);
+	ck_assert_ptr_eq(evs_query("/split/abc", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/split/abcdef", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/split/abcdefghi", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/split/abcdxy", &ev_extra), NULL);
+
+	ck_assert_ptr_eq(evs_query("/split/abcd/efgh", &ev_extra), shorter);
+	ck_assert_str_eq(ev_extra, "/efgh");
+
+	evs_query_end();
+}
+END_TEST
+
+START_TEST(test_evs_query_remove)
+{
+	gchar *ev_extra = NULL;
+	struct event *longest;
+	struct event *shorter;
+	struct event *diverged;
+	struct event *shortest;
+
+	longest = evs_add_handler("/remove", "/abcdefgh", NULL, NULL, NULL, FALSE);
+	shorter = evs_add_handler("/remove", "/abcd", NULL, NULL, NULL, TRUE);
+	diverged = evs_add_handler("/remove", "/abcdxyz", NULL, NULL, NULL, FALSE);
+	shortest = evs_add_handler("/remove", "/ab", NULL, NULL, NULL, FALSE);
+
+	evs_query_begin();
+
+	evs_remove_handler(shorter);
+	ck_assert_ptr_eq(evs_query("/remove/abcd", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/remove/abcd/efgh", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/remove/abcdefgh", &ev_extra), longest);
+	ck_assert_ptr_eq(evs_query("/remove/abcdxyz", &ev_extra), diverged);
+	ck_assert_ptr_eq(evs_query("/remove/ab", &ev_extra), shortest);
+
+	evs_remove_handler(diverged);
+	ck_assert_ptr_eq(evs_query("/remove/abcdxyz", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/remove/abcdefgh", &ev_extra), longest);
+	ck_assert_ptr_eq(evs_query("/remove/ab", &ev_extra), shortest);
+
+	evs_remove_handler(longest);
+	ck_assert_ptr_eq(evs_query("/remove/abcdefgh", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/remove/ab", &ev_extra), shortest);
+
+	shorter = evs_add_handler("/remove", "/abcd", NULL, NULL, NULL, TRUE);
+	ck_assert(shorter != NULL);
+	ck_assert_ptr_eq(evs_query("/remove/abcd/efgh", &ev_extra), shorter);
+	ck_assert_str_eq(ev_extra, "/efgh");
+
+	evs_remove_handler(shortest);
+	evs_remove_handler(shorter);
+	ck_assert_ptr_eq(evs_query("/remove/ab", &ev_extra), NULL);
+	ck_assert_ptr_eq(evs_query("/remove/abcd", &ev_extra), NULL);
+
+	evs_query_end();
+
+	ck_assert(evs_add_handler("/remove", "/ab", NULL, NULL, NULL, FALSE) != NULL);
+}
+END_TEST
+
+START_TEST(test_evs_query_reclaim)
+{
+	guint i;
+	gchar *ev_extra = NULL;
+	struct event *ev;
+
+	ev = evs_add_handler("/reclaim", "/test", NULL, NULL, NULL, FALSE);
+
+	evs_query_begin();
+	ck_assert_ptr_eq(evs_query("/reclaim/test", &ev_extra), ev);
+
+	evs_remove_handler(ev);
+	ck_assert(evs_query_retired() > 0);
+
+	/*
+	 * This thread could still be using the event: nothing may be freed
+	 */
+	for (i = 0; i < 4; i++) {
+		evs_query_reclaim();
+	}
+
+	ck_assert(evs_query_retired() > 0);
+	ck_assert_str_eq(ev->ev_path, "/reclaim/test");
+
+	evs_query_end();
+
+	evs_query_reclaim();
+	evs_query_reclaim();
+	ck_assert_uint_eq(evs_query_retired(), 0);
 }
 END_TEST
 
@@ -276,13 +446,16 @@ START_TEST(test_evs_send)
 	gchar *extra = NULL;
 	qev_fd_t tc = test_client();
 	struct client *client = test_get_client();
-	struct event *ev = evs_query("/test/good-childs/extra", &extra);
+	struct event *ev;
 
 	test_cb(tc,
 		"/qio/on:1=\"/test/good-childs/extra\"",
 		"/qio/callback/1:0={\"code\":200,\"data\":null}");
 
+	evs_query_begin();
+	ev = evs_query("/test/good-childs/extra", &extra);
 	evs_send(client, ev, extra, "\"hooray!\"");
+	evs_query_end();
 
 	test_msg(tc, "/test/good-childs/extra:0=\"hooray!\"");
 
@@ -295,10 +468,14 @@ START_TEST(test_evs_unsubscribed_send)
 	gchar *extra = NULL;
 	qev_fd_t tc = test_client();
 	struct client *client = test_get_client();
-	struct event *ev = evs_query("/test/delayed-childs", &extra);
+	struct event *ev;
+
+	evs_query_begin();
+	ev = evs_query("/test/delayed-childs", &extra);
 	ck_assert(ev != NULL);
 
 	evs_send(client, ev, NULL, "test");
+	evs_query_end();
 
 	close(tc);
 }
@@ -309,10 +486,14 @@ START_TEST(test_evs_send_doesnt_handle_children)
 	gchar *extra = NULL;
 	qev_fd_t tc = test_client();
 	struct client *client = test_get_client();
-	struct event *ev = evs_query("/test/good", &extra);
+	struct event *ev;
+
+	evs_query_begin();
+	ev = evs_query("/test/good", &extra);
 	ck_assert(ev != NULL);
 
 	evs_send(client, ev, "/child", "test");
+	evs_query_end();
 
 	close(tc);
 }
@@ -358,8 +539,11 @@ START_TEST(test_evs_send_sub)
 	gchar *extra = NULL;
 	qev_fd_t tc = test_client();
 	struct client *client = test_get_client();
-	struct event *ev = evs_query("/test/good", &extra);
-	struct subscription *sub = sub_get(ev, extra, TRUE);
+	struct subscription *sub;
+
+	evs_query_begin();
+	sub = sub_get(evs_query("/test/good", &extra), extra, TRUE);
+	evs_query_end();
 
 	test_cb(tc,
 		"/qio/on:1=\"/test/good\"",
@@ -446,6 +630,457 @@ START_TEST(test_evs_on_empty_broadcast)
 }
 END_TEST
 
+START_TEST(test_evs_broadcast_conflate)
+{
+	guint i;
+	guint got = 0;
+	guint64 last = 0;
+	guint64 val;
+	gchar json[16];
+	gchar buff[128];
+	qev_fd_t tc;
+	struct event *ev;
+	struct subscription *sub;
+	const gchar *prefix = "/test-evs/conflate:0=";
+
+	ev = evs_add_handler_full("/test-evs", "/conflate", NULL, NULL, NULL,
+								FALSE, EVS_HANDLER_CONFLATE);
+
+	tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test-evs/conflate\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	for (i = 1; i <= 100; i++) {
+		g_snprintf(json, sizeof(json), "%u", i);
+		evs_broadcast(ev, NULL, json);
+	}
+
+	evs_broadcast_tick();
+
+	/*
+	 * The server ticks on its own too, so a few might have gone out early,
+	 * but they must come in order and end with the newest.
+	 */
+	do {
+		test_recv(tc, buff, sizeof(buff));
+		ck_assert(g_str_has_prefix(buff, prefix));
+
+		val = g_ascii_strtoull(buff + strlen(prefix), NULL, 10);
+		ck_assert(val > last);
+		last = val;
+		got++;
+	} while (last != 100);
+
+	ck_assert_str_eq(buff, "/test-evs/conflate:0=100");
+	test_ping(tc);
+
+	/*
+	 * Every broadcast that went out was delivered exactly once: whatever
+	 * was conflated was never sent at all
+	 */
+	sub = sub_get(ev, NULL, FALSE);
+	ck_assert(sub != NULL);
+	ck_assert_uint_eq(got, sub->seq);
+	ck_assert(got < 100);
+	sub_unref(sub);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_evs_broadcast_lvc)
+{
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	evs_broadcast_path("/test/good", "1");
+	evs_broadcast_path("/test/good", "2");
+	evs_broadcast_tick();
+
+	test_msg(tc, "/test/good:0=1");
+	test_msg(tc, "/test/good:0=2");
+
+	test_cb(tc2,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	test_msg(tc2, "/test/good:0=2");
+	test_ping(tc2);
+
+	evs_broadcast_path("/test/good", "3");
+	evs_broadcast_tick();
+
+	test_msg(tc, "/test/good:0=3");
+	test_msg(tc2, "/test/good:0=3");
+
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_evs_broadcast_no_lvc)
+{
+	struct event *ev;
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+
+	ev = evs_add_handler_full("/test-evs", "/no-lvc", NULL, NULL, NULL,
+								FALSE, EVS_HANDLER_NO_LVC);
+
+	test_cb(tc,
+		"/qio/on:1=\"/test-evs/no-lvc\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	evs_broadcast(ev, NULL, "1");
+	evs_broadcast_tick();
+	test_msg(tc, "/test-evs/no-lvc:0=1");
+
+	test_cb(tc2,
+		"/qio/on:1=\"/test-evs/no-lvc\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	test_ping(tc2);
+
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+/**
+ * The epoch of the subscription at the path, or 0 if there isn't one
+ */
+static guint64 _test_evs_epoch(const gchar *ev_path)
+{
+	gchar *ev_extra;
+	guint64 epoch = 0;
+	struct subscription *sub;
+
+	evs_query_begin();
+	sub = sub_get(evs_query(ev_path, &ev_extra), ev_extra, FALSE);
+	evs_query_end();
+
+	if (sub != NULL) {
+		epoch = sub->epoch;
+		sub_unref(sub);
+	}
+
+	return epoch;
+}
+
+static void _test_evs_resume(
+	qev_fd_t tc,
+	const gchar *ev_path,
+	const guint64 epoch,
+	const guint64 after,
+	const guint64 seq,
+	const gboolean reset)
+{
+	gchar *msg;
+	gchar *expect;
+	gchar buff[256];
+
+	msg = g_strdup_printf(
+		"/qio/on:1=[\"%s\",null,%" G_GUINT64_FORMAT ",\"" SUB_EPOCH_FORMAT "\"]",
+		ev_path, after, epoch);
+	test_send(tc, msg);
+	test_recv(tc, buff, sizeof(buff));
+
+	expect = g_strdup_printf(
+		"/qio/callback/1:0={\"code\":200,\"data\":{\"epoch\":\""
+		SUB_EPOCH_FORMAT "\",\"seq\":%" G_GUINT64_FORMAT ",\"reset\":%s}}",
+		_test_evs_epoch(ev_path), seq, reset ? "true" : "false");
+	ck_assert_str_eq(buff, expect);
+
+	g_free(msg);
+	g_free(expect);
+}
+
+/**
+ * Check for a broadcast to a resumable event, which says where it is
+ */
+static void _test_evs_resumed_msg(
+	qev_fd_t tc,
+	const gchar *ev_path,
+	const guint64 seq,
+	const gchar *data)
+{
+	gchar *msg = g_strdup_printf(
+		"%s:0={\"epoch\":\"" SUB_EPOCH_FORMAT "\",\"seq\":%" G_GUINT64_FORMAT
+		",\"data\":%s}",
+		ev_path, _test_evs_epoch(ev_path), seq, data);
+
+	test_msg(tc, msg);
+	g_free(msg);
+}
+
+START_TEST(test_evs_on_resume)
+{
+	guint64 epoch;
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+	qev_fd_t tc3 = test_client();
+	qev_fd_t tc4 = test_client();
+	const gchar *path = "/test-evs/resumable";
+
+	evs_add_handler_full("/test-evs", "/resumable", NULL, NULL, NULL,
+							FALSE, EVS_HANDLER_RESUMABLE);
+
+	cfg_sub_replay_count = 3;
+
+	/*
+	 * Without an epoch, there's nothing to pick up from
+	 */
+	_test_evs_resume(tc, path, 0, 0, 1, TRUE);
+	epoch = _test_evs_epoch(path);
+	ck_assert(epoch != 0);
+
+	evs_broadcast_path(path, "1");
+	evs_broadcast_path(path, "2");
+	evs_broadcast_tick();
+
+	_test_evs_resumed_msg(tc, path, 1, "1");
+	_test_evs_resumed_msg(tc, path, 2, "2");
+
+	_test_evs_resume(tc2, path, epoch, 0, 1, FALSE);
+	_test_evs_resumed_msg(tc2, path, 1, "1");
+	_test_evs_resumed_msg(tc2, path, 2, "2");
+
+	_test_evs_resume(tc3, path, epoch, 2, 3, FALSE);
+	test_ping(tc3);
+
+	evs_broadcast_path(path, "3");
+	evs_broadcast_path(path, "4");
+	evs_broadcast_path(path, "5");
+	evs_broadcast_tick();
+
+	_test_evs_resumed_msg(tc, path, 3, "3");
+	_test_evs_resumed_msg(tc2, path, 3, "3");
+	_test_evs_resumed_msg(tc3, path, 3, "3");
+
+	/*
+	 * Only 3, 4, and 5 are kept around
+	 */
+	_test_evs_resume(tc4, path, epoch, 1, 5, TRUE);
+	_test_evs_resumed_msg(tc4, path, 5, "5");
+
+	_test_evs_resumed_msg(tc, path, 4, "4");
+	_test_evs_resumed_msg(tc, path, 5, "5");
+	close(tc4);
+
+	tc4 = test_client();
+
+	_test_evs_resume(tc4, path, epoch, 2, 3, FALSE);
+	_test_evs_resumed_msg(tc4, path, 3, "3");
+	_test_evs_resumed_msg(tc4, path, 4, "4");
+	_test_evs_resumed_msg(tc4, path, 5, "5");
+
+	evs_broadcast_path(path, "6");
+	evs_broadcast_tick();
+	_test_evs_resumed_msg(tc, path, 6, "6");
+	_test_evs_resumed_msg(tc4, path, 6, "6");
+
+	close(tc);
+	close(tc2);
+	close(tc3);
+	close(tc4);
+}
+END_TEST
+
+START_TEST(test_evs_on_resume_reset)
+{
+	struct event *ev;
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+	const gchar *path = "/test-evs/no-lvc";
+
+	ev = evs_add_handler_full("/test-evs", "/no-lvc", NULL, NULL, NULL,
+					FALSE, EVS_HANDLER_NO_LVC | EVS_HANDLER_RESUMABLE);
+
+	cfg_sub_replay_count = 1;
+
+	test_cb(tc,
+		"/qio/on:1=\"/test-evs/no-lvc\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	evs_broadcast(ev, NULL, "1");
+	evs_broadcast(ev, NULL, "2");
+	evs_broadcast_tick();
+	_test_evs_resumed_msg(tc, path, 1, "1");
+	_test_evs_resumed_msg(tc, path, 2, "2");
+
+	/*
+	 * Only 2 is kept, and with nothing cached, the next broadcast is the
+	 * first the client gets
+	 */
+	_test_evs_resume(tc2, path, _test_evs_epoch(path), 0, 3, TRUE);
+	test_ping(tc2);
+
+	evs_broadcast(ev, NULL, "3");
+	evs_broadcast_tick();
+	_test_evs_resumed_msg(tc, path, 3, "3");
+	_test_evs_resumed_msg(tc2, path, 3, "3");
+
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_evs_on_resume_recreated)
+{
+	guint64 epoch;
+	qev_fd_t tc = test_client();
+	qev_fd_t tc2 = test_client();
+	qev_fd_t tc3 = test_client();
+	const gchar *path = "/test-evs/resumable";
+
+	evs_add_handler_full("/test-evs", "/resumable", NULL, NULL, NULL,
+							FALSE, EVS_HANDLER_RESUMABLE);
+
+	cfg_sub_replay_count = 3;
+
+	_test_evs_resume(tc, path, 0, 0, 1, TRUE);
+	epoch = _test_evs_epoch(path);
+
+	evs_broadcast_path(path, "1");
+	evs_broadcast_path(path, "2");
+	evs_broadcast_tick();
+	_test_evs_resumed_msg(tc, path, 1, "1");
+	_test_evs_resumed_msg(tc, path, 2, "2");
+
+	/*
+	 * With its only subscriber gone, the subscription is freed, and it
+	 * counts from the start again once it's created again
+	 */
+	test_cb(tc,
+		"/qio/off:1=\"/test-evs/resumable\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	QEV_WAIT_FOR(_test_evs_epoch(path) == 0);
+
+	test_cb(tc2,
+		"/qio/on:1=\"/test-evs/resumable\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	ck_assert(_test_evs_epoch(path) != epoch);
+
+	evs_broadcast_path(path, "\"a\"");
+	evs_broadcast_path(path, "\"b\"");
+	evs_broadcast_path(path, "\"c\"");
+	evs_broadcast_tick();
+	_test_evs_resumed_msg(tc2, path, 1, "\"a\"");
+	_test_evs_resumed_msg(tc2, path, 2, "\"b\"");
+	_test_evs_resumed_msg(tc2, path, 3, "\"c\"");
+
+	/*
+	 * The old 2 isn't the new 2: going by the number alone, only "c" would
+	 * be replayed, and "a" and "b" would never be seen
+	 */
+	_test_evs_resume(tc, path, epoch, 2, 3, TRUE);
+	_test_evs_resumed_msg(tc, path, 3, "\"c\"");
+
+	_test_evs_resume(tc3, path, _test_evs_epoch(path), 2, 3, FALSE);
+	_test_evs_resumed_msg(tc3, path, 3, "\"c\"");
+
+	close(tc);
+	close(tc2);
+	close(tc3);
+}
+END_TEST
+
+START_TEST(test_evs_on_resume_not_resumable)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=[\"/test/good\",null,0,\"\"]",
+		"/qio/callback/1:0={\"code\":400,\"data\":null,"
+			"\"err_msg\":\"event can't be resumed\"}");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_evs_broadcast_overflow)
+{
+	guint i;
+	gchar json[16];
+	gchar expect[64];
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	/*
+	 * More than fit in a thread's ring: the rest have to spill over and
+	 * still come out in order.
+	 */
+	for (i = 0; i < 3000; i++) {
+		g_snprintf(json, sizeof(json), "%u", i);
+		evs_broadcast_path("/test/good", json);
+	}
+
+	for (i = 0; i < 3; i++) {
+		evs_broadcast_tick();
+	}
+
+	for (i = 0; i < 3000; i++) {
+		g_snprintf(expect, sizeof(expect), "/test/good:0=%u", i);
+		test_msg(tc, expect);
+	}
+
+	test_ping(tc);
+
+	close(tc);
+}
+END_TEST
+
+struct _test_evs_queue {
+	gsize next;
+	gsize pushed;
+	gboolean refilled;
+};
+
+static void _test_evs_queue_order(void *item, void *q_)
+{
+	guint i;
+	struct _test_evs_queue *q = q_;
+
+	ck_assert_uint_eq(GPOINTER_TO_SIZE(item), q->next);
+	q->next++;
+
+	/*
+	 * Behind the drain's back, fill the ring up again and spill over: the
+	 * drain has to finish the ring before anything in overflow
+	 */
+	if (!q->refilled) {
+		q->refilled = TRUE;
+
+		for (i = 0; i < 4096; i++) {
+			evs_queue_push(GSIZE_TO_POINTER(q->pushed++));
+		}
+	}
+}
+
+START_TEST(test_evs_queue_refill_while_overflowing)
+{
+	struct _test_evs_queue q = {
+		.next = 1,
+		.pushed = 1,
+	};
+
+	evs_queue_push(GSIZE_TO_POINTER(q.pushed++));
+
+	while (evs_queue_drain(_test_evs_queue_order, &q, G_MAXUINT64) > 0);
+
+	ck_assert(q.refilled);
+	ck_assert_uint_eq(q.next, q.pushed);
+	ck_assert_uint_eq(evs_queue_depth(), 0);
+}
+END_TEST
+
 START_TEST(test_evs_on_delayed)
 {
 	qev_fd_t tc = test_client();
@@ -464,17 +1099,22 @@ START_TEST(test_evs_on_delayed_with_broadcast)
 	struct client *client = test_get_client();
 
 	test_send(tc, "/qio/on:2=\"/test/delayed\"");
-	QEV_WAIT_FOR(client->subs != NULL && g_hash_table_size(client->subs) > 0);
+	QEV_WAIT_FOR(client->subs.len > 0);
 
 	evs_broadcast_path("/test/delayed", NULL);
 	evs_broadcast_tick();
 
 	test_msg(tc, "/qio/callback/2:0={\"code\":200,\"data\":null}");
 
-	evs_broadcast_path("/test/delayed", NULL);
-	evs_broadcast_tick();
+	/*
+	 * What was broadcast while pending comes from the cache
+	 */
 	test_msg(tc, "/test/delayed:0=null");
 
+	evs_broadcast_path("/test/delayed", "\"json!\"");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/delayed:0=\"json!\"");
+
 	test_ping(tc);
 
 	close(tc);
@@ -615,6 +1255,43 @@ START_TEST(test_evs_off_after_close)
 }
 END_TEST
 
+static gboolean _test_evs_remove_handler_off_called = FALSE;
+static void _test_evs_remove_handler_off(
+	struct client *client G_GNUC_UNUSED,
+	const gchar *ev_extra G_GNUC_UNUSED)
+{
+	_test_evs_remove_handler_off_called = TRUE;
+}
+
+START_TEST(test_evs_remove_handler)
+{
+	qev_fd_t tc;
+	struct event *ev;
+
+	ev = evs_add_handler("/test-evs", "/remove", NULL, NULL,
+		_test_evs_remove_handler_off, TRUE);
+
+	tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test-evs/remove/child\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	evs_remove_handler(ev);
+	ck_assert(_test_evs_remove_handler_off_called);
+
+	test_cb(tc,
+		"/qio/on:2=\"/test-evs/remove/child\"",
+		"/qio/callback/2:0={\"code\":404,\"data\":null,\"err_msg\":null}");
+
+	test_cb(tc,
+		"/test-evs/remove:3=null",
+		"/qio/callback/3:0={\"code\":404,\"data\":null,\"err_msg\":null}");
+
+	close(tc);
+}
+END_TEST
+
 START_TEST(test_evs_callback_invalid_id)
 {
 	qev_fd_t tc = test_client();
@@ -701,6 +1378,10 @@ int main()
 	suite_add_tcase(s, tcase);
 	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
 	tcase_add_test(tcase, test_evs_query_handles_children_lookups);
+	tcase_add_test(tcase, test_evs_query_many_handlers);
+	tcase_add_test(tcase, test_evs_query_split_prefixes);
+	tcase_add_test(tcase, test_evs_query_remove);
+	tcase_add_test(tcase, test_evs_query_reclaim);
 
 	tcase = tcase_create("Events");
 	suite_add_tcase(s, tcase);
@@ -718,6 +1399,14 @@ int main()
 	tcase_add_test(tcase, test_evs_send_sub);
 	tcase_add_test(tcase, test_evs_on);
 	tcase_add_test(tcase, test_evs_on_empty_broadcast);
+	tcase_add_test(tcase, test_evs_broadcast_conflate);
+	tcase_add_test(tcase, test_evs_broadcast_lvc);
+	tcase_add_test(tcase, test_evs_broadcast_no_lvc);
+	tcase_add_test(tcase, test_evs_on_resume);
+	tcase_add_test(tcase, test_evs_on_resume_reset);
+	tcase_add_test(tcase, test_evs_on_resume_recreated);
+	tcase_add_test(tcase, test_evs_on_resume_not_resumable);
+	tcase_add_test(tcase, test_evs_broadcast_overflow);
 	tcase_add_test(tcase, test_evs_on_delayed);
 	tcase_add_test(tcase, test_evs_on_delayed_with_broadcast);
 	tcase_add_test(tcase, test_evs_on_reject);
@@ -727,6 +1416,14 @@ int main()
 	tcase_add_test(tcase, test_evs_off_before_on_cb);
 	tcase_add_test(tcase, test_evs_on_off_on_before_first_on_cb);
 	tcase_add_test(tcase, test_evs_off_after_close);
+	tcase_add_test(tcase, test_evs_remove_handler);
+
+	/*
+	 * Without a server, nothing else drains the queue
+	 */
+	tcase = tcase_create("Queue");
+	suite_add_tcase(s, tcase);
+	tcase_add_test(tcase, test_evs_queue_refill_while_overflowing);
 
 	tcase = tcase_create("QIO Builtins");
 	suite_add_tcase(s, tcase);
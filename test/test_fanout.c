@@ -0,0 +1,155 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of quick-event and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "test.h"
+
+#define TASKS 1000
+
+struct _pinned {
+	GThread *thread;
+	guint last;
+	gboolean ok;
+};
+
+struct _pinned_task {
+	struct _pinned *pinned;
+	guint i;
+};
+
+static void _inc(void *hits_)
+{
+	guint *hits = hits_;
+	g_atomic_int_inc(hits);
+}
+
+static void _check_pinned(void *task_)
+{
+	struct _pinned_task *task = task_;
+	struct _pinned *pinned = task->pinned;
+
+	if (pinned->thread == NULL) {
+		pinned->thread = g_thread_self();
+	}
+
+	pinned->ok = pinned->ok &&
+		pinned->thread == g_thread_self() &&
+		pinned->last + 1 == task->i;
+	pinned->last = task->i;
+}
+
+START_TEST(test_fanout_push)
+{
+	guint i;
+	guint hits = 0;
+	struct fanout_group grp = { 0 };
+
+	for (i = 0; i < TASKS; i++) {
+		fanout_push(&grp, _inc, &hits);
+	}
+
+	fanout_wait(&grp);
+
+	ck_assert_uint_eq(grp.pending, 0);
+	ck_assert_uint_eq(hits, TASKS);
+}
+END_TEST
+
+START_TEST(test_fanout_push_no_workers)
+{
+	guint i;
+	guint hits = 0;
+	struct fanout_group grp = { 0 };
+
+	fanout_set_workers(0);
+
+	for (i = 0; i < TASKS; i++) {
+		fanout_push(&grp, _inc, &hits);
+	}
+
+	fanout_wait(&grp);
+	fanout_set_workers(cfg_broadcast_threads);
+
+	ck_assert_uint_eq(hits, TASKS);
+}
+END_TEST
+
+START_TEST(test_fanout_push_detached)
+{
+	guint i;
+	guint hits = 0;
+
+	fanout_set_workers(2);
+
+	/*
+	 * No one waits on these: the workers have to be woken to run them
+	 */
+	for (i = 0; i < TASKS; i++) {
+		fanout_push(NULL, _inc, &hits);
+	}
+
+	for (i = 0; i < 1000 && g_atomic_int_get(&hits) < TASKS; i++) {
+		g_usleep(1000);
+	}
+
+	fanout_set_workers(cfg_broadcast_threads);
+
+	ck_assert_uint_eq(hits, TASKS);
+}
+END_TEST
+
+START_TEST(test_fanout_push_to)
+{
+	guint i;
+	guint owner;
+	struct fanout_group grp = { 0 };
+	struct _pinned pinned[4];
+	struct _pinned_task tasks[G_N_ELEMENTS(pinned)][TASKS];
+
+	fanout_set_workers(G_N_ELEMENTS(pinned));
+
+	memset(pinned, 0, sizeof(pinned));
+	for (owner = 0; owner < G_N_ELEMENTS(pinned); owner++) {
+		pinned[owner].ok = TRUE;
+	}
+
+	for (i = 0; i < TASKS; i++) {
+		for (owner = 0; owner < G_N_ELEMENTS(pinned); owner++) {
+			tasks[owner][i].pinned = pinned + owner;
+			tasks[owner][i].i = i + 1;
+			fanout_push_to(&grp, owner, _check_pinned, &tasks[owner][i]);
+		}
+	}
+
+	fanout_wait(&grp);
+	fanout_set_workers(cfg_broadcast_threads);
+
+	for (owner = 0; owner < G_N_ELEMENTS(pinned); owner++) {
+		ck_assert(pinned[owner].ok);
+		ck_assert_uint_eq(pinned[owner].last, TASKS);
+		ck_assert(pinned[owner].thread != g_thread_self());
+	}
+}
+END_TEST
+
+int main()
+{
+	SRunner *sr;
+	Suite *s;
+	TCase *tcase;
+	test_new("fanout", &sr, &s);
+
+	tcase = tcase_create("Sane");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_fanout_push);
+	tcase_add_test(tcase, test_fanout_push_no_workers);
+	tcase_add_test(tcase, test_fanout_push_detached);
+	tcase_add_test(tcase, test_fanout_push_to);
+
+	return test_do(sr);
+}
@@ -0,0 +1,229 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of quick-event and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "test.h"
+#include <fcntl.h>
+
+#define JOURNAL_DIR "test_journal_" G_STRINGIFY(PORT)
+#define JOURNAL_CONFIG "test_journal_" G_STRINGIFY(PORT) ".ini"
+
+/**
+ * The first segment in a fresh journal
+ */
+#define FIRST_SEGMENT JOURNAL_DIR "/0000000000000001.journal"
+
+static void _clear_journal()
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open(JOURNAL_DIR, 0, NULL);
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		gchar *path = g_build_filename(JOURNAL_DIR, name, NULL);
+		unlink(path);
+		g_free(path);
+	}
+
+	g_dir_close(dir);
+	rmdir(JOURNAL_DIR);
+}
+
+static void _setup()
+{
+	const gchar *cfg =
+		"[quick.io]\n"
+		"journal-dir = " JOURNAL_DIR "\n"
+		"journal-segment-size = 4096\n";
+
+	_clear_journal();
+
+	ck_assert(g_file_set_contents(JOURNAL_CONFIG, cfg, -1, NULL));
+	test_setup_with_config(JOURNAL_CONFIG);
+}
+
+static void _teardown()
+{
+	test_teardown();
+	unlink(JOURNAL_CONFIG);
+	_clear_journal();
+}
+
+START_TEST(test_journal_restore)
+{
+	gchar *json;
+
+	journal_append("/test/good", "1");
+	journal_append("/test/good", "2");
+	journal_append("/test/other", "3");
+
+	ck_assert_uint_eq(journal_replay(), 3);
+
+	json = journal_restore("/test/good");
+	ck_assert_str_eq(json, "2");
+	g_free(json);
+
+	json = journal_restore("/test/other");
+	ck_assert_str_eq(json, "3");
+	g_free(json);
+
+	ck_assert(journal_restore("/test/good") == NULL);
+	ck_assert(journal_restore("/test/nothing") == NULL);
+}
+END_TEST
+
+START_TEST(test_journal_segments)
+{
+	guint i;
+	gchar *json;
+	gchar path[32];
+	gchar expect[16];
+
+	/*
+	 * Plenty to fill a bunch of segments
+	 */
+	for (i = 0; i < 500; i++) {
+		g_snprintf(path, sizeof(path), "/test/segments/%u", i % 10);
+		g_snprintf(expect, sizeof(expect), "%u", i);
+		journal_append(path, expect);
+	}
+
+	ck_assert(g_file_test(JOURNAL_DIR "/0000000000000002.journal",
+							G_FILE_TEST_EXISTS));
+	ck_assert_uint_eq(journal_replay(), 500);
+
+	for (i = 0; i < 10; i++) {
+		g_snprintf(path, sizeof(path), "/test/segments/%u", i);
+		g_snprintf(expect, sizeof(expect), "%u", 490 + i);
+
+		json = journal_restore(path);
+		ck_assert_str_eq(json, expect);
+		g_free(json);
+	}
+}
+END_TEST
+
+START_TEST(test_journal_expire)
+{
+	guint i;
+	gchar expect[16];
+	guint64 retention = cfg_journal_retention;
+
+	for (i = 0; i < 300; i++) {
+		g_snprintf(expect, sizeof(expect), "%u", i);
+		journal_append("/test/expire", expect);
+	}
+
+	ck_assert(g_file_test(FIRST_SEGMENT, G_FILE_TEST_EXISTS));
+	ck_assert(g_file_test(JOURNAL_DIR "/0000000000000003.journal",
+							G_FILE_TEST_EXISTS));
+
+	/*
+	 * Nothing more is appended: the tick alone has to age out the full
+	 * segments, leaving the one being written to
+	 */
+	cfg_journal_retention = 0;
+	g_usleep(G_USEC_PER_SEC * 2);
+	evs_broadcast_tick();
+
+	ck_assert(!g_file_test(FIRST_SEGMENT, G_FILE_TEST_EXISTS));
+	ck_assert(!g_file_test(JOURNAL_DIR "/0000000000000002.journal",
+							G_FILE_TEST_EXISTS));
+	ck_assert(g_file_test(JOURNAL_DIR "/0000000000000003.journal",
+							G_FILE_TEST_EXISTS));
+
+	cfg_journal_retention = retention;
+}
+END_TEST
+
+START_TEST(test_journal_corrupt)
+{
+	gint fd;
+	gchar *json;
+
+	journal_append("/test/good", "1");
+	journal_append("/test/good", "2");
+
+	/*
+	 * Past the segment header and the first record, into the second
+	 * record's path
+	 */
+	fd = open(FIRST_SEGMENT, O_WRONLY);
+	ck_assert(fd != -1);
+	ck_assert_int_eq(pwrite(fd, "X", 1, 16 + 40 + 24), 1);
+	close(fd);
+
+	ck_assert_uint_eq(journal_replay(), 1);
+
+	json = journal_restore("/test/good");
+	ck_assert_str_eq(json, "1");
+	g_free(json);
+}
+END_TEST
+
+START_TEST(test_journal_lvc)
+{
+	qev_fd_t tc = test_client();
+
+	journal_append("/test/good", "\"warm\"");
+	journal_replay();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+	test_msg(tc, "/test/good:0=\"warm\"");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_journal_broadcast)
+{
+	gchar *json;
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	evs_broadcast_path("/test/good", "\"fresh\"");
+	evs_broadcast_tick();
+	test_msg(tc, "/test/good:0=\"fresh\"");
+
+	ck_assert_uint_eq(journal_replay(), 1);
+
+	json = journal_restore("/test/good");
+	ck_assert_str_eq(json, "\"fresh\"");
+	g_free(json);
+
+	close(tc);
+}
+END_TEST
+
+int main()
+{
+	SRunner *sr;
+	Suite *s;
+	TCase *tcase;
+	test_new("journal", &sr, &s);
+
+	tcase = tcase_create("Sane");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, _setup, _teardown);
+	tcase_add_test(tcase, test_journal_restore);
+	tcase_add_test(tcase, test_journal_segments);
+	tcase_add_test(tcase, test_journal_expire);
+	tcase_add_test(tcase, test_journal_corrupt);
+	tcase_add_test(tcase, test_journal_lvc);
+	tcase_add_test(tcase, test_journal_broadcast);
+
+	return test_do(sr);
+}
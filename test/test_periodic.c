@@ -0,0 +1,213 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of quick-event and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "test.h"
+
+#define SEC(s) QEV_SEC_TO_USEC((gint64)(s))
+
+/**
+ * Get a client that's only in the wheel when a test puts it there
+ */
+static struct client* _client(qev_fd_t *tc)
+{
+	struct client *client;
+
+	*tc = test_client();
+	client = test_get_client();
+
+	/*
+	 * Once the ping is answered, the handshake is done putting the client
+	 * in the wheel
+	 */
+	test_ping(*tc);
+	periodic_unschedule(client);
+	ck_assert_int_eq(periodic_level(client), -1);
+
+	return client;
+}
+
+/**
+ * Bring the wheel up to now, so that tests know where it is
+ */
+static gint64 _now()
+{
+	gint64 now = qev_monotonic;
+
+	ck_assert_uint_eq(periodic_turn(now), 0);
+
+	return now;
+}
+
+static enum evs_status _test_periodic_cb(
+	struct client *client G_GNUC_UNUSED,
+	const void *data G_GNUC_UNUSED,
+	const evs_cb_t client_cb G_GNUC_UNUSED,
+	gchar *json G_GNUC_UNUSED)
+{
+	return EVS_STATUS_OK;
+}
+
+static void _test_periodic_cb_expire(
+	struct client *client G_GNUC_UNUSED,
+	const void *expired_,
+	const gboolean evicted)
+{
+	guint *expired = (guint*)expired_;
+
+	ck_assert(!evicted);
+	(*expired)++;
+}
+
+START_TEST(test_periodic_level_0)
+{
+	qev_fd_t tc;
+	struct client *client = _client(&tc);
+	gint64 now = _now();
+
+	periodic_schedule(client, now + SEC(30));
+	ck_assert_int_eq(periodic_level(client), 0);
+
+	ck_assert_uint_eq(periodic_turn(now + SEC(29)), 0);
+	ck_assert_int_eq(periodic_level(client), 0);
+
+	ck_assert_uint_eq(periodic_turn(now + SEC(30)), 1);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_periodic_cascade_level_1)
+{
+	qev_fd_t tc;
+	struct client *client = _client(&tc);
+	gint64 now = _now();
+
+	periodic_schedule(client, now + SEC(100));
+	ck_assert_int_eq(periodic_level(client), 1);
+
+	ck_assert_uint_eq(periodic_turn(now + SEC(99)), 0);
+	ck_assert_int_eq(periodic_level(client), 0);
+
+	ck_assert_uint_eq(periodic_turn(now + SEC(100)), 1);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_periodic_cascade_level_3)
+{
+	qev_fd_t tc;
+	struct client *client = _client(&tc);
+	gint64 now = _now();
+	gint64 due = now + SEC(1 << 20);
+
+	periodic_schedule(client, due);
+	ck_assert_int_eq(periodic_level(client), 3);
+
+	ck_assert_uint_eq(periodic_turn(due - SEC(1)), 0);
+	ck_assert_int_eq(periodic_level(client), 0);
+	ck_assert(client->periodic.due == due);
+
+	ck_assert_uint_eq(periodic_turn(due), 1);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_periodic_clamp)
+{
+	qev_fd_t tc;
+	struct client *client = _client(&tc);
+	gint64 now = _now();
+	gint64 due = now + SEC(1llu << 26);
+
+	periodic_schedule(client, due);
+	ck_assert_int_eq(periodic_level(client), 3);
+
+	/*
+	 * All the way around the wheel and then some: the client's slot came
+	 * around, and it should have gone right back in the last level
+	 */
+	ck_assert_uint_eq(periodic_turn(now + SEC((1 << 24) + (1 << 18))), 0);
+	ck_assert_int_eq(periodic_level(client), 3);
+	ck_assert(client->periodic.due == due);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_periodic_unschedule_on_close)
+{
+	qev_fd_t tc = test_client();
+	struct client *client = test_get_client();
+
+	test_ping(tc);
+	ck_assert_int_ne(periodic_level(client), -1);
+
+	qev_ref(client);
+	close(tc);
+
+	QEV_WAIT_FOR(periodic_level(client) == -1);
+	ck_assert_uint_eq(periodic_turn(qev_monotonic + SEC(PERIODIC_INTERVAL * 2)), 0);
+
+	qev_unref(client);
+}
+END_TEST
+
+START_TEST(test_periodic_cb_expire)
+{
+	qev_fd_t tc;
+	gint64 expires;
+	guint expired = 0;
+	struct client *client = _client(&tc);
+
+	_now();
+
+	evs_cb_on_expire(_test_periodic_cb, _test_periodic_cb_expire);
+	client_cb_new(client, _test_periodic_cb, &expired, NULL);
+
+	/*
+	 * The callback is the only reason the client is in the wheel
+	 */
+	expires = client->cbs.slots[client->cbs.oldest].created +
+				SEC(cfg_clients_cb_max_age);
+	ck_assert(client->periodic.due == expires);
+
+	ck_assert_uint_eq(periodic_turn(expires - SEC(1)), 0);
+	ck_assert_uint_eq(expired, 0);
+	ck_assert(client->cbs.oldest != CLIENT_CB_NONE);
+
+	ck_assert_uint_eq(periodic_turn(expires + SEC(1)), 1);
+	ck_assert_uint_eq(expired, 1);
+	ck_assert(client->cbs.oldest == CLIENT_CB_NONE);
+
+	evs_cb_on_expire(_test_periodic_cb, NULL);
+
+	close(tc);
+}
+END_TEST
+
+int main()
+{
+	SRunner *sr;
+	Suite *s;
+	TCase *tcase;
+	test_new("periodic", &sr, &s);
+
+	tcase = tcase_create("Wheel");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_periodic_level_0);
+	tcase_add_test(tcase, test_periodic_cascade_level_1);
+	tcase_add_test(tcase, test_periodic_cascade_level_3);
+	tcase_add_test(tcase, test_periodic_clamp);
+	tcase_add_test(tcase, test_periodic_unschedule_on_close);
+	tcase_add_test(tcase, test_periodic_cb_expire);
+
+	return test_do(sr);
+}
@@ -27,6 +27,29 @@ START_TEST(test_raw_handshake_partial)
 }
 END_TEST
 
+START_TEST(test_raw_batch)
+{
+	gchar buff[16];
+	qev_fd_t ts = test_socket();
+
+	ck_assert(send(ts, "/qio/ohai/batch", 15, MSG_NOSIGNAL) == 15);
+	ck_assert(recv(ts, buff, sizeof(buff), 0) == 15);
+	buff[15] = '\0';
+	ck_assert_str_eq(buff, "/qio/ohai/batch");
+
+	test_cb(ts,
+		"/qio/ping:1=null\n/qio/ping:2=null\n",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}\n"
+		"/qio/callback/2:0={\"code\":200,\"data\":null}");
+
+	test_cb(ts,
+		"/qio/ping:3=null",
+		"/qio/callback/3:0={\"code\":200,\"data\":null}");
+
+	close(ts);
+}
+END_TEST
+
 START_TEST(test_raw_route_partial)
 {
 	qev_fd_t tc = test_client();
@@ -93,8 +116,10 @@ START_TEST(test_raw_heartbeats)
 
 	test_heartbeat();
 
-	// Not expecting a heartbeat on open
+	// Not expecting a heartbeat on open, just to be back in the wheel
 	test_ping(tc);
+	ck_assert(client->periodic.slot != NULL);
+	ck_assert_int_gt(client->periodic.due, qev_monotonic);
 
 	client->last_send = qev_monotonic - QEV_SEC_TO_USEC(51) - QEV_MS_TO_USEC(1000);
 	test_heartbeat();
@@ -147,6 +172,32 @@ START_TEST(test_raw_multiple_messages)
 }
 END_TEST
 
+START_TEST(test_raw_multiple_messages_corked)
+{
+	gint64 err;
+	gchar buff[128];
+	qev_fd_t tc = test_client();
+
+	err = send(tc,
+			"\x00\x00\x00\x00\x00\x00\x00\x10/qio/ping:1=null"
+			"\x00\x00\x00\x00\x00\x00\x00\x10/qio/ping:2=null", 48, 0);
+	ck_assert(err == 48);
+
+	/*
+	 * Both responses go out in the same write
+	 */
+	err = recv(tc, buff, sizeof(buff), 0);
+	ck_assert_int_eq(err, 100);
+	ck_assert(memcmp(buff,
+		"\x00\x00\x00\x00\x00\x00\x00\x2a"
+		"/qio/callback/1:0={\"code\":200,\"data\":null}"
+		"\x00\x00\x00\x00\x00\x00\x00\x2a"
+		"/qio/callback/2:0={\"code\":200,\"data\":null}", 100) == 0);
+
+	close(tc);
+}
+END_TEST
+
 START_TEST(test_raw_size_overflow)
 {
 	gint64 err;
@@ -160,6 +211,80 @@ START_TEST(test_raw_size_overflow)
 }
 END_TEST
 
+static qev_fd_t _mux_link()
+{
+	gchar buff[16];
+	qev_fd_t ts = test_socket();
+
+	ck_assert(send(ts, "/qio/ohai/mux", 13, MSG_NOSIGNAL) == 13);
+	ck_assert(recv(ts, buff, sizeof(buff), 0) == 13);
+	buff[13] = '\0';
+	ck_assert_str_eq(buff, "/qio/ohai/mux");
+
+	return ts;
+}
+
+START_TEST(test_raw_mux)
+{
+	qev_fd_t ts = _mux_link();
+
+	test_cb(ts,
+		"1 /qio/ping:1=null",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}\n1");
+	test_cb(ts,
+		"2 /qio/ping:1=null",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}\n2");
+
+	/*
+	 * Only the virtual client that misbehaved goes away
+	 */
+	test_cb(ts, "2 lolno", "\n2");
+	test_cb(ts,
+		"1 /qio/ping:2=null",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}\n1");
+
+	test_send(ts, "lolno");
+	test_client_dead(ts);
+
+	close(ts);
+}
+END_TEST
+
+START_TEST(test_raw_mux_bcast)
+{
+	gchar buff[128];
+	qev_fd_t ts = _mux_link();
+
+	test_cb(ts,
+		"1 /qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}\n1");
+	test_cb(ts,
+		"2 /qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}\n2");
+
+	evs_broadcast_path("/test/good", "\"mux\"");
+	evs_broadcast_tick();
+
+	test_recv(ts, buff, sizeof(buff));
+	ck_assert(g_strcmp0(buff, "/test/good:0=\"mux\"\n1,2") == 0 ||
+		g_strcmp0(buff, "/test/good:0=\"mux\"\n2,1") == 0);
+
+	/*
+	 * The ping makes sure the close went through before broadcasting
+	 */
+	test_send(ts, "1");
+	test_cb(ts,
+		"2 /qio/ping:2=null",
+		"/qio/callback/2:0={\"code\":200,\"data\":null}\n2");
+
+	evs_broadcast_path("/test/good", "\"again\"");
+	evs_broadcast_tick();
+	test_msg(ts, "/test/good:0=\"again\"\n2");
+
+	close(ts);
+}
+END_TEST
+
 int main()
 {
 	SRunner *sr;
@@ -171,13 +296,17 @@ int main()
 	suite_add_tcase(s, tcase);
 	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
 	tcase_add_test(tcase, test_raw_handshake_partial);
+	tcase_add_test(tcase, test_raw_batch);
 	tcase_add_test(tcase, test_raw_route_partial);
 	tcase_add_test(tcase, test_raw_route_invalid);
 	tcase_add_test(tcase, test_raw_minimal_event);
 	tcase_add_test(tcase, test_raw_heartbeats);
 	tcase_add_test(tcase, test_raw_heartbeat_challenge);
 	tcase_add_test(tcase, test_raw_multiple_messages);
+	tcase_add_test(tcase, test_raw_multiple_messages_corked);
 	tcase_add_test(tcase, test_raw_size_overflow);
+	tcase_add_test(tcase, test_raw_mux);
+	tcase_add_test(tcase, test_raw_mux_bcast);
 
 	return test_do(sr);
 }
@@ -7,6 +7,7 @@
  */
 
 #include "test.h"
+#include <zlib.h>
 
 #define HEADERS \
 	"GET / HTTP/1.1\r\n" \
@@ -27,6 +28,28 @@
 	"Expires: -1\r\n" \
 	"Sec-WebSocket-Accept: Nf+/kB4wxkn+6EPeanngB3VZNwU=\r\n\r\n"
 
+#define HEADERS_DEFLATE \
+	"GET / HTTP/1.1\r\n" \
+	"Host: localhost\r\n" \
+	"Sec-WebSocket-Key: JF+JVs2N4NAX39FAAkkdIA==\r\n" \
+	"Sec-WebSocket-Protocol: quickio\r\n" \
+	"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n" \
+	"Upgrade: websocket\r\n" \
+	"Connection: Upgrade\r\n" \
+	"Sec-WebSocket-Version: 13\r\n\r\n"
+
+#define HEADERS_DEFLATE_RESPONSE \
+	"HTTP/1.1 101 Switching Protocols\r\n" \
+	"Upgrade: websocket\r\n" \
+	"Connection: Upgrade\r\n" \
+	"Access-Control-Allow-Origin: *\r\n" \
+	"Sec-WebSocket-Protocol: quickio\r\n" \
+	"Cache-Control: private, max-age=0\r\n" \
+	"Expires: -1\r\n" \
+	"Sec-WebSocket-Accept: Nf+/kB4wxkn+6EPeanngB3VZNwU=\r\n" \
+	"Sec-WebSocket-Extensions: permessage-deflate; " \
+	"server_no_context_takeover; client_no_context_takeover\r\n\r\n"
+
 #define QIO_HANDSHAKE "\x81\x89""abcd""N""\x13""\n""\x0b""N""\r""\x0b""\x05""\x08"
 #define HANDSHAKE_RESPONSE "\x81\x09/qio/ohai"
 
@@ -58,6 +81,124 @@ static qev_fd_t _client()
 	return ts;
 }
 
+static qev_fd_t _client_deflate()
+{
+	gint err;
+	gchar buff[1024];
+
+	qev_fd_t ts = test_socket();
+	ck_assert_int_eq(send(ts, HEADERS_DEFLATE, sizeof(HEADERS_DEFLATE) - 1, 0),
+					sizeof(HEADERS_DEFLATE) - 1);
+	err = recv(ts, buff, sizeof(buff), 0);
+	ck_assert(err > 0);
+	buff[err] = '\0';
+	ck_assert_str_eq(HEADERS_DEFLATE_RESPONSE, buff);
+
+	ck_assert_int_eq(send(ts, QIO_HANDSHAKE, sizeof(QIO_HANDSHAKE) - 1, 0),
+					sizeof(QIO_HANDSHAKE) - 1);
+	err = recv(ts, buff, sizeof(buff), 0);
+	ck_assert(err > 0);
+	buff[err] = '\0';
+	ck_assert_str_eq(HANDSHAKE_RESPONSE, buff);
+
+	return ts;
+}
+
+/**
+ * Compress and mask a message, the way a browser would
+ */
+static GString* _deflate_frame(const gchar *msg)
+{
+	guint i;
+	gsize len;
+	z_stream z;
+	guchar out[256];
+	GString *frame = qev_buffer_get();
+
+	memset(&z, 0, sizeof(z));
+	ck_assert_int_eq(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					-MAX_WBITS, 8, Z_DEFAULT_STRATEGY), Z_OK);
+
+	z.next_in = (guchar*)msg;
+	z.avail_in = strlen(msg);
+	z.next_out = out;
+	z.avail_out = sizeof(out);
+	ck_assert_int_eq(deflate(&z, Z_SYNC_FLUSH), Z_OK);
+	deflateEnd(&z);
+
+	len = sizeof(out) - z.avail_out - 4;
+	ck_assert(len <= 125);
+
+	g_string_append_c(frame, '\xc1');
+	g_string_append_c(frame, 0x80 | len);
+	g_string_append(frame, "abcd");
+
+	for (i = 0; i < len; i++) {
+		g_string_append_c(frame, out[i] ^ "abcd"[i & 3]);
+	}
+
+	return frame;
+}
+
+/**
+ * Inflate the payload of a compressed frame
+ */
+static GString* _inflate_frame(const gchar *payload, const gsize len)
+{
+	z_stream z;
+	GString *in = qev_buffer_get();
+	GString *msg = qev_buffer_get();
+
+	qev_buffer_append_len(in, payload, len);
+	qev_buffer_append_len(in, "\x00\x00\xff\xff", 4);
+	g_string_set_size(msg, 0x20000);
+
+	memset(&z, 0, sizeof(z));
+	ck_assert_int_eq(inflateInit2(&z, -MAX_WBITS), Z_OK);
+
+	z.next_in = (guchar*)in->str;
+	z.avail_in = in->len;
+	z.next_out = (guchar*)msg->str;
+	z.avail_out = msg->len;
+	ck_assert_int_eq(inflate(&z, Z_SYNC_FLUSH), Z_OK);
+	g_string_set_size(msg, msg->len - z.avail_out);
+	inflateEnd(&z);
+
+	qev_buffer_put(in);
+
+	return msg;
+}
+
+/**
+ * Subscribe to /test/good
+ */
+static void _test_on(const qev_fd_t tc)
+{
+	guint i;
+	gint err;
+	gchar buff[128];
+	GString *frame = qev_buffer_get();
+	const gchar *on = "/qio/on:1=\"/test/good\"";
+	const gchar *cb = "\x81\x2a/qio/callback/1:0={\"code\":200,\"data\":null}";
+
+	g_string_append_c(frame, '\x81');
+	g_string_append_c(frame, 0x80 | strlen(on));
+	g_string_append(frame, "abcd");
+
+	for (i = 0; i < strlen(on); i++) {
+		g_string_append_c(frame, on[i] ^ "abcd"[i & 3]);
+	}
+
+	err = send(tc, frame->str, frame->len, 0);
+	ck_assert_int_eq(err, frame->len);
+
+	err = recv(tc, buff, strlen(cb), 0);
+	ck_assert_int_eq(err, strlen(cb));
+	ck_assert(memcmp(buff, cb, err) == 0);
+
+	qev_buffer_put(frame);
+}
+
 static void _test_ping_response(const qev_fd_t tc)
 {
 	gint err;
@@ -457,6 +598,83 @@ START_TEST(test_rfc6455_decode_invalid_utf8)
 }
 END_TEST
 
+START_TEST(test_rfc6455_decode_nul)
+{
+	const gchar inval[] = "\x81\x83""abcd""\x0b""\x62""\x0a";
+
+	qev_fd_t tc = _client();
+
+	ck_assert_int_eq(send(tc, inval, sizeof(inval) - 1, 0), sizeof(inval) - 1);
+
+	test_client_dead(tc);
+	close(tc);
+}
+END_TEST
+
+static gboolean _unmask(const gchar *str, const guint offset)
+{
+	guint i;
+	guint32 mask;
+	gboolean valid;
+	const gchar *key = "\x12\x9a\x00\xf3";
+	const guint len = strlen(str);
+	gchar *masked = g_malloc(offset + len + 1);
+	gchar *out = g_malloc(offset + len + 1);
+
+	memcpy(&mask, key, sizeof(mask));
+
+	/*
+	 * Pad the front with ASCII to push the text around inside of the
+	 * vectors
+	 */
+	for (i = 0; i < offset; i++) {
+		masked[i] = 'a' ^ key[i & 3];
+	}
+
+	for (i = 0; i < len; i++) {
+		masked[offset + i] = str[i] ^ key[(offset + i) & 3];
+	}
+
+	valid = protocol_rfc6455_unmask(out, masked, offset + len, mask);
+	if (valid) {
+		ck_assert(memcmp(out + offset, str, len) == 0);
+	}
+
+	g_free(masked);
+	g_free(out);
+
+	return valid;
+}
+
+START_TEST(test_rfc6455_unmask_utf8)
+{
+	guint offset;
+
+	/*
+	 * Slide everything across the vector block boundaries
+	 */
+	for (offset = 0; offset < 70; offset++) {
+		ck_assert(_unmask("", offset));
+		ck_assert(_unmask("/qio/ping:1=null", offset));
+		ck_assert(_unmask("caf\xc3\xa9", offset));
+		ck_assert(_unmask("\xe2\x82\xac 5", offset));
+		ck_assert(_unmask("\xf0\x9f\x98\x80!", offset));
+		ck_assert(_unmask("\xed\x9f\xbf\xf4\x8f\xbf\xbf", offset));
+
+		ck_assert(!_unmask("\xc3", offset));
+		ck_assert(!_unmask("\xe2\x82", offset));
+		ck_assert(!_unmask("\x80", offset));
+		ck_assert(!_unmask("\xc2\x41", offset));
+		ck_assert(!_unmask("\xc0\x80", offset));
+		ck_assert(!_unmask("\xe0\x80\x80", offset));
+		ck_assert(!_unmask("\xed\xa0\x80", offset));
+		ck_assert(!_unmask("\xf4\x90\x80\x80", offset));
+		ck_assert(!_unmask("\xf5\x80\x80\x80", offset));
+		ck_assert(!_unmask("\xff", offset));
+	}
+}
+END_TEST
+
 START_TEST(test_rfc6455_decode_invalid_qio_handshake)
 {
 	const gchar *inval = "\x81\x82""abcd""\xe1""\xe2";
@@ -529,6 +747,211 @@ START_TEST(test_rfc6455_encode_long)
 }
 END_TEST
 
+START_TEST(test_rfc6455_bcast_shared)
+{
+	gchar buff[512];
+	gchar buff2[512];
+	const GString *def;
+	struct protocol_bcast *bcast;
+	const struct protocol_frames *pframes;
+	qev_fd_t tc2 = _client();
+	struct client *client2 = test_get_client();
+	qev_fd_t tc = _client();
+	struct client *client = test_get_client();
+
+	bcast = protocols_bcast("/test/good", "\"shared\"");
+	pframes = bcast->frames + protocol_rfc6455->id;
+
+	ck_assert_ptr_eq(protocols_bcast_ref(bcast), bcast);
+	ck_assert_uint_eq(bcast->refs, 2);
+
+	protocols_bcast_write(client, bcast);
+	def = pframes->def;
+	ck_assert(def != NULL);
+
+	/*
+	 * The second client gets the very same frame: it's made once and shared
+	 */
+	protocols_bcast_write(client2, bcast);
+	ck_assert_ptr_eq(pframes->def, def);
+
+	/*
+	 * Writing doesn't hold on to the frames: each client's write buffer got
+	 * its own copy of the bytes
+	 */
+	ck_assert_uint_eq(bcast->refs, 2);
+
+	ck_assert_int_eq(recv(tc, buff, sizeof(buff), 0), def->len);
+	ck_assert_int_eq(recv(tc2, buff2, sizeof(buff2), 0), def->len);
+	ck_assert(memcmp(buff, def->str, def->len) == 0);
+	ck_assert(memcmp(buff2, def->str, def->len) == 0);
+
+	protocols_bcast_unref(bcast);
+	ck_assert_uint_eq(bcast->refs, 1);
+	protocols_bcast_unref(bcast);
+
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_send)
+{
+	gint err;
+	gchar buff[512];
+	GString *msg;
+	qev_fd_t tc = _client_deflate();
+	struct client *client = test_get_client();
+	GString *json = qev_buffer_get();
+
+	g_string_set_size(json, 1024);
+	memset(json->str, 'a', json->len);
+	evs_send_bruteforce(client, "/test", "/2", "", json->str, NULL, NULL, NULL);
+
+	err = recv(tc, buff, sizeof(buff), 0);
+	ck_assert(err > 2);
+	ck_assert_int_eq((guint8)buff[0], 0xc1);
+	ck_assert_int_eq(buff[1], err - 2);
+
+	msg = _inflate_frame(buff + 2, err - 2);
+	g_string_prepend(json, "/test/2:0=");
+	ck_assert_str_eq(msg->str, json->str);
+
+	qev_buffer_put(msg);
+	qev_buffer_put(json);
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_small)
+{
+	qev_fd_t tc = _client_deflate();
+
+	/*
+	 * Too small to bother compressing
+	 */
+	_test_ping(tc);
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_broadcast)
+{
+	gint err;
+	gchar buff[512];
+	GString *msg;
+	qev_fd_t tc = _client_deflate();
+	qev_fd_t tc2 = _client();
+	GString *json = qev_buffer_get();
+
+	_test_on(tc);
+	_test_on(tc2);
+
+	g_string_set_size(json, 300);
+	memset(json->str, 'b', json->len);
+	json->str[0] = '"';
+	json->str[json->len - 1] = '"';
+	evs_broadcast_path("/test/good", json->str);
+	evs_broadcast_tick();
+
+	err = recv(tc, buff, sizeof(buff), 0);
+	ck_assert(err > 2);
+	ck_assert_int_eq((guint8)buff[0], 0xc1);
+
+	msg = _inflate_frame(buff + 2, err - 2);
+	g_string_prepend(json, "/test/good:0=");
+	ck_assert_str_eq(msg->str, json->str);
+
+	err = recv(tc2, buff, sizeof(buff), 0);
+	ck_assert_int_eq((guint8)buff[0], 0x81);
+
+	qev_buffer_put(msg);
+	qev_buffer_put(json);
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_broadcast_lazy)
+{
+	gchar buff[512];
+	struct protocol_bcast *bcast;
+	const struct protocol_frames *pframes;
+	qev_fd_t tc2 = _client();
+	struct client *client2 = test_get_client();
+	qev_fd_t tc = _client_deflate();
+	struct client *client = test_get_client();
+	GString *json = qev_buffer_get();
+
+	g_string_set_size(json, 300);
+	memset(json->str, 'b', json->len);
+	json->str[0] = '"';
+	json->str[json->len - 1] = '"';
+
+	bcast = protocols_bcast("/test/good", json->str);
+	pframes = bcast->frames + protocol_rfc6455->id;
+
+	/*
+	 * Nothing is framed until a client needs it, and nothing is compressed
+	 * until a client wants it that way
+	 */
+	ck_assert(pframes->def == NULL);
+	ck_assert(pframes->deflated == NULL);
+
+	protocols_bcast_write(client2, bcast);
+	ck_assert(pframes->def != NULL);
+	ck_assert(recv(tc2, buff, sizeof(buff), 0) > 2);
+	ck_assert_int_eq((guint8)buff[0], 0x81);
+	ck_assert(pframes->deflated == NULL);
+
+	protocols_bcast_write(client, bcast);
+	ck_assert(recv(tc, buff, sizeof(buff), 0) > 2);
+	ck_assert_int_eq((guint8)buff[0], 0xc1);
+	ck_assert(pframes->deflated != NULL);
+
+	protocols_bcast_unref(bcast);
+	qev_buffer_put(json);
+	close(tc);
+	close(tc2);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_recv)
+{
+	gint err;
+	qev_fd_t tc = _client_deflate();
+	GString *ping = _deflate_frame("/qio/ping:1=null");
+
+	err = send(tc, ping->str, ping->len, 0);
+	ck_assert_int_eq(err, ping->len);
+
+	_test_ping_response(tc);
+
+	qev_buffer_put(ping);
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_rfc6455_deflate_not_negotiated)
+{
+	gint err;
+	gchar buff[64];
+	qev_fd_t tc = _client();
+	GString *ping = _deflate_frame("/qio/ping:1=null");
+
+	err = send(tc, ping->str, ping->len, 0);
+	ck_assert_int_eq(err, ping->len);
+
+	err = recv(tc, buff, sizeof(buff), 0);
+	ck_assert(memcmp(buff, "\x88\x15\x03\xea""invalid compression", err) == 0);
+
+	test_client_dead(tc);
+	qev_buffer_put(ping);
+	close(tc);
+}
+END_TEST
+
 START_TEST(test_rfc6455_close_invalid_event_format)
 {
 	// /test=123
@@ -641,6 +1064,8 @@ int main()
 	tcase_add_test(tcase, test_rfc6455_decode_long);
 	tcase_add_test(tcase, test_rfc6455_decode_long_overflow);
 	tcase_add_test(tcase, test_rfc6455_decode_invalid_utf8);
+	tcase_add_test(tcase, test_rfc6455_decode_nul);
+	tcase_add_test(tcase, test_rfc6455_unmask_utf8);
 	tcase_add_test(tcase, test_rfc6455_decode_invalid_qio_handshake);
 
 	tcase = tcase_create("Encode");
@@ -648,6 +1073,17 @@ int main()
 	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
 	tcase_add_test(tcase, test_rfc6455_encode_medium);
 	tcase_add_test(tcase, test_rfc6455_encode_long);
+	tcase_add_test(tcase, test_rfc6455_bcast_shared);
+
+	tcase = tcase_create("Deflate");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_rfc6455_deflate_send);
+	tcase_add_test(tcase, test_rfc6455_deflate_small);
+	tcase_add_test(tcase, test_rfc6455_deflate_broadcast);
+	tcase_add_test(tcase, test_rfc6455_deflate_broadcast_lazy);
+	tcase_add_test(tcase, test_rfc6455_deflate_recv);
+	tcase_add_test(tcase, test_rfc6455_deflate_not_negotiated);
 
 	tcase = tcase_create("Close Reasons");
 	suite_add_tcase(s, tcase);
@@ -0,0 +1,250 @@
+/**
+ * @author Andrew Stone <andrew@clovar.com>
+ * @copyright 2012-2014 Clear Channel Inc.
+ *
+ * This file is part of quick-event and is released under
+ * the MIT License: http://opensource.org/licenses/MIT
+ */
+
+#include "test.h"
+#include <sys/un.h>
+
+#define DATAGRAM(d) qev_on_udp(d, sizeof(d) - 1, "127.0.0.1")
+#define UNIX_CONFIG "test_publish_" G_STRINGIFY(PORT) ".ini"
+#define UNIX_SOCK "test_publish_" G_STRINGIFY(PORT) ".sock"
+
+START_TEST(test_publish_single)
+{
+	qev_fd_t tc = test_client();
+
+	cfg_publish_udp = TRUE;
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	DATAGRAM("/test/good={\"from\":\"udp\"}");
+	evs_broadcast_tick();
+
+	test_msg(tc, "/test/good:0={\"from\":\"udp\"}");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_publish_batched)
+{
+	qev_fd_t tc = test_client();
+
+	cfg_publish_udp = TRUE;
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	DATAGRAM(
+		"/test/good=1\n"
+		"\n"
+		"/test//good/=2\r\n"
+		"no json here\n"
+		"/test/good=\"a=b\"\n"
+		"/test/not-subscribed=4\n"
+		"/test/good=5");
+	evs_broadcast_tick();
+
+	test_msg(tc, "/test/good:0=1");
+	test_msg(tc, "/test/good:0=2");
+	test_msg(tc, "/test/good:0=\"a=b\"");
+	test_msg(tc, "/test/good:0=5");
+
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_publish_handle)
+{
+	GString *buff = qev_buffer_get();
+
+	g_string_append(buff, "/test/good=1\n=2\n/test/good=3\n");
+	ck_assert_uint_eq(publish_handle(buff->str, buff->len), 2);
+
+	qev_buffer_clear(buff);
+	ck_assert_uint_eq(publish_handle(buff->str, buff->len), 0);
+
+	qev_buffer_put(buff);
+}
+END_TEST
+
+START_TEST(test_publish_disabled)
+{
+	qev_fd_t tc = test_client();
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	DATAGRAM("/test/good=1");
+	evs_broadcast_tick();
+
+	test_ping(tc);
+
+	close(tc);
+}
+END_TEST
+
+static void _setup_unix(const gboolean stream)
+{
+	gboolean ok;
+	gchar *cfg;
+
+	cfg = g_strdup_printf(
+		"[quick.io]\n"
+		"publish-unix = %s\n"
+		"publish-unix-stream = %s\n",
+		UNIX_SOCK, stream ? "true" : "false");
+	ok = g_file_set_contents(UNIX_CONFIG, cfg, -1, NULL);
+	g_free(cfg);
+	ck_assert(ok);
+
+	test_setup_with_config(UNIX_CONFIG);
+}
+
+static void _setup_unix_dgram()
+{
+	_setup_unix(FALSE);
+}
+
+static void _setup_unix_stream()
+{
+	_setup_unix(TRUE);
+}
+
+static void _teardown_unix()
+{
+	test_teardown();
+	unlink(UNIX_CONFIG);
+	unlink(UNIX_SOCK);
+}
+
+static qev_fd_t _unix_connect(const gint type)
+{
+	qev_fd_t sock;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	g_strlcpy(addr.sun_path, UNIX_SOCK, sizeof(addr.sun_path));
+
+	sock = socket(AF_UNIX, type, 0);
+	ck_assert(sock != -1);
+	ck_assert(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+
+	return sock;
+}
+
+static void _unix_send(qev_fd_t sock, const gchar *records)
+{
+	gssize len = strlen(records);
+	ck_assert_int_eq(send(sock, records, len, MSG_NOSIGNAL), len);
+}
+
+/**
+ * Records come in on their own thread, so keep ticking until they make it
+ * out to the client
+ */
+static void _tick_until_sent(qev_fd_t tc)
+{
+	gchar c;
+
+	do {
+		g_usleep(1000);
+		evs_broadcast_tick();
+	} while (recv(tc, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 1);
+}
+
+START_TEST(test_publish_unix_dgram)
+{
+	qev_fd_t tc = test_client();
+	qev_fd_t sock = _unix_connect(SOCK_DGRAM);
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	_unix_send(sock, "/test/good=1\n/test/good=2");
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0=1");
+	test_msg(tc, "/test/good:0=2");
+
+	_unix_send(sock, "/test/good={\"from\":\"unix\"}");
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0={\"from\":\"unix\"}");
+
+	close(sock);
+	close(tc);
+}
+END_TEST
+
+START_TEST(test_publish_unix_stream)
+{
+	qev_fd_t tc = test_client();
+	qev_fd_t sock = _unix_connect(SOCK_STREAM);
+	qev_fd_t sock2 = _unix_connect(SOCK_STREAM);
+
+	test_cb(tc,
+		"/qio/on:1=\"/test/good\"",
+		"/qio/callback/1:0={\"code\":200,\"data\":null}");
+
+	/*
+	 * Records split across writes are put back together
+	 */
+	_unix_send(sock, "/test/good=1\n/test/go");
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0=1");
+
+	_unix_send(sock, "od=2\n");
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0=2");
+
+	_unix_send(sock2, "/test/good=3\n");
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0=3");
+
+	/*
+	 * The last record needs no newline once the writer hangs up
+	 */
+	_unix_send(sock, "/test/good=4");
+	close(sock);
+	_tick_until_sent(tc);
+	test_msg(tc, "/test/good:0=4");
+
+	close(sock2);
+	close(tc);
+}
+END_TEST
+
+int main()
+{
+	SRunner *sr;
+	Suite *s;
+	TCase *tcase;
+	test_new("publish", &sr, &s);
+
+	tcase = tcase_create("Sane");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+	tcase_add_test(tcase, test_publish_single);
+	tcase_add_test(tcase, test_publish_batched);
+	tcase_add_test(tcase, test_publish_handle);
+	tcase_add_test(tcase, test_publish_disabled);
+
+	tcase = tcase_create("Unix Datagrams");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, _setup_unix_dgram, _teardown_unix);
+	tcase_add_test(tcase, test_publish_unix_dgram);
+
+	tcase = tcase_create("Unix Streams");
+	suite_add_tcase(s, tcase);
+	tcase_add_checked_fixture(tcase, _setup_unix_stream, _teardown_unix);
+	tcase_add_test(tcase, test_publish_unix_stream);
+
+	return test_do(sr);
+}
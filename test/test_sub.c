@@ -11,9 +11,13 @@
 START_TEST(test_sub_get_race)
 {
 	struct subscription *sub2;
+	struct event *ev;
+	struct subscription *sub;
 	gchar *ev_extra = NULL;
-	struct event *ev = evs_query("/test/good", &ev_extra);
-	struct subscription *sub = sub_get(ev, NULL, TRUE);
+
+	evs_query_begin();
+	ev = evs_query("/test/good", &ev_extra);
+	sub = sub_get(ev, NULL, TRUE);
 
 	/*
 	 * Just ensure that, when ref count reaches 0, the subscription
@@ -28,6 +32,234 @@ START_TEST(test_sub_get_race)
 	sub->refs = 1;
 	sub_unref(sub);
 	sub_unref(sub2);
+
+	evs_query_end();
+}
+END_TEST
+
+/**
+ * Real clients for the sets: walks take refs on whatever's in them
+ */
+static struct client *_clients[1000];
+static GHashTable *_indexes = NULL;
+
+static void _clients_new(const guint n)
+{
+	guint i;
+
+	_indexes = g_hash_table_new(NULL, NULL);
+
+	for (i = 0; i < n; i++) {
+		_clients[i] = protocols_new_surrogate(protocol_rfc6455);
+		ck_assert(_clients[i] != NULL);
+		g_hash_table_insert(_indexes, _clients[i], GUINT_TO_POINTER(i + 1));
+	}
+}
+
+static void _clients_close(const guint n)
+{
+	guint i;
+
+	for (i = 0; i < n; i++) {
+		qev_close(_clients[i], 0);
+	}
+
+	g_hash_table_unref(_indexes);
+	_indexes = NULL;
+}
+
+static guint _index(struct client *client)
+{
+	return GPOINTER_TO_UINT(g_hash_table_lookup(_indexes, client)) - 1;
+}
+
+static void _count(struct client *client, void *seen_)
+{
+	GHashTable *seen = seen_;
+	ck_assert(g_hash_table_lookup(seen, client) == NULL);
+	g_hash_table_insert(seen, client, client);
+}
+
+static void _check_walk(struct subscribers *subs)
+{
+	GHashTable *seen = g_hash_table_new(NULL, NULL);
+
+	subscribers_foreach(subs, _count, seen);
+	ck_assert_uint_eq(g_hash_table_size(seen), subscribers_size(subs));
+
+	g_hash_table_unref(seen);
+}
+
+START_TEST(test_sub_subscribers_tiers)
+{
+	guint i;
+	struct subscribers subs;
+	guint64 heap = subscribers_heap_bytes();
+	subscribers_idx_t idxs[300];
+
+	cfg_sub_min_size = 32;
+	subscribers_init(&subs);
+	_clients_new(G_N_ELEMENTS(idxs));
+
+	for (i = 0; i < G_N_ELEMENTS(idxs); i++) {
+		ck_assert(subscribers_add(&subs, _clients[i], idxs + i));
+		ck_assert_uint_eq(idxs[i], i);
+
+		if (i < SUBSCRIBERS_INLINE) {
+			ck_assert_int_eq(subs.tier, SUBSCRIBERS_TIER_INLINE);
+		} else if (i < SUBSCRIBERS_SMALL_MAX) {
+			ck_assert_int_eq(subs.tier, SUBSCRIBERS_TIER_SMALL);
+		} else {
+			ck_assert_int_eq(subs.tier, SUBSCRIBERS_TIER_SEGMENTED);
+		}
+	}
+
+	ck_assert_uint_eq(subscribers_size(&subs), G_N_ELEMENTS(idxs));
+	ck_assert(subscribers_heap_bytes() > heap);
+	_check_walk(&subs);
+
+	/*
+	 * Remove from the front so that every removal moves the last client
+	 * into the hole
+	 */
+	for (i = 0; i < G_N_ELEMENTS(idxs) - 1; i++) {
+		subscribers_remove(&subs, idxs + i);
+		ck_assert_uint_eq(subscribers_size(&subs), G_N_ELEMENTS(idxs) - i - 1);
+		_check_walk(&subs);
+	}
+
+	ck_assert_uint_eq(subscribers_size(&subs), 1);
+	ck_assert_uint_eq(idxs[G_N_ELEMENTS(idxs) - 1], 0);
+	ck_assert_int_eq(subs.tier, SUBSCRIBERS_TIER_INLINE);
+	ck_assert_uint_eq(subscribers_heap_bytes(), heap);
+
+	subscribers_remove(&subs, idxs + G_N_ELEMENTS(idxs) - 1);
+	ck_assert_uint_eq(subscribers_size(&subs), 0);
+
+	subscribers_clear(&subs);
+	_clients_close(G_N_ELEMENTS(idxs));
+}
+END_TEST
+
+struct _removing {
+	struct subscribers *subs;
+	subscribers_idx_t *idxs;
+	guint calls;
+};
+
+static void _remove_while_walking(struct client *client, void *r_)
+{
+	struct _removing *r = r_;
+	guint i = _index(client);
+
+	r->calls++;
+
+	if (i % 2 == 0) {
+		subscribers_remove(r->subs, r->idxs + i);
+	}
+}
+
+START_TEST(test_sub_subscribers_remove_while_walking)
+{
+	guint i;
+	struct subscribers subs;
+	subscribers_idx_t idxs[200];
+	struct _removing r = {
+		.subs = &subs,
+		.idxs = idxs,
+	};
+
+	cfg_sub_min_size = 16;
+	subscribers_init(&subs);
+	_clients_new(G_N_ELEMENTS(idxs));
+
+	for (i = 0; i < G_N_ELEMENTS(idxs); i++) {
+		ck_assert(subscribers_add(&subs, _clients[i], idxs + i));
+	}
+
+	subscribers_foreach(&subs, _remove_while_walking, &r);
+
+	ck_assert_uint_eq(r.calls, G_N_ELEMENTS(idxs));
+	ck_assert_uint_eq(subs.holes, 0);
+	ck_assert_uint_eq(subscribers_size(&subs), G_N_ELEMENTS(idxs) / 2);
+
+	for (i = 1; i < G_N_ELEMENTS(idxs); i += 2) {
+		subscribers_remove(&subs, idxs + i);
+	}
+
+	ck_assert_uint_eq(subscribers_size(&subs), 0);
+	subscribers_clear(&subs);
+	_clients_close(G_N_ELEMENTS(idxs));
+}
+END_TEST
+
+static void _count_hits(struct client *client, void *hits_)
+{
+	guint *hits = hits_;
+	g_atomic_int_inc(hits + _index(client));
+}
+
+static void _run_chunk(void *chunk)
+{
+	subscribers_chunk_run(chunk);
+}
+
+static void _push_chunk(struct subscribers_chunk *chunk, void *grp)
+{
+	fanout_push(grp, _run_chunk, chunk);
+}
+
+START_TEST(test_sub_subscribers_chunked)
+{
+	guint i;
+	guint32 chunks;
+	struct subscribers subs;
+	struct fanout_group grp = { 0 };
+	subscribers_idx_t idxs[1000];
+	guint hits[G_N_ELEMENTS(idxs)];
+
+	cfg_sub_min_size = 16;
+	subscribers_init(&subs);
+	_clients_new(G_N_ELEMENTS(idxs));
+	memset(hits, 0, sizeof(hits));
+
+	for (i = 0; i < SUBSCRIBERS_INLINE; i++) {
+		ck_assert(subscribers_add(&subs, _clients[i], idxs + i));
+	}
+
+	/*
+	 * Small sets are walked right away
+	 */
+	chunks = subscribers_foreach_chunked(
+		&subs, _count_hits, hits, _push_chunk, &grp);
+	ck_assert_uint_eq(chunks, 0);
+	ck_assert_uint_eq(grp.pending, 0);
+
+	for (i = 0; i < SUBSCRIBERS_INLINE; i++) {
+		ck_assert_uint_eq(hits[i], 1);
+	}
+
+	for (i = SUBSCRIBERS_INLINE; i < G_N_ELEMENTS(idxs); i++) {
+		ck_assert(subscribers_add(&subs, _clients[i], idxs + i));
+	}
+
+	chunks = subscribers_foreach_chunked(
+		&subs, _count_hits, hits, _push_chunk, &grp);
+	ck_assert_uint_eq(chunks, (G_N_ELEMENTS(idxs) + 15) / 16);
+
+	fanout_wait(&grp);
+
+	ck_assert_uint_eq(subs.readers, 0);
+	for (i = 0; i < G_N_ELEMENTS(idxs); i++) {
+		ck_assert_uint_eq(hits[i], i < SUBSCRIBERS_INLINE ? 2 : 1);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(idxs); i++) {
+		subscribers_remove(&subs, idxs + i);
+	}
+
+	subscribers_clear(&subs);
+	_clients_close(G_N_ELEMENTS(idxs));
 }
 END_TEST
 
@@ -42,6 +274,9 @@ int main()
 	suite_add_tcase(s, tcase);
 	tcase_add_checked_fixture(tcase, test_setup, test_teardown);
 	tcase_add_test(tcase, test_sub_get_race);
+	tcase_add_test(tcase, test_sub_subscribers_tiers);
+	tcase_add_test(tcase, test_sub_subscribers_remove_while_walking);
+	tcase_add_test(tcase, test_sub_subscribers_chunked);
 
 	return test_do(sr);
 }